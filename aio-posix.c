@@ -17,12 +17,26 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/timer.h"
+#include "qemu/atomic.h"
+#include "qapi/error.h"
+#include "trace.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
+
+/* Polling time when polling starts again, in nanoseconds */
+#define POLL_NS_INITIAL     4000
+
+/* Default factor by which the polling time grows */
+#define POLL_GROW_DEFAULT   2
 
 struct AioHandler
 {
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -42,6 +56,178 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* Number of file descriptors above which aio_poll switches to epoll */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+#define EPOLL_MAX_EVENTS 128
+
+/* Go back to ppoll for good, e.g. because epoll cannot handle one of the
+ * file descriptors.  ctx->epollfd is open as long as epoll_available is true.
+ */
+static void aio_epoll_disable(AioContext *ctx)
+{
+    if (!ctx->epoll_available) {
+        return;
+    }
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+    close(ctx->epollfd);
+}
+
+static inline int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            /* e.g. a regular file, which epoll does not support */
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, int ctl)
+{
+    struct epoll_event event;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+
+    if (ctl == EPOLL_CTL_DEL) {
+        /* Fails harmlessly if the file descriptor was closed already */
+        epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+        return;
+    }
+
+    event.events = epoll_events_from_pfd(node->pfd.events);
+    event.data.ptr = node;
+    if (epoll_ctl(ctx->epollfd, ctl, node->pfd.fd, &event)) {
+        aio_epoll_disable(ctx);
+    }
+}
+
+/* Wait for events on ctx->epollfd and store them in the AioHandlers.
+ * Returns the number of handlers that have events.
+ */
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    AioHandler *node;
+    int i, ret = 0;
+
+    /* epoll_wait only has millisecond resolution, so sleep with ppoll
+     * on the epoll file descriptor itself.
+     */
+    if (timeout > 0) {
+        GPollFD pfd = {
+            .fd = ctx->epollfd,
+            .events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR,
+        };
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+    }
+    if (timeout <= 0 || ret > 0) {
+        ret = epoll_wait(ctx->epollfd, events, EPOLL_MAX_EVENTS,
+                         timeout < 0 ? -1 : 0);
+        for (i = 0; i < ret; i++) {
+            int ev = events[i].events;
+
+            node = events[i].data.ptr;
+            node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                                (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                                (ev & EPOLLHUP ? G_IO_HUP : 0) |
+                                (ev & EPOLLERR ? G_IO_ERR : 0);
+        }
+    }
+    return ret;
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return ctx->epoll_enabled;
+}
+
+/* Decide whether aio_poll() should use epoll, switching to it when there
+ * are many file descriptors to watch.
+ */
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        return true;
+    }
+    if (npfd >= EPOLL_ENABLE_THRESHOLD) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        }
+        aio_epoll_disable(ctx);
+    }
+    return false;
+}
+
+#else
+
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, int ctl)
+{
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+    return false;
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+#endif
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd != -1;
+    ctx->epoll_enabled = false;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    aio_epoll_disable(ctx);
+#endif
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -56,6 +242,10 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            aio_epoll_update(ctx, node, EPOLL_CTL_DEL);
+            if (!node->io_poll) {
+                ctx->poll_disable_cnt--;
+            }
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -71,6 +261,8 @@ void aio_set_fd_handler(AioContext *ctx,
             }
         }
     } else {
+        int ctl = EPOLL_CTL_MOD;
+
         if (node == NULL) {
             /* Alloc and insert if it's not already there */
             node = g_malloc0(sizeof(AioHandler));
@@ -78,6 +270,8 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            ctx->poll_disable_cnt++;
+            ctl = EPOLL_CTL_ADD;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,6 +281,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, ctl);
     }
 
     aio_notify(ctx);
@@ -100,6 +295,48 @@ void aio_set_event_notifier(AioContext *ctx,
                        (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        return;
+    }
+    if (!node->io_poll && io_poll) {
+        ctx->poll_disable_cnt--;
+    } else if (node->io_poll && !io_poll) {
+        ctx->poll_disable_cnt++;
+    }
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns < 0 || grow < 0 || shrink < 0) {
+        error_setg(errp, "polling parameters must not be negative");
+        return;
+    }
+
+    /* No thread synchronization here, it doesn't matter if an incorrect value
+     * is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -186,10 +423,79 @@ bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+/* Spin on the io_poll callbacks until one of them returns true, or until
+ * @max_ns nanoseconds have passed.  Returns true if a handler made progress;
+ * aio_notify() stops the loop but does not count as progress.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    AioHandler *node;
+    int64_t end_time;
+    bool stop = false;
+    bool progress = false;
+
+    trace_run_poll_handlers_begin(ctx, max_ns);
+
+    ctx->walking_handlers++;
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->io_poll &&
+                node->io_poll(node->opaque)) {
+                stop = true;
+                if (node->opaque != &ctx->notifier) {
+                    progress = true;
+                }
+            }
+        }
+    } while (!stop && qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    ctx->walking_handlers--;
+
+    trace_run_poll_handlers_end(ctx, progress);
+    return progress;
+}
+
+/* Adjust the polling time after a blocking aio_poll() that waited @block_ns
+ * nanoseconds for something to happen.
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling was long enough, nothing to do */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* Events come too rarely to catch them by polling, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* A bit more polling would have avoided the wait */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = POLL_NS_INITIAL;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow ? ctx->poll_grow
+                                           : POLL_GROW_DEFAULT;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     bool was_dispatching;
+    bool use_epoll;
+    int64_t timeout;
+    int64_t start = 0;
     int ret;
     bool progress;
 
@@ -212,28 +518,70 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     g_array_set_size(ctx->pollfds, 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        node->pollfds_idx = -1;
-        if (!node->deleted && node->pfd.events) {
-            GPollFD pfd = {
-                .fd = node->pfd.fd,
-                .events = node->pfd.events,
-            };
-            node->pollfds_idx = ctx->pollfds->len;
-            g_array_append_val(ctx->pollfds, pfd);
+    /* fill pollfds, unless the kernel already knows about them */
+    if (!aio_epoll_enabled(ctx)) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            node->pollfds_idx = -1;
+            if (!node->deleted && node->pfd.events) {
+                GPollFD pfd = {
+                    .fd = node->pfd.fd,
+                    .events = node->pfd.events,
+                };
+                node->pollfds_idx = ctx->pollfds->len;
+                g_array_append_val(ctx->pollfds, pfd);
+            }
         }
     }
 
     ctx->walking_handlers--;
 
+    use_epoll = aio_epoll_check_poll(ctx, ctx->pollfds->len);
+
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+
+    /* Busy-wait for a while before going to sleep.  This is only possible
+     * if the events of every handler can be seen without the file
+     * descriptors.
+     */
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        if (!ctx->poll_disable_cnt && ctx->poll_ns && timeout) {
+            int64_t max_ns = ctx->poll_ns;
+
+            if (timeout > 0 && timeout < max_ns) {
+                max_ns = timeout;
+            }
+            if (run_poll_handlers(ctx, max_ns)) {
+                progress = true;
+                timeout = 0;
+            }
+        }
+    }
+
     /* wait until next event */
-    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? aio_compute_timeout(ctx) : 0);
+    if (use_epoll) {
+        ret = aio_epoll(ctx, timeout);
+    } else {
+        ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                             ctx->pollfds->len,
+                             timeout);
+    }
+
+    if (start) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
 
-    /* if we have any readable fds, dispatch event */
-    if (ret > 0) {
+    /* The notifier has done its job, the next aio_poll() will look at
+     * everything again anyway.
+     */
+    if (atomic_xchg(&ctx->notified, false)) {
+        event_notifier_test_and_clear(&ctx->notifier);
+    }
+
+    /* if we have any readable fds, dispatch event; with epoll, the
+     * handlers already have their revents
+     */
+    if (ret > 0 && !use_epoll) {
         QLIST_FOREACH(node, &ctx->aio_handlers, node) {
             if (node->pollfds_idx != -1) {
                 GPollFD *pfd = &g_array_index(ctx->pollfds, GPollFD,
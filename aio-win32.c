@@ -19,6 +19,7 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
 
 struct AioHandler {
     EventNotifier *e;
@@ -144,6 +145,33 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
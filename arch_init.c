@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -40,6 +41,7 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
@@ -52,6 +54,7 @@
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/sockets.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -126,6 +129,8 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static struct defconfig_file {
     const char *filename;
@@ -169,64 +174,92 @@ static struct {
     uint8_t *encoded_buf;
     /* buffer for storing page content */
     uint8_t *current_buf;
-    /* Cache for XBZRLE, Protected by lock. */
+    /*
+     * Cache for XBZRLE, only used by the thread running the RAM
+     * save handlers, so lookups take no lock.  A new size set while
+     * the migration runs is applied by xbzrle_cache_update_size().
+     */
     PageCache *cache;
-    QemuMutex lock;
 } XBZRLE;
 
 /* buffer used for XBZRLE decoding */
 static uint8_t *xbzrle_decoded_buf;
 
-static void XBZRLE_cache_lock(void)
-{
-    if (migrate_use_xbzrle())
-        qemu_mutex_lock(&XBZRLE.lock);
-}
-
-static void XBZRLE_cache_unlock(void)
-{
-    if (migrate_use_xbzrle())
-        qemu_mutex_unlock(&XBZRLE.lock);
-}
+/* Multi-threaded page compression */
+typedef struct CompressParam {
+    /* Protected by mutex */
+    bool start;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Protected by comp_done_lock */
+    bool done;
+    /* Owned by the compression thread while !done */
+    QEMUFile *file;
+    RAMBlock *block;
+    ram_addr_t offset;
+} CompressParam;
+
+typedef struct DecompressParam {
+    /* Protected by mutex */
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Job handed to the thread, protected by mutex */
+    void *des;
+    int len;
+    /* Protected by decomp_done_lock */
+    bool done;
+    int ret;
+    void *busy_host;            /* page being written while !done */
+    /* Owned by the decompression thread while !done */
+    uint8_t *compbuf;
+} DecompressParam;
+
+static CompressParam *comp_param;
+static QemuThread *compress_threads;
+static int comp_thread_count;
+/* comp_done_cond is used to wake up the migration thread when
+ * one of the compression threads has finished the compression.
+ * comp_done_lock is used to co-work with comp_done_cond.
+ */
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+/* false once xbzrle takes over after the bulk stage */
+static bool compression_switch;
+
+static DecompressParam *decomp_param;
+static QemuThread *decompress_threads;
+static int decomp_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static uint8_t *compressed_data_buf;
 
 /*
  * called from qmp_migrate_set_cache_size in main thread, possibly while
- * a migration is in progress.
- * A running migration maybe using the cache and might finish during this
- * call, hence changes to the cache are protected by XBZRLE.lock().
+ * a migration is in progress.  The main thread doesn't touch the cache:
+ * the migration thread picks the new size up in ram_save_iterate().
  */
 int64_t xbzrle_cache_resize(int64_t new_size)
 {
-    PageCache *new_cache;
-    int64_t ret;
-
     if (new_size < TARGET_PAGE_SIZE) {
         return -1;
     }
 
-    XBZRLE_cache_lock();
-
-    if (XBZRLE.cache != NULL) {
-        if (pow2floor(new_size) == migrate_xbzrle_cache_size()) {
-            goto out_new_size;
-        }
-        new_cache = cache_init(new_size / TARGET_PAGE_SIZE,
-                                        TARGET_PAGE_SIZE);
-        if (!new_cache) {
-            error_report("Error creating cache");
-            ret = -1;
-            goto out;
-        }
+    return pow2floor(new_size);
+}
 
-        cache_fini(XBZRLE.cache);
-        XBZRLE.cache = new_cache;
+/* Apply a cache size changed by migrate_set_cache_size, keeping the pages */
+static void xbzrle_cache_update_size(void)
+{
+    if (!XBZRLE.cache) {
+        return;
     }
 
-out_new_size:
-    ret = pow2floor(new_size);
-out:
-    XBZRLE_cache_unlock();
-    return ret;
+    if (cache_resize(XBZRLE.cache,
+                     migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE) < 0) {
+        error_report("Error resizing XBZRLE cache");
+    }
 }
 
 /* accounting for migration statistics */
@@ -238,6 +271,8 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
 } AccountingInfo;
@@ -294,6 +329,16 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_pages_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 double xbzrle_mig_cache_miss_rate(void)
 {
     return acct_info.xbzrle_cache_miss_rate;
@@ -321,6 +366,500 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
     return size;
 }
 
+static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset, int cont)
+{
+    int bytes_sent, blen;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    bytes_sent = save_block_hdr(f, block, offset, cont,
+                                RAM_SAVE_FLAG_COMPRESS_PAGE);
+    blen = qemu_put_compression_data(f, p, TARGET_PAGE_SIZE,
+                                     migrate_compress_level());
+    if (blen == 0) {
+        /* The header is already out; the stream can't be recovered */
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+
+    return bytes_sent + blen;
+}
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->start) {
+            param->start = false;
+            qemu_mutex_unlock(&param->mutex);
+
+            do_compress_ram_page(param->file, param->block, param->offset,
+                                 RAM_SAVE_FLAG_CONTINUE);
+
+            qemu_mutex_lock(&comp_done_lock);
+            param->done = true;
+            qemu_cond_signal(&comp_done_cond);
+            qemu_mutex_unlock(&comp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+void migrate_compress_threads_create(void)
+{
+    int i;
+
+    if (!migrate_use_compression()) {
+        return;
+    }
+    compression_switch = true;
+    comp_thread_count = migrate_compress_threads();
+    compress_threads = g_new0(QemuThread, comp_thread_count);
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_cond_init(&comp_done_cond);
+    qemu_mutex_init(&comp_done_lock);
+    for (i = 0; i < comp_thread_count; i++) {
+        comp_param[i].file = qemu_fopen_buffer();
+        comp_param[i].done = true;
+        qemu_mutex_init(&comp_param[i].mutex);
+        qemu_cond_init(&comp_param[i].cond);
+        qemu_thread_create(compress_threads + i, "compress",
+                           do_data_compress, comp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_compress_threads_join(void)
+{
+    int i;
+
+    if (!comp_param) {
+        return;
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_mutex_lock(&comp_param[i].mutex);
+        comp_param[i].quit = true;
+        qemu_cond_signal(&comp_param[i].cond);
+        qemu_mutex_unlock(&comp_param[i].mutex);
+    }
+    for (i = 0; i < comp_thread_count; i++) {
+        qemu_thread_join(compress_threads + i);
+        qemu_fclose(comp_param[i].file);
+        qemu_mutex_destroy(&comp_param[i].mutex);
+        qemu_cond_destroy(&comp_param[i].cond);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(compress_threads);
+    g_free(comp_param);
+    compress_threads = NULL;
+    comp_param = NULL;
+    comp_thread_count = 0;
+    compression_switch = false;
+}
+
+/* Move the output of an idle compression thread to the stream */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    int ret = qemu_file_get_error(param->file);
+
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+    return qemu_put_qemu_file(f, param->file);
+}
+
+/*
+ * Wait for all compression threads to go idle and write their output to
+ * the stream.
+ *
+ * Returns: Number of bytes written.
+ */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int idx, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        while (!comp_param[idx].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    for (idx = 0; idx < comp_thread_count; idx++) {
+        bytes_sent += flush_compressed_page(f, &comp_param[idx]);
+    }
+    return bytes_sent;
+}
+
+/*
+ * Hand the page to the first idle compression thread, waiting for one if
+ * they are all busy.  The previous output of that thread is written to the
+ * stream first.
+ *
+ * Returns: Number of bytes written.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    int idx, bytes_sent = -1;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (bytes_sent == -1) {
+        for (idx = 0; idx < comp_thread_count; idx++) {
+            CompressParam *param = &comp_param[idx];
+
+            if (param->done) {
+                bytes_sent = flush_compressed_page(f, param);
+                param->done = false;
+                param->block = block;
+                param->offset = offset;
+
+                qemu_mutex_lock(&param->mutex);
+                param->start = true;
+                qemu_cond_signal(&param->cond);
+                qemu_mutex_unlock(&param->mutex);
+                break;
+            }
+        }
+        if (bytes_sent == -1) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return bytes_sent;
+}
+
+/* Multifd: RAM pages spread over several connections */
+
+#define MULTIFD_MAGIC   0x11223344U
+#define MULTIFD_VERSION 1
+/* The receiver waits for the main stream before reading further */
+#define MULTIFD_FLAG_SYNC (1 << 0)
+/* Pages of a single RAMBlock gathered into one packet */
+#define MULTIFD_PAGES_PER_PACKET 64
+
+typedef struct MultiFDPages {
+    RAMBlock *block;
+    int num;
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+} MultiFDPages;
+
+typedef struct MultiFDSendParam {
+    int id;
+    /* Protected by mutex */
+    bool start;
+    bool quit;
+    QemuMutex mutex;
+    QemuCond cond;
+    /* Protected by multifd_send_done_lock */
+    bool done;
+    /* Owned by the channel thread while !done */
+    QEMUFile *file;
+    uint32_t flags;
+    MultiFDPages pages;
+} MultiFDSendParam;
+
+static MultiFDSendParam *multifd_send_param;
+static QemuThread *multifd_send_threads;
+static int multifd_send_count;
+/* multifd_send_done_cond wakes up the migration thread when a channel
+ * thread is idle again; both are used with multifd_send_done_lock.
+ */
+static QemuMutex multifd_send_done_lock;
+static QemuCond multifd_send_done_cond;
+/* First error hit by a channel, protected by multifd_send_done_lock */
+static int multifd_send_error;
+/* Pages queued by the migration thread, not yet given to a channel */
+static MultiFDPages multifd_send_pages;
+
+static void multifd_send_packet(QEMUFile *f, uint32_t flags,
+                                MultiFDPages *pages)
+{
+    int i;
+
+    qemu_put_be32(f, flags);
+    qemu_put_be32(f, pages->num);
+    if (pages->num) {
+        qemu_put_byte(f, strlen(pages->block->idstr));
+        qemu_put_buffer(f, (uint8_t *)pages->block->idstr,
+                        strlen(pages->block->idstr));
+    }
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_be64(f, pages->offset[i]);
+    }
+    for (i = 0; i < pages->num; i++) {
+        qemu_put_buffer_async(f, memory_region_get_ram_ptr(pages->block->mr) +
+                              pages->offset[i], TARGET_PAGE_SIZE);
+    }
+    qemu_fflush(f);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParam *p = opaque;
+    Error *local_err = NULL;
+    int ret = 0;
+    int fd;
+
+    fd = migrate_multifd_connect(migrate_get_current(), &local_err);
+    if (fd < 0) {
+        error_report("multifd channel %d: %s", p->id,
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        ret = -EIO;
+    } else {
+        p->file = qemu_fopen_socket(fd, "wb");
+        qemu_put_be32(p->file, MULTIFD_MAGIC);
+        qemu_put_be32(p->file, MULTIFD_VERSION);
+        qemu_put_be32(p->file, p->id);
+        qemu_put_be32(p->file, multifd_send_count);
+        qemu_fflush(p->file);
+        ret = qemu_file_get_error(p->file);
+    }
+    trace_multifd_send_thread_start(p->id, ret);
+
+    qemu_mutex_lock(&p->mutex);
+    while (!p->quit) {
+        if (p->start) {
+            p->start = false;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (!ret) {
+                multifd_send_packet(p->file, p->flags, &p->pages);
+                ret = qemu_file_get_error(p->file);
+            }
+            p->pages.num = 0;
+
+            qemu_mutex_lock(&multifd_send_done_lock);
+            if (ret && !multifd_send_error) {
+                multifd_send_error = ret;
+            }
+            p->done = true;
+            qemu_cond_signal(&multifd_send_done_cond);
+            qemu_mutex_unlock(&multifd_send_done_lock);
+
+            qemu_mutex_lock(&p->mutex);
+        } else {
+            qemu_cond_wait(&p->cond, &p->mutex);
+        }
+    }
+    qemu_mutex_unlock(&p->mutex);
+
+    trace_multifd_send_thread_end(p->id);
+    return NULL;
+}
+
+void migrate_multifd_send_threads_create(void)
+{
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    multifd_send_count = migrate_multifd_channels();
+    multifd_send_threads = g_new0(QemuThread, multifd_send_count);
+    multifd_send_param = g_new0(MultiFDSendParam, multifd_send_count);
+    multifd_send_error = 0;
+    multifd_send_pages.num = 0;
+    qemu_cond_init(&multifd_send_done_cond);
+    qemu_mutex_init(&multifd_send_done_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        multifd_send_param[i].id = i;
+        multifd_send_param[i].done = true;
+        qemu_mutex_init(&multifd_send_param[i].mutex);
+        qemu_cond_init(&multifd_send_param[i].cond);
+        qemu_thread_create(multifd_send_threads + i, "multifd/send",
+                           multifd_send_thread, multifd_send_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_multifd_send_threads_join(bool failed)
+{
+    int i;
+
+    if (!multifd_send_param) {
+        return;
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *p = &multifd_send_param[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        qemu_cond_signal(&p->cond);
+        qemu_mutex_unlock(&p->mutex);
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        MultiFDSendParam *p = &multifd_send_param[i];
+
+        /* Don't leave a channel stuck on a destination that went away */
+        if (failed && p->file) {
+            qemu_file_shutdown(p->file);
+        }
+        qemu_thread_join(multifd_send_threads + i);
+        if (p->file) {
+            qemu_fclose(p->file);
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_cond_destroy(&p->cond);
+    }
+    qemu_mutex_destroy(&multifd_send_done_lock);
+    qemu_cond_destroy(&multifd_send_done_cond);
+    g_free(multifd_send_threads);
+    g_free(multifd_send_param);
+    multifd_send_threads = NULL;
+    multifd_send_param = NULL;
+    multifd_send_count = 0;
+}
+
+/* Give a packet to a channel thread that the caller marked busy */
+static void multifd_send_start(MultiFDSendParam *p, uint32_t flags,
+                               MultiFDPages *pages)
+{
+    p->flags = flags;
+    p->pages = *pages;
+    pages->num = 0;
+
+    qemu_mutex_lock(&p->mutex);
+    p->start = true;
+    qemu_cond_signal(&p->cond);
+    qemu_mutex_unlock(&p->mutex);
+}
+
+/*
+ * Wait for an idle channel thread and give it a packet to send.
+ *
+ * Returns: 0 on success, or the error of a failed channel, which is also
+ *          set on f.
+ */
+static int multifd_send_to_channel(QEMUFile *f, uint32_t flags,
+                                   MultiFDPages *pages)
+{
+    static int next_channel;
+    MultiFDSendParam *p = NULL;
+    int i, ret;
+
+    qemu_mutex_lock(&multifd_send_done_lock);
+    while (!multifd_send_error) {
+        /* Round robin, so that all the connections are kept busy */
+        for (i = 0; i < multifd_send_count; i++) {
+            int idx = (next_channel + i) % multifd_send_count;
+
+            if (multifd_send_param[idx].done) {
+                p = &multifd_send_param[idx];
+                next_channel = idx + 1;
+                break;
+            }
+        }
+        if (p) {
+            break;
+        }
+        qemu_cond_wait(&multifd_send_done_cond, &multifd_send_done_lock);
+    }
+    ret = multifd_send_error;
+    if (!ret) {
+        p->done = false;
+    }
+    qemu_mutex_unlock(&multifd_send_done_lock);
+
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    multifd_send_start(p, flags, pages);
+    return 0;
+}
+
+/*
+ * Queue a page for the multifd channels; a full batch, or a batch for
+ * another RAMBlock, is handed to the next idle channel first.  The page
+ * data is accounted on the main stream so that rate limiting and the
+ * bandwidth estimate keep working.
+ *
+ * Returns: Number of bytes accounted for the page.
+ */
+static int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = &multifd_send_pages;
+
+    if (pages->num &&
+        (pages->block != block || pages->num == MULTIFD_PAGES_PER_PACKET)) {
+        multifd_send_to_channel(f, 0, pages);
+    }
+    pages->block = block;
+    pages->offset[pages->num++] = offset;
+
+    qemu_update_position(f, TARGET_PAGE_SIZE);
+    qemu_file_update_transfer(f, TARGET_PAGE_SIZE);
+    return TARGET_PAGE_SIZE;
+}
+
+/*
+ * Put a synchronization point into every channel and into the main stream.
+ * The destination doesn't go past the point in the main stream until all
+ * the channels have loaded the pages sent before it, and the channels
+ * don't load anything sent after it before that; so a page sent again
+ * after a sync can never be overwritten by an older copy.
+ *
+ * Returns: Number of bytes written to f.
+ */
+static int multifd_send_sync_main(QEMUFile *f)
+{
+    MultiFDPages empty = { .num = 0 };
+    int i, ret;
+
+    if (!multifd_send_param) {
+        return 0;
+    }
+    if (multifd_send_pages.num) {
+        multifd_send_to_channel(f, 0, &multifd_send_pages);
+    }
+
+    /* Every channel gets exactly one sync packet */
+    qemu_mutex_lock(&multifd_send_done_lock);
+    for (i = 0; i < multifd_send_count; i++) {
+        while (!multifd_send_param[i].done && !multifd_send_error) {
+            qemu_cond_wait(&multifd_send_done_cond, &multifd_send_done_lock);
+        }
+    }
+    ret = multifd_send_error;
+    if (!ret) {
+        for (i = 0; i < multifd_send_count; i++) {
+            multifd_send_param[i].done = false;
+        }
+    }
+    qemu_mutex_unlock(&multifd_send_done_lock);
+
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        return 0;
+    }
+    for (i = 0; i < multifd_send_count; i++) {
+        multifd_send_start(&multifd_send_param[i], MULTIFD_FLAG_SYNC, &empty);
+    }
+    trace_multifd_send_sync_main();
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    return 8;
+}
+
 /* This is the last block that we have visited serching for dirty pages
  */
 static RAMBlock *last_seen_block;
@@ -331,6 +870,11 @@ static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+/* Set once the destination is running and pages are fetched on demand */
+static bool ram_postcopy_active;
+
+/* Maximum number of ranges in a single MIG_CMD_POSTCOPY_RAM_DISCARD */
+#define MAX_DISCARDS_PER_COMMAND 12
 
 /* Update the xbzrle cache to reflect a page that's been sent as all 0.
  * The important thing is that a stale (not-yet-0'd) page be replaced
@@ -346,7 +890,9 @@ static void xbzrle_cache_zero_page(ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE);
+    if (cache_insert(XBZRLE.cache, current_addr, ZERO_TARGET_PAGE) == 1) {
+        acct_info.xbzrle_cache_evictions++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -358,21 +904,25 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     int encoded_len = 0, bytes_sent = -1;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr)) {
+    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    if (!prev_cached_page) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data) == -1) {
+            int ret = cache_insert(XBZRLE.cache, current_addr, *current_data);
+
+            if (ret == -1) {
                 return -1;
-            } else {
-                /* update *current_data when the page has been
-                   inserted into cache */
-                *current_data = get_cached_data(XBZRLE.cache, current_addr);
             }
+            if (ret == 1) {
+                acct_info.xbzrle_cache_evictions++;
+            }
+            /* update *current_data when the page has been
+               inserted into cache */
+            *current_data = get_cached_data(XBZRLE.cache, current_addr);
         }
         return -1;
     }
-
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    acct_info.xbzrle_cache_hit++;
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
@@ -586,8 +1136,6 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
     ret = ram_control_save_page(f, block->offset,
                            offset, TARGET_PAGE_SIZE, &bytes_sent);
 
-    XBZRLE_cache_lock();
-
     current_addr = block->offset + offset;
     if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
         if (ret != RAM_SAVE_CONTROL_DELAYED) {
@@ -607,7 +1155,11 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
          * page would be stale
          */
         xbzrle_cache_zero_page(current_addr);
-    } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+    } else if (!ram_bulk_stage && !ram_postcopy_active &&
+               migrate_use_xbzrle()) {
+        /* The destination can't apply deltas to pages it doesn't have yet,
+         * so xbzrle is off once postcopy starts.
+         */
         bytes_sent = save_xbzrle_page(f, &p, current_addr, block,
                                       offset, cont, last_stage);
         if (!last_stage) {
@@ -618,19 +1170,238 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
         }
     }
 
-    /* XBZRLE overflow or normal page */
-    if (bytes_sent == -1) {
-        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-        if (send_async) {
-            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-        } else {
-            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1 && multifd_send_param) {
+        bytes_sent = multifd_queue_page(f, block, offset);
+        acct_info.norm_pages++;
+    } else if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        if (send_async) {
+            qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        }
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * ram_save_compressed_page: Send the given page to the stream, compressed
+ * by one of the compression threads
+ *
+ * Returns: Number of bytes written; pages still being compressed are
+ *          accounted for when their thread output is flushed.
+ */
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset, bool last_stage)
+{
+    int bytes_sent = -1;
+    int cont;
+    uint8_t *p;
+    int ret;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    ret = ram_control_save_page(f, block->offset,
+                                offset, TARGET_PAGE_SIZE, &bytes_sent);
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                acct_info.norm_pages++;
+            } else if (bytes_sent == 0) {
+                acct_info.dup_pages++;
+            }
+        }
+        return bytes_sent;
+    }
+
+    /* When starting the process of a new block, the first page of
+     * the block should be sent out before other pages in the same
+     * block, and all the pages in last block should have been sent
+     * out.  Keeping this order is important, because the 'cont' flag
+     * is used to avoid resending the block name.
+     */
+    if (block != last_sent_block) {
+        bytes_sent = flush_compressed_data(f);
+        cont = 0;
+    } else {
+        bytes_sent = 0;
+        cont = RAM_SAVE_FLAG_CONTINUE;
+    }
+
+    if (is_zero_range(p, TARGET_PAGE_SIZE)) {
+        acct_info.dup_pages++;
+        bytes_sent += save_block_hdr(f, block, offset, cont,
+                                     RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else if (!cont) {
+        /* All threads are idle after the flush, borrow the first one's
+         * buffer and compress synchronously.
+         */
+        acct_info.norm_pages++;
+        if (do_compress_ram_page(comp_param[0].file, block, offset, 0) < 0) {
+            qemu_file_set_error(f, -EIO);
+            return bytes_sent;
+        }
+        bytes_sent += qemu_put_qemu_file(f, comp_param[0].file);
+    } else {
+        acct_info.norm_pages++;
+        bytes_sent += compress_page_with_multi_thread(f, block, offset);
+    }
+
+    return bytes_sent;
+}
+
+static RAMBlock *ram_find_block_by_idstr(const char *id)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(id, block->idstr)) {
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+static void free_page_request(MigrationState *ms,
+                              MigrationSrcPageRequest *entry)
+{
+    QSIMPLEQ_REMOVE_HEAD(&ms->src_page_requests, next_req);
+    g_free(entry->rbname);
+    g_free(entry);
+}
+
+/*
+ * unqueue_page: Take the next page off the queue of pages requested by
+ * the destination
+ *
+ * Returns:  The block of the page, with its offset in *offset, or NULL if
+ *           the queue is empty or the request was bad (f gets an error).
+ */
+static RAMBlock *unqueue_page(MigrationState *ms, QEMUFile *f,
+                              ram_addr_t *offset)
+{
+    MigrationSrcPageRequest *entry;
+    RAMBlock *block = NULL;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    entry = QSIMPLEQ_FIRST(&ms->src_page_requests);
+    if (entry) {
+        block = ram_find_block_by_idstr(entry->rbname);
+        if (!block || !entry->len ||
+            (entry->offset & ~TARGET_PAGE_MASK) ||
+            entry->offset >= block->length ||
+            entry->len > block->length - entry->offset) {
+            error_report("Bad page request for RAMBlock %s: " RAM_ADDR_FMT
+                         "+" RAM_ADDR_FMT, entry->rbname, entry->offset,
+                         entry->len);
+            qemu_file_set_error(f, -EINVAL);
+            free_page_request(ms, entry);
+            block = NULL;
+        } else {
+            *offset = entry->offset;
+            if (entry->len > TARGET_PAGE_SIZE) {
+                entry->len -= TARGET_PAGE_SIZE;
+                entry->offset += TARGET_PAGE_SIZE;
+            } else {
+                free_page_request(ms, entry);
+            }
+        }
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return block;
+}
+
+/*
+ * flush_page_queue: Drop any page requests still queued, at the end of
+ * a migration.
+ */
+void flush_page_queue(MigrationState *ms)
+{
+    MigrationSrcPageRequest *entry;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    while ((entry = QSIMPLEQ_FIRST(&ms->src_page_requests))) {
+        free_page_request(ms, entry);
+    }
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+}
+
+/*
+ * ram_save_queue_pages: Queue the pages the destination faulted on, so that
+ * the migration thread sends them ahead of the background transfer
+ *
+ * rbname: Name of the RAMBlock of the request; NULL means the same as
+ *         the previous request.
+ *
+ * Returns: 0 on success
+ */
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len)
+{
+    MigrationSrcPageRequest *new_entry;
+
+    if (!rbname) {
+        rbname = ms->last_req_rbname;
+        if (!rbname) {
+            error_report("%s: no previous RAMBlock", __func__);
+            return -1;
         }
-        bytes_sent += TARGET_PAGE_SIZE;
-        acct_info.norm_pages++;
+    } else {
+        g_free(ms->last_req_rbname);
+        ms->last_req_rbname = g_strdup(rbname);
+    }
+    trace_ram_save_queue_pages(rbname, start, len);
+
+    new_entry = g_new0(MigrationSrcPageRequest, 1);
+    new_entry->rbname = g_strdup(rbname);
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    qemu_mutex_lock(&ms->src_page_req_mutex);
+    QSIMPLEQ_INSERT_TAIL(&ms->src_page_requests, new_entry, next_req);
+    qemu_mutex_unlock(&ms->src_page_req_mutex);
+
+    return 0;
+}
+
+/*
+ * ram_save_requested_page: In postcopy, send the next page the destination
+ * is waiting for.  The page is sent whether or not it is dirty: the copy
+ * sent earlier may have been discarded on the destination, and the source
+ * VM is stopped, so sending it again is always safe.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means no page was requested
+ */
+static int ram_save_requested_page(QEMUFile *f, bool last_stage)
+{
+    MigrationState *ms = migrate_get_current();
+    RAMBlock *block;
+    ram_addr_t offset;
+    int bytes_sent;
+
+    block = unqueue_page(ms, f, &offset);
+    if (!block) {
+        return 0;
     }
 
-    XBZRLE_cache_unlock();
+    if (test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                           migration_bitmap)) {
+        migration_dirty_pages--;
+    }
+
+    bytes_sent = ram_save_page(f, block, offset, last_stage);
+    if (bytes_sent > 0) {
+        last_sent_block = block;
+    }
 
     return bytes_sent;
 }
@@ -648,8 +1419,17 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     ram_addr_t offset = last_offset;
     bool complete_round = false;
     int bytes_sent = 0;
+    int bytes_flushed = 0;
     MemoryRegion *mr;
 
+    if (ram_postcopy_active) {
+        /* The destination is stalled on these, they go first */
+        bytes_sent = ram_save_requested_page(f, last_stage);
+        if (bytes_sent > 0) {
+            return bytes_sent;
+        }
+    }
+
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
 
@@ -667,9 +1447,30 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
                 block = QTAILQ_FIRST(&ram_list.blocks);
                 complete_round = true;
                 ram_bulk_stage = false;
+                /* Pages of this round must land before any of them is
+                 * sent again over another channel.
+                 */
+                bytes_flushed += multifd_send_sync_main(f);
+                if (compression_switch) {
+                    /* Pages of this round must be on the wire before
+                     * any of them can be sent again in the next one.
+                     */
+                    bytes_flushed += flush_compressed_data(f);
+                    if (migrate_use_xbzrle()) {
+                        /* Past the bulk stage xbzrle does better than
+                         * compression, switch over to it.
+                         */
+                        compression_switch = false;
+                    }
+                }
             }
         } else {
-            bytes_sent = ram_save_page(f, block, offset, last_stage);
+            if (compression_switch) {
+                bytes_sent = ram_save_compressed_page(f, block, offset,
+                                                      last_stage);
+            } else {
+                bytes_sent = ram_save_page(f, block, offset, last_stage);
+            }
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
@@ -681,7 +1482,7 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return bytes_sent + bytes_flushed;
 }
 
 static uint64_t bytes_transferred;
@@ -738,7 +1539,6 @@ static void migration_end(void)
         migration_bitmap = NULL;
     }
 
-    XBZRLE_cache_lock();
     if (XBZRLE.cache) {
         cache_fini(XBZRLE.cache);
         g_free(XBZRLE.encoded_buf);
@@ -747,7 +1547,6 @@ static void migration_end(void)
         XBZRLE.encoded_buf = NULL;
         XBZRLE.current_buf = NULL;
     }
-    XBZRLE_cache_unlock();
 }
 
 static void ram_migration_cancel(void *opaque)
@@ -761,7 +1560,8 @@ static void reset_ram_globals(void)
     last_sent_block = NULL;
     last_offset = 0;
     last_version = ram_list.version;
-    ram_bulk_stage = true;
+    /* The bulk stage skips the bitmap, which postcopy relies on */
+    ram_bulk_stage = !ram_postcopy_active;
 }
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
@@ -776,16 +1576,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     bitmap_sync_count = 0;
 
     if (migrate_use_xbzrle()) {
-        XBZRLE_cache_lock();
         XBZRLE.cache = cache_init(migrate_xbzrle_cache_size() /
                                   TARGET_PAGE_SIZE,
                                   TARGET_PAGE_SIZE);
         if (!XBZRLE.cache) {
-            XBZRLE_cache_unlock();
             error_report("Error creating cache");
             return -1;
         }
-        XBZRLE_cache_unlock();
 
         /* We prefer not to abort if there is no memory */
         XBZRLE.encoded_buf = g_try_malloc0(TARGET_PAGE_SIZE);
@@ -808,6 +1605,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
+    ram_postcopy_active = false;
     reset_ram_globals();
 
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
@@ -857,12 +1655,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     qemu_mutex_lock_ramlist();
 
+    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
+
+    xbzrle_cache_update_size();
+
     if (ram_list.version != last_version) {
+        /* The walk restarts from the first block */
+        total_sent += multifd_send_sync_main(f);
         reset_ram_globals();
     }
 
-    ram_control_before_iterate(f, RAM_CONTROL_ROUND);
-
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
@@ -938,6 +1740,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         bytes_transferred += bytes_sent;
     }
 
+    bytes_transferred += flush_compressed_data(f);
+    bytes_transferred += multifd_send_sync_main(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     migration_end();
 
@@ -947,6 +1751,64 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     return 0;
 }
 
+/*
+ * ram_postcopy_send_discard_bitmap: Switch RAM to postcopy and tell the
+ * destination to discard every page that is dirty now; those pages were
+ * either never sent or have changed since they were sent.  Called with
+ * the iothread lock held and the VM stopped.
+ *
+ * Returns: 0 on success
+ */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms)
+{
+    QEMUFile *f = ms->file;
+    uint64_t start_list[MAX_DISCARDS_PER_COMMAND];
+    uint64_t length_list[MAX_DISCARDS_PER_COMMAND];
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    migration_bitmap_sync();
+
+    /* Compressed pages must not land after the discards that cover them */
+    bytes_transferred += flush_compressed_data(f);
+    compression_switch = false;
+
+    ram_postcopy_active = true;
+    ram_bulk_stage = false;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = (block->offset + block->length) >>
+                             TARGET_PAGE_BITS;
+        unsigned long run_start, run_end;
+        unsigned int n = 0;
+
+        run_start = find_next_bit(migration_bitmap, last, first);
+        while (run_start < last) {
+            run_end = find_next_zero_bit(migration_bitmap, last, run_start);
+
+            start_list[n] = (uint64_t)(run_start - first) << TARGET_PAGE_BITS;
+            length_list[n] = (uint64_t)(run_end - run_start) <<
+                             TARGET_PAGE_BITS;
+            if (++n == MAX_DISCARDS_PER_COMMAND) {
+                qemu_savevm_send_postcopy_ram_discard(f, block->idstr, n,
+                                                      start_list, length_list);
+                n = 0;
+            }
+            run_start = find_next_bit(migration_bitmap, last, run_end);
+        }
+        if (n) {
+            qemu_savevm_send_postcopy_ram_discard(f, block->idstr, n,
+                                                  start_list, length_list);
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+
+    trace_ram_postcopy_send_discard_bitmap(migration_dirty_pages);
+
+    return qemu_file_get_error(f);
+}
+
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
     uint64_t remaining_size;
@@ -997,6 +1859,419 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return 0;
 }
 
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    unsigned long pagesize;
+    void *des;
+    int len, ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (param->des) {
+            /* Take the job before publishing done, so that a new job
+             * stored after that cannot be lost.
+             */
+            des = param->des;
+            len = param->len;
+            param->des = NULL;
+            qemu_mutex_unlock(&param->mutex);
+
+            pagesize = TARGET_PAGE_SIZE;
+            ret = uncompress((Bytef *)des, &pagesize,
+                             (const Bytef *)param->compbuf, len);
+
+            qemu_mutex_lock(&decomp_done_lock);
+            if (ret != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+                param->ret = -EINVAL;
+            }
+            param->done = true;
+            qemu_cond_signal(&decomp_done_cond);
+            qemu_mutex_unlock(&decomp_done_lock);
+
+            qemu_mutex_lock(&param->mutex);
+        } else {
+            qemu_cond_wait(&param->cond, &param->mutex);
+        }
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decompress_threads = g_new0(QemuThread, decomp_thread_count);
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_mutex_init(&decomp_param[i].mutex);
+        qemu_cond_init(&decomp_param[i].cond);
+        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        decomp_param[i].done = true;
+        qemu_thread_create(decompress_threads + i, "decompress",
+                           do_data_decompress, decomp_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_mutex_lock(&decomp_param[i].mutex);
+        decomp_param[i].quit = true;
+        qemu_cond_signal(&decomp_param[i].cond);
+        qemu_mutex_unlock(&decomp_param[i].mutex);
+    }
+    for (i = 0; i < decomp_thread_count; i++) {
+        qemu_thread_join(decompress_threads + i);
+        qemu_mutex_destroy(&decomp_param[i].mutex);
+        qemu_cond_destroy(&decomp_param[i].cond);
+        g_free(decomp_param[i].compbuf);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decompress_threads);
+    g_free(decomp_param);
+    g_free(compressed_data_buf);
+    decompress_threads = NULL;
+    decomp_param = NULL;
+    compressed_data_buf = NULL;
+    decomp_thread_count = 0;
+}
+
+/* Multifd: receiving side */
+
+typedef struct MultiFDRecvParam {
+    int id;
+    /* Protected by multifd_recv_lock */
+    QEMUFile *file;
+    /* Posted by the loading coroutine once every channel reached a sync */
+    QemuSemaphore sem_sync;
+} MultiFDRecvParam;
+
+static MultiFDRecvParam *multifd_recv_param;
+static QemuThread *multifd_recv_threads;
+static int multifd_recv_count;
+/* The channels are accepted by their own threads */
+static int multifd_recv_listen_fd = -1;
+/* Protects the files of the channels and multifd_recv_quit */
+static QemuMutex multifd_recv_lock;
+static bool multifd_recv_quit;
+/* Posted by each channel when it reaches a sync point, or fails */
+static QemuSemaphore multifd_recv_sem_synced;
+/* First error hit by a channel */
+static int multifd_recv_error;
+
+static int multifd_recv_handshake(QEMUFile *f, MultiFDRecvParam *p)
+{
+    uint32_t magic, version, id, count;
+
+    magic = qemu_get_be32(f);
+    version = qemu_get_be32(f);
+    id = qemu_get_be32(f);
+    count = qemu_get_be32(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (magic != MULTIFD_MAGIC || version != MULTIFD_VERSION) {
+        error_report("multifd: bad channel header (magic 0x%x version %u)",
+                     magic, version);
+        return -EINVAL;
+    }
+    if (count != multifd_recv_count) {
+        error_report("multifd: source uses %u channels but %d are set here",
+                     count, multifd_recv_count);
+        return -EINVAL;
+    }
+    trace_multifd_recv_handshake(p->id, id);
+    return 0;
+}
+
+/*
+ * Load one packet straight into guest RAM.
+ *
+ * Returns: 0, or a negative errno.
+ */
+static int multifd_recv_packet(QEMUFile *f, uint32_t *flags)
+{
+    ram_addr_t offset[MULTIFD_PAGES_PER_PACKET];
+    RAMBlock *block;
+    uint8_t *host;
+    uint32_t num;
+    char id[256];
+    uint8_t len;
+    int i, ret;
+
+    *flags = qemu_get_be32(f);
+    num = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret || !num) {
+        return ret;
+    }
+    if (num > MULTIFD_PAGES_PER_PACKET) {
+        error_report("multifd: too many pages in a packet (%u)", num);
+        return -EINVAL;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    block = ram_find_block_by_idstr(id);
+    if (!block) {
+        error_report("multifd: unknown RAMBlock \"%s\"", id);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < num; i++) {
+        offset[i] = qemu_get_be64(f);
+        if ((offset[i] & ~TARGET_PAGE_MASK) || offset[i] >= block->length) {
+            error_report("multifd: illegal offset " RAM_ADDR_FMT " in %s",
+                         offset[i], id);
+            return -EINVAL;
+        }
+    }
+
+    host = memory_region_get_ram_ptr(block->mr);
+    for (i = 0; i < num; i++) {
+        qemu_get_buffer(f, host + offset[i], TARGET_PAGE_SIZE);
+    }
+    return qemu_file_get_error(f);
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParam *p = opaque;
+    QEMUFile *f = NULL;
+    uint32_t flags;
+    bool quit;
+    int fd, ret;
+
+    do {
+        fd = qemu_accept(multifd_recv_listen_fd, NULL, NULL);
+    } while (fd < 0 && errno == EINTR);
+    if (fd < 0) {
+        ret = -errno;
+        goto out;
+    }
+    qemu_set_block(fd);
+    f = qemu_fopen_socket(fd, "rb");
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    p->file = f;
+    quit = multifd_recv_quit;
+    qemu_mutex_unlock(&multifd_recv_lock);
+    if (quit) {
+        return NULL;
+    }
+
+    ret = multifd_recv_handshake(f, p);
+    while (!ret) {
+        ret = multifd_recv_packet(f, &flags);
+        if (!ret && (flags & MULTIFD_FLAG_SYNC)) {
+            trace_multifd_recv_sync(p->id);
+            qemu_sem_post(&multifd_recv_sem_synced);
+            qemu_sem_wait(&p->sem_sync);
+        }
+    }
+
+out:
+    /* Closing the channels at the end of the migration is not an error */
+    if (!atomic_mb_read(&multifd_recv_quit)) {
+        error_report("multifd channel %d failed: %s", p->id, strerror(-ret));
+        atomic_cmpxchg(&multifd_recv_error, 0, ret);
+    }
+    /* Don't leave the loading coroutine waiting for this channel */
+    qemu_sem_post(&multifd_recv_sem_synced);
+    trace_multifd_recv_thread_end(p->id, ret);
+    return NULL;
+}
+
+void migrate_multifd_recv_threads_create(int listen_fd)
+{
+    int i;
+
+    multifd_recv_count = migrate_multifd_channels();
+    multifd_recv_threads = g_new0(QemuThread, multifd_recv_count);
+    multifd_recv_param = g_new0(MultiFDRecvParam, multifd_recv_count);
+    multifd_recv_listen_fd = listen_fd;
+    multifd_recv_quit = false;
+    multifd_recv_error = 0;
+    qemu_set_block(listen_fd);
+    qemu_mutex_init(&multifd_recv_lock);
+    qemu_sem_init(&multifd_recv_sem_synced, 0);
+    for (i = 0; i < multifd_recv_count; i++) {
+        multifd_recv_param[i].id = i;
+        qemu_sem_init(&multifd_recv_param[i].sem_sync, 0);
+        qemu_thread_create(multifd_recv_threads + i, "multifd/recv",
+                           multifd_recv_thread, multifd_recv_param + i,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_multifd_recv_threads_join(void)
+{
+    int i;
+
+    if (!multifd_recv_param) {
+        return;
+    }
+
+    qemu_mutex_lock(&multifd_recv_lock);
+    atomic_mb_set(&multifd_recv_quit, true);
+    for (i = 0; i < multifd_recv_count; i++) {
+        if (multifd_recv_param[i].file) {
+            qemu_file_shutdown(multifd_recv_param[i].file);
+        }
+    }
+    qemu_mutex_unlock(&multifd_recv_lock);
+    /* Wakes up the threads still waiting for a connection */
+    shutdown(multifd_recv_listen_fd, SHUT_RDWR);
+
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_post(&multifd_recv_param[i].sem_sync);
+        qemu_thread_join(multifd_recv_threads + i);
+        if (multifd_recv_param[i].file) {
+            qemu_fclose(multifd_recv_param[i].file);
+        }
+        qemu_sem_destroy(&multifd_recv_param[i].sem_sync);
+    }
+    closesocket(multifd_recv_listen_fd);
+    multifd_recv_listen_fd = -1;
+    qemu_sem_destroy(&multifd_recv_sem_synced);
+    qemu_mutex_destroy(&multifd_recv_lock);
+    g_free(multifd_recv_threads);
+    g_free(multifd_recv_param);
+    multifd_recv_threads = NULL;
+    multifd_recv_param = NULL;
+    multifd_recv_count = 0;
+}
+
+/*
+ * Called for RAM_SAVE_FLAG_MULTIFD_SYNC: wait until every channel loaded
+ * the pages sent before the sync point, then let them carry on.
+ *
+ * Returns: 0, or a negative errno if a channel failed.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_param) {
+        error_report("multifd sync point received, but x-multifd is not"
+                     " enabled");
+        return -EINVAL;
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        if (atomic_mb_read(&multifd_recv_error)) {
+            break;
+        }
+        qemu_sem_wait(&multifd_recv_sem_synced);
+    }
+    if (atomic_mb_read(&multifd_recv_error)) {
+        return atomic_mb_read(&multifd_recv_error);
+    }
+    for (i = 0; i < multifd_recv_count; i++) {
+        qemu_sem_post(&multifd_recv_param[i].sem_sync);
+    }
+    trace_multifd_recv_sync_main();
+    return 0;
+}
+
+/*
+ * Wait until no decompression thread writes to @host, or to any page if
+ * @host is NULL.  Pages can be resent while an earlier copy is still being
+ * decompressed, and the older copy must not land last.
+ *
+ * Returns: 0, or a negative errno if a decompression failed.
+ */
+static int wait_for_decompress(void *host)
+{
+    int idx, ret = 0;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (idx = 0; idx < decomp_thread_count; idx++) {
+        DecompressParam *param = &decomp_param[idx];
+
+        if (host && param->busy_host != host) {
+            continue;
+        }
+        while (!param->done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+        if (param->ret < 0) {
+            ret = param->ret;
+        }
+    }
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
+
+static int decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                              int len)
+{
+    int idx;
+
+    if (!decomp_param) {
+        unsigned long pagesize = TARGET_PAGE_SIZE;
+
+        /* No thread pool (e.g. loadvm), decompress inline */
+        if (!compressed_data_buf) {
+            compressed_data_buf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
+        }
+        qemu_get_buffer(f, compressed_data_buf, len);
+        if (uncompress((Bytef *)host, &pagesize, compressed_data_buf,
+                       len) != Z_OK || pagesize != TARGET_PAGE_SIZE) {
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (true) {
+        for (idx = 0; idx < decomp_thread_count; idx++) {
+            if (decomp_param[idx].done) {
+                break;
+            }
+        }
+        if (idx < decomp_thread_count) {
+            break;
+        }
+        qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+    }
+    if (decomp_param[idx].ret < 0) {
+        qemu_mutex_unlock(&decomp_done_lock);
+        return decomp_param[idx].ret;
+    }
+    decomp_param[idx].done = false;
+    decomp_param[idx].busy_host = host;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, decomp_param[idx].compbuf, len);
+    qemu_mutex_lock(&decomp_param[idx].mutex);
+    decomp_param[idx].des = host;
+    decomp_param[idx].len = len;
+    qemu_cond_signal(&decomp_param[idx].cond);
+    qemu_mutex_unlock(&decomp_param[idx].mutex);
+
+    return 0;
+}
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
@@ -1043,6 +2318,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     ram_addr_t addr;
     int flags, ret = 0;
     static uint64_t seq_iter;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyState ps = postcopy_state_get(mis);
+    /* Pages are placed atomically while the destination takes faults */
+    bool postcopy_running = ps == POSTCOPY_INCOMING_LISTENING ||
+                            ps == POSTCOPY_INCOMING_RUNNING;
 
     seq_iter++;
 
@@ -1105,8 +2385,24 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
 
+            ret = wait_for_decompress(host);
+            if (ret < 0) {
+                break;
+            }
             ch = qemu_get_byte(f);
-            ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            if (!postcopy_running) {
+                ram_handle_compressed(host, ch, TARGET_PAGE_SIZE);
+            } else if (ch == 0) {
+                ret = postcopy_place_page_zero(mis, host);
+            } else {
+                void *page = postcopy_get_tmp_page(mis);
+
+                memset(page, ch, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(mis, host, page);
+            }
+            if (ret < 0) {
+                break;
+            }
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
@@ -1117,7 +2413,59 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            ret = wait_for_decompress(host);
+            if (ret < 0) {
+                break;
+            }
+            if (postcopy_running) {
+                void *page = postcopy_get_tmp_page(mis);
+
+                /* Never map in a page that was cut short */
+                if (qemu_get_buffer(f, page, TARGET_PAGE_SIZE) !=
+                    TARGET_PAGE_SIZE) {
+                    ret = qemu_file_get_error(f);
+                    if (!ret) {
+                        ret = -EIO;
+                    }
+                    break;
+                }
+                ret = postcopy_place_page(mis, host, page);
+                if (ret < 0) {
+                    break;
+                }
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            int len;
+
+            if (!host) {
+                error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
+                ret = -EINVAL;
+                break;
+            }
+            if (postcopy_running) {
+                error_report("Compressed page received during postcopy");
+                ret = -EINVAL;
+                break;
+            }
+
+            len = qemu_get_be32(f);
+            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+                error_report("Invalid compressed data length: %d", len);
+                ret = -EINVAL;
+                break;
+            }
+            ret = wait_for_decompress(host);
+            if (ret == 0) {
+                ret = decompress_data_with_multi_threads(f, host, len);
+            }
+            if (ret < 0) {
+                error_report("Failed to decompress page at " RAM_ADDR_FMT,
+                             addr);
+                break;
+            }
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
@@ -1125,17 +2473,32 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 break;
             }
+            if (postcopy_running) {
+                error_report("XBZRLE page received during postcopy");
+                ret = -EINVAL;
+                break;
+            }
 
+            ret = wait_for_decompress(host);
+            if (ret < 0) {
+                break;
+            }
             if (load_xbzrle(f, addr, host) < 0) {
                 error_report("Failed to decompress XBZRLE page at "
                              RAM_ADDR_FMT, addr);
                 ret = -EINVAL;
                 break;
             }
+        } else if (flags & RAM_SAVE_FLAG_MULTIFD_SYNC) {
+            ret = multifd_recv_sync_main();
+            if (ret < 0) {
+                break;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         } else if (flags & RAM_SAVE_FLAG_EOS) {
             /* normal exit */
+            ret = wait_for_decompress(NULL);
             break;
         } else {
             error_report("Unknown migration flags: %#x", flags);
@@ -1161,7 +2524,6 @@ static SaveVMHandlers savevm_ram_handlers = {
 
 void ram_mig_init(void)
 {
-    qemu_mutex_init(&XBZRLE.lock);
     register_savevm_live(NULL, "ram", 0, 4, &savevm_ram_handlers, NULL);
 }
 
@@ -26,6 +26,7 @@
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
+#include "block/throttle-groups.h"
 #include "qemu/module.h"
 #include "qapi/qmp/qjson.h"
 #include "sysemu/sysemu.h"
@@ -53,6 +54,10 @@
 
 struct BdrvDirtyBitmap {
     HBitmap *bitmap;
+    BdrvDirtyBitmap *successor; /* Anonymous child; implies frozen status */
+    char *name;                 /* Optional non-empty unique ID */
+    int64_t size;               /* Size of the bitmap (Number of sectors) */
+    bool persistent;            /* Stored in the image when it is closed */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -90,6 +95,8 @@ static BlockDriverAIOCB *bdrv_co_aio_rw_vector(BlockDriverState *bs,
 static void coroutine_fn bdrv_co_do_rw(void *opaque);
 static int coroutine_fn bdrv_co_do_write_zeroes(BlockDriverState *bs,
     int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
+static void bdrv_dirty_bitmap_truncate(BlockDriverState *bs);
+static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -129,7 +136,7 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 {
     int i;
 
-    throttle_config(&bs->throttle_state, cfg);
+    throttle_group_config(bs, cfg);
 
     for (i = 0; i < 2; i++) {
         qemu_co_enter_next(&bs->throttled_reqs[i]);
@@ -162,63 +169,35 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
 
     bdrv_start_throttled_reqs(bs);
 
-    throttle_destroy(&bs->throttle_state);
-}
-
-static void bdrv_throttle_read_timer_cb(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[0]);
-}
-
-static void bdrv_throttle_write_timer_cb(void *opaque)
-{
-    BlockDriverState *bs = opaque;
-    qemu_co_enter_next(&bs->throttled_reqs[1]);
+    throttle_group_unregister_bs(bs);
 }
 
 /* should be called before bdrv_set_io_limits if a limit is set */
-void bdrv_io_limits_enable(BlockDriverState *bs)
+void bdrv_io_limits_enable(BlockDriverState *bs, const char *group)
 {
     assert(!bs->io_limits_enabled);
-    throttle_init(&bs->throttle_state,
-                  bdrv_get_aio_context(bs),
-                  QEMU_CLOCK_VIRTUAL,
-                  bdrv_throttle_read_timer_cb,
-                  bdrv_throttle_write_timer_cb,
-                  bs);
+    throttle_group_register_bs(bs, group);
     bs->io_limits_enabled = true;
 }
 
-/* This function makes an IO wait if needed
- *
- * @nb_sectors: the number of sectors of the IO
- * @is_write:   is the IO a write
+/* Move @bs to the throttling group @group, keeping the limits of the
+ * new group.  Nothing is done if @bs has no I/O limits.
  */
-static void bdrv_io_limits_intercept(BlockDriverState *bs,
-                                     unsigned int bytes,
-                                     bool is_write)
+void bdrv_io_limits_update_group(BlockDriverState *bs, const char *group)
 {
-    /* does this io must wait */
-    bool must_wait = throttle_schedule_timer(&bs->throttle_state, is_write);
-
-    /* if must wait or any request of this type throttled queue the IO */
-    if (must_wait ||
-        !qemu_co_queue_empty(&bs->throttled_reqs[is_write])) {
-        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+    /* this bs is not part of any group */
+    if (!bs->throttle_state) {
+        return;
     }
 
-    /* the IO will be executed, do the accounting */
-    throttle_account(&bs->throttle_state, is_write, bytes);
-
-
-    /* if the next request must wait -> do nothing */
-    if (throttle_schedule_timer(&bs->throttle_state, is_write)) {
+    /* this bs is a part of the same group than the one we want */
+    if (!g_strcmp0(throttle_group_get_name(bs), group)) {
         return;
     }
 
-    /* else queue next request for execution */
-    qemu_co_queue_next(&bs->throttled_reqs[is_write]);
+    /* need to change the group this bs belong to */
+    bdrv_io_limits_disable(bs);
+    bdrv_io_limits_enable(bs, group);
 }
 
 size_t bdrv_opt_mem_align(BlockDriverState *bs)
@@ -1843,6 +1822,7 @@ void bdrv_close(BlockDriverState *bs)
             bdrv_unref(backing_hd);
         }
         bs->drv->bdrv_close(bs);
+        bdrv_release_named_dirty_bitmaps(bs);
         g_free(bs->opaque);
         bs->opaque = NULL;
         bs->drv = NULL;
@@ -1869,7 +1849,7 @@ void bdrv_close(BlockDriverState *bs)
     bdrv_dev_change_media_cb(bs, false);
 
     /*throttling disk I/O limits*/
-    if (bs->io_limits_enabled) {
+    if (bs->throttle_state) {
         bdrv_io_limits_disable(bs);
     }
 
@@ -1987,12 +1967,18 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->enable_write_cache = bs_src->enable_write_cache;
 
     /* i/o throttled req */
-    memcpy(&bs_dest->throttle_state,
-           &bs_src->throttle_state,
-           sizeof(ThrottleState));
+    bs_dest->throttle_state     = bs_src->throttle_state;
+    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    bs_dest->pending_reqs[0]    = bs_src->pending_reqs[0];
+    bs_dest->pending_reqs[1]    = bs_src->pending_reqs[1];
     bs_dest->throttled_reqs[0]  = bs_src->throttled_reqs[0];
     bs_dest->throttled_reqs[1]  = bs_src->throttled_reqs[1];
-    bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
+    memcpy(&bs_dest->round_robin,
+           &bs_src->round_robin,
+           sizeof(bs_dest->round_robin));
+    memcpy(&bs_dest->throttle_timers,
+           &bs_src->throttle_timers,
+           sizeof(ThrottleTimers));
 
     /* r/w error */
     bs_dest->on_read_error      = bs_src->on_read_error;
@@ -2052,7 +2038,16 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->job == NULL);
     assert(bs_new->dev == NULL);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_state == NULL);
+    assert(!throttle_timers_are_initialized(&bs_new->throttle_timers));
+
+    /* If the BlockDriverState is part of a throttling group acquire
+     * its lock since we're going to mess with the protected fields.
+     * Otherwise there's no need to worry since no one else can touch
+     * them. */
+    if (bs_old->throttle_state) {
+        throttle_group_lock(bs_old);
+    }
 
     tmp = *bs_new;
     *bs_new = *bs_old;
@@ -2070,7 +2065,13 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old)
     assert(bs_new->dev == NULL);
     assert(bs_new->job == NULL);
     assert(bs_new->io_limits_enabled == false);
-    assert(!throttle_have_timer(&bs_new->throttle_state));
+    assert(bs_new->throttle_state == NULL);
+    assert(!throttle_timers_are_initialized(&bs_new->throttle_timers));
+
+    /* Release the ThrottleGroup lock */
+    if (bs_old->throttle_state) {
+        throttle_group_unlock(bs_old);
+    }
 
     /* insert the nodes back into the graph node list if needed */
     if (bs_new->node_name[0] != '\0') {
@@ -2771,7 +2772,7 @@ static int bdrv_prwv_co(BlockDriverState *bs, int64_t offset,
      * will not fire; so the I/O throttling function has to be disabled here
      * if it has been enabled.
      */
-    if (bs->io_limits_enabled) {
+    if (bs->throttle_state) {
         fprintf(stderr, "Disabling I/O throttling on '%s' due "
                         "to synchronous I/O.\n", bdrv_get_device_name(bs));
         bdrv_io_limits_disable(bs);
@@ -3168,7 +3169,7 @@ static int coroutine_fn bdrv_co_do_preadv(BlockDriverState *bs,
 
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
-        bdrv_io_limits_intercept(bs, bytes, false);
+        throttle_group_co_io_limits_intercept(bs, bytes, false);
     }
 
     /* Align read if necessary by padding qiov */
@@ -3408,7 +3409,7 @@ static int coroutine_fn bdrv_co_do_pwritev(BlockDriverState *bs,
 
     /* throttling disk I/O */
     if (bs->io_limits_enabled) {
-        bdrv_io_limits_intercept(bs, bytes, true);
+        throttle_group_co_io_limits_intercept(bs, bytes, true);
     }
 
     /*
@@ -3536,6 +3537,111 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE | flags);
 }
 
+static int coroutine_fn bdrv_co_copy_range_internal(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, bool recurse_src)
+{
+    BdrvTrackedRequest req;
+    int64_t offset, bytes = (int64_t)nb_sectors << BDRV_SECTOR_BITS;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EACCES;
+    }
+    if (bdrv_check_request(src, src_sector, nb_sectors) ||
+        bdrv_check_request(dst, dst_sector, nb_sectors)) {
+        return -EIO;
+    }
+
+    /* Offloaded requests cannot be throttled, padded or copied on read */
+    if (src->io_limits_enabled || dst->io_limits_enabled ||
+        src->copy_on_read) {
+        return -ENOTSUP;
+    }
+    if ((src_sector << BDRV_SECTOR_BITS | bytes) &
+        (MAX(BDRV_SECTOR_SIZE, src->request_alignment) - 1)) {
+        return -ENOTSUP;
+    }
+    if ((dst_sector << BDRV_SECTOR_BITS | bytes) &
+        (MAX(BDRV_SECTOR_SIZE, dst->request_alignment) - 1)) {
+        return -ENOTSUP;
+    }
+
+    if (recurse_src) {
+        if (!src->drv->bdrv_co_copy_range_from) {
+            return -ENOTSUP;
+        }
+
+        offset = src_sector << BDRV_SECTOR_BITS;
+        tracked_request_begin(&req, src, offset, bytes, false);
+        wait_serialising_requests(&req);
+        ret = src->drv->bdrv_co_copy_range_from(src, src_sector,
+                                                dst, dst_sector, nb_sectors);
+        tracked_request_end(&req);
+        return ret;
+    }
+
+    if (!dst->drv->bdrv_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+
+    /* The destination side is a write like bdrv_aligned_pwritev() does */
+    offset = dst_sector << BDRV_SECTOR_BITS;
+    tracked_request_begin(&req, dst, offset, bytes, true);
+    wait_serialising_requests(&req);
+
+    ret = notifier_with_return_list_notify(&dst->before_write_notifiers, &req);
+    if (ret == 0) {
+        ret = dst->drv->bdrv_co_copy_range_to(dst, src, src_sector,
+                                              dst_sector, nb_sectors);
+    }
+    if (ret == 0 && !dst->enable_write_cache) {
+        ret = bdrv_co_flush(dst);
+    }
+
+    bdrv_set_dirty(dst, dst_sector, nb_sectors);
+    block_acct_highest_sector(&dst->stats, dst_sector, nb_sectors);
+    if (dst->growable && ret >= 0) {
+        dst->total_sectors = MAX(dst->total_sectors, dst_sector + nb_sectors);
+    }
+
+    tracked_request_end(&req);
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+                                         int64_t src_sector,
+                                         BlockDriverState *dst,
+                                         int64_t dst_sector, int nb_sectors)
+{
+    trace_bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                  nb_sectors);
+    return bdrv_co_copy_range_internal(src, src_sector, dst, dst_sector,
+                                       nb_sectors, true);
+}
+
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+                                       int64_t src_sector,
+                                       BlockDriverState *dst,
+                                       int64_t dst_sector, int nb_sectors)
+{
+    trace_bdrv_co_copy_range_to(src, src_sector, dst, dst_sector,
+                                nb_sectors);
+    return bdrv_co_copy_range_internal(src, src_sector, dst, dst_sector,
+                                       nb_sectors, false);
+}
+
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+                                    BlockDriverState *dst, int64_t dst_sector,
+                                    int nb_sectors)
+{
+    return bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                   nb_sectors);
+}
+
 /**
  * Truncate file to 'offset' bytes (needed only for file protocols)
  */
@@ -3553,6 +3659,7 @@ int bdrv_truncate(BlockDriverState *bs, int64_t offset)
     ret = drv->bdrv_truncate(bs, offset);
     if (ret == 0) {
         ret = refresh_total_sectors(bs, offset >> BDRV_SECTOR_BITS);
+        bdrv_dirty_bitmap_truncate(bs);
         bdrv_dev_resize_cb(bs);
     }
     return ret;
@@ -4219,6 +4326,9 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(QLIST_EMPTY(&bs->dirty_bitmaps));
 
+    if (qemu_in_coroutine() && drv->bdrv_co_write_compressed) {
+        return drv->bdrv_co_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
@@ -5053,6 +5163,9 @@ void bdrv_invalidate_cache(BlockDriverState *bs, Error **errp)
         return;
     }
 
+    /* The image is ours now; from here on the driver may update it.  */
+    bs->open_flags &= ~BDRV_O_INCOMING;
+
     ret = refresh_total_sectors(bs, bs->total_sectors);
     if (ret < 0) {
         error_setg_errno(errp, -ret, "Could not refresh total sector count");
@@ -5146,7 +5259,10 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
         return -EROFS;
     }
 
-    bdrv_reset_dirty(bs, sector_num, nb_sectors);
+    /* The contents of the range may change, so incremental backups and
+     * mirroring must copy it again.
+     */
+    bdrv_set_dirty(bs, sector_num, nb_sectors);
 
     /* Do nothing if disabled.  */
     if (!(bs->open_flags & BDRV_O_UNMAP)) {
@@ -5358,16 +5474,47 @@ bool bdrv_qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
     return true;
 }
 
-BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
+BdrvDirtyBitmap *bdrv_find_dirty_bitmap(BlockDriverState *bs, const char *name)
+{
+    BdrvDirtyBitmap *bm;
+
+    assert(name);
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        if (bm->name && !strcmp(name, bm->name)) {
+            return bm;
+        }
+    }
+    return NULL;
+}
+
+/* Iterate over the named bitmaps of @bs; pass NULL to get the first one.  */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
+                                        BdrvDirtyBitmap *bitmap)
+{
+    bitmap = bitmap ? QLIST_NEXT(bitmap, list) : QLIST_FIRST(&bs->dirty_bitmaps);
+    while (bitmap && !bitmap->name) {
+        bitmap = QLIST_NEXT(bitmap, list);
+    }
+    return bitmap;
+}
+
+BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
+                                          uint32_t granularity,
+                                          const char *name,
                                           Error **errp)
 {
     int64_t bitmap_size;
     BdrvDirtyBitmap *bitmap;
+    uint32_t sector_granularity;
 
     assert((granularity & (granularity - 1)) == 0);
 
-    granularity >>= BDRV_SECTOR_BITS;
-    assert(granularity);
+    if (name && bdrv_find_dirty_bitmap(bs, name)) {
+        error_setg(errp, "Bitmap already exists: %s", name);
+        return NULL;
+    }
+    sector_granularity = granularity >> BDRV_SECTOR_BITS;
+    assert(sector_granularity);
     bitmap_size = bdrv_nb_sectors(bs);
     if (bitmap_size < 0) {
         error_setg_errno(errp, -bitmap_size, "could not get length of device");
@@ -5375,24 +5522,191 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs, int granularity,
         return NULL;
     }
     bitmap = g_new0(BdrvDirtyBitmap, 1);
-    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(granularity) - 1);
+    bitmap->bitmap = hbitmap_alloc(bitmap_size, ffs(sector_granularity) - 1);
+    bitmap->size = bitmap_size;
+    bitmap->name = g_strdup(name);
     QLIST_INSERT_HEAD(&bs->dirty_bitmaps, bitmap, list);
     return bitmap;
 }
 
+bool bdrv_dirty_bitmap_frozen(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->successor;
+}
+
+const char *bdrv_dirty_bitmap_name(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->name;
+}
+
+uint32_t bdrv_dirty_bitmap_granularity(BdrvDirtyBitmap *bitmap)
+{
+    return BDRV_SECTOR_SIZE << hbitmap_granularity(bitmap->bitmap);
+}
+
+int64_t bdrv_dirty_bitmap_size(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->size;
+}
+
+void bdrv_dirty_bitmap_set_persistent(BdrvDirtyBitmap *bitmap, bool persistent)
+{
+    bitmap->persistent = persistent;
+}
+
+bool bdrv_dirty_bitmap_get_persistent(BdrvDirtyBitmap *bitmap)
+{
+    return bitmap->persistent;
+}
+
+bool bdrv_can_store_dirty_bitmap(BlockDriverState *bs)
+{
+    return bs->drv && bs->drv->bdrv_can_store_dirty_bitmap &&
+           bs->drv->bdrv_can_store_dirty_bitmap(bs);
+}
+
+/**
+ * Create a successor bitmap destined to replace this bitmap after an operation.
+ * Requires that the bitmap is not frozen and has no successor.
+ */
+int bdrv_dirty_bitmap_create_successor(BlockDriverState *bs,
+                                       BdrvDirtyBitmap *bitmap, Error **errp)
+{
+    uint32_t granularity;
+    BdrvDirtyBitmap *child;
+
+    if (bdrv_dirty_bitmap_frozen(bitmap)) {
+        error_setg(errp, "Cannot create a successor for a bitmap that is "
+                   "currently frozen");
+        return -1;
+    }
+    assert(!bitmap->successor);
+
+    /* Create an anonymous successor */
+    granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    child = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
+    if (!child) {
+        return -1;
+    }
+
+    /* Successor will be on or off based on our current state.  */
+    bitmap->successor = child;
+    return 0;
+}
+
+/**
+ * For a bitmap with a successor, yield our name to the successor,
+ * delete the old bitmap, and return a handle to the new bitmap.
+ */
+BdrvDirtyBitmap *bdrv_dirty_bitmap_abdicate(BlockDriverState *bs,
+                                            BdrvDirtyBitmap *bitmap,
+                                            Error **errp)
+{
+    BdrvDirtyBitmap *successor = bitmap->successor;
+
+    if (!successor) {
+        error_setg(errp, "Cannot relinquish control if "
+                   "there's no successor present");
+        return NULL;
+    }
+
+    successor->name = bitmap->name;
+    successor->persistent = bitmap->persistent;
+    bitmap->name = NULL;
+    bitmap->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, bitmap);
+
+    return successor;
+}
+
+/**
+ * In cases of failure where we can no longer safely delete the parent,
+ * we may wish to re-join the parent and child/successor.
+ * The merged parent will be un-frozen, but not explicitly re-enabled.
+ */
+BdrvDirtyBitmap *bdrv_reclaim_dirty_bitmap(BlockDriverState *bs,
+                                           BdrvDirtyBitmap *parent,
+                                           Error **errp)
+{
+    BdrvDirtyBitmap *successor = parent->successor;
+
+    if (!successor) {
+        error_setg(errp, "Cannot reclaim a successor when none is present");
+        return NULL;
+    }
+
+    if (!hbitmap_merge(parent->bitmap, successor->bitmap)) {
+        error_setg(errp, "Merging of parent and successor bitmap failed");
+        return NULL;
+    }
+    parent->successor = NULL;
+    bdrv_release_dirty_bitmap(bs, successor);
+
+    return parent;
+}
+
+/* Resize every bitmap to the new size of @bs.  Bits beyond the old end
+ * are set, since whatever is there now was never backed up.
+ */
+static void bdrv_dirty_bitmap_truncate(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bitmap;
+    HBitmapIter hbi;
+    HBitmap *hb;
+    int64_t size = bdrv_nb_sectors(bs);
+    int64_t sector;
+
+    if (size < 0) {
+        return;
+    }
+
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bitmap->size == size) {
+            continue;
+        }
+        hb = hbitmap_alloc(size, hbitmap_granularity(bitmap->bitmap));
+        hbitmap_iter_init(&hbi, bitmap->bitmap, 0);
+        while ((sector = hbitmap_iter_next(&hbi)) >= 0 && sector < size) {
+            hbitmap_set(hb, sector, 1);
+        }
+        if (size > bitmap->size) {
+            hbitmap_set(hb, bitmap->size, size - bitmap->size);
+        }
+        hbitmap_free(bitmap->bitmap);
+        bitmap->bitmap = hb;
+        bitmap->size = size;
+    }
+}
+
 void bdrv_release_dirty_bitmap(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
     BdrvDirtyBitmap *bm, *next;
     QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
         if (bm == bitmap) {
+            assert(!bdrv_dirty_bitmap_frozen(bm));
             QLIST_REMOVE(bitmap, list);
             hbitmap_free(bitmap->bitmap);
+            g_free(bitmap->name);
             g_free(bitmap);
             return;
         }
     }
 }
 
+/* Called on close, after the driver had a chance to store the persistent
+ * bitmaps.  Anonymous bitmaps belong to their users (block jobs, block
+ * migration), which have already released them.
+ */
+static void bdrv_release_named_dirty_bitmaps(BlockDriverState *bs)
+{
+    BdrvDirtyBitmap *bm, *next;
+    QLIST_FOREACH_SAFE(bm, &bs->dirty_bitmaps, list, next) {
+        if (bm->name) {
+            bdrv_release_dirty_bitmap(bs, bm);
+        }
+    }
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -5403,8 +5717,11 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
         BlockDirtyInfo *info = g_new0(BlockDirtyInfo, 1);
         BlockDirtyInfoList *entry = g_new0(BlockDirtyInfoList, 1);
         info->count = bdrv_get_dirty_count(bs, bm);
-        info->granularity =
-            ((int64_t) BDRV_SECTOR_SIZE << hbitmap_granularity(bm->bitmap));
+        info->granularity = bdrv_dirty_bitmap_granularity(bm);
+        info->has_name = !!bm->name;
+        info->name = g_strdup(bm->name);
+        info->frozen = bdrv_dirty_bitmap_frozen(bm);
+        info->persistent = bm->persistent;
         entry->value = info;
         *plist = entry;
         plist = &entry->next;
@@ -5428,26 +5745,77 @@ void bdrv_dirty_iter_init(BlockDriverState *bs,
     hbitmap_iter_init(hbi, bitmap->bitmap, 0);
 }
 
+/* Restart the iteration at @sector, e.g. to skip a range that the caller
+ * handled as a whole.
+ */
+void bdrv_set_dirty_iter(HBitmapIter *hbi, int64_t sector)
+{
+    hbitmap_iter_init(hbi, hbi->hb, sector);
+}
+
+void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap,
+                           int64_t cur_sector, int nr_sectors)
+{
+    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
+                             int64_t cur_sector, int nr_sectors)
+{
+    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+}
+
+void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap)
+{
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
+    hbitmap_reset_all(bitmap->bitmap);
+}
+
+/* A frozen bitmap is not updated; its successor records the writes.  */
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
                     int nr_sectors)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            continue;
+        }
         hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
     }
 }
 
-void bdrv_reset_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors)
+int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
 {
-    BdrvDirtyBitmap *bitmap;
-    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
-        hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
-    }
+    return hbitmap_count(bitmap->bitmap);
 }
 
-int64_t bdrv_get_dirty_count(BlockDriverState *bs, BdrvDirtyBitmap *bitmap)
+uint64_t bdrv_dirty_bitmap_serialization_size(BdrvDirtyBitmap *bitmap,
+                                              uint64_t start, uint64_t count)
 {
-    return hbitmap_count(bitmap->bitmap);
+    return hbitmap_serialization_size(bitmap->bitmap, start, count);
+}
+
+uint64_t bdrv_dirty_bitmap_serialization_align(BdrvDirtyBitmap *bitmap)
+{
+    return hbitmap_serialization_granularity(bitmap->bitmap);
+}
+
+void bdrv_dirty_bitmap_serialize_part(BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                                      uint64_t start, uint64_t count)
+{
+    hbitmap_serialize_part(bitmap->bitmap, buf, start, count);
+}
+
+void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap, uint8_t *buf,
+                                        uint64_t start, uint64_t count,
+                                        bool finish)
+{
+    hbitmap_deserialize_part(bitmap->bitmap, buf, start, count, finish);
+}
+
+void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap)
+{
+    hbitmap_deserialize_finish(bitmap->bitmap);
 }
 
 /* Get a reference to bs */
@@ -5745,8 +6113,8 @@ void bdrv_detach_aio_context(BlockDriverState *bs)
         baf->detach_aio_context(baf->opaque);
     }
 
-    if (bs->io_limits_enabled) {
-        throttle_detach_aio_context(&bs->throttle_state);
+    if (bs->throttle_state) {
+        throttle_timers_detach_aio_context(&bs->throttle_timers);
     }
     if (bs->drv->bdrv_detach_aio_context) {
         bs->drv->bdrv_detach_aio_context(bs);
@@ -5781,8 +6149,8 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
     if (bs->drv->bdrv_attach_aio_context) {
         bs->drv->bdrv_attach_aio_context(bs, new_context);
     }
-    if (bs->io_limits_enabled) {
-        throttle_attach_aio_context(&bs->throttle_state, new_context);
+    if (bs->throttle_state) {
+        throttle_timers_attach_aio_context(&bs->throttle_timers, new_context);
     }
 
     QLIST_FOREACH(ban, &bs->aio_notifiers, list) {
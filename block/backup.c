@@ -25,6 +25,9 @@
 #define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
 #define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
 
+#define BACKUP_MAX_WORKERS 64
+#define BACKUP_MAX_CHUNK_SIZE (64 << 20)
+
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -38,6 +41,7 @@ typedef struct BackupBlockJob {
     BlockJob common;
     BlockDriverState *target;
     MirrorSyncMode sync_mode;
+    BdrvDirtyBitmap *sync_bitmap;
     RateLimit limit;
     BlockdevOnError on_source_error;
     BlockdevOnError on_target_error;
@@ -45,8 +49,29 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     HBitmap *bitmap;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Background copies.  The job coroutine merges adjacent clusters into
+     * runs of up to chunk_clusters and hands each run to a worker
+     * coroutine, keeping at most max_workers of them in flight.
+     */
+    int max_workers;
+    int chunk_clusters;
+    int in_flight;
+    CoQueue worker_queue;       /* the job waiting for a worker to finish */
+    int64_t run_start;          /* run being built, not dispatched yet */
+    int run_len;
+    int ret;                    /* first error of a worker */
+    bool error_is_read;
+    int64_t error_cluster;      /* first cluster of the failed runs */
+    bool use_copy_range;        /* cleared when the copy cannot be offloaded */
 } BackupBlockJob;
 
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int nb_clusters;
+} BackupWorker;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -95,7 +120,7 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t start, end;
-    int n;
+    int n, nb_clusters;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
@@ -107,20 +132,51 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += nb_clusters) {
         if (hbitmap_get(job->bitmap, start)) {
             trace_backup_do_cow_skip(job, start);
+            nb_clusters = 1;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy the clusters that follow in the same request, as long as
+         * they have not been copied yet.
+         */
+        nb_clusters = 1;
+        while (start + nb_clusters < end &&
+               nb_clusters < job->chunk_clusters &&
+               !hbitmap_get(job->bitmap, start + nb_clusters)) {
+            nb_clusters++;
+        }
+
+        trace_backup_do_cow_process(job, start, nb_clusters);
 
-        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
+        n = MIN(nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * BACKUP_SECTORS_PER_CLUSTER);
 
+        if (job->use_copy_range) {
+            ret = bdrv_co_copy_range(bs, start * BACKUP_SECTORS_PER_CLUSTER,
+                                     job->target,
+                                     start * BACKUP_SECTORS_PER_CLUSTER, n);
+            if (ret == 0) {
+                goto copied;
+            } else if (ret != -ENOTSUP) {
+                /* Both a read and a write error are possible; blame the
+                 * target like a failed write would.
+                 */
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
+            }
+            job->use_copy_range = false;
+        }
+
         if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+            bounce_buffer = qemu_blockalign(bs,
+                MIN(end - start, job->chunk_clusters) * BACKUP_CLUSTER_SIZE);
         }
         iov.iov_base = bounce_buffer;
         iov.iov_len = n * BDRV_SECTOR_SIZE;
@@ -153,7 +209,8 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             goto out;
         }
 
-        hbitmap_set(job->bitmap, start, 1);
+copied:
+        hbitmap_set(job->bitmap, start, nb_clusters);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
@@ -227,6 +284,299 @@ static BlockErrorAction backup_error_action(BackupBlockJob *job,
     }
 }
 
+static bool coroutine_fn yield_and_check(BackupBlockJob *job)
+{
+    if (block_job_is_cancelled(&job->common)) {
+        return true;
+    }
+
+    /* we need to yield so that qemu_aio_flush() returns.
+     * (without, VM does not reboot)
+     */
+    if (job->common.speed) {
+        uint64_t delay_ns = ratelimit_calculate_delay(&job->limit,
+                                                      job->sectors_read);
+        job->sectors_read = 0;
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
+    } else {
+        block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
+    }
+
+    if (block_job_is_cancelled(&job->common)) {
+        return true;
+    }
+
+    return false;
+}
+
+static void coroutine_fn backup_worker(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs,
+                        w->cluster * BACKUP_SECTORS_PER_CLUSTER,
+                        w->nb_clusters * BACKUP_SECTORS_PER_CLUSTER,
+                        &error_is_read);
+    if (ret < 0) {
+        if (!job->ret) {
+            job->ret = ret;
+            job->error_is_read = error_is_read;
+        }
+        job->error_cluster = MIN(job->error_cluster, w->cluster);
+    }
+
+    g_free(w);
+    job->in_flight--;
+    qemu_co_queue_next(&job->worker_queue);
+}
+
+/* Hand the pending run to a worker, waiting for one to be free.  */
+static void coroutine_fn backup_flush_run(BackupBlockJob *job)
+{
+    BackupWorker *w;
+    Coroutine *co;
+
+    if (!job->run_len) {
+        return;
+    }
+
+    while (job->in_flight == job->max_workers) {
+        qemu_co_queue_wait(&job->worker_queue);
+    }
+
+    w = g_new(BackupWorker, 1);
+    w->job = job;
+    w->cluster = job->run_start;
+    w->nb_clusters = job->run_len;
+    job->run_len = 0;
+
+    job->in_flight++;
+    co = qemu_coroutine_create(backup_worker);
+    qemu_coroutine_enter(co, w);
+}
+
+/* Queue clusters for copying, merging them with the pending run if they
+ * follow it.
+ */
+static void coroutine_fn backup_queue_clusters(BackupBlockJob *job,
+                                               int64_t cluster,
+                                               int64_t nb_clusters)
+{
+    int n;
+
+    while (nb_clusters > 0) {
+        if (job->run_len &&
+            (cluster != job->run_start + job->run_len ||
+             job->run_len == job->chunk_clusters)) {
+            backup_flush_run(job);
+        }
+        if (!job->run_len) {
+            job->run_start = cluster;
+        }
+        n = MIN(nb_clusters, job->chunk_clusters - job->run_len);
+        job->run_len += n;
+        cluster += n;
+        nb_clusters -= n;
+    }
+}
+
+/* Drop the pending run and wait for the copies in flight.  */
+static void coroutine_fn backup_wait_for_workers(BackupBlockJob *job)
+{
+    job->run_len = 0;
+    while (job->in_flight > 0) {
+        qemu_co_queue_wait(&job->worker_queue);
+    }
+}
+
+/* Finish the queued copies.  Return 0 if they all succeeded, or the error
+ * that the job must fail with.  If the error action asks for the copy to
+ * be retried, return -EAGAIN and store in @cluster the first cluster from
+ * which the caller must start again.
+ */
+static int coroutine_fn backup_finish_copies(BackupBlockJob *job,
+                                             int64_t *cluster)
+{
+    int ret;
+
+    if (!job->ret) {
+        backup_flush_run(job);
+    }
+    backup_wait_for_workers(job);
+
+    ret = job->ret;
+    if (!ret) {
+        return 0;
+    }
+
+    job->ret = 0;
+    *cluster = job->error_cluster;
+    job->error_cluster = INT64_MAX;
+    if (backup_error_action(job, job->error_is_read, -ret) ==
+        BLOCK_ERROR_ACTION_REPORT) {
+        return ret;
+    }
+    return -EAGAIN;
+}
+
+/* Whether "top" sync mode must copy @cluster */
+static bool coroutine_fn backup_cluster_is_allocated(BlockDriverState *bs,
+                                                     int64_t cluster)
+{
+    int i, n;
+    int alloced = 0;
+
+    /* Check to see if these blocks are already in the backing file. */
+    for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * BACKUP_SECTORS_PER_CLUSTER + i,
+                    BACKUP_SECTORS_PER_CLUSTER - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    /* If the above loop never found any sectors that are in
+     * the topmost image, skip this cluster. */
+    return alloced != 0;
+}
+
+/* Copy the whole drive, or in "top" sync mode the clusters allocated in
+ * the topmost image.
+ */
+static int coroutine_fn backup_run_full(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t nb_clusters = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    int64_t cluster = 0;
+    int ret;
+
+    for (;;) {
+        if (cluster < nb_clusters && !job->ret) {
+            if (yield_and_check(job)) {
+                return 0;
+            }
+            if (job->sync_mode != MIRROR_SYNC_MODE_TOP ||
+                backup_cluster_is_allocated(bs, cluster)) {
+                backup_queue_clusters(job, cluster, 1);
+            }
+            cluster++;
+            continue;
+        }
+
+        /* Depending on error action, fail now or retry from the failed
+         * clusters; those that were copied already are skipped.
+         */
+        ret = backup_finish_copies(job, &cluster);
+        if (ret != -EAGAIN) {
+            return ret;
+        }
+    }
+}
+
+/* Copy the clusters that are dirty in the sync bitmap.  The bitmap itself
+ * is frozen for the duration of the job; writes go to its successor.
+ */
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+{
+    BlockDriverState *bs = job->common.bs;
+    bool done = false;
+    int ret;
+    int clusters_per_iter;
+    uint32_t granularity;
+    int64_t sector;
+    int64_t cluster;
+    int64_t end;
+    int64_t last_cluster = -1;
+    int64_t nb_clusters;
+    HBitmapIter hbi;
+
+    nb_clusters = DIV_ROUND_UP(job->common.len, BACKUP_CLUSTER_SIZE);
+    granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
+    clusters_per_iter = MAX((granularity / BACKUP_CLUSTER_SIZE), 1);
+    bdrv_dirty_iter_init(bs, job->sync_bitmap, &hbi);
+
+    for (;;) {
+        /* Find the next dirty sector(s) */
+        if (!done && !job->ret &&
+            (sector = hbitmap_iter_next(&hbi)) != -1) {
+            if (yield_and_check(job)) {
+                return 0;
+            }
+
+            cluster = sector / BACKUP_SECTORS_PER_CLUSTER;
+            end = MIN(cluster + clusters_per_iter, nb_clusters);
+
+            /* Fake progress updates for any clusters we skipped */
+            if (cluster > last_cluster + 1) {
+                job->common.offset += ((cluster - last_cluster - 1) *
+                                       BACKUP_CLUSTER_SIZE);
+            }
+            last_cluster = MAX(last_cluster, end - 1);
+
+            backup_queue_clusters(job, cluster, end - cluster);
+
+            /* If the bitmap granularity is smaller than the backup
+             * granularity, we need to advance the iterator pointer to the
+             * next cluster.
+             */
+            if (granularity < BACKUP_CLUSTER_SIZE) {
+                if (end >= nb_clusters) {
+                    done = true;
+                } else {
+                    bdrv_set_dirty_iter(&hbi,
+                                        end * BACKUP_SECTORS_PER_CLUSTER);
+                }
+            }
+            continue;
+        }
+
+        ret = backup_finish_copies(job, &cluster);
+        if (ret != -EAGAIN) {
+            break;
+        }
+
+        /* Retry from the failed clusters */
+        bdrv_set_dirty_iter(&hbi, cluster * BACKUP_SECTORS_PER_CLUSTER);
+        done = false;
+    }
+
+    /* Play some final catchup with the progress meter */
+    if (ret == 0 && last_cluster + 1 < nb_clusters) {
+        job->common.offset += ((nb_clusters - last_cluster - 1) *
+                               BACKUP_CLUSTER_SIZE);
+    }
+
+    return ret;
+}
+
+static void backup_cleanup_sync_bitmap(BackupBlockJob *job, int ret)
+{
+    BlockDriverState *bs = job->common.bs;
+    BdrvDirtyBitmap *bm;
+
+    if (ret < 0 || block_job_is_cancelled(&job->common)) {
+        /* Merge the successor back into the parent, delete nothing.  */
+        bm = bdrv_reclaim_dirty_bitmap(bs, job->sync_bitmap, NULL);
+    } else {
+        /* Everything is fine, delete this bitmap and install the backup.  */
+        bm = bdrv_dirty_bitmap_abdicate(bs, job->sync_bitmap, NULL);
+    }
+    assert(bm);
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -236,13 +586,14 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
+    qemu_co_queue_init(&job->worker_queue);
+    job->error_cluster = INT64_MAX;
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len / BDRV_SECTOR_SIZE,
                        BACKUP_SECTORS_PER_CLUSTER);
 
@@ -262,85 +613,25 @@ static void coroutine_fn backup_run(void *opaque)
             qemu_coroutine_yield();
             job->common.busy = true;
         }
+    } else if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
-
-            /* we need to yield so that qemu_aio_flush() returns.
-             * (without, VM does not reboot)
-             */
-            if (job->common.speed) {
-                uint64_t delay_ns = ratelimit_calculate_delay(
-                        &job->limit, job->sectors_read);
-                job->sectors_read = 0;
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, delay_ns);
-            } else {
-                block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
-            }
-
-            if (block_job_is_cancelled(&job->common)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < BACKUP_SECTORS_PER_CLUSTER;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * BACKUP_SECTORS_PER_CLUSTER + i,
-                                BACKUP_SECTORS_PER_CLUSTER - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
-                    BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_full(job);
     }
 
+    /* the job may have been cancelled with copies in flight */
+    backup_wait_for_workers(job);
+
     notifier_with_return_remove(&before_write);
 
     /* wait until pending backup_do_cow() calls have completed */
     qemu_co_rwlock_wrlock(&job->flush_rwlock);
     qemu_co_rwlock_unlock(&job->flush_rwlock);
 
+    if (job->sync_bitmap) {
+        backup_cleanup_sync_bitmap(job, ret);
+    }
     hbitmap_free(job->bitmap);
 
     bdrv_iostatus_disable(target);
@@ -351,11 +642,14 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  int64_t max_workers, int64_t max_chunk,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
                   Error **errp)
 {
+    BackupBlockJob *job;
     int64_t len;
 
     assert(bs);
@@ -369,24 +663,67 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                  "a value between 1 and " stringify(BACKUP_MAX_WORKERS));
+        return;
+    }
+
+    if (max_chunk < BACKUP_CLUSTER_SIZE ||
+        max_chunk > BACKUP_MAX_CHUNK_SIZE ||
+        max_chunk % BACKUP_CLUSTER_SIZE) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "max-chunk",
+                  "a multiple of 64 KiB, at most 64 MiB");
+        return;
+    }
+
+    if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        if (!sync_bitmap) {
+            error_setg(errp, "must provide a valid bitmap name for "
+                             "\"incremental\" sync mode");
+            return;
+        }
+
+        /* Create a new bitmap, and freeze/disable this one. */
+        if (bdrv_dirty_bitmap_create_successor(bs, sync_bitmap, errp) < 0) {
+            return;
+        }
+    } else if (sync_bitmap) {
+        error_setg(errp,
+                   "a sync_bitmap was provided to backup_run, "
+                   "but received an incompatible sync_mode (%s)",
+                   MirrorSyncMode_lookup[sync_mode]);
+        return;
+    }
+
     len = bdrv_getlength(bs);
     if (len < 0) {
         error_setg_errno(errp, -len, "unable to get length for '%s'",
                          bdrv_get_device_name(bs));
-        return;
+        goto error;
     }
 
-    BackupBlockJob *job = block_job_create(&backup_job_driver, bs, speed,
-                                           cb, opaque, errp);
+    job = block_job_create(&backup_job_driver, bs, speed, cb, opaque, errp);
     if (!job) {
-        return;
+        goto error;
     }
 
     job->on_source_error = on_source_error;
     job->on_target_error = on_target_error;
     job->target = target;
     job->sync_mode = sync_mode;
+    job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
+                       sync_bitmap : NULL;
+    job->use_copy_range = true;
+    job->max_workers = max_workers;
+    job->chunk_clusters = max_chunk / BACKUP_CLUSTER_SIZE;
     job->common.len = len;
     job->common.co = qemu_coroutine_create(backup_run);
     qemu_coroutine_enter(job->common.co, job);
+    return;
+
+ error:
+    if (sync_bitmap) {
+        bdrv_reclaim_dirty_bitmap(bs, sync_bitmap, NULL);
+    }
 }
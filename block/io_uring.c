@@ -0,0 +1,370 @@
+/*
+ * Linux io_uring support.
+ *
+ * The submission and completion queues are rings shared with the kernel, so
+ * a batch of requests costs at most one io_uring_enter() system call, and
+ * completions are reaped from memory without any.  Unlike Linux native AIO,
+ * buffered I/O is asynchronous too and does not need the thread pool.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "trace.h"
+
+#include <liburing.h>
+
+/*
+ * Queue size (per-device).  Requests that do not fit are submitted as soon
+ * as a slot is free, see luring_get_sqe().
+ */
+#define MAX_ENTRIES 128
+
+/* The file is registered with the ring and referred to by its index */
+#define LURING_FIXED_FILE 0
+
+struct qemu_luringcb {
+    BlockDriverAIOCB common;
+    struct qemu_luring_state *ctx;
+    int type;
+    off_t offset;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+
+    /* Short reads are resubmitted for the part that was not read yet */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+};
+
+struct qemu_luring_state {
+    struct io_uring ring;
+    EventNotifier e;
+
+    /* Requests are only pushed to the kernel when not plugged */
+    int plugged;
+    unsigned int in_queue;
+};
+
+static int luring_submit_queue(struct qemu_luring_state *s)
+{
+    int ret;
+
+    if (!s->in_queue) {
+        return 0;
+    }
+
+    do {
+        ret = io_uring_submit(&s->ring);
+    } while (ret == -EINTR);
+    trace_luring_submit_queue(s, s->in_queue, ret);
+
+    /* On failure the requests stay in the ring for the next attempt */
+    if (ret >= 0) {
+        s->in_queue = 0;
+    }
+    return ret;
+}
+
+static struct io_uring_sqe *luring_get_sqe(struct qemu_luring_state *s)
+{
+    struct io_uring_sqe *sqe;
+
+    sqe = io_uring_get_sqe(&s->ring);
+    if (!sqe) {
+        /* The ring is full of plugged requests, make room */
+        luring_submit_queue(s);
+        sqe = io_uring_get_sqe(&s->ring);
+    }
+    return sqe;
+}
+
+static int luring_prep_request(struct qemu_luring_state *s,
+                               struct qemu_luringcb *luringcb)
+{
+    struct io_uring_sqe *sqe;
+    QEMUIOVector *qiov = luringcb->qiov;
+    off_t offset = luringcb->offset;
+
+    sqe = luring_get_sqe(s);
+    if (!sqe) {
+        return -EAGAIN;
+    }
+
+    if (luringcb->total_read) {
+        qiov = &luringcb->resubmit_qiov;
+        offset += luringcb->total_read;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, LURING_FIXED_FILE, qiov->iov, qiov->niov,
+                             offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, LURING_FIXED_FILE, qiov->iov, qiov->niov,
+                            offset);
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, LURING_FIXED_FILE, IORING_FSYNC_DATASYNC);
+        break;
+    default:
+        abort();
+    }
+    io_uring_sqe_set_flags(sqe, IOSQE_FIXED_FILE);
+    io_uring_sqe_set_data(sqe, luringcb);
+    s->in_queue++;
+
+    if (!s->plugged) {
+        luring_submit_queue(s);
+    }
+    return 0;
+}
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB), or
+ * resubmits what is left of it.
+ */
+static void luring_process_completion(struct qemu_luring_state *s,
+                                      struct qemu_luringcb *luringcb,
+                                      int ret)
+{
+    trace_luring_process_completion(s, luringcb, ret);
+
+    if (ret == -EINTR || ret == -EAGAIN) {
+        goto resubmit;
+    }
+    if (ret < 0) {
+        goto done;
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_READ:
+        luringcb->total_read += ret;
+        if (ret > 0 && luringcb->total_read < luringcb->nbytes) {
+            if (!luringcb->resubmit_qiov.iov) {
+                qemu_iovec_init(&luringcb->resubmit_qiov,
+                                luringcb->qiov->niov);
+            } else {
+                qemu_iovec_reset(&luringcb->resubmit_qiov);
+            }
+            qemu_iovec_concat(&luringcb->resubmit_qiov, luringcb->qiov,
+                              luringcb->total_read,
+                              luringcb->nbytes - luringcb->total_read);
+            goto resubmit;
+        }
+
+        /* Short reads mean EOF, pad with zeros. */
+        if (luringcb->total_read < luringcb->nbytes) {
+            qemu_iovec_memset(luringcb->qiov, luringcb->total_read, 0,
+                              luringcb->nbytes - luringcb->total_read);
+        }
+        ret = 0;
+        break;
+    case QEMU_AIO_WRITE:
+        ret = (ret == luringcb->nbytes) ? 0 : -EINVAL;
+        break;
+    default:
+        ret = 0;
+        break;
+    }
+    goto done;
+
+resubmit:
+    ret = luring_prep_request(s, luringcb);
+    if (ret == 0) {
+        return;
+    }
+
+done:
+    if (luringcb->resubmit_qiov.iov) {
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+    }
+    luringcb->common.cb(luringcb->common.opaque, ret);
+    qemu_aio_unref(luringcb);
+}
+
+/*
+ * Each completion is consumed before its callback runs, so a nested event
+ * loop started by the callback simply goes on with the next ones.
+ */
+static void luring_process_completions(struct qemu_luring_state *s)
+{
+    struct io_uring_cqe *cqe;
+    struct qemu_luringcb *luringcb;
+    int ret;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        luringcb = io_uring_cqe_get_data(cqe);
+        ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        luring_process_completion(s, luringcb, ret);
+    }
+
+    /* Push resubmitted requests and those a failed submission left over */
+    if (!s->plugged) {
+        luring_submit_queue(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions(s);
+    }
+}
+
+/* Look for completions in the ring, without a system call */
+static bool luring_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions(s);
+    return true;
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+};
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+int luring_io_unplug(BlockDriverState *bs, void *aio_ctx, bool unplug)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->plugged > 0 || !unplug);
+
+    if (unplug && --s->plugged > 0) {
+        return 0;
+    }
+
+    return luring_submit_queue(s);
+}
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->ctx = s;
+    luringcb->type = type;
+    luringcb->offset = sector_num * BDRV_SECTOR_SIZE;
+    luringcb->nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    luringcb->qiov = qiov;
+    luringcb->total_read = 0;
+    memset(&luringcb->resubmit_qiov, 0, sizeof(luringcb->resubmit_qiov));
+
+    trace_luring_submit(s, luringcb, sector_num, nb_sectors, type);
+    if (luring_prep_request(s, luringcb) < 0) {
+        qemu_aio_unref(luringcb);
+        return NULL;
+    }
+    return &luringcb->common;
+}
+
+/* Requests refer to the file by its index in the ring's file table, so the
+ * table must be updated when raw-posix reopens the file.
+ */
+int luring_set_fd(void *aio_ctx, int fd)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    int ret;
+
+    io_uring_unregister_files(&s->ring);
+    ret = io_uring_register_files(&s->ring, &fd, 1);
+    return ret < 0 ? ret : 0;
+}
+
+void luring_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL);
+}
+
+void luring_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_luring_state *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, luring_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+void *luring_init(int fd, bool sqpoll, Error **errp)
+{
+    struct qemu_luring_state *s;
+    struct io_uring_params p;
+    int ret;
+
+    s = g_malloc0(sizeof(*s));
+    if (event_notifier_init(&s->e, false) < 0) {
+        error_setg(errp, "Failed to initialize event notifier");
+        goto out_free_state;
+    }
+
+    /* With kernel-side submission polling, a kernel thread picks up the
+     * requests from the ring and io_uring_submit() rarely has to enter the
+     * kernel.  It costs a busy thread per ring while requests come in.
+     */
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags |= IORING_SETUP_SQPOLL;
+    }
+    ret = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &p);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to initialize io_uring%s",
+                         sqpoll ? " with submission polling" : "");
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_files(&s->ring, &fd, 1);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register file with io_uring");
+        goto out_exit_ring;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to register io_uring eventfd");
+        goto out_exit_ring;
+    }
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *s_)
+{
+    struct qemu_luring_state *s = s_;
+
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -59,6 +60,24 @@ struct qemu_laio_state {
     int event_max;
 };
 
+/* The io_context_t returned by io_setup() points to the completion ring,
+ * which the kernel maps into the address space of the process.  Its layout
+ * is part of the kernel ABI.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
 static inline ssize_t io_event_ret(struct io_event *ev)
 {
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
@@ -146,6 +165,21 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* Look for completions in the ring, without a system call */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -304,6 +338,9 @@ void laio_attach_aio_context(void *s_, AioContext *new_context)
 
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb);
+    if (((struct aio_ring *)s->ctx)->magic == AIO_RING_MAGIC) {
+        aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
+    }
 }
 
 void *laio_init(void)
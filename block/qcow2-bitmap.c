@@ -0,0 +1,660 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "qemu/error-report.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/* The bitmaps of an image live in memory while it is open read-write.
+ * qcow2_load_dirty_bitmaps takes them over when the image is opened and
+ * removes them from the file; qcow2_store_dirty_bitmaps writes them back
+ * when it is closed.  A crash therefore loses the bitmaps rather than
+ * leaving stale ones behind, which would silently break incremental backups.
+ */
+
+/* Bitmap directory entry flags */
+#define BME_FLAG_IN_USE             (1U << 0)
+#define BME_RESERVED_FLAGS          (~BME_FLAG_IN_USE)
+
+#define BME_TYPE_DIRTY_TRACKING     1
+
+#define BME_MAX_NAME_SIZE           1023
+#define BME_MIN_GRANULARITY_BITS    9
+#define BME_MAX_GRANULARITY_BITS    31
+#define BME_MAX_TABLE_SIZE          0x8000000
+
+/* Bitmap table entries */
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
+
+typedef struct Qcow2BitmapDirEntry {
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t type;
+    uint8_t granularity_bits;
+    uint16_t name_size;
+    uint32_t extra_data_size;
+    /* extra data and name follow, padded to a multiple of 8 bytes */
+} QEMU_PACKED Qcow2BitmapDirEntry;
+
+/* An entry of the bitmap directory, in host byte order */
+typedef struct Qcow2Bitmap {
+    Qcow2BitmapDirEntry entry;
+    char *name;
+    uint64_t *table;    /* NULL if not read or corrupt */
+} Qcow2Bitmap;
+
+static inline size_t dir_entry_size(size_t name_size, size_t extra_data_size)
+{
+    return ROUND_UP(sizeof(Qcow2BitmapDirEntry) + name_size + extra_data_size,
+                    8);
+}
+
+/* Each cluster of bitmap data holds cluster_size * 8 bits.  */
+static uint64_t sectors_covered_by_bitmap_cluster(BDRVQcowState *s,
+                                                  uint32_t granularity)
+{
+    return ((uint64_t)s->cluster_size << 3) * (granularity >> BDRV_SECTOR_BITS);
+}
+
+static uint64_t bitmap_table_size(BDRVQcowState *s, int64_t nb_sectors,
+                                  uint32_t granularity)
+{
+    return DIV_ROUND_UP(nb_sectors,
+                        sectors_covered_by_bitmap_cluster(s, granularity));
+}
+
+bool qcow2_can_store_dirty_bitmap(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    return s->qcow_version >= 3 && !bs->read_only;
+}
+
+static void bitmap_list_free(Qcow2Bitmap *bitmaps, uint32_t nb_bitmaps)
+{
+    uint32_t i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+        g_free(bitmaps[i].table);
+    }
+    g_free(bitmaps);
+}
+
+static Qcow2Bitmap *bitmap_directory_read(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    uint8_t *dir, *p, *end;
+    uint32_t i;
+    int ret;
+
+    dir = g_try_malloc(s->bitmap_directory_size);
+    if (dir == NULL) {
+        error_setg(errp, "Could not allocate the bitmap directory");
+        return NULL;
+    }
+
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the bitmap directory");
+        g_free(dir);
+        return NULL;
+    }
+
+    bitmaps = g_new0(Qcow2Bitmap, s->nb_bitmaps);
+    end = dir + s->bitmap_directory_size;
+    for (i = 0, p = dir; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e = &bitmaps[i].entry;
+        size_t entry_size;
+
+        if (end - p < sizeof(*e)) {
+            goto corrupt;
+        }
+        memcpy(e, p, sizeof(*e));
+        be64_to_cpus(&e->bitmap_table_offset);
+        be32_to_cpus(&e->bitmap_table_size);
+        be32_to_cpus(&e->flags);
+        be16_to_cpus(&e->name_size);
+        be32_to_cpus(&e->extra_data_size);
+
+        if (e->name_size == 0 || e->name_size > BME_MAX_NAME_SIZE ||
+            e->extra_data_size > end - p) {
+            goto corrupt;
+        }
+        entry_size = dir_entry_size(e->name_size, e->extra_data_size);
+        if (entry_size > end - p) {
+            goto corrupt;
+        }
+
+        bitmaps[i].name = g_strndup((char *)p + sizeof(*e) +
+                                    e->extra_data_size, e->name_size);
+        p += entry_size;
+    }
+
+    g_free(dir);
+    return bitmaps;
+
+corrupt:
+    error_setg(errp, "The bitmap directory is corrupt");
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    g_free(dir);
+    return NULL;
+}
+
+/* Read the bitmap table of @bm, leaving bm->table NULL if it is corrupt.  */
+static int bitmap_table_read(BlockDriverState *bs, Qcow2Bitmap *bm,
+                             Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry *e = &bm->entry;
+    uint64_t *table;
+    uint32_t i;
+    int ret;
+
+    if (e->bitmap_table_size == 0) {
+        return 0;
+    }
+    if (e->bitmap_table_size > BME_MAX_TABLE_SIZE ||
+        e->bitmap_table_offset == 0 ||
+        offset_into_cluster(s, e->bitmap_table_offset)) {
+        error_setg(errp, "Invalid bitmap table for bitmap '%s'", bm->name);
+        return -EINVAL;
+    }
+
+    table = g_try_new(uint64_t, e->bitmap_table_size);
+    if (table == NULL) {
+        error_setg(errp, "Could not allocate the table of bitmap '%s'",
+                   bm->name);
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(bs->file, e->bitmap_table_offset, table,
+                     e->bitmap_table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read the table of bitmap '%s'",
+                         bm->name);
+        g_free(table);
+        return ret;
+    }
+
+    for (i = 0; i < e->bitmap_table_size; i++) {
+        be64_to_cpus(&table[i]);
+        if (table[i] & ~BME_TABLE_ENTRY_OFFSET_MASK ||
+            offset_into_cluster(s, table[i])) {
+            error_setg(errp, "Invalid table entry for bitmap '%s'", bm->name);
+            g_free(table);
+            return -EINVAL;
+        }
+    }
+
+    bm->table = table;
+    return 0;
+}
+
+static int bitmap_load_data(BlockDriverState *bs, const Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s,
+                            bdrv_dirty_bitmap_granularity(bitmap));
+    uint64_t sector;
+    uint8_t *buf;
+    uint32_t i;
+    int ret = 0;
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < bm->entry.bitmap_table_size;
+         i++, sector += sbc) {
+        uint64_t count = MIN(nb_sectors - sector, sbc);
+
+        if (bm->table[i] == 0) {
+            /* All zeroes, which is what the new bitmap has already */
+            continue;
+        }
+
+        ret = bdrv_pread(bs->file, bm->table[i], buf, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+        bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count, false);
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    ret = 0;
+
+out:
+    g_free(buf);
+    return ret;
+}
+
+static void bitmap_load(BlockDriverState *bs, Qcow2Bitmap *bm, Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2BitmapDirEntry *e = &bm->entry;
+    BdrvDirtyBitmap *bitmap;
+    uint32_t granularity;
+    int64_t nb_sectors;
+    int ret;
+
+    if (e->type != BME_TYPE_DIRTY_TRACKING) {
+        error_setg(errp, "Bitmap '%s' has unknown type %d", bm->name, e->type);
+        return;
+    }
+    if (e->flags & BME_FLAG_IN_USE) {
+        error_setg(errp, "Bitmap '%s' is inconsistent", bm->name);
+        return;
+    }
+    if (e->flags & BME_RESERVED_FLAGS) {
+        error_setg(errp, "Bitmap '%s' has unknown flags 0x%" PRIx32,
+                   bm->name, e->flags & BME_RESERVED_FLAGS);
+        return;
+    }
+    if (e->extra_data_size) {
+        error_setg(errp, "Bitmap '%s' has unknown extra data", bm->name);
+        return;
+    }
+    if (e->granularity_bits < BME_MIN_GRANULARITY_BITS ||
+        e->granularity_bits > BME_MAX_GRANULARITY_BITS) {
+        error_setg(errp, "Bitmap '%s' has invalid granularity", bm->name);
+        return;
+    }
+
+    granularity = 1U << e->granularity_bits;
+    nb_sectors = bdrv_nb_sectors(bs);
+    if (nb_sectors < 0 ||
+        e->bitmap_table_size != bitmap_table_size(s, nb_sectors, granularity)) {
+        error_setg(errp, "Bitmap '%s' does not match the size of the image",
+                   bm->name);
+        return;
+    }
+    if (e->bitmap_table_size && !bm->table) {
+        error_setg(errp, "Bitmap '%s' is corrupt", bm->name);
+        return;
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, bm->name, errp);
+    if (!bitmap) {
+        return;
+    }
+
+    ret = bitmap_load_data(bs, bm, bitmap);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read bitmap '%s'", bm->name);
+        bdrv_release_dirty_bitmap(bs, bitmap);
+        return;
+    }
+
+    bdrv_dirty_bitmap_set_persistent(bitmap, true);
+}
+
+/* Free the clusters of the bitmaps whose tables could be read.  */
+static void bitmap_list_free_clusters(BlockDriverState *bs,
+                                      Qcow2Bitmap *bitmaps,
+                                      uint32_t nb_bitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bm;
+    uint32_t i, j;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        bm = &bitmaps[i];
+        if (!bm->table) {
+            continue;
+        }
+        for (j = 0; j < bm->entry.bitmap_table_size; j++) {
+            if (bm->table[j]) {
+                qcow2_free_clusters(bs, bm->table[j], s->cluster_size,
+                                    QCOW2_DISCARD_OTHER);
+            }
+        }
+        qcow2_free_clusters(bs, bm->entry.bitmap_table_offset,
+                            bm->entry.bitmap_table_size * sizeof(uint64_t),
+                            QCOW2_DISCARD_OTHER);
+    }
+}
+
+void qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    uint32_t nb_bitmaps = s->nb_bitmaps;
+    uint64_t dir_offset = s->bitmap_directory_offset;
+    uint64_t dir_size = s->bitmap_directory_size;
+    Error *local_err = NULL;
+    uint32_t i;
+    int ret;
+
+    bitmaps = bitmap_directory_read(bs, &local_err);
+    if (!bitmaps) {
+        error_report("qcow2: %s; dropping persistent dirty bitmaps",
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        local_err = NULL;
+    }
+
+    for (i = 0; bitmaps && i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (bitmap_table_read(bs, bm, &local_err) < 0) {
+            error_report("qcow2: %s", error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            continue;
+        }
+
+        /* A bitmap that is already in memory is newer than the copy in the
+         * file; this happens when the image is reopened after a failed
+         * migration.
+         */
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            continue;
+        }
+
+        bitmap_load(bs, bm, &local_err);
+        if (local_err) {
+            error_report("qcow2: %s; dropping it", error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+        }
+    }
+
+    /* Remove the bitmaps from the image before freeing their clusters; a
+     * crash in between only leaks the clusters.
+     */
+    s->nb_bitmaps = 0;
+    s->bitmap_directory_offset = 0;
+    s->bitmap_directory_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_report("qcow2: could not remove the bitmaps from the image "
+                     "header: %s", strerror(-ret));
+        goto out;
+    }
+
+    if (bitmaps) {
+        bitmap_list_free_clusters(bs, bitmaps, nb_bitmaps);
+        qcow2_free_clusters(bs, dir_offset, dir_size, QCOW2_DISCARD_OTHER);
+    }
+
+out:
+    if (bitmaps) {
+        bitmap_list_free(bitmaps, nb_bitmaps);
+    }
+}
+
+/* Write the data and the table of @bitmap, and fill in @e.  Clusters are
+ * leaked on failure.
+ */
+static int bitmap_store(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
+                        Qcow2BitmapDirEntry *e)
+{
+    BDRVQcowState *s = bs->opaque;
+    int64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint32_t granularity = bdrv_dirty_bitmap_granularity(bitmap);
+    uint64_t sbc = sectors_covered_by_bitmap_cluster(s, granularity);
+    uint64_t tb_size = bitmap_table_size(s, nb_sectors, granularity);
+    uint64_t sector;
+    uint64_t *table;
+    uint8_t *buf;
+    int64_t offset;
+    uint32_t i;
+    int ret;
+
+    if (tb_size > BME_MAX_TABLE_SIZE) {
+        return -EFBIG;
+    }
+
+    memset(e, 0, sizeof(*e));
+    e->bitmap_table_size = tb_size;
+    e->type = BME_TYPE_DIRTY_TRACKING;
+    e->granularity_bits = ctz32(granularity);
+    if (tb_size == 0) {
+        return 0;
+    }
+
+    table = g_try_new0(uint64_t, tb_size);
+    if (table == NULL) {
+        return -ENOMEM;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, sector = 0; i < tb_size; i++, sector += sbc) {
+        uint64_t count = MIN(nb_sectors - sector, sbc);
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto out;
+        }
+        ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+        table[i] = cpu_to_be64(offset);
+    }
+
+    offset = qcow2_alloc_clusters(bs, tb_size * sizeof(uint64_t));
+    if (offset < 0) {
+        ret = offset;
+        goto out;
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                        tb_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+    ret = bdrv_pwrite(bs->file, offset, table, tb_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto out;
+    }
+
+    e->bitmap_table_offset = offset;
+    ret = 0;
+
+out:
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+void qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap;
+    Qcow2BitmapDirEntry e;
+    uint8_t *dir = NULL;
+    size_t dir_size = 0;
+    uint32_t nb_bitmaps = 0;
+    int64_t dir_offset;
+    int ret;
+
+    for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+         bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+        size_t name_size = strlen(name);
+        size_t entry_size;
+        Qcow2BitmapDirEntry *de;
+
+        if (!bdrv_dirty_bitmap_get_persistent(bitmap)) {
+            continue;
+        }
+        if (!qcow2_can_store_dirty_bitmap(bs) || s->nb_bitmaps) {
+            error_report("qcow2: cannot store dirty bitmap '%s' in this image",
+                         name);
+            continue;
+        }
+        if (name_size > BME_MAX_NAME_SIZE) {
+            error_report("qcow2: name of dirty bitmap '%s' is too long", name);
+            continue;
+        }
+        if (nb_bitmaps == QCOW2_MAX_BITMAPS) {
+            error_report("qcow2: too many dirty bitmaps, not storing '%s'",
+                         name);
+            continue;
+        }
+
+        ret = bitmap_store(bs, bitmap, &e);
+        if (ret < 0) {
+            error_report("qcow2: could not store dirty bitmap '%s': %s",
+                         name, strerror(-ret));
+            continue;
+        }
+
+        entry_size = dir_entry_size(name_size, 0);
+        dir = g_realloc(dir, dir_size + entry_size);
+        memset(dir + dir_size, 0, entry_size);
+        de = (Qcow2BitmapDirEntry *)(dir + dir_size);
+        de->bitmap_table_offset = cpu_to_be64(e.bitmap_table_offset);
+        de->bitmap_table_size = cpu_to_be32(e.bitmap_table_size);
+        de->flags = cpu_to_be32(e.flags);
+        de->type = e.type;
+        de->granularity_bits = e.granularity_bits;
+        de->name_size = cpu_to_be16(name_size);
+        de->extra_data_size = cpu_to_be32(0);
+        memcpy(dir + dir_size + sizeof(e), name, name_size);
+
+        dir_size += entry_size;
+        nb_bitmaps++;
+    }
+
+    if (nb_bitmaps == 0) {
+        goto out;
+    }
+
+    ret = -EFBIG;
+    if (dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        goto fail;
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        goto fail;
+    }
+    ret = qcow2_pre_write_overlap_check(bs, 0, dir_offset, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The refcounts and the bitmaps must be stable before the header
+     * points to them.
+     */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = 0;
+        s->bitmap_directory_offset = 0;
+        s->bitmap_directory_size = 0;
+        s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+        goto fail;
+    }
+    goto out;
+
+fail:
+    error_report("qcow2: could not store dirty bitmaps: %s", strerror(-ret));
+out:
+    g_free(dir);
+}
+
+int qcow2_check_bitmaps_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
+                                  uint16_t *refcount_table,
+                                  int64_t nb_clusters)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    Error *local_err = NULL;
+    uint32_t i, j;
+
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
+                        s->bitmap_directory_offset, s->bitmap_directory_size);
+
+    bitmaps = bitmap_directory_read(bs, &local_err);
+    if (!bitmaps) {
+        fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+        error_free(local_err);
+        res->corruptions++;
+        return 0;
+    }
+
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+
+        if (bitmap_table_read(bs, bm, &local_err) < 0) {
+            fprintf(stderr, "ERROR %s\n", error_get_pretty(local_err));
+            error_free(local_err);
+            local_err = NULL;
+            res->corruptions++;
+            continue;
+        }
+        if (!bm->table) {
+            continue;
+        }
+
+        qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
+                            bm->entry.bitmap_table_offset,
+                            bm->entry.bitmap_table_size * sizeof(uint64_t));
+        for (j = 0; j < bm->entry.bitmap_table_size; j++) {
+            if (bm->table[j]) {
+                qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
+                                    bm->table[j], s->cluster_size);
+            }
+        }
+    }
+
+    bitmap_list_free(bitmaps, s->nb_bitmaps);
+    return 0;
+}
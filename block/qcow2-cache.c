@@ -22,57 +22,173 @@
  * THE SOFTWARE.
  */
 
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
 #include "block/block_int.h"
 #include "qemu-common.h"
+#include "qemu/queue.h"
+#include "qemu/host-utils.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Each entry of the cache holds one table (or one slice of a table) of
+ * c->table_size bytes.  The tables themselves live in one contiguous array,
+ * so the index of an entry can be computed from a table pointer, and memory
+ * for entries that are not used is never touched (or is given back to the
+ * host by qcow2_cache_clean_unused()).
+ *
+ * Entries are found by offset through a small chained hash table, and the
+ * entries that aren't referenced are kept on a LRU list whose head is the
+ * next one to be replaced.
+ */
 typedef struct Qcow2CachedTable {
-    void*   table;
-    int64_t offset;
-    bool    dirty;
-    int     cache_hits;
-    int     ref;
+    int64_t  offset;
+    uint64_t lru_counter;
+    int      ref;
+    bool     dirty;
+    int      hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
     int                     size;
+    int                     table_size;
+    int                     table_bits;
     bool                    depends_on_flush;
+    void                   *table_array;
+    int                    *buckets;
+    int                     bucket_bits;
+    uint64_t                lru_counter;
+    uint64_t                cache_clean_lru_counter;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
+{
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset >> c->table_bits;
+
+    assert(idx >= 0 && idx < c->size && (table_offset & (c->table_size - 1)) == 0);
+    return idx;
+}
+
+static inline unsigned qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    return ((offset >> c->table_bits) * 0x9e3779b97f4a7c15ULL)
+           >> (64 - c->bucket_bits);
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->buckets[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void qcow2_cache_hash_insert(Qcow2Cache *c, int i)
+{
+    int *head = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    c->entries[i].hash_next = *head;
+    *head = i;
+}
+
+static void qcow2_cache_hash_remove(Qcow2Cache *c, int i)
+{
+    int *p = &c->buckets[qcow2_cache_hash(c, c->entries[i].offset)];
+
+    while (*p != i) {
+        assert(*p >= 0);
+        p = &c->entries[*p].hash_next;
+    }
+    *p = c->entries[i].hash_next;
+    c->entries[i].hash_next = -1;
+}
+
+/* Forget the table cached in an unused entry and make it the next victim */
+static void qcow2_cache_entry_drop(Qcow2Cache *c, int i)
+{
+    assert(c->entries[i].ref == 0 && !c->entries[i].dirty);
+
+    if (c->entries[i].offset) {
+        qcow2_cache_hash_remove(c, i);
+    }
+    c->entries[i].offset = 0;
+    c->entries[i].lru_counter = 0;
+
+    QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru);
+    QTAILQ_INSERT_HEAD(&c->lru_list, &c->entries[i], lru);
+}
+
+/* Give the memory of num_tables tables starting at index i back to the host */
+static void qcow2_cache_table_release(Qcow2Cache *c, int i, int num_tables)
+{
+    void *t = qcow2_cache_get_table_addr(c, i);
+    int align = getpagesize();
+    size_t mem_size = (size_t) c->table_size * num_tables;
+    size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
+    size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
+
+    if (mem_size > offset && length > 0) {
+        qemu_madvise((uint8_t *) t + offset, length, QEMU_MADV_DONTNEED);
+    }
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size)
 {
-    BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
     int i;
 
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size) && table_size >= BDRV_SECTOR_SIZE);
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
+    c->table_bits = ctz32(table_size);
+    c->bucket_bits = 1;
+    while ((1 << c->bucket_bits) < num_tables) {
+        c->bucket_bits++;
+    }
+    QTAILQ_INIT(&c->lru_list);
+
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
-    if (!c->entries) {
-        goto fail;
+    c->buckets = g_try_new(int, 1 << c->bucket_bits);
+    c->table_array = qemu_try_blockalign(bs->file,
+                                         (size_t) num_tables * table_size);
+    if (!c->entries || !c->buckets || !c->table_array) {
+        qemu_vfree(c->table_array);
+        g_free(c->buckets);
+        g_free(c->entries);
+        g_free(c);
+        return NULL;
     }
 
+    memset(c->buckets, -1, sizeof(int) << c->bucket_bits);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_try_blockalign(bs->file, s->cluster_size);
-        if (c->entries[i].table == NULL) {
-            goto fail;
-        }
+        c->entries[i].hash_next = -1;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
     }
 
     return c;
-
-fail:
-    if (c->entries) {
-        for (i = 0; i < c->size; i++) {
-            qemu_vfree(c->entries[i].table);
-        }
-    }
-    g_free(c->entries);
-    g_free(c);
-    return NULL;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
@@ -81,9 +197,10 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
@@ -132,13 +249,13 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -151,8 +268,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+                      qcow2_cache_get_table_addr(c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -227,67 +344,87 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        c->entries[i].offset = 0;
-        c->entries[i].cache_hits = 0;
+        qcow2_cache_entry_drop(c, i);
     }
+    qcow2_cache_table_release(c, 0, c->size);
+    c->lru_counter = 0;
+    c->cache_clean_lru_counter = 0;
 
     return 0;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    Qcow2CachedTable *t = &c->entries[i];
 
+    return t->ref == 0 && !t->dirty && t->offset != 0 &&
+           t->lru_counter <= c->cache_clean_lru_counter;
+}
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
+/*
+ * Drops the clean tables that have not been used since the previous call and
+ * gives their memory back to the host.  Called periodically, so that a cache
+ * that grew with the working set shrinks again once the tables are idle.
+ */
+void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcowState *s = bs->opaque;
+    int i = 0, cleaned = 0;
+
+    while (i < c->size) {
+        int to_clean = 0;
+
+        /* Skip the entries that we don't need to clean */
+        while (i < c->size && !can_clean_entry(c, i)) {
+            i++;
         }
 
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        /* And count how many we can clean in a row */
+        while (i < c->size && can_clean_entry(c, i)) {
+            qcow2_cache_entry_drop(c, i);
+            i++;
+            to_clean++;
         }
 
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        if (to_clean > 0) {
+            qcow2_cache_table_release(c, i - to_clean, to_clean);
+            cleaned += to_clean;
+        }
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    c->cache_clean_lru_counter = c->lru_counter;
+    trace_qcow2_cache_clean_unused(bs, c == s->l2_table_cache, cleaned);
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *victim;
     int i;
     int ret;
 
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    assert(offset != 0 && (offset & (c->table_size - 1)) == 0);
+
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
-        }
+    i = qcow2_cache_lookup(c, offset);
+    if (i >= 0) {
+        goto found;
     }
 
-    /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
+    /* If not, write back the least recently used table and replace it */
+    victim = QTAILQ_FIRST(&c->lru_list);
+    if (victim == NULL) {
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
+    }
+    i = victim - c->entries;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
-    if (i < 0) {
-        return i;
-    }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
@@ -296,28 +433,28 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_entry_drop(c, i);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
     c->entries[i].offset = offset;
+    qcow2_cache_hash_insert(c, i);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru);
+    }
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -339,34 +476,22 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, *table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    assert(c->entries[i].ref > 0);
+    if (--c->entries[i].ref == 0) {
+        c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru);
     }
-    return -ENOENT;
-
-found:
-    c->entries[i].ref--;
     *table = NULL;
 
-    assert(c->entries[i].ref >= 0);
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
+    assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
 }
@@ -883,12 +883,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
+    unsigned slice, slice_size2, n_slices;
     int i, j, l1_modified = 0, nb_csectors, refcount;
     int ret;
 
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -930,93 +933,99 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                    l2_offset + slice * slice_size2, (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
+
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
+
+                    offset = be64_to_cpu(l2_table[j]);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
+
+                    switch (qcow2_get_cluster_type(offset)) {
+                        case QCOW2_CLUSTER_COMPRESSED:
+                            nb_csectors = ((offset >> s->csize_shift) &
+                                           s->csize_mask) + 1;
+                            if (addend != 0) {
+                                ret = update_refcount(bs,
+                                    (offset & s->cluster_offset_mask) & ~511,
+                                    nb_csectors * 512, addend,
+                                    QCOW2_DISCARD_SNAPSHOT);
+                                if (ret < 0) {
+                                    goto fail;
+                                }
+                            }
+                            /* compressed clusters are never modified */
+                            refcount = 2;
+                            break;
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
-
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
-
-                switch (qcow2_get_cluster_type(offset)) {
-                    case QCOW2_CLUSTER_COMPRESSED:
-                        nb_csectors = ((offset >> s->csize_shift) &
-                                       s->csize_mask) + 1;
-                        if (addend != 0) {
-                            ret = update_refcount(bs,
-                                (offset & s->cluster_offset_mask) & ~511,
-                                nb_csectors * 512, addend,
-                                QCOW2_DISCARD_SNAPSHOT);
-                            if (ret < 0) {
+                        case QCOW2_CLUSTER_NORMAL:
+                        case QCOW2_CLUSTER_ZERO:
+                            if (offset_into_cluster(s,
+                                                    offset & L2E_OFFSET_MASK)) {
+                                qcow2_signal_corruption(bs, true, -1, -1,
+                                        "Data cluster offset %#llx unaligned "
+                                        "(L2 offset: %#" PRIx64 ", L2 index: "
+                                        "%#x)", offset & L2E_OFFSET_MASK,
+                                        l2_offset,
+                                        slice * s->l2_slice_size + j);
+                                ret = -EIO;
                                 goto fail;
                             }
-                        }
-                        /* compressed clusters are never modified */
-                        refcount = 2;
-                        break;
-
-                    case QCOW2_CLUSTER_NORMAL:
-                    case QCOW2_CLUSTER_ZERO:
-                        if (offset_into_cluster(s, offset & L2E_OFFSET_MASK)) {
-                            qcow2_signal_corruption(bs, true, -1, -1, "Data "
-                                                    "cluster offset %#llx "
-                                                    "unaligned (L2 offset: %#"
-                                                    PRIx64 ", L2 index: %#x)",
-                                                    offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
-                            ret = -EIO;
-                            goto fail;
-                        }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
-                        if (!cluster_index) {
-                            /* unallocated */
-                            refcount = 0;
-                            break;
-                        }
-                        if (addend != 0) {
-                            refcount = qcow2_update_cluster_refcount(bs,
-                                    cluster_index, addend,
-                                    QCOW2_DISCARD_SNAPSHOT);
-                        } else {
-                            refcount = get_refcount(bs, cluster_index);
-                        }
+                            cluster_index = (offset & L2E_OFFSET_MASK)
+                                            >> s->cluster_bits;
+                            if (!cluster_index) {
+                                /* unallocated */
+                                refcount = 0;
+                                break;
+                            }
+                            if (addend != 0) {
+                                refcount = qcow2_update_cluster_refcount(bs,
+                                        cluster_index, addend,
+                                        QCOW2_DISCARD_SNAPSHOT);
+                            } else {
+                                refcount = get_refcount(bs, cluster_index);
+                            }
 
-                        if (refcount < 0) {
-                            ret = refcount;
-                            goto fail;
-                        }
-                        break;
+                            if (refcount < 0) {
+                                ret = refcount;
+                                goto fail;
+                            }
+                            break;
 
-                    case QCOW2_CLUSTER_UNALLOCATED:
-                        refcount = 0;
-                        break;
+                        case QCOW2_CLUSTER_UNALLOCATED:
+                            refcount = 0;
+                            break;
 
-                    default:
-                        abort();
-                }
+                        default:
+                            abort();
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        l2_table[j] = cpu_to_be64(offset);
+                        qcow2_cache_entry_mark_dirty(s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                 }
-            }
 
-            ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
+                ret = qcow2_cache_put(bs, s->l2_table_cache,
+                                      (void**) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
             }
 
 
@@ -1080,11 +1089,11 @@ fail:
  *
  * Modifies the number of errors in res.
  */
-static void inc_refcounts(BlockDriverState *bs,
-                          BdrvCheckResult *res,
-                          uint16_t *refcount_table,
-                          int refcount_table_size,
-                          int64_t offset, int64_t size)
+void qcow2_inc_refcounts(BlockDriverState *bs,
+                         BdrvCheckResult *res,
+                         uint16_t *refcount_table,
+                         int refcount_table_size,
+                         int64_t offset, int64_t size)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t start, last, cluster_offset, k;
@@ -1160,7 +1169,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             nb_csectors = ((l2_entry >> s->csize_shift) &
                            s->csize_mask) + 1;
             l2_entry &= s->cluster_offset_mask;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
                 l2_entry & ~511, nb_csectors * 512);
 
             if (flags & CHECK_FRAG_INFO) {
@@ -1196,7 +1205,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
             }
 
             /* Mark cluster as used */
-            inc_refcounts(bs, res, refcount_table,refcount_table_size,
+            qcow2_inc_refcounts(bs, res, refcount_table,refcount_table_size,
                 offset, s->cluster_size);
 
             /* Correct offsets are cluster aligned */
@@ -1247,7 +1256,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
     l1_size2 = l1_size * sizeof(uint64_t);
 
     /* Mark L1 table as used */
-    inc_refcounts(bs, res, refcount_table, refcount_table_size,
+    qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
         l1_table_offset, l1_size2);
 
     /* Read L1 table entries from disk */
@@ -1272,7 +1281,7 @@ static int check_refcounts_l1(BlockDriverState *bs,
         if (l2_offset) {
             /* Mark L2 table as used */
             l2_offset &= L1E_OFFSET_MASK;
-            inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            qcow2_inc_refcounts(bs, res, refcount_table, refcount_table_size,
                 l2_offset, s->cluster_size);
 
             /* L2 tables are cluster aligned */
@@ -1572,7 +1581,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         size_to_clusters(s, bs->total_sectors * BDRV_SECTOR_SIZE);
 
     /* header */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
         0, s->cluster_size);
 
     /* current L1 table */
@@ -1591,11 +1600,17 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
             goto fail;
         }
     }
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* persistent dirty bitmaps */
+    ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* refcount data */
-    inc_refcounts(bs, res, refcount_table, nb_clusters,
+    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
         s->refcount_table_size * sizeof(uint64_t));
 
@@ -1620,7 +1635,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         if (offset != 0) {
-            inc_refcounts(bs, res, refcount_table, nb_clusters,
+            qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
                 offset, s->cluster_size);
             if (refcount_table[cluster] != 1) {
                 fprintf(stderr, "%s refcount block %" PRId64
@@ -1649,7 +1664,7 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                                 - old_nb_clusters) * sizeof(uint16_t));
                     }
                     refcount_table[cluster]--;
-                    inc_refcounts(bs, res, refcount_table, nb_clusters,
+                    qcow2_inc_refcounts(bs, res, refcount_table, nb_clusters,
                             new_offset, s->cluster_size);
 
                     res->corruptions_fixed++;
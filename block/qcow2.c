@@ -35,6 +35,7 @@
 #include "qapi-event.h"
 #include "trace.h"
 #include "qemu/option_int.h"
+#include "block/thread-pool.h"
 
 /*
   Differences with QCOW:
@@ -61,6 +62,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -88,6 +90,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 {
     BDRVQcowState *s = bs->opaque;
     QCowExtension ext;
+    Qcow2BitmapHeaderExt bitmaps_ext;
     uint64_t offset;
     int ret;
 
@@ -159,6 +162,45 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+                /* The image was modified by a program that does not know
+                 * about bitmaps, so they are stale.  The extension is
+                 * dropped the next time the header is written.
+                 */
+                break;
+            }
+            if (ext.len != sizeof(bitmaps_ext)) {
+                error_report("qcow2: invalid bitmaps extension length; "
+                             "ignoring persistent dirty bitmaps");
+                break;
+            }
+            ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: bitmaps_ext: "
+                                 "Could not read ext header");
+                return ret;
+            }
+            be32_to_cpus(&bitmaps_ext.nb_bitmaps);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_size);
+            be64_to_cpus(&bitmaps_ext.bitmap_directory_offset);
+
+            if (bitmaps_ext.nb_bitmaps == 0 ||
+                bitmaps_ext.nb_bitmaps > QCOW2_MAX_BITMAPS ||
+                bitmaps_ext.bitmap_directory_size == 0 ||
+                bitmaps_ext.bitmap_directory_size >
+                    QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+                offset_into_cluster(s, bitmaps_ext.bitmap_directory_offset)) {
+                error_report("qcow2: invalid bitmaps extension; "
+                             "ignoring persistent dirty bitmaps");
+                break;
+            }
+
+            s->nb_bitmaps = bitmaps_ext.nb_bitmaps;
+            s->bitmap_directory_size = bitmaps_ext.bitmap_directory_size;
+            s->bitmap_directory_offset = bitmaps_ext.bitmap_directory_offset;
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -467,6 +509,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum refcount block cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
+        {
+            .name = QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Clean unused cache entries after this time (in seconds)",
+        },
         { /* end of list */ }
     },
 };
@@ -482,10 +534,59 @@ static const char *overlap_bool_option_names[QCOW2_OL_MAX_BITNR] = {
     [QCOW2_OL_INACTIVE_L2_BITNR]    = QCOW2_OPT_OVERLAP_INACTIVE_L2,
 };
 
-static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
+static void cache_clean_timer_cb(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_cache_clean_unused(bs, s->l2_table_cache);
+    qcow2_cache_clean_unused(bs, s->refcount_block_cache);
+    timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+              (int64_t) s->cache_clean_interval * 1000);
+}
+
+static void cache_clean_timer_init(BlockDriverState *bs, AioContext *context)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_interval > 0) {
+        s->cache_clean_timer = aio_timer_new(context, QEMU_CLOCK_VIRTUAL,
+                                             SCALE_MS, cache_clean_timer_cb,
+                                             bs);
+        timer_mod(s->cache_clean_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) +
+                  (int64_t) s->cache_clean_interval * 1000);
+    }
+}
+
+static void cache_clean_timer_del(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    if (s->cache_clean_timer) {
+        timer_del(s->cache_clean_timer);
+        timer_free(s->cache_clean_timer);
+        s->cache_clean_timer = NULL;
+    }
+}
+
+static void qcow2_detach_aio_context(BlockDriverState *bs)
+{
+    cache_clean_timer_del(bs);
+}
+
+static void qcow2_attach_aio_context(BlockDriverState *bs,
+                                     AioContext *new_context)
+{
+    cache_clean_timer_init(bs, new_context);
+}
+
+static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
+                             uint64_t *l2_cache_size,
+                             uint64_t *l2_cache_entry_size,
                              uint64_t *refcount_cache_size, Error **errp)
 {
-    uint64_t combined_cache_size;
+    BDRVQcowState *s = bs->opaque;
+    uint64_t combined_cache_size, max_l2_cache;
     bool l2_cache_size_set, refcount_cache_size_set, combined_cache_size_set;
 
     combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
@@ -496,6 +597,14 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
     *l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
     *refcount_cache_size = qemu_opt_get_size(opts,
                                              QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+    *l2_cache_entry_size = qemu_opt_get_size(opts,
+                                             QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                             s->cluster_size);
+
+    /* The L2 tables needed to map the whole image */
+    max_l2_cache = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                s->cluster_size) * sizeof(uint64_t);
+    max_l2_cache = align_offset(max_l2_cache, s->cluster_size);
 
     if (combined_cache_size_set) {
         if (l2_cache_size_set && refcount_cache_size_set) {
@@ -524,8 +633,8 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
         }
     } else {
         if (!l2_cache_size_set && !refcount_cache_size_set) {
-            *l2_cache_size = DEFAULT_L2_CACHE_BYTE_SIZE;
-            *refcount_cache_size = *l2_cache_size
+            *l2_cache_size = MIN(max_l2_cache, DEFAULT_L2_CACHE_MAX_SIZE);
+            *refcount_cache_size = DEFAULT_L2_CACHE_BYTE_SIZE
                                  / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
         } else if (!l2_cache_size_set) {
             *l2_cache_size = *refcount_cache_size
@@ -535,6 +644,15 @@ static void read_cache_sizes(QemuOpts *opts, uint64_t *l2_cache_size,
                                  / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
         }
     }
+
+    if (*l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        *l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(*l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two "
+                   "between %d and the cluster size (%d)",
+                   1 << MIN_CLUSTER_BITS, s->cluster_size);
+        return;
+    }
 }
 
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
@@ -550,7 +668,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     uint64_t l1_vm_state_index;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t cache_clean_interval;
+    uint64_t stale_autoclear;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -796,14 +916,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    read_cache_sizes(opts, &l2_cache_size, &refcount_cache_size, &local_err);
+    read_cache_sizes(bs, opts, &l2_cache_size, &l2_cache_entry_size,
+                     &refcount_cache_size, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         ret = -EINVAL;
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -823,9 +944,23 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    cache_clean_interval =
+        qemu_opt_get_number(opts, QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+                            DEFAULT_CACHE_CLEAN_INTERVAL);
+    if (cache_clean_interval > UINT_MAX) {
+        error_setg(errp, "Cache clean interval too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->cache_clean_interval = cache_clean_interval;
+
+    /* alloc L2 table/refcount block cache; L2 tables are cached in slices
+     * of l2_cache_entry_size bytes, refcount blocks always as a whole */
+    s->l2_slice_size = l2_cache_entry_size / sizeof(uint64_t);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (s->l2_table_cache == NULL || s->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -889,9 +1024,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
-    /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && s->autoclear_features) {
-        s->autoclear_features = 0;
+    /* Clear unknown autoclear feature bits, and the bitmaps bit if the
+     * extension that goes with it is missing or invalid
+     */
+    stale_autoclear = s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK;
+    if (!s->nb_bitmaps) {
+        stale_autoclear |= s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS;
+    }
+    if (!bs->read_only && !(flags & BDRV_O_INCOMING) && stale_autoclear) {
+        s->autoclear_features &= ~stale_autoclear;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             error_setg_errno(errp, -ret, "Could not update qcow2 header");
@@ -978,6 +1119,16 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    /* Take over the persistent dirty bitmaps; they are written back
+     * when the image is closed.
+     */
+    if (!bs->read_only && !(flags & (BDRV_O_CHECK | BDRV_O_INCOMING)) &&
+        s->nb_bitmaps) {
+        qcow2_load_dirty_bitmaps(bs);
+    }
+
+    cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -1420,6 +1571,12 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    if (!(bs->open_flags & BDRV_O_INCOMING) && !bs->read_only) {
+        qcow2_store_dirty_bitmaps(bs);
+    }
+
+    cache_clean_timer_del(bs);
     qemu_vfree(s->l1_table);
     /* else pre-write overlap checks in cache_destroy may crash */
     s->l1_table = NULL;
@@ -1476,6 +1633,8 @@ static void qcow2_invalidate_cache(BlockDriverState *bs, Error **errp)
     memset(s, 0, sizeof(BDRVQcowState));
     options = qdict_clone_shallow(bs->options);
 
+    /* Migration is over, so the image may be written again */
+    flags &= ~BDRV_O_INCOMING;
     ret = qcow2_open(bs, options, flags, &local_err);
     QDECREF(options);
     if (local_err) {
@@ -1614,6 +1773,26 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Bitmaps extension */
+    if (s->nb_bitmaps > 0) {
+        Qcow2BitmapHeaderExt bitmaps_header = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size =
+                cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_header, sizeof(bitmaps_header),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     Qcow2Feature features[] = {
         {
@@ -1631,6 +1810,11 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -2132,13 +2316,72 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+/*
+ * Deflate @src_size bytes from @src into @dest, with the settings of the
+ * compressed clusters: best compression, small window, no zlib header.
+ *
+ * Returns the compressed size, -ENOSPC if it would not be smaller than
+ * @dest_size, or -EINVAL on error.
+ */
+static ssize_t qcow2_compress(void *dest, size_t dest_size,
+                              const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (uint8_t *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = (uint8_t *)strm.next_out - (uint8_t *)dest;
+        if (ret >= dest_size) {
+            ret = -ENOSPC;
+        }
+    } else if (ret == Z_OK) {
+        /* out of space in dest */
+        ret = -ENOSPC;
+    } else {
+        ret = -EINVAL;
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+} Qcow2CompressData;
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = qcow2_compress(data->dest, data->dest_size,
+                               data->src, data->src_size);
+    return 0;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
     int ret, out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
@@ -2167,39 +2410,18 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
-
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    out_buf = g_malloc(s->cluster_size);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
-    }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
+    out_len = qcow2_compress(out_buf, s->cluster_size, buf, s->cluster_size);
+    if (out_len == -ENOSPC) {
         /* could not compress: write normal cluster */
         ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
+    } else if (out_len < 0) {
+        ret = -EINVAL;
+        goto fail;
     } else {
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
@@ -2227,6 +2449,91 @@ fail:
     return ret;
 }
 
+/*
+ * The coroutine version deflates in the thread pool, so that several
+ * clusters can be compressed at the same time, and only holds s->lock to
+ * allocate the space of the compressed cluster.
+ */
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressData data;
+    ThreadPool *pool;
+    uint64_t cluster_offset;
+    uint8_t *out_buf;
+    int ret;
+
+    if (nb_sectors == 0) {
+        /* end of file alignment */
+        return qcow2_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
+
+    if (nb_sectors != s->cluster_sectors) {
+        ret = -EINVAL;
+
+        /* Zero-pad last write if image size is not cluster aligned */
+        if (sector_num + nb_sectors == bs->total_sectors &&
+            nb_sectors < s->cluster_sectors) {
+            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
+            memset(pad_buf, 0, s->cluster_size);
+            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
+            qemu_vfree(pad_buf);
+        }
+        return ret;
+    }
+
+    out_buf = g_malloc(s->cluster_size);
+
+    data = (Qcow2CompressData) {
+        .dest       = out_buf,
+        .dest_size  = s->cluster_size,
+        .src        = buf,
+        .src_size   = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+
+    if (data.ret == -ENOSPC) {
+        /* could not compress: write normal cluster */
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        goto out;
+    } else if (data.ret < 0) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, data.ret);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
+        goto out;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, data.ret);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto out;
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, data.ret);
+    if (ret >= 0) {
+        ret = 0;
+    }
+
+out:
+    g_free(out_buf);
+    return ret;
+}
+
 static coroutine_fn int qcow2_co_flush_to_os(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
@@ -2662,6 +2969,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_reopen_prepare  = qcow2_reopen_prepare,
     .bdrv_create        = qcow2_create,
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
+    .bdrv_can_store_dirty_bitmap = qcow2_can_store_dirty_bitmap,
     .bdrv_co_get_block_status = qcow2_co_get_block_status,
     .bdrv_set_key       = qcow2_set_key,
 
@@ -2673,6 +2981,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_co_discard        = qcow2_co_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_co_write_compressed = qcow2_co_write_compressed,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -2691,6 +3000,9 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_refresh_limits        = qcow2_refresh_limits,
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_detach_aio_context    = qcow2_detach_aio_context,
+    .bdrv_attach_aio_context    = qcow2_attach_aio_context,
+
     .create_opts         = &qcow2_create_opts,
     .bdrv_check          = qcow2_check,
     .bdrv_amend_options  = qcow2_amend_options,
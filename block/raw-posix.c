@@ -24,6 +24,7 @@
 #include "qemu-common.h"
 #include "qemu/timer.h"
 #include "qemu/log.h"
+#include "qemu/error-report.h"
 #include "block/block_int.h"
 #include "qemu/module.h"
 #include "trace.h"
@@ -56,6 +57,7 @@
 #include <linux/cdrom.h>
 #include <linux/fd.h>
 #include <linux/fs.h>
+#include <sys/syscall.h>
 #ifndef FS_NOCOW_FL
 #define FS_NOCOW_FL                     0x00800000 /* Do not cow file */
 #endif
@@ -144,11 +146,16 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_io_uring;
+    void *io_uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs:1;
 #endif
     bool has_discard:1;
     bool has_write_zeroes:1;
+    bool has_copy_range:1;
     bool discard_zeroes:1;
 #ifdef CONFIG_FIEMAP
     bool skip_fiemap;
@@ -178,6 +185,8 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    int aio_fd2;        /* destination of QEMU_AIO_COPY_RANGE */
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -318,25 +327,39 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 
 static void raw_detach_aio_context(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_detach_aio_context(s->io_uring_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
 }
 
 static void raw_attach_aio_context(BlockDriverState *bs,
                                    AioContext *new_context)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
 
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_attach_aio_context(s->aio_ctx, new_context);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_attach_aio_context(s->io_uring_ctx, new_context);
+    }
+#endif
 }
 
 #ifdef CONFIG_LINUX_AIO
@@ -391,6 +414,11 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "File name of the image",
         },
+        {
+            .name = "aio-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "Poll the io_uring submission queue from a kernel thread",
+        },
         { /* end of list */ }
     },
 };
@@ -444,8 +472,26 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_io_uring = !!(bdrv_flags & BDRV_O_IO_URING);
+    if (s->use_io_uring) {
+        s->io_uring_ctx = luring_init(fd,
+                                      qemu_opt_get_bool(opts, "aio-sqpoll",
+                                                        false),
+                                      &local_err);
+        if (!s->io_uring_ctx) {
+            error_propagate(errp, local_err);
+            qemu_close(fd);
+            s->fd = -1;
+            ret = -EINVAL;
+            goto fail;
+        }
+    }
+#endif
+
     s->has_discard = true;
     s->has_write_zeroes = true;
+    s->has_copy_range = true;
 
     if (fstat(s->fd, &st) < 0) {
         error_setg_errno(errp, errno, "Could not stat file");
@@ -612,6 +658,18 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    /* requests are drained, nothing refers to the old file anymore */
+    if (s->use_io_uring && luring_set_fd(s->io_uring_ctx, s->fd) < 0) {
+        error_report("Could not register reopened file with io_uring, "
+                     "falling back to aio=threads");
+        luring_detach_aio_context(s->io_uring_ctx,
+                                  bdrv_get_aio_context(state->bs));
+        luring_cleanup(s->io_uring_ctx);
+        s->io_uring_ctx = NULL;
+        s->use_io_uring = false;
+    }
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -966,6 +1024,56 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifndef CONFIG_COPY_FILE_RANGE
+static ssize_t copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                               off_t *out_off, size_t len, unsigned int flags)
+{
+#ifdef __NR_copy_file_range
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd,
+                   out_off, len, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+    BDRVRawState *s = aiocb->bs->opaque;
+    uint64_t bytes = aiocb->aio_nbytes;
+    off_t in_off = aiocb->aio_offset;
+    off_t out_off = aiocb->aio_offset2;
+    ssize_t ret;
+
+    while (bytes) {
+        ret = copy_file_range(aiocb->aio_fildes, &in_off,
+                              aiocb->aio_fd2, &out_off, bytes, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            ret = -errno;
+            if (ret == -ENOSYS) {
+                s->has_copy_range = false;
+            }
+            /* Cross-filesystem copies, overlapping ranges and file types
+             * that the kernel cannot copy are left to the caller */
+            if (ret == -ENOSYS || ret == -EXDEV || ret == -EINVAL ||
+                ret == -EOPNOTSUPP) {
+                ret = -ENOTSUP;
+            }
+            return ret;
+        }
+        if (ret == 0) {
+            /* End of the source file; the caller reads zeroes instead */
+            return -ENOTSUP;
+        }
+        bytes -= ret;
+    }
+    return 0;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1006,6 +1114,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1091,40 +1202,73 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* io_uring handles buffered I/O too, only bounce buffers need threads */
+    if (s->use_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->io_uring_ctx, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_plug(bs, s->aio_ctx);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_plug(bs, s->io_uring_ctx);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, true);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, true);
+    }
+#endif
 }
 
 static void raw_aio_flush_io_queue(BlockDriverState *bs)
 {
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
     if (s->use_aio) {
         laio_io_unplug(bs, s->aio_ctx, false);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_io_unplug(bs, s->io_uring_ctx, false);
+    }
+#endif
 }
 
+
 static BlockDriverAIOCB *raw_aio_readv(BlockDriverState *bs,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque)
@@ -1149,6 +1293,13 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        return luring_submit(bs, s->io_uring_ctx, 0, NULL, 0, cb, opaque,
+                             QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
@@ -1162,6 +1313,11 @@ static void raw_close(BlockDriverState *bs)
     if (s->use_aio) {
         laio_cleanup(s->aio_ctx);
     }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_io_uring) {
+        luring_cleanup(s->io_uring_ctx);
+    }
 #endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
@@ -1621,6 +1777,51 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors)
+{
+    return bdrv_co_copy_range_to(bs, sector_num, dst, dst_sector, nb_sectors);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BlockDriverState *src,
+                                             int64_t src_sector,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    if (src->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    src_s = src->opaque;
+    if (!src_s->has_copy_range) {
+        return -ENOTSUP;
+    }
+    if (fd_open(src) < 0 || fd_open(bs) < 0) {
+        return -EIO;
+    }
+
+    acb = g_slice_new(RawPosixAIOData);
+    acb->bs = src;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_sector * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = sector_num * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_co(sector_num, nb_sectors, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1669,6 +1870,8 @@ static BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
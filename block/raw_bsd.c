@@ -78,6 +78,26 @@ static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
     return bdrv_co_write_zeroes(bs->file, sector_num, nb_sectors, flags);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors)
+{
+    return bdrv_co_copy_range_from(bs->file, sector_num, dst, dst_sector,
+                                   nb_sectors);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BlockDriverState *src,
+                                             int64_t src_sector,
+                                             int64_t sector_num,
+                                             int nb_sectors)
+{
+    return bdrv_co_copy_range_to(src, src_sector, bs->file, sector_num,
+                                 nb_sectors);
+}
+
 static int coroutine_fn raw_co_discard(BlockDriverState *bs,
                                        int64_t sector_num, int nb_sectors)
 {
@@ -185,6 +205,8 @@ static BlockDriver bdrv_raw = {
     .bdrv_co_write_zeroes = &raw_co_write_zeroes,
     .bdrv_co_discard      = &raw_co_discard,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
+    .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = &raw_co_copy_range_to,
     .bdrv_truncate        = &raw_truncate,
     .bdrv_getlength       = &raw_getlength,
     .has_variable_length  = true,
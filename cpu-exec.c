@@ -21,9 +21,13 @@
 #include "trace.h"
 #include "disas/disas.h"
 #include "tcg.h"
+#include "exec/helper-proto.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
 #include "qemu/timer.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "qemu/main-loop.h"
+#endif
 
 /* -icount align implementation. */
 
@@ -215,8 +219,66 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
+}
+
+typedef struct TBLookupDesc {
+    CPUArchState *env;
+    tb_page_addr_t phys_page1;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+} TBLookupDesc;
+
+static bool tb_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBLookupDesc *desc = d;
+
+    if (tb->pc == desc->pc &&
+        tb->page_addr[0] == desc->phys_page1 &&
+        tb->cs_base == desc->cs_base &&
+        tb->flags == desc->flags &&
+        !atomic_read(&tb->invalid)) {
+        /* check next page if needed */
+        if (tb->page_addr[1] == -1) {
+            return true;
+        } else {
+            tb_page_addr_t phys_page2;
+            target_ulong virt_page2;
+
+            virt_page2 = (desc->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(desc->env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static TranslationBlock *tb_htable_lookup(CPUArchState *env,
+                                          target_ulong pc,
+                                          target_ulong cs_base,
+                                          uint64_t flags)
+{
+    tb_page_addr_t phys_pc;
+    TBLookupDesc desc;
+    uint32_t h;
+
+    /* find translated block using physical mappings */
+    phys_pc = get_page_addr_code(env, pc);
+    desc.env = env;
+    desc.phys_page1 = phys_pc & TARGET_PAGE_MASK;
+    desc.pc = pc;
+    desc.cs_base = cs_base;
+    desc.flags = flags;
+
+    h = tb_hash_func(phys_pc, pc, flags, cs_base);
+    return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
 static TranslationBlock *tb_find_slow(CPUArchState *env,
@@ -225,57 +287,57 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       uint64_t flags)
 {
     CPUState *cpu = ENV_GET_CPU(env);
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
-
-    tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+    TranslationBlock *tb;
 
-    /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    /* the hash table is looked up without tb_lock; only take it when
+       we need to translate, and check again that nobody else did */
+    tb = tb_htable_lookup(env, pc, cs_base, flags);
+    if (!tb) {
+        tb_lock();
+        tb = tb_htable_lookup(env, pc, cs_base, flags);
+        if (!tb) {
+            tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+            /* if no translated code available, then translate it now;
+               with tiered translation, count its executions */
+            tb = tb_gen_code(cpu, pc, cs_base, flags,
+                             tb_hot_threshold ? CF_PROFILE : 0);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+        tb_unlock();
     }
+
     /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
     return tb;
 }
 
+/* The profiling code of TB found it hot and left it.  Replace it with a
+   second-tier translation; invalidating it also unchains it from the TBs
+   that jump to it, so that they go through the new one.  */
+static TranslationBlock *tb_find_hot(CPUArchState *env, TranslationBlock *tb)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    uint64_t flags = tb->flags;
+    TranslationBlock *hot;
+
+    tb_lock();
+    if (!tb->invalid) {
+        tb_phys_invalidate(tb, -1);
+    }
+    /* another vCPU may have retranslated it already */
+    hot = tb_htable_lookup(env, pc, cs_base, flags);
+    if (!hot) {
+        tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
+        hot = tb_gen_code(cpu, pc, cs_base, flags, CF_TIER2);
+        tcg_ctx.tb_ctx.tb_tier2_count++;
+    }
+    tb_unlock();
+
+    atomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], hot);
+    return hot;
+}
+
 static inline TranslationBlock *tb_find_fast(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -287,14 +349,88 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
-    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
-                 tb->flags != flags)) {
+    tb = atomic_read(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)]);
+    if (unlikely(!tb || tb->invalid || tb->pc != pc ||
+                 tb->cs_base != cs_base || tb->flags != flags)) {
         tb = tb_find_slow(env, pc, cs_base, flags);
     }
+    if (unlikely(tb->cflags & CF_PROFILE) &&
+        tb->exec_count >= tb_hot_threshold) {
+        tb = tb_find_hot(env, tb);
+    }
     return tb;
 }
 
+/* Called by the code that tcg_gen_lookup_and_goto_ptr() generates at the
+   end of a TB, to find where to continue.  We are running from the code
+   buffer, so we can't translate here: if the next TB does not exist yet,
+   return the epilogue, which goes back to cpu_exec to translate it.  */
+void *HELPER(lookup_tb_ptr)(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    unsigned int h;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    h = tb_jmp_cache_hash_func(pc);
+    tb = atomic_read(&cpu->tb_jmp_cache[h]);
+    if (unlikely(!tb || tb->invalid || tb->pc != pc ||
+                 tb->cs_base != cs_base || tb->flags != flags)) {
+        tb = tb_htable_lookup(env, pc, cs_base, flags);
+        if (!tb) {
+            return tcg_ctx.code_gen_epilogue;
+        }
+        atomic_set(&cpu->tb_jmp_cache[h], tb);
+    }
+    return tb->tc_ptr;
+}
+
+/* Guest atomic operations, see tcg_gen_atomic_*().  DESC holds the log2
+   of the access size and, above it, the MMU index.  */
+#define ATOMIC_SIZE(desc)     (1 << ((desc) & MO_SIZE))
+#define ATOMIC_MMU_IDX(desc)  ((desc) >> 2)
+
+uint32_t HELPER(atomic_cmpxchg_i32)(CPUArchState *env, target_ulong addr,
+                                    uint32_t cmpv, uint32_t newv,
+                                    uint32_t desc)
+{
+    return cpu_atomic_cmpxchg(env, addr, cmpv, newv, ATOMIC_SIZE(desc),
+                              ATOMIC_MMU_IDX(desc), GETRA());
+}
+
+uint64_t HELPER(atomic_cmpxchg_i64)(CPUArchState *env, target_ulong addr,
+                                    uint64_t cmpv, uint64_t newv,
+                                    uint32_t desc)
+{
+    return cpu_atomic_cmpxchg(env, addr, cmpv, newv, ATOMIC_SIZE(desc),
+                              ATOMIC_MMU_IDX(desc), GETRA());
+}
+
+#define ATOMIC_RMW_HELPERS(NAME, OP)                                    \
+uint32_t HELPER(atomic_##NAME##_i32)(CPUArchState *env, target_ulong addr,  \
+                                     uint32_t val, uint32_t desc)          \
+{                                                                           \
+    return cpu_atomic_rmw(env, addr, OP, val, ATOMIC_SIZE(desc),            \
+                          ATOMIC_MMU_IDX(desc), GETRA());                   \
+}                                                                           \
+                                                                            \
+uint64_t HELPER(atomic_##NAME##_i64)(CPUArchState *env, target_ulong addr,  \
+                                     uint64_t val, uint32_t desc)          \
+{                                                                           \
+    return cpu_atomic_rmw(env, addr, OP, val, ATOMIC_SIZE(desc),            \
+                          ATOMIC_MMU_IDX(desc), GETRA());                   \
+}
+
+ATOMIC_RMW_HELPERS(xchg, CPU_ATOMIC_XCHG)
+ATOMIC_RMW_HELPERS(fetch_add, CPU_ATOMIC_FETCH_ADD)
+ATOMIC_RMW_HELPERS(fetch_and, CPU_ATOMIC_FETCH_AND)
+ATOMIC_RMW_HELPERS(fetch_or, CPU_ATOMIC_FETCH_OR)
+ATOMIC_RMW_HELPERS(fetch_xor, CPU_ATOMIC_FETCH_XOR)
+
+#undef ATOMIC_RMW_HELPERS
+
 static void cpu_handle_debug_exception(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -310,6 +446,28 @@ static void cpu_handle_debug_exception(CPUArchState *env)
     cc->debug_excp_handler(cpu);
 }
 
+/* With multi-threaded TCG, guest code runs without the iothread mutex
+ * but interrupts and exceptions are delivered with it held, since they
+ * look at and update device state.
+ */
+static inline void cpu_exec_lock_iothread(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_lock_iothread();
+    }
+#endif
+}
+
+static inline void cpu_exec_unlock_iothread(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
+
 /* main execution loop */
 
 volatile sig_atomic_t exit_request;
@@ -327,9 +485,6 @@ int cpu_exec(CPUArchState *env)
     uintptr_t next_tb;
     SyncClocks sc;
 
-    /* This must be volatile so it is not trashed by longjmp() */
-    volatile bool have_tb_lock = false;
-
     if (cpu->halted) {
         if (!cpu_has_work(cpu)) {
             return EXCP_HALTED;
@@ -385,8 +540,10 @@ int cpu_exec(CPUArchState *env)
                     ret = cpu->exception_index;
                     break;
 #else
+                    cpu_exec_lock_iothread();
                     cc->do_interrupt(cpu);
                     cpu->exception_index = -1;
+                    cpu_exec_unlock_iothread();
 #endif
                 }
             }
@@ -395,6 +552,7 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    cpu_exec_lock_iothread();
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -437,14 +595,13 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    cpu_exec_unlock_iothread();
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
                     cpu->exception_index = EXCP_INTERRUPT;
                     cpu_loop_exit(cpu);
                 }
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = true;
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -461,13 +618,18 @@ int cpu_exec(CPUArchState *env)
                 }
                 /* see if we can patch the calling TB. When the TB
                    spans two pages, we cannot safely do a direct
-                   jump. */
+                   jump.  Nor can we chain from or to a TB that another
+                   vCPU invalidated meanwhile. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb =
+                        (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+
+                    tb_lock();
+                    if (!last_tb->invalid && !tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                have_tb_lock = false;
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -540,10 +702,12 @@ int cpu_exec(CPUArchState *env)
 #ifdef TARGET_I386
             x86_cpu = X86_CPU(cpu);
 #endif
-            if (have_tb_lock) {
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
-                have_tb_lock = false;
+            tb_lock_reset();
+#if !defined(CONFIG_USER_ONLY)
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                qemu_mutex_unlock_iothread();
             }
+#endif
         }
     } /* for(;;) */
 
@@ -32,6 +32,7 @@
 #include "sysemu/dma.h"
 #include "sysemu/kvm.h"
 #include "qmp-commands.h"
+#include "tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -499,6 +500,35 @@ void cpu_ticks_init(void)
     vmstate_register(NULL, 0, &vmstate_timers, &timers_state);
 }
 
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+
+    if (!t || strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else if (strcmp(t, "multi") == 0) {
+#if !defined(TARGET_SUPPORTS_MTTCG)
+        error_setg(errp, "multi-threaded TCG is not supported for this guest");
+#elif !defined(TCG_TARGET_SUPPORTS_MTTCG) || !defined(CONFIG_LINUX)
+        /* The host memory model must be at least as strong as the guest's,
+         * and current_cpu must be a real per-thread variable.
+         */
+        error_setg(errp, "multi-threaded TCG is not supported on this host");
+#else
+        if (use_icount) {
+            error_setg(errp, "multi-threaded TCG is not supported with icount");
+        } else {
+            mttcg_enabled = true;
+        }
+#endif
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+
+    tb_hot_threshold = qemu_opt_get_bool(opts, "tiered", false) ?
+                       TB_HOT_THRESHOLD : 0;
+}
+
 void configure_icount(QemuOpts *opts, Error **errp)
 {
     const char *option;
@@ -786,6 +816,7 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static __thread bool iothread_locked;
 
 static QemuThread io_thread;
 
@@ -798,6 +829,13 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* multi-threaded TCG exclusive sections, protected by the iothread mutex */
+static QemuCond exclusive_cond;
+static QemuCond exclusive_resume;
+static int pending_cpus;
+static __thread int exclusive_depth;
+static __thread CPUState *exclusive_self;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -805,11 +843,104 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&exclusive_cond);
+    qemu_cond_init(&exclusive_resume);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+/* Wait for the pending exclusive section, if any, to finish.  */
+static void tcg_exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&exclusive_resume, &qemu_global_mutex);
+    }
+}
+
+/* With multi-threaded TCG, a vCPU thread brackets the execution of guest
+ * code with these.  They are called with the iothread mutex held.
+ */
+static void tcg_cpu_exec_start(CPUState *cpu)
+{
+    tcg_exclusive_idle();
+    cpu->running = true;
+}
+
+static void tcg_cpu_exec_end(CPUState *cpu)
+{
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&exclusive_cond);
+        }
+    }
+}
+
+/* This is the same scheme that linux-user uses for atomic operations:
+ * pending_cpus counts the vCPUs that have yet to leave guest code, plus
+ * one for the thread in the exclusive section.
+ */
+void tcg_start_exclusive(void)
+{
+    CPUState *cpu;
+
+    if (!qemu_tcg_mttcg_enabled() || exclusive_depth++) {
+        return;
+    }
+
+    /* Called from guest code, e.g. by a helper: stop counting as running,
+     * or we would wait for ourselves.
+     */
+    if (current_cpu && current_cpu->running) {
+        exclusive_self = current_cpu;
+        tcg_cpu_exec_end(current_cpu);
+    }
+
+    tcg_exclusive_idle();
+    pending_cpus = 1;
+    CPU_FOREACH(cpu) {
+        if (cpu->running) {
+            pending_cpus++;
+            cpu_exit(cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+void tcg_end_exclusive(void)
+{
+    if (!qemu_tcg_mttcg_enabled() || --exclusive_depth) {
+        return;
+    }
+
+    pending_cpus = 0;
+    qemu_cond_broadcast(&exclusive_resume);
+    if (exclusive_self) {
+        tcg_cpu_exec_start(exclusive_self);
+        exclusive_self = NULL;
+    }
+}
+
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    qemu_mutex_lock(&cpu->work_mutex);
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+    qemu_mutex_unlock(&cpu->work_mutex);
+
+    qemu_cpu_kick(cpu);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -822,16 +953,8 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
-
-    qemu_cpu_kick(cpu);
+    wi.exclusive = false;
+    queue_work_on_cpu(cpu, &wi);
     while (!wi.done) {
         CPUState *self_cpu = current_cpu;
 
@@ -853,16 +976,20 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->func = func;
     wi->data = data;
     wi->free = true;
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
-    }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
+    queue_work_on_cpu(cpu, wi);
+}
 
-    qemu_cpu_kick(cpu);
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+    queue_work_on_cpu(cpu, wi);
 }
 
 static void flush_queued_work(CPUState *cpu)
@@ -873,15 +1000,28 @@ static void flush_queued_work(CPUState *cpu)
         return;
     }
 
+    qemu_mutex_lock(&cpu->work_mutex);
     while ((wi = cpu->queued_work_first)) {
         cpu->queued_work_first = wi->next;
-        wi->func(wi->data);
-        wi->done = true;
+        if (!cpu->queued_work_first) {
+            cpu->queued_work_last = NULL;
+        }
+        qemu_mutex_unlock(&cpu->work_mutex);
+        if (wi->exclusive) {
+            tcg_start_exclusive();
+            wi->func(wi->data);
+            tcg_end_exclusive();
+        } else {
+            wi->func(wi->data);
+        }
+        qemu_mutex_lock(&cpu->work_mutex);
         if (wi->free) {
             g_free(wi);
+        } else {
+            wi->done = true;
         }
     }
-    cpu->queued_work_last = NULL;
+    qemu_mutex_unlock(&cpu->work_mutex);
     qemu_cond_broadcast(&qemu_work_cond);
 }
 
@@ -916,6 +1056,16 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    tcg_exclusive_idle();
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -932,6 +1082,7 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
     int r;
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     qemu_thread_get_self(cpu->thread);
     cpu->thread_id = qemu_get_thread_id();
     current_cpu = cpu;
@@ -1003,6 +1154,7 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
 static void tcg_exec_all(void);
 
 static void *qemu_tcg_cpu_thread_fn(void *arg)
@@ -1013,6 +1165,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     qemu_thread_get_self(cpu->thread);
 
     qemu_mutex_lock(&qemu_global_mutex);
+    iothread_locked = true;
     CPU_FOREACH(cpu) {
         cpu->thread_id = qemu_get_thread_id();
         cpu->created = true;
@@ -1045,6 +1198,37 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG: each vCPU has its own thread, which runs guest code
+ * without the iothread mutex.
+ */
+static void *qemu_tcg_mttcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            tcg_cpu_exec_start(cpu);
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu->env_ptr);
+            qemu_mutex_lock_iothread();
+            tcg_cpu_exec_end(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_mttcg_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1087,7 +1271,9 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu_exit(cpu);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -1117,9 +1303,14 @@ static bool qemu_in_vcpu_thread(void)
     return current_cpu && qemu_cpu_is_self(current_cpu);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled()) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -1130,10 +1321,12 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    iothread_locked = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    iothread_locked = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
@@ -1162,7 +1355,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1205,8 +1398,20 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
 
     tcg_cpu_address_space_init(cpu, cpu->as);
 
-    /* share a single thread for all cpus with TCG */
-    if (!tcg_cpu_thread) {
+    if (qemu_tcg_mttcg_enabled()) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
+                 cpu->cpu_index);
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mttcg_cpu_thread_fn,
+                           cpu, QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+    } else if (!tcg_cpu_thread) {
+        /* share a single thread for all cpus with TCG */
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
         qemu_cond_init(cpu->halt_cond);
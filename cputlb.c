@@ -23,11 +23,15 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "exec/cpu_ldst.h"
+#include "exec/cpu_atomic.h"
+#include "qemu/main-loop.h"
 
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "tcg/tcg.h"
 
 //#define DEBUG_TLB
@@ -36,6 +40,158 @@
 /* statistics */
 int tlb_flush_count;
 
+static inline size_t tlb_n_entries(CPUState *cpu, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    return (cpu->tlb_desc[mmu_idx].mask >> CPU_TLB_ENTRY_BITS) + 1;
+#else
+    return CPU_TLB_SIZE;
+#endif
+}
+
+/* Unlike env->tlb_table, this is not cleared by a reset of the CPU.  */
+static inline CPUTLBEntry *tlb_mmu_table(CPUState *cpu, int mmu_idx)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    return cpu->tlb_desc[mmu_idx].table;
+#else
+    CPUArchState *env = cpu->env_ptr;
+
+    return env->tlb_table[mmu_idx];
+#endif
+}
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Use rates are measured over windows of at least this length.  */
+#define TLB_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns, size_t max_entries)
+{
+    desc->window_begin_ns = ns;
+    desc->window_max_entries = max_entries;
+}
+
+/* Called at flush time, when the TLB is empty, to resize it.
+ *
+ * A TLB that was more than 70% full at some point of the window is
+ * doubled: a larger TLB costs a little more to flush, but misses are
+ * much more expensive.  A TLB that stayed below 30% use for a whole
+ * window shrinks, so that guests that flush often (e.g. on every context
+ * switch) with a small working set do not pay for clearing a large TLB;
+ * its new size keeps the largest use of the window below 70%.
+ */
+static void tlb_mmu_alloc(CPUTLBDesc *desc, size_t n_entries)
+{
+    desc->mask = (n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    desc->table = g_new(CPUTLBEntry, n_entries);
+    desc->iotlb = g_new(hwaddr, n_entries);
+}
+
+static void tlb_mmu_resize(CPUState *cpu, int mmu_idx)
+{
+    CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+    size_t old_size = tlb_n_entries(cpu, mmu_idx);
+    size_t new_size = old_size;
+    int64_t now = get_clock();
+    bool window_expired;
+    size_t rate;
+
+    window_expired = now > desc->window_begin_ns + TLB_WINDOW_NS;
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = desc->window_max_entries <= 1 ? 1 :
+            (size_t)1 << (32 - clz32(desc->window_max_entries - 1));
+
+        if (desc->window_max_entries * 100 / ceil > 70) {
+            ceil <<= 1;
+        }
+        new_size = MAX(ceil, 1 << CPU_TLB_DYN_MIN_BITS);
+    }
+
+    desc->n_used_entries = 0;
+    if (new_size == old_size) {
+        if (window_expired) {
+            tlb_window_reset(desc, now, 0);
+        }
+        return;
+    }
+    g_free(desc->table);
+    g_free(desc->iotlb);
+    tlb_mmu_alloc(desc, new_size);
+    tlb_window_reset(desc, now, 0);
+}
+#endif
+
+/* Called with cpu->tlb_lock held.  */
+static void tlb_flush_tables(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &cpu->tlb_desc[mmu_idx];
+
+        tlb_mmu_resize(cpu, mmu_idx);
+        memset(desc->table, -1,
+               tlb_n_entries(cpu, mmu_idx) * sizeof(CPUTLBEntry));
+        env->tlb_mask[mmu_idx] = desc->mask;
+        env->tlb_table[mmu_idx] = desc->table;
+        env->iotlb[mmu_idx] = desc->iotlb;
+    }
+#else
+    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+#endif
+}
+
+void tlb_init(CPUState *cpu)
+{
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int64_t now = get_clock();
+    int mmu_idx;
+
+    cpu->tlb_desc = g_new0(CPUTLBDesc, NB_MMU_MODES);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_mmu_alloc(&cpu->tlb_desc[mmu_idx], 1 << CPU_TLB_DYN_DEFAULT_BITS);
+        tlb_window_reset(&cpu->tlb_desc[mmu_idx], now, 0);
+    }
+#endif
+    qemu_mutex_init(&cpu->tlb_lock);
+    qemu_mutex_lock(&cpu->tlb_lock);
+    tlb_flush_tables(cpu);
+    qemu_mutex_unlock(&cpu->tlb_lock);
+}
+
+void tlb_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+    CPUArchState *env;
+    uint64_t miss_count = 0, fill_count = 0;
+    int mmu_idx;
+
+    CPU_FOREACH(cpu) {
+        env = cpu->env_ptr;
+        miss_count += env->tlb_miss_count;
+        fill_count += env->tlb_fill_count;
+    }
+    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB miss count      %" PRIu64 "\n", miss_count);
+    cpu_fprintf(f, "TLB fill count      %" PRIu64 "\n", fill_count);
+    CPU_FOREACH(cpu) {
+        cpu_fprintf(f, "TLB entries CPU %-3d", cpu->cpu_index);
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            cpu_fprintf(f, " %zu", tlb_n_entries(cpu, mmu_idx));
+        }
+        cpu_fprintf(f, "\n");
+    }
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -48,10 +204,26 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
+static void tlb_flush_async_work(void *opaque);
+
+/* With multi-threaded TCG, the TLB of a vCPU is only ever modified by the
+ * thread running it, so flushes of another vCPU's TLB are queued as work
+ * for that thread.  They are done before it executes any more guest code.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
 void tlb_flush(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
 
+    if (tlb_flush_is_remote(cpu)) {
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
@@ -59,7 +231,9 @@ void tlb_flush(CPUState *cpu, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
+    qemu_mutex_lock(&cpu->tlb_lock);
+    tlb_flush_tables(cpu);
+    qemu_mutex_unlock(&cpu->tlb_lock);
     memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
     memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
 
@@ -69,7 +243,31 @@ void tlb_flush(CPUState *cpu, int flush_global)
     tlb_flush_count++;
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+static void tlb_flush_async_work(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+typedef struct TLBFlushPageWork {
+    CPUState *cpu;
+    target_ulong addr;
+} TLBFlushPageWork;
+
+static void tlb_flush_page_async_work(void *opaque)
+{
+    TLBFlushPageWork *work = opaque;
+
+    tlb_flush_page(work->cpu, work->addr);
+    g_free(work);
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
+}
+
+/* Returns true if the entry was flushed.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -78,7 +276,9 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
     }
+    return false;
 }
 
 void tlb_flush_page(CPUState *cpu, target_ulong addr)
@@ -87,6 +287,15 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     int i;
     int mmu_idx;
 
+    if (tlb_flush_is_remote(cpu)) {
+        TLBFlushPageWork *work = g_new(TLBFlushPageWork, 1);
+
+        work->cpu = cpu;
+        work->addr = addr;
+        async_run_on_cpu(cpu, tlb_flush_page_async_work, work);
+        return;
+    }
+
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
@@ -105,9 +314,16 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
     cpu->current_tb = NULL;
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        i = tlb_index(env, mmu_idx, addr);
+        if (tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr)) {
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+            /* the count is an estimate: victim TLB swaps do not update it */
+            if (cpu->tlb_desc[mmu_idx].n_used_entries) {
+                cpu->tlb_desc[mmu_idx].n_used_entries--;
+            }
+#endif
+        }
     }
 
     /* check whether there are entries that need to be flushed in the vtlb */
@@ -150,7 +366,10 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
-            tlb_entry->addr_write |= TLB_NOTDIRTY;
+            /* Other vCPUs may be using the entry concurrently; a single
+               store keeps it consistent for them.  */
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
         }
     }
 }
@@ -175,12 +394,14 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
         int mmu_idx;
 
         env = cpu->env_ptr;
+        /* the vCPU thread may be reallocating its tables */
+        qemu_mutex_lock(&cpu->tlb_lock);
         for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            CPUTLBEntry *table = tlb_mmu_table(cpu, mmu_idx);
             unsigned int i;
 
-            for (i = 0; i < CPU_TLB_SIZE; i++) {
-                tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                      start1, length);
+            for (i = 0; i < tlb_n_entries(cpu, mmu_idx); i++) {
+                tlb_reset_dirty_range(&table[i], start1, length);
             }
 
             for (i = 0; i < CPU_VTLB_SIZE; i++) {
@@ -188,6 +409,7 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                                       start1, length);
             }
         }
+        qemu_mutex_unlock(&cpu->tlb_lock);
     }
 }
 
@@ -206,8 +428,8 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        i = tlb_index(env, mmu_idx, vaddr);
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
 
@@ -289,8 +511,14 @@ void tlb_set_page(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
+    env->tlb_fill_count++;
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+    if (tlb_entry_is_empty(te)) {
+        cpu->tlb_desc[mmu_idx].n_used_entries++;
+    }
+#endif
 
     /* do not discard the translation in te, evict it into a victim tlb */
     env->tlb_v_table[mmu_idx][vidx] = *te;
@@ -339,8 +567,8 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     MemoryRegion *mr;
     CPUState *cpu = ENV_GET_CPU(env1);
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
@@ -361,6 +589,133 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     return qemu_ram_addr_from_host_nofail(p);
 }
 
+/* Fill the TLB entry for a write to addr, and check that the page can be
+   read as well, so that guest faults are raised at this point.  retaddr
+   is the GETRA() of the helper doing the access.  */
+void tlb_probe_rmw(CPUArchState *env, target_ulong addr, int mmu_idx,
+                   uintptr_t retaddr)
+{
+    int index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+
+    retaddr -= GETPC_ADJ;
+    if ((addr & TARGET_PAGE_MASK)
+        != (te->addr_write & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(ENV_GET_CPU(env), addr, 1, mmu_idx, retaddr);
+    }
+    if ((addr & TARGET_PAGE_MASK)
+        != (te->addr_read & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        tlb_fill(ENV_GET_CPU(env), addr, 0, mmu_idx, retaddr);
+    }
+}
+
+static uint64_t atomic_ld_slow(CPUArchState *env, target_ulong addr, int size,
+                               int mmu_idx, uintptr_t retaddr)
+{
+    switch (size) {
+    case 1:
+        return helper_ret_ldub_mmu(env, addr, mmu_idx, retaddr);
+    case 2:
+        return helper_ret_lduw_mmu(env, addr, mmu_idx, retaddr);
+    case 4:
+        return helper_ret_ldul_mmu(env, addr, mmu_idx, retaddr);
+    case 8:
+        return helper_ret_ldq_mmu(env, addr, mmu_idx, retaddr);
+    default:
+        abort();
+    }
+}
+
+static void atomic_st_slow(CPUArchState *env, target_ulong addr, uint64_t val,
+                           int size, int mmu_idx, uintptr_t retaddr)
+{
+    switch (size) {
+    case 1:
+        helper_ret_stb_mmu(env, addr, val, mmu_idx, retaddr);
+        break;
+    case 2:
+        helper_ret_stw_mmu(env, addr, val, mmu_idx, retaddr);
+        break;
+    case 4:
+        helper_ret_stl_mmu(env, addr, val, mmu_idx, retaddr);
+        break;
+    case 8:
+        helper_ret_stq_mmu(env, addr, val, mmu_idx, retaddr);
+        break;
+    default:
+        abort();
+    }
+}
+
+/* Naturally aligned accesses to RAM use the host's atomic instructions.
+ * Anything else (MMIO, pages with translated code or dirty tracking,
+ * page crossing accesses) is done with plain loads and stores while the
+ * other vCPUs are kept out of guest code.
+ */
+static uint64_t atomic_rmw(CPUArchState *env, target_ulong addr,
+                           CPUAtomicOp op, uint64_t cmpv, uint64_t val,
+                           int size, int mmu_idx, uintptr_t retaddr)
+{
+    int index = tlb_index(env, mmu_idx, addr);
+    CPUTLBEntry *te = &env->tlb_table[mmu_idx][index];
+    uint64_t mask = size == 8 ? -1 : (1ull << (size * 8)) - 1;
+    bool locked = false;
+    uint64_t old, newv;
+
+    tlb_probe_rmw(env, addr, mmu_idx, retaddr);
+    if ((addr & (size - 1)) == 0
+        && te->addr_write == (addr & TARGET_PAGE_MASK)
+        && te->addr_read == (addr & TARGET_PAGE_MASK)) {
+        return cpu_atomic_host_op(addr + te->addend, op, cmpv, val, size);
+    }
+
+    /* Slow path.  Fault in the second page now, as the accesses below
+       must not longjmp out of the exclusive section.  */
+    if (((addr + size - 1) ^ addr) & TARGET_PAGE_MASK) {
+        tlb_probe_rmw(env, addr + size - 1, mmu_idx, retaddr);
+    }
+
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    tcg_start_exclusive();
+
+    old = atomic_ld_slow(env, addr, size, mmu_idx, retaddr);
+    newv = cpu_atomic_new_value(op, old, cmpv & mask, val) & mask;
+    if (op != CPU_ATOMIC_CMPXCHG || old == (cmpv & mask)) {
+        atomic_st_slow(env, addr, newv, size, mmu_idx, retaddr);
+    }
+
+    tcg_end_exclusive();
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return old;
+}
+
+/* Atomically replace the 'size' bytes (1, 2, 4 or 8) of guest memory at
+ * addr with newv if they are equal to cmpv, and return their old value.
+ * This is the building block for guest compare-and-swap and LL/SC
+ * instructions when several vCPUs run in parallel.
+ */
+uint64_t cpu_atomic_cmpxchg(CPUArchState *env, target_ulong addr,
+                            uint64_t cmpv, uint64_t newv, int size,
+                            int mmu_idx, uintptr_t retaddr)
+{
+    return atomic_rmw(env, addr, CPU_ATOMIC_CMPXCHG, cmpv, newv, size,
+                      mmu_idx, retaddr);
+}
+
+/* Likewise for the other operations: exchange, or combine val into memory
+   with an addition or a bitwise operation.  */
+uint64_t cpu_atomic_rmw(CPUArchState *env, target_ulong addr,
+                        CPUAtomicOp op, uint64_t val, int size,
+                        int mmu_idx, uintptr_t retaddr)
+{
+    return atomic_rmw(env, addr, op, 0, val, size, mmu_idx, retaddr);
+}
+
 #define MMUSUFFIX _mmu
 
 #define SHIFT 0
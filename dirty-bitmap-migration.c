@@ -0,0 +1,282 @@
+/*
+ * QEMU dirty bitmap migration
+ *
+ * Named dirty bitmaps are sent in the completion phase, when the guest is
+ * stopped and they cannot change anymore.  They are small compared to the
+ * disks they describe (one bit per granularity bytes), so sending them
+ * while the guest runs and tracking their own dirtiness is not worth it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu-common.h"
+#include "block/block.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/notify.h"
+#include "migration/dirty-bitmap.h"
+#include "migration/migration.h"
+#include "migration/vmstate.h"
+
+#define DIRTY_BITMAP_MIG_FLAG_EOS       0x01
+#define DIRTY_BITMAP_MIG_FLAG_BITMAP    0x02
+
+/* Sectors covered by one chunk of the stream, in units of the
+ * serialization alignment.  This sends 64 KiB of bitmap data at a time.
+ */
+#define DIRTY_BITMAP_MIG_CHUNK          8192
+
+static Notifier dirty_bitmap_mig_state_notifier;
+
+static void put_string(QEMUFile *f, const char *str)
+{
+    size_t len = strlen(str);
+
+    qemu_put_be32(f, len);
+    qemu_put_buffer(f, (const uint8_t *)str, len);
+}
+
+static char *get_string(QEMUFile *f)
+{
+    uint32_t len = qemu_get_be32(f);
+    char *str;
+
+    if (len > 1024) {
+        return NULL;
+    }
+    str = g_malloc(len + 1);
+    qemu_get_buffer(f, (uint8_t *)str, len);
+    str[len] = '\0';
+    return str;
+}
+
+static void send_bitmap(QEMUFile *f, BlockDriverState *bs,
+                        BdrvDirtyBitmap *bitmap)
+{
+    int64_t nb_sectors = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t chunk = bdrv_dirty_bitmap_serialization_align(bitmap) *
+                     DIRTY_BITMAP_MIG_CHUNK;
+    uint64_t sector, count, size;
+    uint8_t *buf;
+
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_BITMAP);
+    put_string(f, bdrv_get_device_name(bs));
+    put_string(f, bdrv_dirty_bitmap_name(bitmap));
+    qemu_put_be32(f, bdrv_dirty_bitmap_granularity(bitmap));
+    qemu_put_byte(f, bdrv_dirty_bitmap_get_persistent(bitmap));
+    qemu_put_be64(f, nb_sectors);
+    if (nb_sectors == 0) {
+        return;
+    }
+
+    buf = g_malloc(bdrv_dirty_bitmap_serialization_size(bitmap, 0,
+                                                        MIN(chunk,
+                                                            nb_sectors)));
+    for (sector = 0; sector < nb_sectors; sector += count) {
+        count = MIN(nb_sectors - sector, chunk);
+        size = bdrv_dirty_bitmap_serialization_size(bitmap, sector, count);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, sector, count);
+        qemu_put_buffer(f, buf, size);
+    }
+    g_free(buf);
+}
+
+static int dirty_bitmap_save_setup(QEMUFile *f, void *opaque)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    int ret = 0;
+
+    qemu_mutex_lock_iothread();
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            if (bdrv_dirty_bitmap_frozen(bitmap)) {
+                error_report("Dirty bitmap '%s' of device '%s' is in use "
+                             "by a backup job and cannot be migrated",
+                             bdrv_dirty_bitmap_name(bitmap),
+                             bdrv_get_device_name(bs));
+                ret = -EBUSY;
+            }
+        }
+    }
+    qemu_mutex_unlock_iothread();
+
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return ret;
+}
+
+/* Called with iothread lock taken.  */
+
+static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            if (bdrv_dirty_bitmap_frozen(bitmap)) {
+                error_report("Dirty bitmap '%s' of device '%s' is in use "
+                             "by a backup job and cannot be migrated",
+                             bdrv_dirty_bitmap_name(bitmap),
+                             bdrv_get_device_name(bs));
+                return -EBUSY;
+            }
+            send_bitmap(f, bs, bitmap);
+        }
+    }
+
+    qemu_put_be32(f, DIRTY_BITMAP_MIG_FLAG_EOS);
+    return qemu_file_get_error(f);
+}
+
+static int load_bitmap(QEMUFile *f)
+{
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+    Error *local_err = NULL;
+    char *device_name, *name = NULL;
+    uint32_t granularity;
+    bool persistent;
+    int64_t nb_sectors;
+    uint64_t chunk, sector, count, size;
+    uint8_t *buf;
+    int ret = -EINVAL;
+
+    device_name = get_string(f);
+    if (!device_name) {
+        error_report("Invalid dirty bitmap migration stream");
+        return -EINVAL;
+    }
+    name = get_string(f);
+    if (!name) {
+        error_report("Invalid dirty bitmap migration stream");
+        goto out;
+    }
+    granularity = qemu_get_be32(f);
+    persistent = qemu_get_byte(f);
+    nb_sectors = qemu_get_be64(f);
+
+    bs = bdrv_find(device_name);
+    if (!bs) {
+        error_report("Error unknown block device %s", device_name);
+        goto out;
+    }
+    if (bdrv_nb_sectors(bs) != nb_sectors) {
+        error_report("Dirty bitmap '%s' does not match the size of "
+                     "device '%s'", name, device_name);
+        goto out;
+    }
+
+    /* The incoming bitmap is newer than anything the destination has.  */
+    bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (bitmap) {
+        if (bdrv_dirty_bitmap_frozen(bitmap)) {
+            error_report("Dirty bitmap '%s' of device '%s' is in use",
+                         name, device_name);
+            goto out;
+        }
+        bdrv_release_dirty_bitmap(bs, bitmap);
+    }
+
+    bitmap = bdrv_create_dirty_bitmap(bs, granularity, name, &local_err);
+    if (!bitmap) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        goto out;
+    }
+    bdrv_dirty_bitmap_set_persistent(bitmap, persistent);
+    ret = 0;
+    if (nb_sectors == 0) {
+        goto out;
+    }
+
+    chunk = bdrv_dirty_bitmap_serialization_align(bitmap) *
+            DIRTY_BITMAP_MIG_CHUNK;
+    buf = g_malloc(bdrv_dirty_bitmap_serialization_size(bitmap, 0,
+                                                        MIN(chunk,
+                                                            nb_sectors)));
+    for (sector = 0; sector < nb_sectors; sector += count) {
+        count = MIN(nb_sectors - sector, chunk);
+        size = bdrv_dirty_bitmap_serialization_size(bitmap, sector, count);
+        qemu_get_buffer(f, buf, size);
+        bdrv_dirty_bitmap_deserialize_part(bitmap, buf, sector, count, false);
+    }
+    bdrv_dirty_bitmap_deserialize_finish(bitmap);
+    g_free(buf);
+
+out:
+    g_free(device_name);
+    g_free(name);
+    return ret;
+}
+
+static int dirty_bitmap_load(QEMUFile *f, void *opaque, int version_id)
+{
+    uint32_t flags;
+    int ret;
+
+    do {
+        flags = qemu_get_be32(f);
+        if (flags & DIRTY_BITMAP_MIG_FLAG_BITMAP) {
+            ret = load_bitmap(f);
+            if (ret < 0) {
+                return ret;
+            }
+        } else if (!(flags & DIRTY_BITMAP_MIG_FLAG_EOS)) {
+            error_report("Unknown dirty bitmap migration flags: %#x", flags);
+            return -EINVAL;
+        }
+        ret = qemu_file_get_error(f);
+        if (ret != 0) {
+            return ret;
+        }
+    } while (!(flags & DIRTY_BITMAP_MIG_FLAG_EOS));
+
+    return 0;
+}
+
+static bool dirty_bitmap_is_active(void *opaque)
+{
+    return migrate_dirty_bitmaps();
+}
+
+/* Once the destination owns the bitmaps, the source must not write its
+ * stale copies back to a shared image when it closes it.
+ */
+static void dirty_bitmap_mig_state_changed(Notifier *notifier, void *data)
+{
+    MigrationState *s = data;
+    BlockDriverState *bs;
+    BdrvDirtyBitmap *bitmap;
+
+    if (!migration_has_finished(s) || !migrate_dirty_bitmaps()) {
+        return;
+    }
+
+    for (bs = bdrv_next(NULL); bs; bs = bdrv_next(bs)) {
+        for (bitmap = bdrv_dirty_bitmap_next(bs, NULL); bitmap;
+             bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) {
+            bdrv_dirty_bitmap_set_persistent(bitmap, false);
+        }
+    }
+}
+
+static SaveVMHandlers savevm_dirty_bitmap_handlers = {
+    .save_live_setup = dirty_bitmap_save_setup,
+    .save_live_complete = dirty_bitmap_save_complete,
+    .load_state = dirty_bitmap_load,
+    .is_active = dirty_bitmap_is_active,
+};
+
+void dirty_bitmap_mig_init(void)
+{
+    register_savevm_live(NULL, "dirty-bitmap", 0, 1,
+                         &savevm_dirty_bitmap_handlers, NULL);
+
+    dirty_bitmap_mig_state_notifier.notify = dirty_bitmap_mig_state_changed;
+    add_migration_state_change_notifier(&dirty_bitmap_mig_state_notifier);
+}
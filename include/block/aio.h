@@ -47,6 +47,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -90,11 +91,47 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+    /* Set by aio_notify() together with the event notifier, so that
+     * aio_poll() can see it while busy-polling.
+     */
+    bool notified;
+
+    /* Adaptive polling: a blocking aio_poll() first spins on the handlers'
+     * io_poll callbacks for up to poll_ns nanoseconds.  poll_ns grows and
+     * shrinks between 0 and poll_max_ns depending on how long aio_poll()
+     * had to wait for events; a poll_max_ns of 0 disables polling.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;          /* growth factor, 0 selects the default */
+    int64_t poll_shrink;        /* shrink factor, 0 resets poll_ns to 0 */
+
+    /* Number of handlers that do not have an io_poll callback; polling is
+     * only done when this is zero.
+     */
+    int poll_disable_cnt;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* With many file descriptors, aio_poll() keeps them registered in an
+     * epoll file descriptor instead of passing all of them to ppoll() each
+     * time.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
 void aio_set_dispatching(AioContext *ctx, bool dispatching);
 
+/* Set up and tear down the parts of an AioContext that are specific to
+ * aio-posix.c or aio-win32.c.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -266,6 +303,38 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifier *notifier,
                             EventNotifierHandler *io_read);
 
+/* Register a poll callback for a file descriptor that already has handlers
+ * registered with aio_set_fd_handler, or remove it if @io_poll is NULL.  The
+ * callback goes away together with the handlers.
+ *
+ * While polling, aio_poll() calls @io_poll repeatedly with the opaque of the
+ * handlers instead of waiting for the file descriptor to become ready.  It
+ * must be cheap (e.g. look at a ring index in shared memory) and, if there
+ * is work to do, process it and return true.  Polling is only done when all
+ * the handlers in the AioContext have a poll callback.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Like aio_set_fd_poll, for an event notifier registered with
+ * aio_set_event_notifier.  @io_poll is passed the EventNotifier.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds; 0 disables polling
+ * @grow: factor by which to increase the polling time, 0 for the default
+ * @shrink: factor by which to decrease the polling time, 0 to stop polling
+ *
+ * Configure adaptive polling for @ctx.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -157,6 +157,24 @@ struct BlockDriver {
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum);
 
+    /*
+     * Copy data without passing it through QEMU; both may be NULL.
+     *
+     * .bdrv_co_copy_range_from() is called on the source: a format driver
+     * forwards to the node that holds the data with
+     * bdrv_co_copy_range_from(), a protocol driver hands over to the
+     * destination with bdrv_co_copy_range_to().  .bdrv_co_copy_range_to()
+     * is then called on each node of the destination in the same way; the
+     * protocol driver at the bottom does the copy from the protocol node
+     * @src, or returns -ENOTSUP if it cannot.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        int64_t sector_num, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors);
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BlockDriverState *src, int64_t src_sector, int64_t sector_num,
+        int nb_sectors);
+
     /*
      * Invalidate any cached meta-data.
      */
@@ -184,6 +202,14 @@ struct BlockDriver {
 
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /*
+     * Same as bdrv_write_compressed, for callers in coroutine context;
+     * it must be safe to run concurrently with other requests.
+     */
+    int coroutine_fn (*bdrv_co_write_compressed)(BlockDriverState *bs,
+                                                 int64_t sector_num,
+                                                 const uint8_t *buf,
+                                                 int nb_sectors);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -252,6 +278,12 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /*
+     * Returns true if the driver stores the persistent dirty bitmaps of
+     * @bs in the image when it is closed, and loads them when it is opened.
+     */
+    bool (*bdrv_can_store_dirty_bitmap)(BlockDriverState *bs);
+
     /* Remove fd handlers, timers, and other event loop callbacks so the event
      * loop is no longer in use.  Called with no in-flight requests and in
      * depth-first traversal order with parents before child nodes.
@@ -354,10 +386,18 @@ struct BlockDriverState {
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
-    /* I/O throttling */
-    ThrottleState throttle_state;
-    CoQueue      throttled_reqs[2];
-    bool         io_limits_enabled;
+    /* I/O throttling.
+     * throttle_state tells us if this BDS has I/O limits configured.
+     * io_limits_enabled tells us if they are currently being
+     * enforced, but it can be temporarily set to false */
+    CoQueue        throttled_reqs[2];
+    bool           io_limits_enabled;
+    /* The following fields are protected by the ThrottleGroup lock.
+     * See the ThrottleGroup documentation for details. */
+    ThrottleState *throttle_state;
+    ThrottleTimers throttle_timers;
+    unsigned       pending_reqs[2];
+    QLIST_ENTRY(BlockDriverState) round_robin;
 
     /* I/O stats (display with "info blockstats"). */
     BlockAcctStats stats;
@@ -427,6 +467,24 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_co_copy_range_from:
+ * bdrv_co_copy_range_to:
+ *
+ * Recurse into the source and destination side of bdrv_co_copy_range(),
+ * for use by the .bdrv_co_copy_range_from() and .bdrv_co_copy_range_to()
+ * callbacks.  The destination side runs before write notifiers and marks
+ * the copied sectors dirty, like a write.
+ */
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+                                         int64_t src_sector,
+                                         BlockDriverState *dst,
+                                         int64_t dst_sector, int nb_sectors);
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+                                       int64_t src_sector,
+                                       BlockDriverState *dst,
+                                       int64_t dst_sector, int nb_sectors);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -572,6 +630,9 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @target: Block device to write to.
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
+ * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @max_workers: The maximum number of copy requests in flight.
+ * @max_chunk: The maximum size of one copy request, in bytes.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -582,6 +643,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *sync_bitmap,
+                  int64_t max_workers, int64_t max_chunk,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb, void *opaque,
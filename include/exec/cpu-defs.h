@@ -29,6 +29,7 @@
 #include "qemu/queue.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+#include "tcg-target.h"
 #endif
 
 #ifndef TARGET_LONG_BITS
@@ -59,6 +60,8 @@ typedef uint64_t target_ulong;
 #define EXCP_DEBUG      0x10002 /* cpu stopped after a breakpoint or singlestep */
 #define EXCP_HALTED     0x10003 /* cpu is halted (waiting for external event) */
 #define EXCP_YIELD      0x10004 /* cpu wants to yield timeslice to another */
+#define EXCP_ATOMIC     0x10005 /* atomic operation to run with the other
+                                   cpus stopped */
 
 /* Only the bottom TB_JMP_PAGE_BITS of the jump cache hash bits vary for
    addresses on the same page.  The top bits are the same.  This allows
@@ -69,8 +72,17 @@ typedef uint64_t target_ulong;
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
 #if !defined(CONFIG_USER_ONLY)
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* The TLB of each MMU mode is allocated on the heap, and reallocated
+   when it is flushed, between these sizes, depending on how much of it
+   was used.  */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+#define CPU_TLB_DYN_MAX_BITS 12
+#else
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif
 /* use a fully associative victim tlb of 8 entries */
 #define CPU_VTLB_SIZE 8
 
@@ -102,15 +114,46 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* One per MMU mode, hanging off CPUState so that it survives the
+   target's reset of env.  */
+typedef struct CPUTLBDesc {
+    /* (number of entries - 1) << CPU_TLB_ENTRY_BITS */
+    uintptr_t mask;
+    CPUTLBEntry *table;
+    hwaddr *iotlb;
+    /* Largest number of entries used between two flushes, since
+       window_begin_ns; the next flush sizes the TLB after it.  */
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+/* Copies of CPUTLBDesc's mask, table and iotlb, at a fixed offset from
+   env for the TCG backend.  A reset clears them; tlb_flush sets them
+   again.  */
+#define CPU_COMMON_TLB_TABLES                                           \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    hwaddr *iotlb[NB_MMU_MODES];
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                           \
     hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                        \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
     target_ulong vtlb_index;                                            \
+    /* Statistics for "info jit".  After the tables, so as not to move  \
+       them away from env for the TCG backends.  */                     \
+    uint64_t tlb_miss_count;                                            \
+    uint64_t tlb_fill_count;                                            \
 
 #else
 
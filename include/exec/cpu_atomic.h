@@ -0,0 +1,112 @@
+/*
+ *  Atomic read-modify-write of guest memory
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CPU_ATOMIC_H
+#define CPU_ATOMIC_H
+
+#include "qemu/atomic.h"
+
+/* Internal to cputlb.c and user-exec.c, which implement cpu_atomic_*()
+   on top of these for the system and user emulators respectively.  */
+
+/* Values are passed and returned in host order, memory holds them in
+   target order.  The bitwise operations do not care, but when the two
+   orders differ an addition cannot be done by the host directly on
+   memory, so fetch-and-add becomes a compare-and-swap loop.  */
+#define CPU_ATOMIC_HOST_OP(TYPE, SWAP)                                  \
+static inline TYPE cpu_atomic_host_##TYPE(TYPE *p, CPUAtomicOp op,      \
+                                          TYPE cmpv, TYPE val)          \
+{                                                                       \
+    TYPE old, cur;                                                      \
+                                                                        \
+    switch (op) {                                                       \
+    case CPU_ATOMIC_CMPXCHG:                                            \
+        return SWAP(atomic_cmpxchg(p, SWAP(cmpv), SWAP(val)));          \
+    case CPU_ATOMIC_XCHG:                                               \
+        return SWAP(atomic_xchg(p, SWAP(val)));                         \
+    case CPU_ATOMIC_FETCH_AND:                                          \
+        return SWAP(atomic_fetch_and(p, SWAP(val)));                    \
+    case CPU_ATOMIC_FETCH_OR:                                           \
+        return SWAP(atomic_fetch_or(p, SWAP(val)));                     \
+    case CPU_ATOMIC_FETCH_XOR:                                          \
+        return SWAP(atomic_fetch_xor(p, SWAP(val)));                    \
+    case CPU_ATOMIC_FETCH_ADD:                                          \
+        if (SWAP((TYPE)1) == 1) {                                       \
+            return atomic_fetch_add(p, val);                            \
+        }                                                               \
+        cur = atomic_read(p);                                           \
+        do {                                                            \
+            old = cur;                                                  \
+            cur = atomic_cmpxchg(p, old, SWAP((TYPE)(SWAP(old) + val))); \
+        } while (cur != old);                                           \
+        return SWAP(old);                                               \
+    default:                                                            \
+        abort();                                                        \
+    }                                                                   \
+}
+
+#define cpu_atomic_noswap(x) (x)
+
+CPU_ATOMIC_HOST_OP(uint8_t, cpu_atomic_noswap)
+CPU_ATOMIC_HOST_OP(uint16_t, tswap16)
+CPU_ATOMIC_HOST_OP(uint32_t, tswap32)
+CPU_ATOMIC_HOST_OP(uint64_t, tswap64)
+
+#undef cpu_atomic_noswap
+#undef CPU_ATOMIC_HOST_OP
+
+/* Do OP on the naturally aligned SIZE bytes at host address HADDR.  */
+static inline uint64_t cpu_atomic_host_op(uintptr_t haddr, CPUAtomicOp op,
+                                          uint64_t cmpv, uint64_t val,
+                                          int size)
+{
+    switch (size) {
+    case 1:
+        return cpu_atomic_host_uint8_t((uint8_t *)haddr, op, cmpv, val);
+    case 2:
+        return cpu_atomic_host_uint16_t((uint16_t *)haddr, op, cmpv, val);
+    case 4:
+        return cpu_atomic_host_uint32_t((uint32_t *)haddr, op, cmpv, val);
+    case 8:
+        return cpu_atomic_host_uint64_t((uint64_t *)haddr, op, cmpv, val);
+    default:
+        abort();
+    }
+}
+
+/* The value that OP leaves in memory when it finds OLD there.  */
+static inline uint64_t cpu_atomic_new_value(CPUAtomicOp op, uint64_t old,
+                                            uint64_t cmpv, uint64_t val)
+{
+    switch (op) {
+    case CPU_ATOMIC_CMPXCHG:
+        return old == cmpv ? val : old;
+    case CPU_ATOMIC_XCHG:
+        return val;
+    case CPU_ATOMIC_FETCH_ADD:
+        return old + val;
+    case CPU_ATOMIC_FETCH_AND:
+        return old & val;
+    case CPU_ATOMIC_FETCH_OR:
+        return old | val;
+    case CPU_ATOMIC_FETCH_XOR:
+        return old ^ val;
+    default:
+        abort();
+    }
+}
+
+#endif
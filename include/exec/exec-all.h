@@ -21,6 +21,10 @@
 #define _EXEC_ALL_H_
 
 #include "qemu-common.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/qht.h"
+#include "qemu/xxhash.h"
 
 /* allow to see translation results - the slowdown should be negligible, so we leave it */
 #define DEBUG_DISAS
@@ -98,11 +102,14 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
 #if !defined(CONFIG_USER_ONLY)
 void tcg_cpu_address_space_init(CPUState *cpu, AddressSpace *as);
 /* cputlb.c */
+void tlb_init(CPUState *cpu);
 void tlb_flush_page(CPUState *cpu, target_ulong addr);
 void tlb_flush(CPUState *cpu, int flush_global);
 void tlb_set_page(CPUState *cpu, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
+void tlb_probe_rmw(CPUArchState *env, target_ulong addr, int mmu_idx,
+                   uintptr_t retaddr);
 void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr);
 #else
 static inline void tlb_flush_page(CPUState *cpu, target_ulong addr)
@@ -114,10 +121,28 @@ static inline void tlb_flush(CPUState *cpu, int flush_global)
 }
 #endif
 
+/* cputlb.c, user-exec.c */
+typedef enum CPUAtomicOp {
+    CPU_ATOMIC_CMPXCHG,
+    CPU_ATOMIC_XCHG,
+    CPU_ATOMIC_FETCH_ADD,
+    CPU_ATOMIC_FETCH_AND,
+    CPU_ATOMIC_FETCH_OR,
+    CPU_ATOMIC_FETCH_XOR,
+} CPUAtomicOp;
+
+uint64_t cpu_atomic_cmpxchg(CPUArchState *env, target_ulong addr,
+                            uint64_t cmpv, uint64_t newv, int size,
+                            int mmu_idx, uintptr_t retaddr);
+uint64_t cpu_atomic_rmw(CPUArchState *env, target_ulong addr,
+                        CPUAtomicOp op, uint64_t val, int size,
+                        int mmu_idx, uintptr_t retaddr);
+
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
-#define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+/* initial number of entries of the TB hash table; it grows on demand */
+#define CODE_GEN_HTABLE_BITS     15
+#define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -142,13 +167,13 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_PROFILE     0x10000 /* Count executions to find hot TBs.  */
+#define CF_TIER2       0x20000 /* Retranslation of a hot TB.  */
 
     void *tc_ptr;    /* pointer to the translated code */
-    /* next matching tb for physical address. */
-    struct TranslationBlock *phys_hash_next;
     /* first and second physical page containing code. The lower bit
        of the pointer tells the index in page_next[] */
     struct TranslationBlock *page_next[2];
@@ -169,23 +194,51 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* set when the TB is removed from the hash tables, so that vCPUs that
+       still find it in their jump cache do not chain to it */
+    bool invalid;
+    /* the code embeds host pointers that may change from run to run, so
+       the persistent translation cache does not save it */
+    bool host_ptrs;
+    /* number of executions, for CF_PROFILE TBs; updated without any
+       synchronization, so it is only an estimate with several vCPUs */
+    uint32_t exec_count;
 };
 
-#include "exec/spinlock.h"
-
 typedef struct TBContext TBContext;
 
+/* The code buffer and tbs[] are split into regions that are filled in
+   turn; when all are full, the oldest one is emptied and reused.  */
+#define TB_MAX_REGIONS 8
+
+typedef struct TBRegion {
+    TranslationBlock *tbs;      /* this region's slice of tbs[] */
+    int nb_tbs;
+    void *code_start;
+    void *code_max;             /* no TB may start past this point */
+    void *code_end;             /* end of the code, once no longer current */
+} TBRegion;
+
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-    int nb_tbs;
-    /* any access to the tbs or the page table must use this lock */
-    spinlock_t tb_lock;
+    /* TBs by physical address, looked up without tb_lock */
+    QHT htable;
+    int nb_tbs;                 /* in all regions */
+    TBRegion regions[TB_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    size_t region_size;
+    int region_max_blocks;
+    /* any access to the tbs or the page table must use this lock,
+       see tb_lock() */
+    QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_recycle_count;
     int tb_phys_invalidate_count;
+    int tb_tier2_count;
 
     int tb_invalidated_flag;
 };
@@ -205,13 +258,19 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint32_t flags, target_ulong cs_base)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t cs = cs_base;
+
+    return qemu_xxhash6(phys_pc, pc, flags, cs ^ (cs >> 32));
 }
 
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
 #if defined(USE_DIRECT_JUMP)
@@ -229,8 +288,9 @@ void ppc_tb_set_jmp_target(uintptr_t jmp_addr, uintptr_t addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
-    /* patch the branch destination */
-    stl_le_p((void*)jmp_addr, addr - (jmp_addr + 4));
+    /* patch the branch destination; the displacement is 4-byte aligned
+       (see tcg_out_op), so vCPUs running the code see either jump */
+    atomic_set((uint32_t *)jmp_addr, addr - (jmp_addr + 4));
     /* no need to flush icache explicitly */
 }
 #elif defined(__s390x__)
@@ -359,6 +419,24 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr);
 /* vl.c */
 extern int singlestep;
 
+/* translate-all.c */
+/* Executions after which a CF_PROFILE TB is retranslated with CF_TIER2,
+   0 if TBs are not profiled.  */
+#define TB_HOT_THRESHOLD 1000
+extern unsigned int tb_hot_threshold;
+#if defined(CONFIG_USER_ONLY)
+/* Persistent translation cache; @key identifies everything translation
+   depends on besides the addresses that the cache file checks itself.  */
+bool tb_cache_load(const char *path, const char *key);
+void tb_cache_save(const char *path, const char *key);
+
+/* user-exec.c */
+/* Set by helpers that access guest memory directly to the GETPC() of
+   their caller, so that a fault can be attributed to the guest insn.  */
+DECLARE_TLS(uintptr_t, helper_retaddr);
+#define helper_retaddr tls_var(helper_retaddr)
+#endif
+
 /* cpu-exec.c */
 extern volatile sig_atomic_t exit_request;
 
@@ -9,7 +9,7 @@ static TCGArg *icount_arg;
 static int icount_label;
 static int exitreq_label;
 
-static inline void gen_tb_start(void)
+static inline void gen_tb_start(TranslationBlock *tb)
 {
     TCGv_i32 count;
     TCGv_i32 flag;
@@ -21,6 +21,21 @@ static inline void gen_tb_start(void)
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
 
+    if (tb->cflags & CF_PROFILE) {
+        /* Count executions; once the TB is hot, leave it before it starts
+           so that the main loop retranslates it.  */
+        TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+
+        count = tcg_temp_new_i32();
+        tcg_gen_ld_i32(count, ptr, 0);
+        tcg_gen_addi_i32(count, count, 1);
+        tcg_gen_st_i32(count, ptr, 0);
+        tcg_gen_brcondi_i32(TCG_COND_GEU, count, tb_hot_threshold,
+                            exitreq_label);
+        tcg_temp_free_i32(count);
+        tcg_temp_free_ptr(ptr);
+    }
+
     if (!use_icount)
         return;
 
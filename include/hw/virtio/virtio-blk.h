@@ -41,6 +41,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -58,6 +59,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -114,6 +117,7 @@ struct VirtIOBlkConf
     uint32_t scsi;
     uint32_t config_wce;
     uint32_t data_plane;
+    uint32_t num_queues;
 };
 
 struct VirtIOBlockDataPlane;
@@ -122,7 +126,6 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockDriverState *bs;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     BlockConf *conf;
@@ -143,6 +146,7 @@ typedef struct MultiReqBuffer {
 
 typedef struct VirtIOBlockReq {
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
@@ -151,7 +155,7 @@ typedef struct VirtIOBlockReq {
     BlockAcctCookie acct;
 } VirtIOBlockReq;
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s);
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq);
 
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
@@ -0,0 +1,14 @@
+/*
+ * QEMU dirty bitmap migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef DIRTY_BITMAP_MIGRATION_H
+#define DIRTY_BITMAP_MIGRATION_H
+
+void dirty_bitmap_mig_init(void);
+
+#endif /* DIRTY_BITMAP_MIGRATION_H */
@@ -18,6 +18,7 @@
 #include "qemu-common.h"
 #include "qemu/thread.h"
 #include "qemu/notify.h"
+#include "qemu/queue.h"
 #include "qapi/error.h"
 #include "migration/vmstate.h"
 #include "qapi-types.h"
@@ -33,12 +34,95 @@
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x08
+
+/* Commands sent in QEMU_VM_COMMAND sections */
+enum qemu_vm_cmd {
+    MIG_CMD_INVALID = 0,       /* Must be 0 */
+    MIG_CMD_OPEN_RETURN_PATH,  /* Tell the dest to open the return path */
+    MIG_CMD_POSTCOPY_ADVISE,   /* We might switch to postcopy later */
+    MIG_CMD_POSTCOPY_LISTEN,   /* Start serving page faults */
+    MIG_CMD_POSTCOPY_RUN,      /* Start execution on the destination */
+    MIG_CMD_POSTCOPY_RAM_DISCARD, /* A list of pages to drop on the dest */
+    MIG_CMD_PACKAGED,          /* A wrapped stream within this stream */
+    MIG_CMD_MAX
+};
+
+/* Upper bound of the data wrapped by MIG_CMD_PACKAGED */
+#define MAX_VM_CMD_PACKAGED_SIZE (1ul << 24)
+
+/* Messages sent on the return path from destination to source */
+enum mig_rp_message_type {
+    MIG_RP_MSG_INVALID = 0,  /* Must be 0 */
+    MIG_RP_MSG_SHUT,         /* sibling will not send any more RP messages */
+    MIG_RP_MSG_REQ_PAGES_ID, /* data (start: be64, len: be32, id: string) */
+    MIG_RP_MSG_REQ_PAGES,    /* data (start: be64, len: be32) */
+    MIG_RP_MSG_MAX
+};
+
+/* Postcopy progress on the destination */
+typedef enum {
+    POSTCOPY_INCOMING_NONE = 0,  /* Initial state - no postcopy */
+    POSTCOPY_INCOMING_ADVISE,
+    POSTCOPY_INCOMING_DISCARD,
+    POSTCOPY_INCOMING_LISTENING,
+    POSTCOPY_INCOMING_RUNNING,
+    POSTCOPY_INCOMING_END
+} PostcopyState;
 
 struct MigrationParams {
     bool blk;
     bool shared;
 };
 
+typedef struct LoadStateEntry LoadStateEntry;
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateEntry_Head;
+
+/* State of the incoming migration */
+typedef struct MigrationIncomingState {
+    QEMUFile *from_src_file;
+
+    /*
+     * The return path; written by the postcopy fault thread and the
+     * thread loading the stream, so writes are serialized by rp_mutex.
+     */
+    QEMUFile *to_src_file;
+    QemuMutex rp_mutex;
+
+    PostcopyState postcopy_state;
+
+    /* Postcopy page fault handling, see postcopy-ram.c */
+    bool have_fault_thread;
+    QemuThread fault_thread;
+    int userfault_fd;
+    int userfault_quit_fd;
+    void *postcopy_tmp_page;
+
+    /* Set once the listen thread owns from_src_file */
+    bool have_listen_thread;
+    QemuThread listen_thread;
+
+    LoadStateEntry_Head loadvm_handlers;
+} MigrationIncomingState;
+
+MigrationIncomingState *migration_incoming_get_current(void);
+MigrationIncomingState *migration_incoming_state_new(QEMUFile *f);
+void migration_incoming_state_destroy(void);
+
+PostcopyState postcopy_state_get(MigrationIncomingState *mis);
+/* Set the state and return the old state */
+PostcopyState postcopy_state_set(MigrationIncomingState *mis,
+                                 PostcopyState new_state);
+
+/* A page the destination asked for, see ram_save_queue_pages() */
+typedef struct MigrationSrcPageRequest {
+    char *rbname;
+    ram_addr_t offset;
+    ram_addr_t len;
+
+    QSIMPLEQ_ENTRY(MigrationSrcPageRequest) next_req;
+} MigrationSrcPageRequest;
+
 typedef struct MigrationState MigrationState;
 
 struct MigrationState
@@ -59,13 +143,45 @@ struct MigrationState
     int64_t dirty_pages_rate;
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
     int64_t dirty_sync_count;
+
+    /* Set by migrate-start-postcopy */
+    bool start_postcopy;
+    /* Set once the device state has been sent for postcopy */
+    bool postcopy_after_devices;
+
+    /* State of the return path from the destination */
+    struct {
+        QEMUFile *from_dst_file;
+        QemuThread rp_thread;
+        bool error;
+    } rp_state;
+
+    /* Pages requested by the destination, sent ahead of the others */
+    QemuMutex src_page_req_mutex;
+    QSIMPLEQ_HEAD(src_page_requests, MigrationSrcPageRequest) src_page_requests;
+    /* The RAMBlock used in the last page request */
+    char *last_req_rbname;
+
+    /* Where the multifd channels connect to, see migrate_multifd_connect */
+    char *multifd_uri;
 };
 
 void process_incoming_migration(QEMUFile *f);
 
+void migrate_compress_threads_create(void);
+void migrate_compress_threads_join(void);
+void migrate_decompress_threads_create(void);
+void migrate_decompress_threads_join(void);
+void migrate_multifd_send_threads_create(void);
+void migrate_multifd_send_threads_join(bool failed);
+void migrate_multifd_recv_threads_create(int listen_fd);
+void migrate_multifd_recv_threads_join(void);
+int migrate_multifd_connect(MigrationState *s, Error **errp);
+
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
@@ -105,6 +221,7 @@ void remove_migration_state_change_notifier(Notifier *notify);
 bool migration_in_setup(MigrationState *);
 bool migration_has_finished(MigrationState *);
 bool migration_has_failed(MigrationState *);
+bool migration_in_postcopy(MigrationState *);
 MigrationState *migrate_get_current(void);
 
 uint64_t ram_bytes_remaining(void);
@@ -124,6 +241,8 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_pages_cache_evictions(void);
 double xbzrle_mig_cache_miss_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
@@ -144,8 +263,10 @@ void migrate_del_blocker(Error *reason);
 
 bool migrate_rdma_pin_all(void);
 bool migrate_zero_blocks(void);
+bool migrate_dirty_bitmaps(void);
 
 bool migrate_auto_converge(void);
+bool migrate_postcopy_ram(void);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
@@ -154,6 +275,14 @@ int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+
+bool migrate_use_multifd(void);
+int migrate_multifd_channels(void);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 
 void ram_control_before_iterate(QEMUFile *f, uint64_t flags);
@@ -174,4 +303,25 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
                              ram_addr_t offset, size_t size,
                              int *bytes_sent);
 
+/* Postcopy: source side */
+int ram_postcopy_send_discard_bitmap(MigrationState *ms);
+int ram_save_queue_pages(MigrationState *ms, const char *rbname,
+                         ram_addr_t start, ram_addr_t len);
+void flush_page_queue(MigrationState *ms);
+
+/* Postcopy: return path messages from the destination */
+void migrate_send_rp_shut(MigrationIncomingState *mis, uint32_t value);
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len);
+
+void qemu_savevm_send_open_return_path(QEMUFile *f);
+void qemu_savevm_send_postcopy_advise(QEMUFile *f);
+void qemu_savevm_send_postcopy_listen(QEMUFile *f);
+void qemu_savevm_send_postcopy_run(QEMUFile *f);
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list);
+int qemu_savevm_send_packaged(QEMUFile *f, const GByteArray *pkg);
+
 #endif
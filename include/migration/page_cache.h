@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -37,7 +37,8 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached; a hit protects
+ * the page from the next eviction in its set
  *
  * Returns %true if page is cached
  *
@@ -60,7 +61,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
  * cache_insert: insert the page into the cache. the page cache
  * will dup the data on insert. the previous value will be overwritten
  *
- * Returns -1 on error
+ * Returns -1 on error, 1 if another page was evicted to make room, 0
+ * otherwise
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -82,6 +82,19 @@ typedef size_t (QEMURamSaveFunc)(QEMUFile *f, void *opaque,
                                size_t size,
                                int *bytes_sent);
 
+/*
+ * Return a QEMUFile for comms in the opposite direction
+ */
+typedef QEMUFile *(QEMUFileGetReturnPathFunc)(void *opaque);
+
+/*
+ * Stop any read or write (depending on flags) on the underlying
+ * transport on the QEMUFile.
+ * Existing blocking reads/writes must be woken
+ * Returns 0 on success, -err on error
+ */
+typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
+
 typedef struct QEMUFileOps {
     QEMUFilePutBufferFunc *put_buffer;
     QEMUFileGetBufferFunc *get_buffer;
@@ -92,6 +105,8 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *after_ram_iterate;
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
+    QEMUFileGetReturnPathFunc *get_return_path;
+    QEMUFileShutdownFunc *shut_down;
 } QEMUFileOps;
 
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops);
@@ -110,6 +125,21 @@ void qemu_put_byte(QEMUFile *f, int v);
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 bool qemu_file_mode_is_not_valid(const char *mode);
+/*
+ * Memory-only QEMUFile: data written to it stays in its buffer until it
+ * is copied into another file with qemu_put_qemu_file().
+ */
+QEMUFile *qemu_fopen_buffer(void);
+ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
+                                  int level);
+int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src);
+/*
+ * QEMUFile on top of a GByteArray owned by the caller: writes append to
+ * @buf, reads start at its beginning.
+ */
+QEMUFile *qemu_bufopen(const char *mode, GByteArray *buf);
+QEMUFile *qemu_file_get_return_path(QEMUFile *f);
+int qemu_file_shutdown(QEMUFile *f);
 
 static inline void qemu_put_ubyte(QEMUFile *f, unsigned int v)
 {
@@ -132,6 +162,7 @@ int qemu_peek_byte(QEMUFile *f, int offset);
 int qemu_get_byte(QEMUFile *f);
 void qemu_file_skip(QEMUFile *f, int size);
 void qemu_update_position(QEMUFile *f, size_t size);
+void qemu_file_update_transfer(QEMUFile *f, int64_t len);
 
 static inline unsigned int qemu_get_ubyte(QEMUFile *f)
 {
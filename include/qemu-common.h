@@ -106,6 +106,7 @@ static inline char *realpath(const char *path, char *resolved_path)
 #endif
 
 void cpu_ticks_init(void);
+void qemu_tcg_configure(QemuOpts *opts, Error **errp);
 
 /* icount */
 void configure_icount(QemuOpts *opts, Error **errp);
@@ -288,6 +289,7 @@ struct qemu_work_item {
     void *data;
     int done;
     bool free;
+    bool exclusive;
 };
 
 
@@ -468,6 +470,24 @@ can_use_buffer_find_nonzero_offset(const void *buf, size_t len)
 }
 size_t buffer_find_nonzero_offset(const void *buf, size_t len);
 
+/*
+ * Implementations of buffer_find_nonzero_offset() and of the scan loops of
+ * xbzrle_encode_buffer(), from the slowest to the fastest.  The fastest one
+ * the host can run is picked at startup; tests and benchmarks can switch
+ * to another one with buffer_accel_set().
+ */
+typedef enum BufferAccel {
+    BUFFER_ACCEL_NONE,      /* one unsigned long at a time */
+    BUFFER_ACCEL_VECTOR,    /* VECTYPE: SSE2, Altivec or unsigned long */
+    BUFFER_ACCEL_AVX2,
+    BUFFER_ACCEL__MAX,
+} BufferAccel;
+
+BufferAccel buffer_accel_get(void);
+/* Returns false, and changes nothing, if the host can't run @accel */
+bool buffer_accel_set(BufferAccel accel);
+const char *buffer_accel_name(BufferAccel accel);
+
 /*
  * helper to parse debug environment variables
  */
@@ -0,0 +1,58 @@
+/*
+ * Host CPU feature detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUID_H
+#define QEMU_CPUID_H
+
+#ifdef CONFIG_CPUID_H
+#include <cpuid.h>
+
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX     (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2    (1 << 5)
+#endif
+
+/*
+ * True if the host can run AVX2 code: the CPU must have it, and the OS
+ * must save the YMM registers on context switches.
+ */
+static inline bool host_cpu_has_avx2(void)
+{
+    unsigned int a, b, c, d;
+    unsigned int xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+
+    /* XCR0 bits 1 and 2: SSE and AVX state */
+    asm("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+    return (b & bit_AVX2) != 0;
+}
+#else
+static inline bool host_cpu_has_avx2(void)
+{
+    return false;
+}
+#endif
+
+#endif
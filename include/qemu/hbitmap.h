@@ -108,6 +108,85 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
  */
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * hbitmap_reset_all:
+ * @hb: HBitmap to operate on.
+ *
+ * Reset all bits in an HBitmap.
+ */
+void hbitmap_reset_all(HBitmap *hb);
+
+/**
+ * hbitmap_merge:
+ * @a: The bitmap to store the result in.
+ * @b: The bitmap to merge into @a.
+ *
+ * Set in @a every bit that is set in @b.  Return false, leaving @a
+ * untouched, if the two bitmaps differ in size or granularity.
+ */
+bool hbitmap_merge(HBitmap *a, const HBitmap *b);
+
+/**
+ * hbitmap_serialization_granularity:
+ * @hb: HBitmap to operate on.
+ *
+ * Return the alignment, in items, of the ranges passed to
+ * hbitmap_serialize_part and hbitmap_deserialize_part.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb);
+
+/**
+ * hbitmap_serialization_size:
+ * @hb: HBitmap to operate on.
+ * @start: First item of the range (0-based).
+ * @count: Number of items in the range.
+ *
+ * Return the number of bytes hbitmap_serialize_part needs to store
+ * the given range of @hb.
+ */
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_serialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store the serialized data in.
+ * @start: First item to store (0-based).
+ * @count: Number of items to store.
+ *
+ * Store the bits covering a range of items of @hb in @buf, one bit per
+ * group of 2^granularity items, least significant bit first.  The
+ * format does not depend on the host.  @start must be a multiple of
+ * hbitmap_serialization_granularity, and so must @count unless the range
+ * extends to the end of the bitmap.
+ */
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize_part:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer holding data written by hbitmap_serialize_part.
+ * @start: First item to restore (0-based).
+ * @count: Number of items to restore.
+ * @finish: Whether to call hbitmap_deserialize_finish.
+ *
+ * Overwrite a range of @hb with the contents of @buf.  Only the bottom
+ * level is touched, so the bitmap must not be used until
+ * hbitmap_deserialize_finish has been called.
+ */
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish);
+
+/**
+ * hbitmap_deserialize_finish:
+ * @hb: HBitmap to operate on.
+ *
+ * Rebuild the upper levels and the count of @hb after its bottom level
+ * was filled by hbitmap_deserialize_part.
+ */
+void hbitmap_deserialize_finish(HBitmap *hb);
+
 /**
  * hbitmap_get:
  * @hb: HBitmap to operate on.
@@ -269,6 +269,19 @@ int qemu_set_fd_handler(int fd,
 int qemu_add_child_watch(pid_t pid);
 #endif
 
+/**
+ * qemu_mutex_iothread_locked: Return lock status of the main loop mutex.
+ *
+ * The main loop mutex is the coarsest lock in QEMU, and as such it
+ * must always be taken outside other locks.  This function helps
+ * functions take different paths depending on whether the current
+ * thread is running within the main loop mutex.
+ *
+ * NOTE: tools currently are single-threaded and qemu_mutex_iothread_locked
+ * always returns true there.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /**
  * qemu_mutex_lock_iothread: Lock the main loop mutex.
  *
@@ -0,0 +1,152 @@
+/*
+ * QHT: concurrent hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_QHT_H
+#define QEMU_QHT_H 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "qemu/thread.h"
+
+typedef struct QHT QHT;
+typedef struct QHTMap QHTMap;
+typedef struct QHTStats QHTStats;
+
+/* Grow the table when its chains get long */
+#define QHT_MODE_AUTO_RESIZE 0x1
+
+struct QHT {
+    QHTMap *map;
+    QemuMutex lock;         /* serializes writers */
+    QHTMap *retired;        /* maps replaced by a resize */
+    unsigned int mode;
+    unsigned int resizes;
+};
+
+struct QHTStats {
+    size_t head_buckets;
+    size_t used_head_buckets;
+    size_t entries;
+    size_t max_chain;       /* longest chain, in buckets */
+    double avg_chain;       /* average chain of the used head buckets */
+    double lookup_cost;     /* buckets visited to find an entry, on average */
+    double occupancy;       /* fraction of the slots in use */
+    unsigned int resizes;
+};
+
+/**
+ * QHTCompareFunc:
+ * @obj: an entry whose hash matches the one looked up
+ * @userp: the pointer passed to qht_lookup()
+ *
+ * Returns: true if @obj is the entry looked up.  The function may run
+ * concurrently with writers, and on entries that are being removed.
+ */
+typedef bool (*QHTCompareFunc)(const void *obj, const void *userp);
+typedef void (*QHTIterFunc)(QHT *ht, void *p, uint32_t hash, void *userp);
+
+/**
+ * qht_init:
+ * @ht: the table to initialize
+ * @n_elems: number of entries the table is sized for
+ * @mode: QHT_MODE_* flags
+ */
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode);
+
+/**
+ * qht_destroy:
+ * @ht: the table to destroy
+ *
+ * Frees the table's memory; the entries themselves are not touched.
+ */
+void qht_destroy(QHT *ht);
+
+/**
+ * qht_insert:
+ * @ht: the table
+ * @p: the entry to insert, not NULL
+ * @hash: the hash of @p
+ *
+ * Returns: true on success, false if @p already was in the table.
+ */
+bool qht_insert(QHT *ht, void *p, uint32_t hash);
+
+/**
+ * qht_lookup:
+ * @ht: the table
+ * @func: the function that recognizes the entry looked up
+ * @userp: passed to @func
+ * @hash: the hash of the entry looked up
+ *
+ * Lookups never take a lock and can run concurrently with insertions,
+ * removals and resizes.  A lookup that races with an insertion may miss
+ * the new entry, and one that races with a removal may still return the
+ * old one.
+ *
+ * Returns: the entry, or NULL if it was not found.
+ */
+void *qht_lookup(QHT *ht, QHTCompareFunc func, const void *userp,
+                 uint32_t hash);
+
+/**
+ * qht_remove:
+ * @ht: the table
+ * @p: the entry to remove
+ * @hash: the hash of @p
+ *
+ * Returns: true on success, false if @p was not in the table.
+ */
+bool qht_remove(QHT *ht, const void *p, uint32_t hash);
+
+/**
+ * qht_reset:
+ * @ht: the table
+ *
+ * Removes all the entries.  Unlike qht_reset_size(), this is safe against
+ * concurrent lookups.
+ */
+void qht_reset(QHT *ht);
+
+/**
+ * qht_reset_size:
+ * @ht: the table
+ * @n_elems: number of entries the emptied table is sized for, 0 to keep
+ * the current size
+ *
+ * Removes all the entries.  This also frees the maps that were replaced
+ * by resizes, so it must not run concurrently with qht_lookup().
+ */
+void qht_reset_size(QHT *ht, size_t n_elems);
+
+/**
+ * qht_resize:
+ * @ht: the table
+ * @n_elems: number of entries the table is sized for
+ *
+ * Moves the entries to a map of the new size.  Lookups can proceed during
+ * the resize; the old map is only freed by qht_reset_size() or
+ * qht_destroy().
+ */
+void qht_resize(QHT *ht, size_t n_elems);
+
+/**
+ * qht_iter:
+ * @ht: the table
+ * @func: called on each entry, with the writer lock held
+ * @userp: passed to @func
+ */
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp);
+
+/**
+ * qht_statistics_init:
+ * @ht: the table
+ * @stats: filled with the current statistics of @ht
+ */
+void qht_statistics_init(QHT *ht, QHTStats *stats);
+
+#endif
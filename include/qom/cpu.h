@@ -200,10 +200,16 @@ struct kvm_run;
  * @nr_threads: Number of threads within this CPU.
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
- * @running: #true if CPU is currently running (usermode).
+ * @running: #true if CPU is currently running (usermode, and system
+ *           emulation with multi-threaded TCG).
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
+ * @work_mutex: Lock to prevent multiple access to queued_work_*.
+ * @tlb_desc: The heap-allocated TLB of each MMU mode, when the TCG backend
+ *            resizes it.
+ * @tlb_lock: Lock held while the TLB tables are reallocated, and by other
+ *            threads that walk them.
  * @stop: Indicates a pending stop request.
  * @stopped: Indicates the CPU has been artificially stopped.
  * @tcg_exit_req: Set to force TCG to stop executing linked TBs for this
@@ -244,7 +250,10 @@ struct CPUState {
     uint32_t host_tid;
     bool running;
     struct QemuCond *halt_cond;
+    QemuMutex work_mutex;
     struct qemu_work_item *queued_work_first, *queued_work_last;
+    struct CPUTLBDesc *tlb_desc;
+    QemuMutex tlb_lock;
     bool thread_kicked;
     bool created;
     bool stop;
@@ -313,6 +322,17 @@ extern struct CPUTailQ cpus;
 DECLARE_TLS(CPUState *, current_cpu);
 #define current_cpu tls_var(current_cpu)
 
+/**
+ * qemu_tcg_mttcg_enabled:
+ *
+ * Check whether TCG runs each vCPU in its own host thread, as selected
+ * with "-accel tcg,thread=multi".
+ *
+ * Returns: %true if multi-threaded TCG is in use, %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * cpu_paging_enabled:
  * @cpu: The CPU whose state is to be inspected.
@@ -518,6 +538,38 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * at a point where no other vCPU is executing guest code.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
+/**
+ * tcg_start_exclusive:
+ *
+ * Wait until no other vCPU is executing guest code, and keep them from
+ * starting again until tcg_end_exclusive() is called.  If the caller is
+ * a vCPU thread, its own vCPU does not count as running in the meanwhile.
+ *
+ * Must be called with the iothread mutex held.  Does nothing unless
+ * multi-threaded TCG is in use, because otherwise holding the iothread
+ * mutex already keeps the vCPUs stopped.
+ */
+void tcg_start_exclusive(void);
+
+/**
+ * tcg_end_exclusive:
+ *
+ * Ends a section started with tcg_start_exclusive().
+ */
+void tcg_end_exclusive(void);
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
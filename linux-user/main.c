@@ -25,6 +25,7 @@
 #include <sys/mman.h>
 #include <sys/syscall.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 
 #include "qemu.h"
 #include "qemu-common.h"
@@ -42,6 +43,9 @@ const char *argv0;
 int gdbstub_port;
 envlist_t *envlist;
 static const char *cpu_model;
+static const char *tb_cache_dir;
+static char *tb_cache_path;
+static char *tb_cache_key;
 unsigned long mmap_min_addr;
 #if defined(CONFIG_USE_GUEST_BASE)
 unsigned long guest_base;
@@ -107,7 +111,7 @@ static int pending_cpus;
 /* Make sure everything is in a consistent state for calling fork().  */
 void fork_start(void)
 {
-    pthread_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     pthread_mutex_lock(&exclusive_lock);
     mmap_fork_start();
 }
@@ -129,11 +133,11 @@ void fork_end(int child)
         pthread_mutex_init(&cpu_list_mutex, NULL);
         pthread_cond_init(&exclusive_cond, NULL);
         pthread_cond_init(&exclusive_resume, NULL);
-        pthread_mutex_init(&tcg_ctx.tb_ctx.tb_lock, NULL);
+        qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
         gdbserver_fork((CPUArchState *)thread_cpu->env_ptr);
     } else {
         pthread_mutex_unlock(&exclusive_lock);
-        pthread_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
     }
 }
 
@@ -275,6 +279,50 @@ static void set_idt(int n, unsigned int dpl)
 }
 #endif
 
+#ifdef TARGET_X86_64
+/* Run CMPXCHG16B, which helper_cmpxchg16b() left to us because hosts
+   have no 16-byte compare-and-swap.  Like the real instruction, this
+   writes the operand back even if the comparison fails.  */
+static void do_cmpxchg16b(CPUX86State *env)
+{
+    abi_ulong addr = env->exclusive_addr;
+    target_siginfo_t info;
+    uint64_t d0, d1;
+    int eflags;
+
+    start_exclusive();
+    if (!access_ok(VERIFY_WRITE, addr, 16)) {
+        end_exclusive();
+        info.si_signo = SIGSEGV;
+        info.si_errno = 0;
+        info.si_code = TARGET_SEGV_MAPERR;
+        info._sifields._sigfault._addr = addr;
+        queue_signal(env, info.si_signo, &info);
+        return;
+    }
+
+    eflags = cpu_cc_compute_all(env, CC_OP);
+    __get_user(d0, (uint64_t *)g2h(addr));
+    __get_user(d1, (uint64_t *)g2h(addr + 8));
+    if (d0 == env->regs[R_EAX] && d1 == env->regs[R_EDX]) {
+        __put_user(env->regs[R_EBX], (uint64_t *)g2h(addr));
+        __put_user(env->regs[R_ECX], (uint64_t *)g2h(addr + 8));
+        eflags |= CC_Z;
+    } else {
+        __put_user(d0, (uint64_t *)g2h(addr));
+        __put_user(d1, (uint64_t *)g2h(addr + 8));
+        env->regs[R_EDX] = d1;
+        env->regs[R_EAX] = d0;
+        eflags &= ~CC_Z;
+    }
+    end_exclusive();
+
+    CC_SRC = eflags;
+    CC_OP = CC_OP_EFLAGS;
+    env->eip = env->exception_next_eip;
+}
+#endif
+
 void cpu_loop(CPUX86State *env)
 {
     CPUState *cs = CPU(x86_env_get_cpu(env));
@@ -283,7 +331,9 @@ void cpu_loop(CPUX86State *env)
     target_siginfo_t info;
 
     for(;;) {
+        cpu_exec_start(cs);
         trapnr = cpu_x86_exec(env);
+        cpu_exec_end(cs);
         switch(trapnr) {
         case 0x80:
             /* linux syscall from int $0x80 */
@@ -404,6 +454,11 @@ void cpu_loop(CPUX86State *env)
         case EXCP_INTERRUPT:
             /* just indicate that signals should be handled asap */
             break;
+#ifdef TARGET_X86_64
+        case EXCP_ATOMIC:
+            do_cmpxchg16b(env);
+            break;
+#endif
         case EXCP_DEBUG:
             {
                 int sig;
@@ -584,90 +639,6 @@ do_kernel_trap(CPUARMState *env)
     return 0;
 }
 
-/* Store exclusive handling for AArch32 */
-static int do_strex(CPUARMState *env)
-{
-    uint64_t val;
-    int size;
-    int rc = 1;
-    int segv = 0;
-    uint32_t addr;
-    start_exclusive();
-    if (env->exclusive_addr != env->exclusive_test) {
-        goto fail;
-    }
-    /* We know we're always AArch32 so the address is in uint32_t range
-     * unless it was the -1 exclusive-monitor-lost value (which won't
-     * match exclusive_test above).
-     */
-    assert(extract64(env->exclusive_addr, 32, 32) == 0);
-    addr = env->exclusive_addr;
-    size = env->exclusive_info & 0xf;
-    switch (size) {
-    case 0:
-        segv = get_user_u8(val, addr);
-        break;
-    case 1:
-        segv = get_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = get_user_u32(val, addr);
-        break;
-    default:
-        abort();
-    }
-    if (segv) {
-        env->exception.vaddress = addr;
-        goto done;
-    }
-    if (size == 3) {
-        uint32_t valhi;
-        segv = get_user_u32(valhi, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
-        val = deposit64(val, 32, 32, valhi);
-    }
-    if (val != env->exclusive_val) {
-        goto fail;
-    }
-
-    val = env->regs[(env->exclusive_info >> 8) & 0xf];
-    switch (size) {
-    case 0:
-        segv = put_user_u8(val, addr);
-        break;
-    case 1:
-        segv = put_user_u16(val, addr);
-        break;
-    case 2:
-    case 3:
-        segv = put_user_u32(val, addr);
-        break;
-    }
-    if (segv) {
-        env->exception.vaddress = addr;
-        goto done;
-    }
-    if (size == 3) {
-        val = env->regs[(env->exclusive_info >> 12) & 0xf];
-        segv = put_user_u32(val, addr + 4);
-        if (segv) {
-            env->exception.vaddress = addr + 4;
-            goto done;
-        }
-    }
-    rc = 0;
-fail:
-    env->regs[15] += 4;
-    env->regs[(env->exclusive_info >> 4) & 0xf] = rc;
-done:
-    end_exclusive();
-    return segv;
-}
-
 void cpu_loop(CPUARMState *env)
 {
     CPUState *cs = CPU(arm_env_get_cpu(env));
@@ -833,11 +804,6 @@ void cpu_loop(CPUARMState *env)
         case EXCP_INTERRUPT:
             /* just indicate that signals should be handled asap */
             break;
-        case EXCP_STREX:
-            if (!do_strex(env)) {
-                break;
-            }
-            /* fall through for segv */
         case EXCP_PREFETCH_ABORT:
         case EXCP_DATA_ABORT:
             addr = env->exception.vaddress;
@@ -885,6 +851,9 @@ void cpu_loop(CPUARMState *env)
 /*
  * Handle AArch64 store-release exclusive
  *
+ * Only pairs of 64-bit registers get here; the translator does the other
+ * sizes with a host compare-and-swap.
+ *
  * rs = gets the status result of store exclusive
  * rt = is the register that is stored
  * rt2 = is the second register store (in STP)
@@ -3617,6 +3586,23 @@ static void handle_arg_singlestep(const char *arg)
     singlestep = 1;
 }
 
+static void handle_arg_tiered(const char *arg)
+{
+    tb_hot_threshold = TB_HOT_THRESHOLD;
+}
+
+static void handle_arg_tb_cache(const char *arg)
+{
+#if (defined(__PIE__) || defined(__pie__)) && !TCG_TARGET_IMPLEMENTS_PIC
+    /* the cached code would refer to QEMU's text at the address of the run
+       that saved it */
+    fprintf(stderr, "qemu: -tbcache is not supported by position "
+            "independent builds of QEMU on this host\n");
+    exit(1);
+#endif
+    tb_cache_dir = arg;
+}
+
 static void handle_arg_strace(const char *arg)
 {
     do_strace = 1;
@@ -3674,6 +3660,10 @@ static const struct qemu_argument arg_table[] = {
      "",           "run in singlestep mode"},
     {"strace",     "QEMU_STRACE",      false, handle_arg_strace,
      "",           "log system calls"},
+    {"tiered",     "QEMU_TIERED",      false, handle_arg_tiered,
+     "",           "retranslate hot code with more optimizations"},
+    {"tbcache",    "QEMU_TBCACHE",     true,  handle_arg_tb_cache,
+     "dir",        "keep translated code in 'dir' for the next runs"},
     {"version",    "QEMU_VERSION",     false, handle_arg_version,
      "",           "display version information and exit"},
     {NULL, NULL, false, NULL, NULL, NULL}
@@ -3812,6 +3802,45 @@ static int parse_args(int argc, char **argv)
     return optind;
 }
 
+/* The cache file of a program is named after it, and its key covers
+   everything that translation depends on apart from the addresses that
+   translate-all.c checks: the program, QEMU itself and the options.  */
+static void tb_cache_open(const char *prog)
+{
+    struct stat prog_st, qemu_st;
+    char *path, *base;
+
+    path = realpath(prog, NULL);
+    if (!path || stat(path, &prog_st) < 0 ||
+        stat("/proc/self/exe", &qemu_st) < 0) {
+        free(path);
+        return;
+    }
+
+    tb_cache_key = g_strdup_printf("%s %llu %lld %lld %llu %lld %lld %s %d %u",
+                                   path, (unsigned long long)prog_st.st_ino,
+                                   (long long)prog_st.st_mtime,
+                                   (long long)prog_st.st_size,
+                                   (unsigned long long)qemu_st.st_ino,
+                                   (long long)qemu_st.st_mtime,
+                                   (long long)qemu_st.st_size,
+                                   cpu_model, singlestep, tb_hot_threshold);
+    base = g_path_get_basename(path);
+    tb_cache_path = g_strdup_printf("%s/%s-%08x", tb_cache_dir, base,
+                                    g_str_hash(tb_cache_key));
+    g_free(base);
+    free(path);
+
+    tb_cache_load(tb_cache_path, tb_cache_key);
+}
+
+void tb_cache_close(void)
+{
+    if (tb_cache_path) {
+        tb_cache_save(tb_cache_path, tb_cache_key);
+    }
+}
+
 int main(int argc, char **argv, char **envp)
 {
     struct target_pt_regs regs1, *regs = &regs1;
@@ -4054,6 +4083,10 @@ int main(int argc, char **argv, char **envp)
     tcg_prologue_init(&tcg_ctx);
 #endif
 
+    if (tb_cache_dir) {
+        tb_cache_open(filename);
+    }
+
 #if defined(TARGET_I386)
     env->cr[0] = CR0_PG_MASK | CR0_WP_MASK | CR0_PE_MASK;
     env->hflags |= HF_PE_MASK | HF_CPL_MASK;
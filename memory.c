@@ -25,6 +25,7 @@
 #include "exec/memory-internal.h"
 #include "exec/ram_addr.h"
 #include "sysemu/sysemu.h"
+#include "qom/cpu.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -802,6 +803,9 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            /* The old dispatch tables are freed by the commit; with
+               multi-threaded TCG, no vCPU may be walking them.  */
+            tcg_start_exclusive();
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
@@ -809,6 +813,7 @@ void memory_region_transaction_commit(void)
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            tcg_end_exclusive();
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -14,6 +14,7 @@
  */
 
 #include "qemu-common.h"
+#include "qemu/error-report.h"
 #include "qemu/main-loop.h"
 #include "migration/migration.h"
 #include "monitor/monitor.h"
@@ -33,6 +34,7 @@ enum {
     MIG_STATE_CANCELLING,
     MIG_STATE_CANCELLED,
     MIG_STATE_ACTIVE,
+    MIG_STATE_POSTCOPY_ACTIVE,
     MIG_STATE_COMPLETED,
 };
 
@@ -46,6 +48,13 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Default compression level, thread counts for multi-thread compression */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+/* Default number of multifd channels */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -60,11 +69,128 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] =
+                DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] =
+                DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
+        .parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                DEFAULT_MIGRATE_MULTIFD_CHANNELS,
     };
 
     return &current_migration;
 }
 
+MigrationIncomingState *migration_incoming_get_current(void)
+{
+    static bool once;
+    static MigrationIncomingState mis_current;
+
+    if (!once) {
+        QLIST_INIT(&mis_current.loadvm_handlers);
+        qemu_mutex_init(&mis_current.rp_mutex);
+        once = true;
+    }
+    return &mis_current;
+}
+
+MigrationIncomingState *migration_incoming_state_new(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    mis->from_src_file = f;
+    return mis;
+}
+
+void migration_incoming_state_destroy(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    if (mis->to_src_file) {
+        qemu_fclose(mis->to_src_file);
+        mis->to_src_file = NULL;
+    }
+    mis->from_src_file = NULL;
+}
+
+PostcopyState postcopy_state_get(MigrationIncomingState *mis)
+{
+    return atomic_mb_read(&mis->postcopy_state);
+}
+
+PostcopyState postcopy_state_set(MigrationIncomingState *mis,
+                                 PostcopyState new_state)
+{
+    return atomic_xchg(&mis->postcopy_state, new_state);
+}
+
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static void migrate_send_rp_message(MigrationIncomingState *mis,
+                                    enum mig_rp_message_type message_type,
+                                    uint16_t len, void *data)
+{
+    trace_migrate_send_rp_message((int)message_type, len);
+    qemu_mutex_lock(&mis->rp_mutex);
+    qemu_put_be16(mis->to_src_file, (unsigned int)message_type);
+    qemu_put_be16(mis->to_src_file, len);
+    qemu_put_buffer(mis->to_src_file, data, len);
+    qemu_fflush(mis->to_src_file);
+    qemu_mutex_unlock(&mis->rp_mutex);
+}
+
+/*
+ * Send a 'SHUT' message on the return channel with the given value
+ * to indicate that we've finished with the RP.  Non-0 value indicates
+ * error.
+ */
+void migrate_send_rp_shut(MigrationIncomingState *mis,
+                          uint32_t value)
+{
+    uint32_t buf;
+
+    if (!mis->to_src_file) {
+        return;
+    }
+    buf = cpu_to_be32(value);
+    migrate_send_rp_message(mis, MIG_RP_MSG_SHUT, sizeof(buf), &buf);
+}
+
+/* Request a range of pages from the source VM at the given
+ * start address.
+ *   rbname: Name of the RAMBlock to request the page in, if NULL it's the same
+ *           as the last request (a name must have been given previously)
+ *   Start: Address offset within the RB
+ *   Len: Length in bytes required - must be a multiple of pagesize
+ */
+void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
+                               ram_addr_t start, size_t len)
+{
+    uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
+    size_t msglen = 12; /* start + len */
+    enum mig_rp_message_type msg_type;
+
+    stq_be_p(bufc, (uint64_t)start);
+    stl_be_p(bufc + 8, (uint32_t)len);
+
+    if (rbname) {
+        int rbname_len = strlen(rbname);
+        assert(rbname_len < 256);
+
+        bufc[msglen++] = rbname_len;
+        memcpy(bufc + msglen, rbname, rbname_len);
+        msglen += rbname_len;
+        msg_type = MIG_RP_MSG_REQ_PAGES_ID;
+    } else {
+        msg_type = MIG_RP_MSG_REQ_PAGES;
+    }
+
+    migrate_send_rp_message(mis, msg_type, msglen, bufc);
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
@@ -91,12 +217,31 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
+    MigrationIncomingState *mis;
     Error *local_err = NULL;
     int ret;
 
+    mis = migration_incoming_state_new(f);
+    migrate_decompress_threads_create();
     ret = qemu_loadvm_state(f);
+
+    if (mis->have_listen_thread) {
+        /* Postcopy: the guest is running, and the listen thread finishes
+         * loading the stream and cleans up.
+         */
+        if (ret < 0) {
+            error_report("load of migration failed: %s", strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    migrate_send_rp_shut(mis, ret < 0);
+    migration_incoming_state_destroy();
     qemu_fclose(f);
     free_xbzrle_decoded_buf();
+    migrate_decompress_threads_join();
+    migrate_multifd_recv_threads_join();
     if (ret < 0) {
         error_report("load of migration failed: %s", strerror(-ret));
         exit(EXIT_FAILURE);
@@ -165,6 +310,23 @@ MigrationCapabilityStatusList *qmp_query_migrate_capabilities(Error **errp)
     return head;
 }
 
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params;
+    MigrationState *s = migrate_get_current();
+
+    params = g_malloc0(sizeof(*params));
+    params->compress_level = s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+    params->compress_threads =
+            s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+    params->decompress_threads =
+            s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+    params->x_multifd_channels =
+            s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+
+    return params;
+}
+
 static void get_xbzrle_cache_stats(MigrationInfo *info)
 {
     if (migrate_use_xbzrle()) {
@@ -174,6 +336,9 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_evictions =
+            xbzrle_mig_pages_cache_evictions();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
@@ -195,8 +360,10 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
     case MIG_STATE_CANCELLING:
+    case MIG_STATE_POSTCOPY_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->state == MIG_STATE_POSTCOPY_ACTIVE ?
+                                "postcopy-active" : "active");
         info->has_total_time = true;
         info->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
             - s->total_time;
@@ -271,7 +438,8 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     MigrationState *s = migrate_get_current();
     MigrationCapabilityStatusList *cap;
 
-    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -281,6 +449,60 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress_level",
+                  "is invalid, it should be in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+            (compress_threads < 1 || compress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "compress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+            (decompress_threads < 1 || decompress_threads > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "decompress_threads",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE,
+                  "x_multifd_channels",
+                  "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL] = compress_level;
+    }
+    if (has_compress_threads) {
+        s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS] = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS] =
+                                                    decompress_threads;
+    }
+    if (has_x_multifd_channels) {
+        s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS] =
+                                                    x_multifd_channels;
+    }
+}
+
 /* shared migration helpers */
 
 static void migrate_set_state(MigrationState *s, int old_state, int new_state)
@@ -303,11 +525,19 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_thread_join(&s->thread);
         qemu_mutex_lock_iothread();
 
+        migrate_compress_threads_join();
+        migrate_multifd_send_threads_join(!migration_has_finished(s));
+
         qemu_fclose(s->file);
         s->file = NULL;
     }
 
-    assert(s->state != MIG_STATE_ACTIVE);
+    flush_page_queue(s);
+    g_free(s->last_req_rbname);
+    s->last_req_rbname = NULL;
+
+    assert(s->state != MIG_STATE_ACTIVE &&
+           s->state != MIG_STATE_POSTCOPY_ACTIVE);
 
     if (s->state != MIG_STATE_COMPLETED) {
         qemu_savevm_state_cancel();
@@ -335,7 +565,8 @@ static void migrate_fd_cancel(MigrationState *s)
 
     do {
         old_state = s->state;
-        if (old_state != MIG_STATE_SETUP && old_state != MIG_STATE_ACTIVE) {
+        if (old_state != MIG_STATE_SETUP && old_state != MIG_STATE_ACTIVE &&
+            old_state != MIG_STATE_POSTCOPY_ACTIVE) {
             break;
         }
         migrate_set_state(s, old_state, MIG_STATE_CANCELLING);
@@ -368,26 +599,39 @@ bool migration_has_failed(MigrationState *s)
             s->state == MIG_STATE_ERROR);
 }
 
+bool migration_in_postcopy(MigrationState *s)
+{
+    return s->state == MIG_STATE_POSTCOPY_ACTIVE;
+}
+
 static MigrationState *migrate_init(const MigrationParams *params)
 {
     MigrationState *s = migrate_get_current();
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
+    int parameters[MIGRATION_PARAMETER_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
 
+    g_free(s->multifd_uri);
+
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(parameters, s->parameters, sizeof(parameters));
 
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
+    memcpy(s->parameters, parameters, sizeof(parameters));
     s->xbzrle_cache_size = xbzrle_cache_size;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
 
+    qemu_mutex_init(&s->src_page_req_mutex);
+    QSIMPLEQ_INIT(&s->src_page_requests);
+
     s->total_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
     return s;
 }
@@ -417,7 +661,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     params.shared = has_inc && inc;
 
     if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP ||
-        s->state == MIG_STATE_CANCELLING) {
+        s->state == MIG_STATE_CANCELLING ||
+        s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         error_set(errp, QERR_MIGRATION_ACTIVE);
         return;
     }
@@ -427,6 +672,29 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (migrate_postcopy_ram()) {
+        if (params.blk) {
+            error_setg(errp, "Block migration and postcopy are incompatible");
+            return;
+        }
+        if (strstart(uri, "rdma:", NULL)) {
+            error_setg(errp, "Postcopy is not supported over RDMA");
+            return;
+        }
+    }
+
+    if (migrate_use_multifd()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "Multifd needs a tcp or unix transport");
+            return;
+        }
+        if (migrate_postcopy_ram() || migrate_use_compression()) {
+            error_setg(errp, "Multifd can't be used together with postcopy"
+                       " or compression");
+            return;
+        }
+    }
+
     if (qemu_savevm_state_blocked(errp)) {
         return;
     }
@@ -437,6 +705,9 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     }
 
     s = migrate_init(&params);
+    if (migrate_use_multifd()) {
+        s->multifd_uri = g_strdup(uri);
+    }
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -470,6 +741,28 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "Enable postcopy with migrate_set_capability before"
+                         " the start of migration");
+        return;
+    }
+
+    if (s->state == MIG_STATE_NONE) {
+        error_setg(errp, "Postcopy must be started after migration has been"
+                         " started");
+        return;
+    }
+    /*
+     * we don't error if migration has finished since that would be racy
+     * with issuing this command.
+     */
+    atomic_mb_set(&s->start_postcopy, true);
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -547,6 +840,24 @@ bool migrate_auto_converge(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
+bool migrate_dirty_bitmaps(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_BITMAPS];
+}
+
 bool migrate_zero_blocks(void)
 {
     MigrationState *s;
@@ -574,8 +885,327 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_LEVEL];
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_COMPRESS_THREADS];
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_DECOMPRESS_THREADS];
+}
+
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS];
+}
+
+/*
+ * Open one more connection to the destination, for a multifd channel.
+ * Blocks; called from the channel threads.
+ *
+ * Returns: the socket, or -1 on error.
+ */
+int migrate_multifd_connect(MigrationState *s, Error **errp)
+{
+    const char *p;
+
+    if (strstart(s->multifd_uri, "tcp:", &p)) {
+        return inet_connect(p, errp);
+#if !defined(WIN32)
+    } else if (strstart(s->multifd_uri, "unix:", &p)) {
+        return unix_connect(p, errp);
+#endif
+    }
+    error_setg(errp, "Multifd needs a tcp or unix transport");
+    return -1;
+}
+
 /* migration thread support */
 
+/*
+ * Something bad happened to the return path; the migration thread
+ * notices rp_state.error and fails the migration.
+ */
+static void source_return_path_bad(MigrationState *s)
+{
+    atomic_mb_set(&s->rp_state.error, true);
+}
+
+/*
+ * Handles messages sent on the return path towards the source VM
+ */
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *ms = opaque;
+    QEMUFile *rp = ms->rp_state.from_dst_file;
+    uint16_t header_len, header_type;
+    uint8_t buf[512];
+    uint32_t tmp32;
+    ram_addr_t start;
+    size_t len;
+    char *rbname;
+    int res;
+
+    trace_source_return_path_thread_entry();
+    while (!ms->rp_state.error && !qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_loop_top();
+        header_type = qemu_get_be16(rp);
+        header_len = qemu_get_be16(rp);
+
+        if (header_type >= MIG_RP_MSG_MAX ||
+            header_type == MIG_RP_MSG_INVALID) {
+            error_report("RP: Received invalid message 0x%04x length 0x%04x",
+                         header_type, header_len);
+            source_return_path_bad(ms);
+            goto out;
+        }
+
+        if (header_len > sizeof(buf)) {
+            error_report("RP: Received message 0x%04x with bad length 0x%04x",
+                         header_type, header_len);
+            source_return_path_bad(ms);
+            goto out;
+        }
+
+        res = qemu_get_buffer(rp, buf, header_len);
+        if (res != header_len) {
+            error_report("RP: Failed reading data for message 0x%04x"
+                         " read %d expected %d",
+                         header_type, res, header_len);
+            source_return_path_bad(ms);
+            goto out;
+        }
+
+        switch (header_type) {
+        case MIG_RP_MSG_SHUT:
+            if (header_len != 4) {
+                goto bad_len;
+            }
+            tmp32 = ldl_be_p(buf);
+            trace_source_return_path_thread_shut(tmp32);
+            if (tmp32) {
+                error_report("RP: Sibling indicated error %d", tmp32);
+                source_return_path_bad(ms);
+            }
+            /*
+             * We'll let the main thread deal with closing the RP
+             * we could do a shutdown(2) on it, but we're the only user
+             * anyway, so there's nothing gained.
+             */
+            goto out;
+
+        case MIG_RP_MSG_REQ_PAGES:
+        case MIG_RP_MSG_REQ_PAGES_ID:
+            if (header_len < 12) {
+                goto bad_len;
+            }
+            start = ldq_be_p(buf);
+            len = ldl_be_p(buf + 8);
+            rbname = NULL;
+            if (header_type == MIG_RP_MSG_REQ_PAGES_ID) {
+                uint8_t rbname_len = buf[12];
+
+                if (header_len != 13 + rbname_len) {
+                    goto bad_len;
+                }
+                /* Safe: buf is larger than any message we accept */
+                buf[13 + rbname_len] = '\0';
+                rbname = (char *)buf + 13;
+            } else if (header_len != 12) {
+                goto bad_len;
+            }
+            trace_source_return_path_thread_pages(rbname ? rbname : "", start, len);
+            if (ram_save_queue_pages(ms, rbname, start, len)) {
+                source_return_path_bad(ms);
+                goto out;
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+    if (qemu_file_get_error(rp)) {
+        trace_source_return_path_thread_bad_end();
+        source_return_path_bad(ms);
+    }
+
+out:
+    trace_source_return_path_thread_end();
+    return NULL;
+
+bad_len:
+    error_report("RP: Received message 0x%04x with bad length 0x%04x",
+                 header_type, header_len);
+    source_return_path_bad(ms);
+    goto out;
+}
+
+static int open_return_path_on_source(MigrationState *ms)
+{
+    ms->rp_state.from_dst_file = qemu_file_get_return_path(ms->file);
+    if (!ms->rp_state.from_dst_file) {
+        return -1;
+    }
+
+    trace_open_return_path_on_source();
+    qemu_thread_create(&ms->rp_state.rp_thread, "return path",
+                       source_return_path_thread, ms, QEMU_THREAD_JOINABLE);
+
+    trace_open_return_path_on_source_continue();
+
+    return 0;
+}
+
+/* Returns 0 if the RP was ok, otherwise there was an error on the RP */
+static int await_return_path_close_on_source(MigrationState *ms)
+{
+    /*
+     * If this is a normal exit then the destination will send a SHUT and the
+     * rp_thread will exit, however if there's an error we need to cause
+     * it to exit.
+     */
+    if (ms->state != MIG_STATE_COMPLETED && ms->rp_state.from_dst_file) {
+        /*
+         * shutdown(2), if we have it, will cause it to unblock if it's stuck
+         * waiting for the destination.
+         */
+        qemu_file_shutdown(ms->rp_state.from_dst_file);
+    }
+    trace_await_return_path_close_on_source_joining();
+    qemu_thread_join(&ms->rp_state.rp_thread);
+    qemu_fclose(ms->rp_state.from_dst_file);
+    ms->rp_state.from_dst_file = NULL;
+    trace_await_return_path_close_on_source_close();
+    return ms->rp_state.error;
+}
+
+/*
+ * Switch from normal iteration to postcopy
+ * Returns non-0 on error
+ */
+static int postcopy_start(MigrationState *ms, bool *old_vm_running)
+{
+    int ret;
+    QEMUFile *fb;
+    GByteArray *pkg;
+
+    migrate_set_state(ms, MIG_STATE_ACTIVE, MIG_STATE_POSTCOPY_ACTIVE);
+    if (ms->state != MIG_STATE_POSTCOPY_ACTIVE) {
+        /* Cancelled or failed under us */
+        return -1;
+    }
+
+    trace_postcopy_start();
+    qemu_mutex_lock_iothread();
+    trace_postcopy_start_set_run();
+
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+
+    ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /*
+     * Tell the destination to throw away any pages it has already received
+     * that have since been dirtied.
+     */
+    ret = ram_postcopy_send_discard_bitmap(ms);
+    if (ret < 0) {
+        error_report("postcopy send discard bitmap failed");
+        goto fail;
+    }
+
+    /*
+     * send rest of state - note things that are doing postcopy
+     * will notice we're in POSTCOPY_ACTIVE and not actually
+     * wrap their state up here
+     */
+    qemu_file_set_rate_limit(ms->file, INT64_MAX);
+
+    /*
+     * The device state is wrapped in a package so that the destination
+     * reads all of it before the listen thread takes over the stream;
+     * loading devices may touch guest RAM, which can only be satisfied
+     * once the destination is listening for page requests.
+     */
+    pkg = g_byte_array_new();
+    fb = qemu_bufopen("w", pkg);
+    qemu_savevm_send_postcopy_listen(fb);
+    qemu_savevm_state_device_only(fb);
+    qemu_savevm_send_postcopy_run(fb);
+    qemu_put_byte(fb, QEMU_VM_EOF);
+    ret = qemu_fclose(fb);
+    if (ret < 0) {
+        g_byte_array_free(pkg, true);
+        error_report("postcopy failed to build the device state package");
+        goto fail;
+    }
+
+    ret = qemu_savevm_send_packaged(ms->file, pkg);
+    g_byte_array_free(pkg, true);
+    if (!ret) {
+        /* The destination owns the devices now, don't restart the source */
+        ms->postcopy_after_devices = true;
+        ret = qemu_file_get_error(ms->file);
+    }
+    if (ret) {
+        error_report("postcopy failed to send the device state");
+        goto fail;
+    }
+    qemu_mutex_unlock_iothread();
+
+    trace_postcopy_start_end();
+    return 0;
+
+fail:
+    migrate_set_state(ms, MIG_STATE_POSTCOPY_ACTIVE, MIG_STATE_ERROR);
+    qemu_mutex_unlock_iothread();
+    return -1;
+}
+
 static void *migration_thread(void *opaque)
 {
     MigrationState *s = opaque;
@@ -585,13 +1215,32 @@ static void *migration_thread(void *opaque)
     int64_t max_size = 0;
     int64_t start_time = initial_time;
     bool old_vm_running = false;
+    bool entered_postcopy = false;
+    /* The active state we expect to be in; ACTIVE or POSTCOPY_ACTIVE */
+    int current_active_state = MIG_STATE_ACTIVE;
+
+    if (migrate_postcopy_ram()) {
+        /* Postcopy needs the destination to ask for pages */
+        if (open_return_path_on_source(s)) {
+            error_report("Unable to open return-path for postcopy");
+            migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ERROR);
+            goto out;
+        }
+    }
 
     qemu_savevm_state_begin(s->file, &s->params);
 
+    if (s->rp_state.from_dst_file) {
+        qemu_savevm_send_open_return_path(s->file);
+        /* Let the destination check it can do postcopy before we start */
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
+
     s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
     migrate_set_state(s, MIG_STATE_SETUP, MIG_STATE_ACTIVE);
 
-    while (s->state == MIG_STATE_ACTIVE) {
+    while (s->state == MIG_STATE_ACTIVE ||
+           s->state == MIG_STATE_POSTCOPY_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
@@ -599,7 +1248,30 @@ static void *migration_thread(void *opaque)
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             trace_migrate_pending(pending_size, max_size);
             if (pending_size && pending_size >= max_size) {
+                /* Still a significant amount to transfer */
+                if (migrate_postcopy_ram() && !entered_postcopy &&
+                    atomic_mb_read(&s->start_postcopy)) {
+                    start_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                    if (!postcopy_start(s, &old_vm_running)) {
+                        current_active_state = MIG_STATE_POSTCOPY_ACTIVE;
+                        entered_postcopy = true;
+                        s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                                      start_time;
+                    }
+                    continue;
+                }
                 qemu_savevm_state_iterate(s->file);
+            } else if (entered_postcopy) {
+                trace_migration_thread_postcopy_complete();
+                qemu_mutex_lock_iothread();
+                qemu_savevm_state_postcopy_complete(s->file);
+                qemu_mutex_unlock_iothread();
+
+                if (!qemu_file_get_error(s->file)) {
+                    migrate_set_state(s, MIG_STATE_POSTCOPY_ACTIVE,
+                                      MIG_STATE_COMPLETED);
+                    break;
+                }
             } else {
                 int ret;
 
@@ -627,8 +1299,9 @@ static void *migration_thread(void *opaque)
             }
         }
 
-        if (qemu_file_get_error(s->file)) {
-            migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
+        if (qemu_file_get_error(s->file) ||
+            atomic_mb_read(&s->rp_state.error)) {
+            migrate_set_state(s, current_active_state, MIG_STATE_ERROR);
             break;
         }
         current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -659,17 +1332,35 @@ static void *migration_thread(void *opaque)
         }
     }
 
+    /* If we enabled the return path, wait for the destination to close it */
+    if (s->rp_state.from_dst_file) {
+        if (await_return_path_close_on_source(s)) {
+            trace_migration_thread_rp_error();
+            migrate_set_state(s, MIG_STATE_COMPLETED, MIG_STATE_ERROR);
+        }
+    }
+
+out:
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
         uint64_t transferred_bytes = qemu_ftell(s->file);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!entered_postcopy) {
+            s->downtime = end_time - start_time;
+        }
         if (s->total_time) {
             s->mbps = (((double) transferred_bytes * 8.0) /
                        ((double) s->total_time)) / 1000;
         }
         runstate_set(RUN_STATE_POSTMIGRATE);
+    } else if (s->postcopy_after_devices) {
+        /*
+         * The destination already has the device state and may be running
+         * the guest; restarting here could corrupt its disks.
+         */
+        error_report("migration failed after the destination took over"
+                     " the devices; the source VM stays stopped");
     } else {
         if (old_vm_running) {
             vm_start();
@@ -696,6 +1387,8 @@ void migrate_fd_connect(MigrationState *s)
     /* Notify before starting migration thread */
     notifier_list_notify(&migration_state_notifiers, s);
 
+    migrate_compress_threads_create();
+    migrate_multifd_send_threads_create();
     qemu_thread_create(&s->thread, "migration", migration_thread, s,
                        QEMU_THREAD_JOINABLE);
 }
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set associative, based on a hash of the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,18 +33,34 @@
     do { } while (0)
 #endif
 
+/* Number of pages that can be cached for addresses of the same set */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
     uint8_t *it_data;
+    /* CLOCK reference bit: set when the page is looked up again */
+    bool it_ref;
 };
 
+/*
+ * The items are grouped in sets of num_ways items; an address can only
+ * be cached in the set given by cache_get_set().  When the set is full,
+ * the victim is picked by the CLOCK algorithm: the set's hand goes round
+ * its items, clearing the reference bits, and stops at the first item
+ * whose bit was already clear.  Pages inserted once and never looked up
+ * again are thus evicted before the ones that are hit.
+ */
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *clock_hand;
     unsigned int page_size;
     int64_t max_num_items;
+    unsigned int num_ways;
+    int64_t num_sets;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -75,14 +91,20 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
                                      sizeof(*cache->page_cache));
-    if (!cache->page_cache) {
+    cache->clock_hand = g_try_malloc0(cache->num_sets);
+    if (!cache->page_cache || !cache->clock_hand) {
         DPRINTF("Failed to allocate cache->page_cache\n");
+        g_free(cache->page_cache);
+        g_free(cache->clock_hand);
         g_free(cache);
         return NULL;
     }
@@ -91,6 +113,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_ref = false;
     }
 
     return cache;
@@ -108,59 +131,105 @@ void cache_fini(PageCache *cache)
     }
 
     g_free(cache->page_cache);
+    g_free(cache->clock_hand);
     cache->page_cache = NULL;
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
-
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    g_assert(cache->num_sets);
+    return (address / cache->page_size) & (cache->num_sets - 1);
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+/* Returns the item caching @addr, or NULL */
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = &cache->page_cache[cache_get_set(cache, addr) * cache->num_ways];
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    if (it) {
+        it->it_ref = true;
+    }
+    return it != NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        return NULL;
+    }
+    it->it_ref = true;
+    return it->it_data;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/*
+ * Returns the item of @addr's set where a new page goes: a free one if
+ * there is any, the CLOCK victim otherwise.
+ */
+static CacheItem *cache_get_victim(PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    size_t set_idx = cache_get_set(cache, addr);
+    CacheItem *set = &cache->page_cache[set_idx * cache->num_ways];
+    uint8_t *hand = &cache->clock_hand[set_idx];
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        if (!set[i].it_data) {
+            return &set[i];
+        }
+    }
+
+    /* at most one round clearing the bits, then a victim is found */
+    for (;;) {
+        CacheItem *it = &set[*hand];
+
+        *hand = (*hand + 1) % cache->num_ways;
+        if (!it->it_ref) {
+            return it;
+        }
+        it->it_ref = false;
+    }
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
 {
-
-    CacheItem *it = NULL;
+    CacheItem *it;
+    int ret = 0;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
+    if (it) {
+        /* an update of the page counts as a use */
+        it->it_ref = true;
+    } else {
+        it = cache_get_victim(cache, addr);
+        if (it->it_data) {
+            DPRINTF("Evicting %" PRIx64 "\n", it->it_addr);
+            ret = 1;
+        }
+        it->it_ref = false;
+    }
 
     /* allocate page */
     if (!it->it_data) {
@@ -177,15 +246,16 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata)
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
 
-    return 0;
+    return ret;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
     int64_t i;
+    unsigned int j;
 
-    CacheItem *old_it, *new_it;
+    CacheItem *old_it, *new_it, *set;
 
     g_assert(cache);
 
@@ -208,27 +278,39 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     /* move all data from old cache */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+        if (old_it->it_addr == -1) {
+            continue;
+        }
+
+        /* a free item of the new set, or else its LRU one */
+        set = &new_cache->page_cache[cache_get_set(new_cache, old_it->it_addr)
+                                     * new_cache->num_ways];
+        new_it = &set[0];
+        for (j = 0; j < new_cache->num_ways && new_it->it_data; j++) {
+            if (!set[j].it_data || set[j].it_age < new_it->it_age) {
+                new_it = &set[j];
+            }
+        }
+
+        if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            /* keep the MRU page */
+            g_free(old_it->it_data);
+        } else {
+            if (!new_it->it_data) {
+                new_cache->num_items++;
             }
+            g_free(new_it->it_data);
+            *new_it = *old_it;
         }
     }
 
     g_free(cache->page_cache);
+    g_free(cache->clock_hand);
     cache->page_cache = new_cache->page_cache;
+    cache->clock_hand = new_cache->clock_hand;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
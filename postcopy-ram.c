@@ -0,0 +1,571 @@
+/*
+ * Postcopy migration for RAM
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * Postcopy is a migration technique where the execution flips from the
+ * source to the destination before all the data has been copied.
+ * Pages the guest touches on the destination before they have arrived are
+ * trapped with userfaultfd and requested from the source over the return
+ * path; the rest keep streaming in the background.
+ */
+
+#include "qemu-common.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "exec/cpu-all.h"
+#include "exec/ram_addr.h"
+#include "trace.h"
+
+#if defined(__linux__)
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__linux__) && defined(__NR_userfaultfd) && defined(CONFIG_EVENTFD)
+#include <linux/userfaultfd.h>
+
+static bool ufd_version_check(int ufd)
+{
+    struct uffdio_api api_struct;
+    uint64_t ioctl_mask;
+
+    api_struct.api = UFFD_API;
+    api_struct.features = 0;
+    if (ioctl(ufd, UFFDIO_API, &api_struct)) {
+        error_report("postcopy_ram_supported_by_host: UFFDIO_API failed: %s",
+                     strerror(errno));
+        return false;
+    }
+
+    ioctl_mask = (__u64)1 << _UFFDIO_REGISTER |
+                 (__u64)1 << _UFFDIO_UNREGISTER;
+    if ((api_struct.ioctls & ioctl_mask) != ioctl_mask) {
+        error_report("Missing userfault features: %" PRIx64,
+                     (uint64_t)(~api_struct.ioctls & ioctl_mask));
+        return false;
+    }
+
+    return true;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    long pagesize = getpagesize();
+    int ufd = -1;
+    bool ret = false; /* Error unless we change it */
+    void *testarea = NULL;
+    struct uffdio_register reg_struct;
+    struct uffdio_range range_struct;
+    uint64_t feature_mask;
+    RAMBlock *block;
+
+    /* Pages are placed one at a time as they arrive */
+    if (TARGET_PAGE_SIZE != pagesize) {
+        error_report("Postcopy needs the target page size (%d) to match "
+                     "the host page size (%ld)", TARGET_PAGE_SIZE, pagesize);
+        goto out;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd >= 0) {
+            error_report("Postcopy doesn't support file backed RAM (%s)",
+                         block->idstr);
+            goto out;
+        }
+    }
+
+    ufd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (ufd == -1) {
+        error_report("%s: userfaultfd not available: %s", __func__,
+                     strerror(errno));
+        goto out;
+    }
+
+    /* Version and features check */
+    if (!ufd_version_check(ufd)) {
+        goto out;
+    }
+
+    /*
+     *  We need to check that the ops we need are supported on anon memory
+     *  To do that we need to register a chunk and see the flags that
+     *  are returned.
+     */
+    testarea = mmap(NULL, pagesize, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                    MAP_ANONYMOUS, -1, 0);
+    if (testarea == MAP_FAILED) {
+        error_report("%s: Failed to map test area: %s", __func__,
+                     strerror(errno));
+        goto out;
+    }
+    g_assert(((size_t)testarea & (pagesize - 1)) == 0);
+
+    reg_struct.range.start = (uintptr_t)testarea;
+    reg_struct.range.len = pagesize;
+    reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s userfault register: %s", __func__, strerror(errno));
+        goto out;
+    }
+
+    range_struct.start = (uintptr_t)testarea;
+    range_struct.len = pagesize;
+    if (ioctl(ufd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s userfault unregister: %s", __func__, strerror(errno));
+        goto out;
+    }
+
+    feature_mask = (__u64)1 << _UFFDIO_WAKE |
+                   (__u64)1 << _UFFDIO_COPY |
+                   (__u64)1 << _UFFDIO_ZEROPAGE;
+    if ((reg_struct.ioctls & feature_mask) != feature_mask) {
+        error_report("Missing userfault map features: %" PRIx64,
+                     (uint64_t)(~reg_struct.ioctls & feature_mask));
+        goto out;
+    }
+
+    /* Success! */
+    ret = true;
+out:
+    if (testarea && testarea != MAP_FAILED) {
+        munmap(testarea, pagesize);
+    }
+    if (ufd != -1) {
+        close(ufd);
+    }
+    return ret;
+}
+
+static RAMBlock *postcopy_ram_block_by_name(const char *rbname)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(block->idstr, rbname)) {
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Find the RAMBlock that a faulting host address is part of; the list
+ * of blocks does not change while an incoming migration runs.
+ */
+static RAMBlock *postcopy_ram_block_from_host(uint64_t addr,
+                                              ram_addr_t *offset)
+{
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        uint64_t host = (uintptr_t)block->host;
+
+        if (addr >= host && addr - host < block->length) {
+            *offset = addr - host;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Transparent huge pages would have to be split by every discard and
+ * could be populated behind our back, so they stay off during postcopy.
+ */
+int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
+{
+#ifdef MADV_NOHUGEPAGE
+    RAMBlock *block;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (qemu_madvise(block->host, block->length, MADV_NOHUGEPAGE)) {
+            error_report("%s: NOHUGEPAGE: %s", __func__, strerror(errno));
+            return -1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+int postcopy_ram_discard_range(MigrationIncomingState *mis, const char *rbname,
+                               uint64_t start, uint64_t length)
+{
+    RAMBlock *block = postcopy_ram_block_by_name(rbname);
+
+    trace_postcopy_ram_discard_range(rbname, start, length);
+    if (!block) {
+        error_report("%s: RAMBlock %s not found", __func__, rbname);
+        return -1;
+    }
+    if (start > block->length || length > block->length - start ||
+        (start | length) & (getpagesize() - 1)) {
+        error_report("%s: bad range %" PRIx64 "+%" PRIx64 " in %s",
+                     __func__, start, length, rbname);
+        return -1;
+    }
+
+    if (qemu_madvise(block->host + start, length, QEMU_MADV_DONTNEED)) {
+        error_report("%s MADV_DONTNEED: %s", __func__, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Handle faults detected by the USERFAULT markings
+ */
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    RAMBlock *last_rb = NULL; /* last RAMBlock we sent part of */
+    struct uffd_msg msg;
+    ram_addr_t rb_offset;
+    RAMBlock *rb;
+    int ret;
+
+    trace_postcopy_ram_fault_thread_entry();
+    while (true) {
+        struct pollfd pfd[2];
+
+        /*
+         * We're mainly waiting for the kernel to give us a faulting HVA,
+         * however we can be told to quit via userfault_quit_fd which is
+         * an eventfd
+         */
+        pfd[0].fd = mis->userfault_fd;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        pfd[1].fd = mis->userfault_quit_fd;
+        pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
+        pfd[1].revents = 0;
+
+        if (poll(pfd, 2, -1 /* Wait forever */) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (pfd[1].revents) {
+            trace_postcopy_ram_fault_thread_quit();
+            break;
+        }
+
+        ret = read(mis->userfault_fd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (errno == EAGAIN) {
+                /*
+                 * if a wake up happens on the other thread just after
+                 * the poll, there is nothing to read.
+                 */
+                continue;
+            }
+            if (ret < 0) {
+                error_report("%s: Failed to read full userfault message: %s",
+                             __func__, strerror(errno));
+                break;
+            } else {
+                error_report("%s: Read %d bytes from userfaultfd expected %zd",
+                             __func__, ret, sizeof(msg));
+                break; /* Lost alignment, don't know what we'd read next */
+            }
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            error_report("%s: Read unexpected event %u from userfaultfd",
+                         __func__, msg.event);
+            continue; /* It's not a page fault, shouldn't happen */
+        }
+
+        rb = postcopy_ram_block_from_host(msg.arg.pagefault.address,
+                                          &rb_offset);
+        if (!rb) {
+            error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                         PRIx64, (uint64_t)msg.arg.pagefault.address);
+            break;
+        }
+
+        rb_offset &= ~((ram_addr_t)getpagesize() - 1);
+        trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
+                                                rb->idstr, rb_offset);
+
+        /*
+         * Send the request to the source - we want to request one
+         * of our host page sizes (which is >= TPS)
+         */
+        if (rb != last_rb) {
+            last_rb = rb;
+            migrate_send_rp_req_pages(mis, rb->idstr, rb_offset,
+                                      getpagesize());
+        } else {
+            /* Save some space */
+            migrate_send_rp_req_pages(mis, NULL, rb_offset, getpagesize());
+        }
+    }
+    trace_postcopy_ram_fault_thread_exit();
+    return NULL;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    /* Open the fd for the kernel to give us userfaults */
+    mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (mis->userfault_fd == -1) {
+        error_report("%s: Failed to open userfault fd: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+
+    /*
+     * Although the host check already tested the API, we need to
+     * do the check again as an ABI handshake on the new fd.
+     */
+    if (!ufd_version_check(mis->userfault_fd)) {
+        close(mis->userfault_fd);
+        return -1;
+    }
+
+    /* Now an eventfd we use to tell the fault-thread to quit */
+    mis->userfault_quit_fd = eventfd(0, EFD_CLOEXEC);
+    if (mis->userfault_quit_fd == -1) {
+        error_report("%s: Opening userfault_quit_fd: %s", __func__,
+                     strerror(errno));
+        close(mis->userfault_fd);
+        return -1;
+    }
+
+    /* Mark so that we get notified of accesses to unwritten areas */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_register reg_struct;
+
+        reg_struct.range.start = (uintptr_t)block->host;
+        reg_struct.range.len = block->length;
+        reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+
+        /* Now tell our userfault_fd that it's responsible for this area */
+        if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+            error_report("%s userfault register: %s", __func__,
+                         strerror(errno));
+            goto fail;
+        }
+    }
+
+    mis->postcopy_tmp_page = mmap(NULL, getpagesize(),
+                                  PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                                  MAP_ANONYMOUS, -1, 0);
+    if (mis->postcopy_tmp_page == MAP_FAILED) {
+        mis->postcopy_tmp_page = NULL;
+        error_report("%s: %s", __func__, strerror(errno));
+        goto fail;
+    }
+
+    qemu_thread_create(&mis->fault_thread, "postcopy/fault",
+                       postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
+    mis->have_fault_thread = true;
+
+    return 0;
+
+fail:
+    /* Closing the userfaultfd drops all the registrations */
+    close(mis->userfault_fd);
+    close(mis->userfault_quit_fd);
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    RAMBlock *block;
+
+    trace_postcopy_ram_incoming_cleanup_entry();
+
+    if (mis->have_fault_thread) {
+        uint64_t tmp64 = 1;
+
+        /*
+         * Tell the fault_thread to exit, it's an eventfd that should
+         * currently be at 0, we're going to increment it to 1
+         */
+        if (write(mis->userfault_quit_fd, &tmp64, 8) != 8) {
+            error_report("%s: incrementing userfault_quit_fd: %s", __func__,
+                         strerror(errno));
+            return -1;
+        }
+        qemu_thread_join(&mis->fault_thread);
+        mis->have_fault_thread = false;
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            struct uffdio_range range_struct;
+
+            range_struct.start = (uintptr_t)block->host;
+            range_struct.len = block->length;
+            if (ioctl(mis->userfault_fd, UFFDIO_UNREGISTER, &range_struct)) {
+                error_report("%s: userfault unregister %s", __func__,
+                             strerror(errno));
+                return -1;
+            }
+        }
+
+        close(mis->userfault_fd);
+        close(mis->userfault_quit_fd);
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        qemu_madvise(block->host, block->length, QEMU_MADV_HUGEPAGE);
+    }
+
+    if (mis->postcopy_tmp_page) {
+        munmap(mis->postcopy_tmp_page, getpagesize());
+        mis->postcopy_tmp_page = NULL;
+    }
+    trace_postcopy_ram_incoming_cleanup_exit();
+    return 0;
+}
+
+/*
+ * Place a host page (from) at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    struct uffdio_copy copy_struct;
+
+    copy_struct.dst = (uint64_t)(uintptr_t)host;
+    copy_struct.src = (uint64_t)(uintptr_t)from;
+    copy_struct.len = getpagesize();
+    copy_struct.mode = 0;
+
+    /* copy also acks to the kernel waking the stalled thread up
+     * TODO: We can inhibit that ack and only do it if it was requested
+     * which would be slightly cheaper, but we'd have to be careful
+     * of the order of updating our page state.
+     */
+    if (ioctl(mis->userfault_fd, UFFDIO_COPY, &copy_struct)) {
+        int e = errno;
+
+        /*
+         * A page that was requested by a fault may arrive a second time
+         * in the background stream; the source is stopped, so the
+         * copy that is already there is just as good.
+         */
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s copy host: %p from: %p",
+                     __func__, strerror(e), host, from);
+
+        return -e;
+    }
+
+    trace_postcopy_place_page(host);
+    return 0;
+}
+
+/*
+ * Place a zero page at (host) atomically
+ * returns 0 on success
+ */
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    struct uffdio_zeropage zero_struct;
+
+    zero_struct.range.start = (uint64_t)(uintptr_t)host;
+    zero_struct.range.len = getpagesize();
+    zero_struct.mode = 0;
+
+    if (ioctl(mis->userfault_fd, UFFDIO_ZEROPAGE, &zero_struct)) {
+        int e = errno;
+
+        if (e == EEXIST) {
+            return 0;
+        }
+        error_report("%s: %s zero host: %p",
+                     __func__, strerror(e), host);
+
+        return -e;
+    }
+
+    trace_postcopy_place_page_zero(host);
+    return 0;
+}
+
+/*
+ * Returns a target page of memory that can be mapped at a later point in time
+ * using postcopy_place_page
+ * The same address is used repeatedly, postcopy_place_page just takes the
+ * backing page away.
+ * Returns: Pointer to allocated page
+ *
+ */
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    return mis->postcopy_tmp_page;
+}
+
+#else
+/* No target OS support, stubs just fail */
+bool postcopy_ram_supported_by_host(void)
+{
+    error_report("%s: No OS support", __func__);
+    return false;
+}
+
+int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_discard_range(MigrationIncomingState *mis, const char *rbname,
+                               uint64_t start, uint64_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_enable_notify(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from)
+{
+    assert(0);
+    return -1;
+}
+
+int postcopy_place_page_zero(MigrationIncomingState *mis, void *host)
+{
+    assert(0);
+    return -1;
+}
+
+void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+{
+    assert(0);
+    return NULL;
+}
+
+#endif
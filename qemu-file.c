@@ -1,4 +1,6 @@
+#include <zlib.h>
 #include "qemu-common.h"
+#include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "block/coroutine.h"
@@ -90,6 +92,44 @@ static int socket_close(void *opaque)
     return 0;
 }
 
+static int socket_shutdown(void *opaque, bool rd, bool wr)
+{
+    QEMUFileSocket *s = opaque;
+
+    if (shutdown(s->fd, rd ? (wr ? SHUT_RDWR : SHUT_RD) : SHUT_WR)) {
+        return -socket_error();
+    }
+    return 0;
+}
+
+static const QEMUFileOps socket_read_ops;
+static const QEMUFileOps socket_write_ops;
+
+/*
+ * The return path shares the socket, but has its own descriptor so
+ * that each QEMUFile can be closed on its own.
+ */
+static QEMUFile *socket_get_return_path(void *opaque)
+{
+    QEMUFileSocket *s = opaque;
+    QEMUFileSocket *rp;
+    int fd;
+
+    fd = dup(s->fd);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    rp = g_malloc0(sizeof(QEMUFileSocket));
+    rp->fd = fd;
+    if (s->file->ops == &socket_write_ops) {
+        rp->file = qemu_fopen_ops(rp, &socket_read_ops);
+    } else {
+        rp->file = qemu_fopen_ops(rp, &socket_write_ops);
+    }
+    return rp->file;
+}
+
 static int stdio_get_fd(void *opaque)
 {
     QEMUFileStdio *s = opaque;
@@ -337,13 +377,17 @@ QEMUFile *qemu_fdopen(int fd, const char *mode)
 static const QEMUFileOps socket_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = socket_get_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path,
+    .shut_down =  socket_shutdown
 };
 
 static const QEMUFileOps socket_write_ops = {
     .get_fd =     socket_get_fd,
     .writev_buffer = socket_writev_buffer,
-    .close =      socket_close
+    .close =      socket_close,
+    .get_return_path = socket_get_return_path,
+    .shut_down =  socket_shutdown
 };
 
 bool qemu_file_mode_is_not_valid(const char *mode)
@@ -414,6 +458,101 @@ QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
     return f;
 }
 
+static const QEMUFileOps buffer_ops = {
+};
+
+QEMUFile *qemu_fopen_buffer(void)
+{
+    return qemu_fopen_ops(NULL, &buffer_ops);
+}
+
+typedef struct QEMUFileByteArray {
+    GByteArray *buf;
+    QEMUFile *file;
+} QEMUFileByteArray;
+
+static int bytearray_put_buffer(void *opaque, const uint8_t *buf,
+                                int64_t pos, int size)
+{
+    QEMUFileByteArray *s = opaque;
+
+    g_byte_array_append(s->buf, buf, size);
+    return size;
+}
+
+static int bytearray_get_buffer(void *opaque, uint8_t *buf, int64_t pos,
+                                int size)
+{
+    QEMUFileByteArray *s = opaque;
+
+    if (pos >= s->buf->len) {
+        return 0;
+    }
+    size = MIN(size, s->buf->len - pos);
+    memcpy(buf, s->buf->data + pos, size);
+    return size;
+}
+
+static int bytearray_close(void *opaque)
+{
+    g_free(opaque);
+    return 0;
+}
+
+static const QEMUFileOps bytearray_read_ops = {
+    .get_buffer = bytearray_get_buffer,
+    .close =      bytearray_close
+};
+
+static const QEMUFileOps bytearray_write_ops = {
+    .put_buffer = bytearray_put_buffer,
+    .close =      bytearray_close
+};
+
+QEMUFile *qemu_bufopen(const char *mode, GByteArray *buf)
+{
+    QEMUFileByteArray *s;
+
+    if (mode == NULL || (mode[0] != 'r' && mode[0] != 'w') ||
+        mode[1] != '\0') {
+        error_report("qemu_bufopen: Argument validity check failed");
+        return NULL;
+    }
+
+    s = g_malloc0(sizeof(QEMUFileByteArray));
+    s->buf = buf;
+    if (mode[0] == 'r') {
+        s->file = qemu_fopen_ops(s, &bytearray_read_ops);
+    } else {
+        s->file = qemu_fopen_ops(s, &bytearray_write_ops);
+    }
+    return s->file;
+}
+
+/*
+ * Result: QEMUFile* for a 'return path' for comms in the opposite direction
+ *         NULL if not available
+ */
+QEMUFile *qemu_file_get_return_path(QEMUFile *f)
+{
+    if (!f->ops->get_return_path) {
+        return NULL;
+    }
+    return f->ops->get_return_path(f->opaque);
+}
+
+/*
+ * Stop a file from being read/written - not all backing files can do this
+ * typically only sockets can.
+ */
+int qemu_file_shutdown(QEMUFile *f)
+{
+    if (!f->ops->shut_down) {
+        return -ENOSYS;
+    }
+    return f->ops->shut_down(f->opaque, true, true);
+}
+
 /*
  * Get last error for stream f
  *
@@ -579,6 +718,12 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/* Account for data sent outside of f, for rate limiting */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -878,3 +1023,45 @@ uint64_t qemu_get_be64(QEMUFile *f)
     v |= qemu_get_be32(f);
     return v;
 }
+
+/*
+ * Compress size bytes of data starting at p with the given compression
+ * level and store the compressed data, preceded by its be32 length, in
+ * the buffer of f.  f must be a memory-only file (see qemu_fopen_buffer).
+ *
+ * Returns the number of bytes added to f, or 0 on failure.
+ */
+ssize_t qemu_put_compression_data(QEMUFile *f, const uint8_t *p, size_t size,
+                                  int level)
+{
+    uLong blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
+
+    if (blen < compressBound(size)) {
+        return 0;
+    }
+    if (compress2(f->buf + f->buf_index + sizeof(int32_t), &blen,
+                  (Bytef *)p, size, level) != Z_OK) {
+        error_report("Compress Failed!");
+        return 0;
+    }
+    qemu_put_be32(f, blen);
+    f->buf_index += blen;
+    f->bytes_xfer += blen;
+    return blen + sizeof(int32_t);
+}
+
+/*
+ * Put the data in the buffer of f_src to the buffer of f_des, and
+ * then reset the buf_index of f_src to 0.
+ */
+int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
+{
+    int len = 0;
+
+    if (f_src->buf_index > 0) {
+        len = f_src->buf_index;
+        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
+        f_src->buf_index = 0;
+    }
+    return len;
+}
@@ -127,6 +127,14 @@ static void QEMU_NORETURN help(void)
            "  '-n' skips the target volume creation (useful if the volume is created\n"
            "       prior to running qemu-img)\n"
            "\n"
+           "Parameters to convert subcommand:\n"
+           "  '-m' specifies how many coroutines work in parallel during the convert\n"
+           "       process (defaults to 8)\n"
+           "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '-C' offloads the copy to the host (e.g. copy_file_range) when the\n"
+           "       source and target support it; zero sectors are then copied too\n"
+           "  '-r' sets the size of each read and write request (defaults to 2M)\n"
+           "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
            "       '-r leaks' repairs only cluster leaks, whereas '-r all' fixes all\n"
@@ -803,6 +811,11 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     is_zero = buffer_is_zero(buf, 512);
+    if (is_zero && can_use_buffer_find_nonzero_offset(buf, n * 512)) {
+        /* Scan the whole zero run at once rather than sector by sector */
+        *pnum = buffer_find_nonzero_offset(buf, n * 512) / 512;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
         if (is_zero != buffer_is_zero(buf, 512)) {
@@ -1193,19 +1206,435 @@ out3:
     return ret;
 }
 
+enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_ZERO,
+    BLK_BACKING_FILE,
+};
+
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    int64_t allocated_sectors;
+    int64_t allocated_done;
+    /* next sector to be picked up by a coroutine */
+    int64_t sector_num;
+    /* with in order writes, the sectors before wr_offs are written */
+    int64_t wr_offs;
+    enum ImgConvertBlockStatus status;
+    int64_t sector_next_status;
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool compressed;
+    bool target_has_backing;
+    bool wr_in_order;
+    bool copy_range;
+    int min_sparse;
+    size_t cluster_sectors;
+    size_t buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num,
+                                int *src_cur, int64_t *src_cur_offset)
+{
+    *src_cur = 0;
+    *src_cur_offset = 0;
+    while (sector_num - *src_cur_offset >= s->src_sectors[*src_cur]) {
+        *src_cur_offset += s->src_sectors[*src_cur];
+        (*src_cur)++;
+        assert(*src_cur < s->src_num);
+    }
+}
+
+/*
+ * Returns the number of sectors from @sector_num that can be handled by a
+ * single request, and sets s->status to tell how; or a negative errno.
+ */
+static int convert_iteration_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t src_cur_offset;
+    int ret, n, src_cur;
+
+    assert(s->total_sectors > sector_num);
+
+    /* compressed clusters are written as a whole, zero or not */
+    if (s->compressed) {
+        s->status = BLK_DATA;
+        return MIN(s->cluster_sectors, s->total_sectors - sector_num);
+    }
+
+    convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+    n = MIN(s->src_sectors[src_cur] - (sector_num - src_cur_offset), INT_MAX);
+
+    if (s->sector_next_status <= sector_num) {
+        if (!s->has_zero_init && !s->target_has_backing) {
+            /* everything is copied, no need to look at the source */
+            s->status = BLK_DATA;
+        } else {
+            ret = bdrv_get_block_status(s->src[src_cur],
+                                        sector_num - src_cur_offset, n, &n);
+            if (ret < 0) {
+                return ret;
+            }
+
+            if (s->has_zero_init && !s->target_has_backing &&
+                (ret & BDRV_BLOCK_ZERO)) {
+                /* the target is zero initialized and not working on a
+                 * shared base, zero sectors can be skipped */
+                s->status = BLK_ZERO;
+            } else if (s->target_has_backing && !(ret & BDRV_BLOCK_DATA)) {
+                /* assume that sectors which are unallocated in the input
+                 * image are present in both the output's and input's base
+                 * images */
+                s->status = BLK_BACKING_FILE;
+            } else {
+                s->status = BLK_DATA;
+            }
+        }
+        s->sector_next_status = sector_num + n;
+    }
+
+    n = MIN(n, s->sector_next_status - sector_num);
+    if (s->status == BLK_DATA) {
+        n = MIN(n, s->buf_sectors);
+
+        /* round down request length to an aligned sector, but
+         * do not bother doing this on short requests. They happen
+         * when we found an all-zero area, and the next sector to
+         * write will not be sector_num + n. */
+        if (s->cluster_sectors > 0 && n >= s->cluster_sectors) {
+            int64_t next_aligned_sector = (sector_num + n);
+            next_aligned_sector -= next_aligned_sector % s->cluster_sectors;
+            if (sector_num + n > next_aligned_sector) {
+                n = next_aligned_sector - sector_num;
+            }
+        }
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    assert(nb_sectors <= s->buf_sectors);
+    while (nb_sectors > 0) {
+        int64_t src_cur_offset;
+        int src_cur;
+
+        /* A compressed cluster can span two source images */
+        convert_select_part(s, sector_num, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors,
+                s->src_sectors[src_cur] - (sector_num - src_cur_offset));
+
+        iov.iov_base = buf;
+        iov.iov_len = n << BDRV_SECTOR_BITS;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[src_cur], sector_num - src_cur_offset,
+                            n, &qiov);
+        if (ret < 0) {
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    if (s->compressed) {
+        if (buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE)) {
+            return 0;
+        }
+        return bdrv_write_compressed(s->target, sector_num, buf, nb_sectors);
+    }
+
+    while (nb_sectors > 0) {
+        int n = nb_sectors;
+
+        /* NOTE: at the same time we convert, we do not write zero
+           sectors to have a chance to compress the image. Ideally, we
+           should add a specific call to have the info to go faster */
+        if (!s->has_zero_init ||
+            is_allocated_sectors_min(buf, n, &n, s->min_sparse)) {
+            iov.iov_base = buf;
+            iov.iov_len = n << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+/*
+ * Copy the sectors with bdrv_co_copy_range().  If the copy cannot be
+ * offloaded, fall back to reading into @buf and writing it, for this and
+ * all following requests.
+ */
+static int coroutine_fn convert_co_copy_range(ImgConvertState *s,
+                                              int64_t sector_num,
+                                              int nb_sectors, uint8_t *buf)
+{
+    int64_t copied = 0;
+    int n, ret;
+
+    while (copied < nb_sectors) {
+        int64_t src_cur_offset;
+        int src_cur;
+
+        convert_select_part(s, sector_num + copied, &src_cur, &src_cur_offset);
+        n = MIN(nb_sectors - copied,
+                s->src_sectors[src_cur] -
+                (sector_num + copied - src_cur_offset));
+
+        ret = bdrv_co_copy_range(s->src[src_cur],
+                                 sector_num + copied - src_cur_offset,
+                                 s->target, sector_num + copied, n);
+        if (ret == -ENOTSUP) {
+            s->copy_range = false;
+            break;
+        } else if (ret < 0) {
+            return ret;
+        }
+        copied += n;
+    }
+
+    if (copied < nb_sectors) {
+        nb_sectors -= copied;
+        sector_num += copied;
+        ret = convert_co_read(s, sector_num, nb_sectors, buf);
+        if (ret < 0) {
+            return ret;
+        }
+        return convert_co_write(s, sector_num, nb_sectors, buf);
+    }
+    return 0;
+}
+
+/*
+ * Each coroutine takes the next request from s->sector_num, reads it into
+ * its own buffer and writes it; the requests of the coroutines overlap.
+ * Unless out of order writes are allowed, a coroutine waits before writing
+ * until all the sectors before its request are written.
+ */
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (1) {
+        enum ImgConvertBlockStatus status;
+        bool copy_range;
+        int64_t sector_num;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != -EINPROGRESS || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", s->sector_num, strerror(-n));
+            s->ret = n;
+            break;
+        }
+        sector_num = s->sector_num;
+        status = s->status;
+        copy_range = s->copy_range;
+        /* the other coroutines can go on with the next request already */
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            s->allocated_done += n;
+            qemu_progress_print(100.0 * s->allocated_done /
+                                s->allocated_sectors, 0);
+
+            /* offloaded copies read and write when it is time to write */
+            ret = copy_range ? 0 : convert_co_read(s, sector_num, n, buf);
+            if (ret < 0) {
+                error_report("error while reading sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == -EINPROGRESS) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == -EINPROGRESS && status == BLK_DATA) {
+            if (copy_range) {
+                ret = convert_co_copy_range(s, sector_num, n, buf);
+            } else {
+                ret = convert_co_write(s, sector_num, n, buf);
+            }
+            if (ret < 0) {
+                error_report("error while %s sector %" PRId64 ": %s",
+                             copy_range ? "copying" : "writing",
+                             sector_num, strerror(-ret));
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* wake up the coroutine waiting to write what follows */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    /* we have wait_sector_num[index] == -1, so it can't
+                     * enter us back */
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+    if (!s->running_coroutines && s->ret == -EINPROGRESS) {
+        /* the convert job finished successfully */
+        s->ret = 0;
+    }
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    int64_t sector_num = 0;
+    int ret, i, n;
+
+    /* Check whether we have zero initialisation or can get it efficiently */
+    s->has_zero_init = s->min_sparse ? bdrv_has_zero_init(s->target) : false;
+    if (!s->compressed && !s->has_zero_init &&
+        bdrv_can_write_zeroes_with_unmap(s->target)) {
+        ret = bdrv_make_zero(s->target, BDRV_REQ_MAY_UNMAP);
+        if (ret < 0) {
+            return ret;
+        }
+        s->has_zero_init = true;
+    }
+
+    /* For compressed images, only one cluster can be copied at a time */
+    if (s->compressed) {
+        if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
+            error_report("invalid cluster size");
+            return -EINVAL;
+        }
+        s->buf_sectors = s->cluster_sectors;
+    }
+
+    /* Count the sectors to copy, for the progress report */
+    while (sector_num < s->total_sectors) {
+        n = convert_iteration_sectors(s, sector_num);
+        if (n < 0) {
+            error_report("error while reading block status of sector %"
+                         PRId64 ": %s", sector_num, strerror(-n));
+            return n;
+        }
+        if (s->status == BLK_DATA) {
+            s->allocated_sectors += n;
+        }
+        sector_num += n;
+    }
+
+    /* Do the copy */
+    s->sector_next_status = 0;
+    s->ret = -EINPROGRESS;
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        aio_poll(bdrv_get_aio_context(s->target), true);
+    }
+
+    if (s->compressed && !s->ret) {
+        /* signal EOF to align */
+        ret = bdrv_write_compressed(s->target, 0, NULL, 0);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, n, n1, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    int c, bs_n, bs_i, compress, cluster_sectors, skip_create;
     int64_t ret = 0;
     int progress = 0, flags, src_flags;
     const char *fmt, *out_fmt, *cache, *src_cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     int64_t *bs_sectors = NULL;
-    uint8_t * buf = NULL;
     size_t bufsectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE;
-    const uint8_t *buf1;
+    int64_t buf_size = 0;
     BlockDriverInfo bdi;
     QemuOpts *opts = NULL;
     QemuOptsList *create_opts = NULL;
@@ -1216,6 +1645,10 @@ static int img_convert(int argc, char **argv)
     bool quiet = false;
     Error *local_err = NULL;
     QemuOpts *sn_opts = NULL;
+    ImgConvertState state;
+    int num_coroutines = 8;
+    bool wr_in_order = true;
+    bool copy_range = false;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1225,7 +1658,7 @@ static int img_convert(int argc, char **argv)
     compress = 0;
     skip_create = 0;
     for(;;) {
-        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn");
+        c = getopt(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnm:Wr:C");
         if (c == -1) {
             break;
         }
@@ -1315,6 +1748,41 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'm':
+        {
+            char *end;
+            errno = 0;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (errno || *end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
+        case 'C':
+            copy_range = true;
+            break;
+        case 'r':
+        {
+            char *end;
+            buf_size = strtosz_suffix(optarg, &end, STRTOSZ_DEFSUFFIX_B);
+            if (buf_size < 0 || *end || buf_size % BDRV_SECTOR_SIZE ||
+                buf_size < BDRV_SECTOR_SIZE ||
+                buf_size > (int64_t)32768 * BDRV_SECTOR_SIZE) {
+                error_report("Invalid request size, it must be a multiple "
+                             "of 512 bytes, up to 16M");
+                ret = -1;
+                goto fail_getopt;
+            }
+            break;
+        }
         }
     }
 
@@ -1492,18 +1960,17 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-
     /* increase bufsectors from the default 4096 (2M) if opt_transfer_length
      * or discard_alignment of the out_bs is greater. Limit to 32768 (16MB)
-     * as maximum. */
-    bufsectors = MIN(32768,
-                     MAX(bufsectors, MAX(out_bs->bl.opt_transfer_length,
-                                         out_bs->bl.discard_alignment))
-                    );
-
-    buf = qemu_blockalign(out_bs, bufsectors * BDRV_SECTOR_SIZE);
+     * as maximum.  An explicit -r size takes precedence. */
+    if (buf_size) {
+        bufsectors = buf_size / BDRV_SECTOR_SIZE;
+    } else {
+        bufsectors = MIN(32768,
+                         MAX(bufsectors, MAX(out_bs->bl.opt_transfer_length,
+                                             out_bs->bl.discard_alignment))
+                        );
+    }
 
     if (skip_create) {
         int64_t output_sectors = bdrv_nb_sectors(out_bs);
@@ -1531,203 +1998,29 @@ static int img_convert(int argc, char **argv)
         cluster_sectors = bdi.cluster_size / BDRV_SECTOR_SIZE;
     }
 
-    if (compress) {
-        if (cluster_sectors <= 0 || cluster_sectors > bufsectors) {
-            error_report("invalid cluster size");
-            ret = -1;
-            goto out;
-        }
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors[bs_i]) {
-                    bs_offset += bs_sectors[bs_i];
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors[bs_i]); */
-                }
-                assert (bs_num < bs_sectors[bs_i]);
-
-                nlow = remainder > bs_sectors[bs_i] - bs_num
-                    ? bs_sectors[bs_i] - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(100.0 * sector_num / total_sectors, 0);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int64_t sectors_to_read, sectors_read, sector_num_next_status;
-        bool count_allocated_sectors;
-        int has_zero_init = min_sparse ? bdrv_has_zero_init(out_bs) : 0;
-
-        if (!has_zero_init && bdrv_can_write_zeroes_with_unmap(out_bs)) {
-            ret = bdrv_make_zero(out_bs, BDRV_REQ_MAY_UNMAP);
-            if (ret < 0) {
-                goto out;
-            }
-            has_zero_init = 1;
-        }
-
-        sectors_to_read = total_sectors;
-        count_allocated_sectors = progress && (out_baseimg || has_zero_init);
-restart:
-        sector_num = 0; // total number of sectors converted so far
-        sectors_read = 0;
-        sector_num_next_status = 0;
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                if (count_allocated_sectors) {
-                    sectors_to_read = sectors_read;
-                    count_allocated_sectors = false;
-                    goto restart;
-                }
-                ret = 0;
-                break;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors[bs_i]) {
-                bs_offset += bs_sectors[bs_i];
-                bs_i ++;
-                assert (bs_i < bs_n);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors[bs_i]); */
-            }
-
-            if ((out_baseimg || has_zero_init) &&
-                sector_num >= sector_num_next_status) {
-                n = nb_sectors > INT_MAX ? INT_MAX : nb_sectors;
-                ret = bdrv_get_block_status(bs[bs_i], sector_num - bs_offset,
-                                            n, &n1);
-                if (ret < 0) {
-                    error_report("error while reading block status of sector %"
-                                 PRId64 ": %s", sector_num - bs_offset,
-                                 strerror(-ret));
-                    goto out;
-                }
-                /* If the output image is zero initialized, we are not working
-                 * on a shared base and the input is zero we can skip the next
-                 * n1 sectors */
-                if (has_zero_init && !out_baseimg && (ret & BDRV_BLOCK_ZERO)) {
-                    sector_num += n1;
-                    continue;
-                }
-                /* If the output image is being created as a copy on write
-                 * image, assume that sectors which are unallocated in the
-                 * input image are present in both the output's and input's
-                 * base images (no need to copy them). */
-                if (out_baseimg) {
-                    if (!(ret & BDRV_BLOCK_DATA)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image.
-                     * Copy only those as they may be followed by unallocated
-                     * sectors. */
-                    nb_sectors = n1;
-                }
-                /* avoid redundant callouts to get_block_status */
-                sector_num_next_status = sector_num + n1;
-            }
-
-            n = MIN(nb_sectors, bufsectors);
-
-            /* round down request length to an aligned sector, but
-             * do not bother doing this on short requests. They happen
-             * when we found an all-zero area, and the next sector to
-             * write will not be sector_num + n. */
-            if (cluster_sectors > 0 && n >= cluster_sectors) {
-                int64_t next_aligned_sector = (sector_num + n);
-                next_aligned_sector -= next_aligned_sector % cluster_sectors;
-                if (sector_num + n > next_aligned_sector) {
-                    n = next_aligned_sector - sector_num;
-                }
-            }
-
-            n = MIN(n, bs_sectors[bs_i] - (sector_num - bs_offset));
-
-            sectors_read += n;
-            if (count_allocated_sectors) {
-                sector_num += n;
-                continue;
-            }
+    /* Drivers that can't compress from several coroutines at once get
+     * their clusters one after the other */
+    if (compress && !out_bs->drv->bdrv_co_write_compressed) {
+        wr_in_order = true;
+    }
+
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .target_has_backing = (bool) out_baseimg,
+        .min_sparse         = min_sparse,
+        .cluster_sectors    = cluster_sectors,
+        .buf_sectors        = bufsectors,
+        .wr_in_order        = wr_in_order,
+        .copy_range         = copy_range && !compress,
+        .num_coroutines     = num_coroutines,
+    };
+    ret = convert_do_copy(&state);
 
-            n1 = n;
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                if (!has_zero_init ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(100.0 * sectors_read / sectors_to_read, 0);
-        }
-    }
 out:
     if (!ret) {
         qemu_progress_print(100, 0);
@@ -1735,7 +2028,6 @@ out:
     qemu_progress_end();
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
-    qemu_vfree(buf);
     qemu_opts_del(sn_opts);
     if (out_bs) {
         bdrv_unref(out_bs);
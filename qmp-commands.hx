@@ -660,6 +660,29 @@ Example:
 -> { "execute": "migrate_cancel" }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch an ongoing migration that has the "x-postcopy-ram" capability set
+to postcopy mode: the guest is started on the destination and the pages
+that were not migrated yet are fetched from the source on demand.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 {
         .name       = "migrate-set-cache-size",
@@ -1048,6 +1071,7 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
+                      "bitmap:s?,max-workers:i?,max-chunk:i?,"
                       "on-source-error:s?,on-target-error:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_backup,
     },
@@ -1075,11 +1099,18 @@ Arguments:
             (json-string, optional)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for only the sectors that are dirty in "bitmap"
   (MirrorSyncMode).
 - "mode": whether and how QEMU should create a new image
           (NewImageMode, optional, default 'absolute-paths')
 - "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": dirty bitmap to use when "sync" is "incremental"; it is cleared
+            when the backup succeeds (json-string, optional)
+- "max-workers": the maximum number of copy requests in flight, between 1
+                 and 64 (json-int, optional, default 8)
+- "max-chunk": the maximum size of one copy request in bytes; a multiple of
+               64 KiB, at most 64 MiB (json-int, optional, default 1 MiB)
 - "on-source-error": the action to take on an error on the source, default
                      'report'.  'stop' and 'enospc' can only be used
                      if the block device supports io-status.
@@ -1094,6 +1125,87 @@ Example:
                                                "sync": "full",
                                                "target": "backup.img" } }
 <- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "node:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a dirty bitmap with a name on the device, and start tracking the writes.
+
+Arguments:
+
+- "node": device/node on which to create dirty bitmap (json-string)
+- "name": name of the new dirty bitmap (json-string)
+- "granularity": granularity to track writes with (int, optional)
+- "persistent": store the bitmap in the image when it is closed, so that it
+                survives a restart of QEMU (json-bool, optional)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "node": "drive0",
+                                                   "name": "bitmap0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "node:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Stop write tracking and remove the dirty bitmap that was created with
+block-dirty-bitmap-add.
+
+Arguments:
+
+- "node": device/node on which to remove dirty bitmap (json-string)
+- "name": name of the dirty bitmap to remove (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "node": "drive0",
+                                                      "name": "bitmap0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "node:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Reset the dirty bitmap associated with a node so that an incremental backup
+from this point in time forward will only backup clusters modified after this
+clear operation.
+
+Arguments:
+
+- "node": device/node on which to remove dirty bitmap (json-string)
+- "name": name of the dirty bitmap to remove (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "node": "drive0",
+                                                           "name": "bitmap0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1662,7 +1774,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1688,6 +1800,7 @@ Arguments:
 - "iops_rd_max":  read I/O operations max (json-int)
 - "iops_wr_max":  write I/O operations max (json-int)
 - "iops_size":  I/O size in bytes when limiting (json-int)
+- "group": throttle group name (json-string, optional)
 
 Example:
 
@@ -1704,7 +1817,8 @@ Example:
                                                "iops_max": 0,
                                                "iops_rd_max": 0,
                                                "iops_wr_max": 0,
-                                               "iops_size": 0 } }
+                                               "iops_size": 0,
+                                               "group": "tenant1" } }
 <- { "return": {} }
 
 EQMP
@@ -2102,6 +2216,7 @@ Each json-object contain the following:
          - "iops_rd_max":  read I/O operations max (json-int)
          - "iops_wr_max":  write I/O operations max (json-int)
          - "iops_size": I/O size when limiting by iops (json-int)
+         - "group": throttle group name (json-string, optional)
          - "detect_zeroes": detect and optimize zero writing (json-string)
              - Possible values: "off", "on", "unmap"
          - "image": the detail of the image, it is a json-object containing
@@ -2413,6 +2528,9 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns, 0 if polling is disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink factor, 0 for none (json-int)
 
 Example:
 
@@ -2421,11 +2539,17 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0
          }
       ]
    }
@@ -3012,7 +3136,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "setup", "active", "completed", "failed", "cancelled"
+     - Possible values: "setup", "active", "postcopy-active", "completed",
+                        "failed", "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -3054,6 +3179,9 @@ The main json-object contains the following:
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of XBRZRLE page cache misses
+         - "cache-hit": number of XBRZRLE page cache hits
+         - "cache-evictions": number of pages dropped from the XBZRLE
+           page cache to make room for other ones
          - "cache-miss-rate": rate of XBRZRLE page cache misses
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
@@ -3163,6 +3291,8 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
+            "cache-hit":2441099,
+            "cache-evictions":1023,
             "cache-miss-rate":0.123,
             "overflow":34434
          }
@@ -3184,6 +3314,10 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": XBZRLE support
+- "compress": multiple compression threads state
+- "x-postcopy-ram": postcopy mode for RAM migration
+- "x-multifd": RAM migration over several parallel channels
+- "dirty-bitmaps": migration of the named dirty bitmaps
 
 Arguments:
 
@@ -3208,6 +3342,10 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "compress": multiple compression threads state (json-bool)
+         - "x-postcopy-ram": postcopy mode state (json-bool)
+         - "x-multifd": multifd state (json-bool)
+         - "dirty-bitmaps": dirty bitmap migration state (json-bool)
 
 Arguments:
 
@@ -3224,6 +3362,67 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "compress-level": set compression level during migration (json-int)
+- "compress-threads": set compression thread count for migration (json-int)
+- "decompress-threads": set decompression thread count for migration (json-int)
+- "x-multifd-channels": set the number of multifd channels (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "compress-level": 1 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+            "x-multifd-channels:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "compress-level" : compression level value (json-int)
+         - "compress-threads" : compression thread count value (json-int)
+         - "decompress-threads" : decompression thread count value (json-int)
+         - "x-multifd-channels" : multifd channel count value (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "decompress-threads": 2,
+         "compress-threads": 8,
+         "compress-level": 1,
+         "x-multifd-channels": 2
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
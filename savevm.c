@@ -33,6 +33,8 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "qemu/error-report.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
@@ -582,6 +584,140 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
     vmstate_save_state(f, se->vmsd, se->opaque);
 }
 
+static struct mig_cmd_args {
+    ssize_t     len; /* -1 = variable */
+    const char *name;
+} mig_cmd_args[] = {
+    [MIG_CMD_INVALID]          = { .len = -1, .name = "INVALID" },
+    [MIG_CMD_OPEN_RETURN_PATH] = { .len =  0, .name = "OPEN_RETURN_PATH" },
+    [MIG_CMD_POSTCOPY_ADVISE]  = { .len = 16, .name = "POSTCOPY_ADVISE" },
+    [MIG_CMD_POSTCOPY_LISTEN]  = { .len =  0, .name = "POSTCOPY_LISTEN" },
+    [MIG_CMD_POSTCOPY_RUN]     = { .len =  0, .name = "POSTCOPY_RUN" },
+    [MIG_CMD_POSTCOPY_RAM_DISCARD] = {
+                                   .len = -1, .name = "POSTCOPY_RAM_DISCARD" },
+    [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
+    [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
+};
+
+/* Send a 'QEMU_VM_COMMAND' type element with the command
+ * and associated data.
+ */
+static void qemu_savevm_command_send(QEMUFile *f,
+                                     enum qemu_vm_cmd command,
+                                     uint16_t len,
+                                     uint8_t *data)
+{
+    trace_savevm_command_send(command, len);
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, (uint16_t)command);
+    qemu_put_be16(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+/* Ask the destination to open a return path to us */
+void qemu_savevm_send_open_return_path(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_OPEN_RETURN_PATH, 0, NULL);
+}
+
+/* We have a buffer of data to send; we don't want that all to be loaded
+ * by the command itself, so the command contains just the length of the
+ * extra buffer that we then send straight after it.
+ *
+ * Returns:
+ *    0 on success
+ *    -ve on error
+ */
+int qemu_savevm_send_packaged(QEMUFile *f, const GByteArray *pkg)
+{
+    uint32_t tmp;
+
+    if (pkg->len > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("%s: Unreasonably large packaged state: %u",
+                     __func__, pkg->len);
+        return -1;
+    }
+
+    tmp = cpu_to_be32(pkg->len);
+
+    trace_savevm_send_packaged();
+    qemu_savevm_command_send(f, MIG_CMD_PACKAGED, 4, (uint8_t *)&tmp);
+
+    qemu_put_buffer(f, pkg->data, pkg->len);
+    qemu_fflush(f);
+
+    return 0;
+}
+
+/* Send prior to any postcopy transfer; tell the destination which page
+ * sizes we use so that it can check it is able to take the pages.
+ */
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    uint64_t tmp[2];
+
+    tmp[0] = cpu_to_be64(getpagesize());
+    tmp[1] = cpu_to_be64(TARGET_PAGE_SIZE);
+
+    trace_savevm_send_postcopy_advise();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 16, (uint8_t *)tmp);
+}
+
+/* Sent from the source to tell the destination to drop pages it
+ * received during precopy but that have been dirtied since.
+ *
+ *  name:  RAMBlock name that these entries are part of
+ *  len: Number of page entries
+ *  start_list: 'len' addresses (offsets into the RAMBlock)
+ *  length_list: 'len' lengths in bytes
+ *
+ *  The layout is:
+ *      byte   Length of name field
+ *      n x byte RAM block name
+ *      [be64 start, be64 length] x len
+ */
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *name,
+                                           uint16_t len,
+                                           uint64_t *start_list,
+                                           uint64_t *length_list)
+{
+    uint8_t *buf;
+    uint16_t tmplen;
+    uint16_t t;
+    size_t name_len = strlen(name);
+
+    trace_savevm_send_postcopy_ram_discard(name, len);
+    assert(name_len < 256);
+    buf = g_malloc0(1 + name_len + len * 16);
+    buf[0] = name_len;
+    memcpy(buf + 1, name, name_len);
+    tmplen = 1 + name_len;
+
+    for (t = 0; t < len; t++) {
+        stq_be_p(buf + tmplen, start_list[t]);
+        tmplen += 8;
+        stq_be_p(buf + tmplen, length_list[t]);
+        tmplen += 8;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, tmplen, buf);
+    g_free(buf);
+}
+
+/* Get the destination into a state where it can receive postcopy data. */
+void qemu_savevm_send_postcopy_listen(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_listen();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_LISTEN, 0, NULL);
+}
+
+/* Kick the destination into running */
+void qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    trace_savevm_send_postcopy_run();
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, 0, NULL);
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -690,15 +826,11 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static void qemu_savevm_state_complete_iterable(QEMUFile *f)
 {
     SaveStateEntry *se;
     int ret;
 
-    trace_savevm_state_complete();
-
-    cpu_synchronize_all_states();
-
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
@@ -720,6 +852,11 @@ void qemu_savevm_state_complete(QEMUFile *f)
             return;
         }
     }
+}
+
+static void qemu_savevm_state_complete_devices(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -743,6 +880,44 @@ void qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se);
         trace_savevm_section_end(se->idstr, se->section_id);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    trace_savevm_state_complete();
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_complete_iterable(f);
+    if (qemu_file_get_error(f)) {
+        return;
+    }
+    qemu_savevm_state_complete_devices(f);
+
+    qemu_put_byte(f, QEMU_VM_EOF);
+    qemu_fflush(f);
+}
+
+/*
+ * Send the state of the non-iterable devices, used at the switch to
+ * postcopy when the iterable sections are still going.
+ */
+void qemu_savevm_state_device_only(QEMUFile *f)
+{
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_complete_devices(f);
+}
+
+/*
+ * Finish the iterable sections once a postcopy migration has sent all
+ * the outstanding data; the devices have been sent already.
+ */
+void qemu_savevm_state_postcopy_complete(QEMUFile *f)
+{
+    trace_savevm_state_postcopy_complete();
+
+    qemu_savevm_state_complete_iterable(f);
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
@@ -871,46 +1046,380 @@ static SaveStateEntry *find_se(const char *idstr, int instance_id)
     return NULL;
 }
 
-typedef struct LoadStateEntry {
+struct LoadStateEntry {
     QLIST_ENTRY(LoadStateEntry) entry;
     SaveStateEntry *se;
     int section_id;
     int version_id;
-} LoadStateEntry;
+};
 
-int qemu_loadvm_state(QEMUFile *f)
+/* Returned by a command handler when the caller must stop reading the
+ * stream, because it now belongs to the postcopy listen thread.
+ */
+#define LOADVM_QUIT     1
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis);
+
+static void loadvm_free_handlers(MigrationIncomingState *mis)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, &mis->loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+/*
+ * Triggered by a postcopy_listen command; this thread takes over reading
+ * the input stream, leaving the main thread free to carry on loading the rest
+ * of the device state (from RAM).
+ * (TODO:This could do with being in a postcopy file - but there again it's
+ * just another input loop, not that postcopy specific)
+ */
+static void *postcopy_ram_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int load_res;
+
+    trace_postcopy_ram_listen_thread_start();
+
+    load_res = qemu_loadvm_state_main(f, mis);
+    if (load_res == 0) {
+        load_res = qemu_file_get_error(f);
+    }
+
+    trace_postcopy_ram_listen_thread_exit();
+    if (load_res < 0) {
+        /* The guest is already running here; with part of its RAM still
+         * on the source there is no way to carry on.
+         */
+        error_report("%s: loadvm failed: %d", __func__, load_res);
+        exit(EXIT_FAILURE);
+    }
+
+    qemu_mutex_lock_iothread();
+    if (postcopy_ram_incoming_cleanup(mis)) {
+        error_report("%s: Failed to cleanup postcopy", __func__);
+    }
+    postcopy_state_set(mis, POSTCOPY_INCOMING_END);
+    migrate_send_rp_shut(mis, 0);
+
+    qemu_fclose(f);
+    free_xbzrle_decoded_buf();
+    migrate_decompress_threads_join();
+    migrate_multifd_recv_threads_join();
+    loadvm_free_handlers(mis);
+    migration_incoming_state_destroy();
+    qemu_mutex_unlock_iothread();
+
+    return NULL;
+}
+
+/* The source may want to switch to postcopy later; check we can do it */
+static int loadvm_postcopy_handle_advise(MigrationIncomingState *mis,
+                                         QEMUFile *f)
+{
+    PostcopyState ps = postcopy_state_get(mis);
+    uint64_t remote_hps, remote_tps;
+
+    trace_loadvm_postcopy_handle_advise();
+    if (ps != POSTCOPY_INCOMING_NONE) {
+        error_report("CMD_POSTCOPY_ADVISE in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    if (!postcopy_ram_supported_by_host()) {
+        return -1;
+    }
+
+    remote_hps = qemu_get_be64(f);
+    if (remote_hps != getpagesize())  {
+        /*
+         * Some combinations of mismatch are probably possible but it gets
+         * a bit more complicated.  In particular we need to place whole
+         * host pages on the dest at once, and we need to ensure that we
+         * handle dirtying to make sure we never end up sending part of
+         * a hostpage on it's own.
+         */
+        error_report("Postcopy needs matching host page sizes (s=%d d=%d)",
+                     (int)remote_hps, getpagesize());
+        return -1;
+    }
+
+    remote_tps = qemu_get_be64(f);
+    if (remote_tps != TARGET_PAGE_SIZE) {
+        error_report("Postcopy needs matching target page sizes (s=%d d=%d)",
+                     (int)remote_tps, TARGET_PAGE_SIZE);
+        return -1;
+    }
+
+    if (postcopy_ram_prepare_discard(mis)) {
+        return -1;
+    }
+
+    postcopy_state_set(mis, POSTCOPY_INCOMING_ADVISE);
+
+    return 0;
+}
+
+/* After postcopy we will be told to throw some pages away since they're
+ * dirty and will have to be demand fetched.  Must happen before CPU is
+ * started.
+ * There can be 0..many of these messages, each encoding multiple pages.
+ */
+static int loadvm_postcopy_ram_handle_discard(MigrationIncomingState *mis,
+                                              QEMUFile *f, uint16_t len)
+{
+    PostcopyState ps = postcopy_state_set(mis, POSTCOPY_INCOMING_DISCARD);
+    char ramid[256];
+    uint8_t tmp;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
-        return -EINVAL;
+    trace_loadvm_postcopy_ram_handle_discard();
+
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD in wrong postcopy state (%d)",
+                     ps);
+        return -1;
     }
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC) {
+    if (len < 1) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+    tmp = qemu_get_byte(f);
+    len--;
+    if (len < tmp) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid name length (%d)",
+                     tmp);
+        return -1;
+    }
+    qemu_get_buffer(f, (uint8_t *)ramid, tmp);
+    ramid[tmp] = '\0';
+    len -= tmp;
+
+    if (len % 16) {
+        error_report("CMD_POSTCOPY_RAM_DISCARD invalid length (%d)", len);
+        return -1;
+    }
+
+    while (len) {
+        uint64_t start_addr, block_length;
+
+        start_addr = qemu_get_be64(f);
+        block_length = qemu_get_be64(f);
+        len -= 16;
+
+        ret = postcopy_ram_discard_range(mis, ramid, start_addr,
+                                         block_length);
+        if (ret) {
+            return ret;
+        }
+    }
+    trace_loadvm_postcopy_ram_handle_discard_end();
+
+    return qemu_file_get_error(f);
+}
+
+/* After this message we must be able to immediately receive postcopy data */
+static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_get(mis);
+
+    trace_loadvm_postcopy_handle_listen();
+    if (ps != POSTCOPY_INCOMING_ADVISE && ps != POSTCOPY_INCOMING_DISCARD) {
+        error_report("CMD_POSTCOPY_LISTEN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+    if (!mis->to_src_file) {
+        error_report("CMD_POSTCOPY_LISTEN without a return path");
+        return -1;
+    }
+
+    /*
+     * Sensitise RAM - can now generate requests for blocks that don't exist
+     * However, at this point the CPU shouldn't be running, and the IO
+     * shouldn't be doing anything yet so don't actually expect requests
+     */
+    if (postcopy_ram_enable_notify(mis)) {
+        return -1;
+    }
+
+    postcopy_state_set(mis, POSTCOPY_INCOMING_LISTENING);
+
+    /* The listen thread reads the stream with blocking reads from now on,
+     * rather than yielding from the incoming migration coroutine.
+     */
+    qemu_set_block(qemu_get_fd(mis->from_src_file));
+    mis->have_listen_thread = true;
+    qemu_thread_create(&mis->listen_thread, "postcopy/listen",
+                       postcopy_ram_listen_thread, mis->from_src_file,
+                       QEMU_THREAD_DETACHED);
+
+    return 0;
+}
+
+/* After all discards we can start running and asking for pages */
+static int loadvm_postcopy_handle_run(MigrationIncomingState *mis)
+{
+    PostcopyState ps = postcopy_state_set(mis, POSTCOPY_INCOMING_RUNNING);
+    Error *local_err = NULL;
+
+    trace_loadvm_postcopy_handle_run();
+    if (ps != POSTCOPY_INCOMING_LISTENING) {
+        error_report("CMD_POSTCOPY_RUN in wrong postcopy state (%d)", ps);
+        return -1;
+    }
+
+    /* The device state has been loaded from the package by now */
+    cpu_synchronize_all_post_init();
+
+    qemu_announce_self();
+
+    bdrv_clear_incoming_migration_all();
+    /* Make sure all file formats flush their mutable metadata */
+    bdrv_invalidate_cache_all(&local_err);
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        return -1;
+    }
+
+    if (autostart) {
+        /* Hold onto your hats, starting the CPU */
+        vm_start();
+    } else {
+        /* leave it paused and let management decide when to start the CPU */
+        runstate_set(RUN_STATE_PAUSED);
+    }
+
+    return 0;
+}
+
+/**
+ * Immediately following this command is a blob of data containing an embedded
+ * chunk of migration stream; read it and load it.
+ *
+ * @mis: Incoming state
+ * @f: The main migration stream
+ *
+ * Returns: Negative values on error, LOADVM_QUIT once the listen thread
+ *          has taken over the stream.
+ */
+static int loadvm_handle_cmd_packaged(MigrationIncomingState *mis,
+                                      QEMUFile *f)
+{
+    int ret;
+    uint32_t length;
+    GByteArray *buffer;
+    QEMUFile *packf;
+
+    length = qemu_get_be32(f);
+    trace_loadvm_handle_cmd_packaged(length);
+
+    if (length > MAX_VM_CMD_PACKAGED_SIZE) {
+        error_report("Unreasonably large packaged state: %u", length);
+        return -1;
+    }
+
+    buffer = g_byte_array_sized_new(length);
+    g_byte_array_set_size(buffer, length);
+    ret = qemu_get_buffer(f, buffer->data, length);
+    if (ret != length) {
+        g_byte_array_free(buffer, TRUE);
+        error_report("CMD_PACKAGED: Buffer receive fail ret=%d length=%d",
+                     ret, length);
+        return (ret < 0) ? ret : -EAGAIN;
+    }
+
+    packf = qemu_bufopen("r", buffer);
+
+    ret = qemu_loadvm_state_main(packf, mis);
+    trace_loadvm_handle_cmd_packaged_main(ret);
+    qemu_fclose(packf);
+    g_byte_array_free(buffer, TRUE);
+
+    if (ret == 0 && mis->have_listen_thread) {
+        return LOADVM_QUIT;
+    }
+    return ret;
+}
+
+/*
+ * Process an incoming 'QEMU_VM_COMMAND'
+ * negative return on error (will issue error message)
+ * 0 just a normal return
+ * LOADVM_QUIT All good, but exit the loop
+ */
+static int loadvm_process_command(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint16_t cmd;
+    uint16_t len;
+
+    cmd = qemu_get_be16(f);
+    len = qemu_get_be16(f);
+
+    trace_loadvm_process_command(cmd, len);
+    if (cmd >= MIG_CMD_MAX || cmd == MIG_CMD_INVALID) {
+        error_report("MIG_CMD 0x%x unknown (len 0x%x)", cmd, len);
         return -EINVAL;
     }
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+    if (mig_cmd_args[cmd].len != -1 && mig_cmd_args[cmd].len != len) {
+        error_report("%s received with bad length - expecting %zd, got %d",
+                     mig_cmd_args[cmd].name, mig_cmd_args[cmd].len, len);
+        return -ERANGE;
     }
-    if (v != QEMU_VM_FILE_VERSION) {
-        return -ENOTSUP;
+
+    switch (cmd) {
+    case MIG_CMD_OPEN_RETURN_PATH:
+        if (mis->to_src_file) {
+            error_report("CMD_OPEN_RETURN_PATH called when RP already open");
+            /* Not really a problem, so don't give up */
+            return 0;
+        }
+        mis->to_src_file = qemu_file_get_return_path(f);
+        if (!mis->to_src_file) {
+            error_report("CMD_OPEN_RETURN_PATH failed");
+            return -1;
+        }
+        break;
+
+    case MIG_CMD_POSTCOPY_ADVISE:
+        return loadvm_postcopy_handle_advise(mis, f);
+
+    case MIG_CMD_POSTCOPY_LISTEN:
+        return loadvm_postcopy_handle_listen(mis);
+
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run(mis);
+
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(mis, f, len);
+
+    case MIG_CMD_PACKAGED:
+        return loadvm_handle_cmd_packaged(mis, f);
     }
 
+    return 0;
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f, MigrationIncomingState *mis)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret;
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
         char idstr[257];
         int len;
 
+        trace_qemu_loadvm_state_section(section_type);
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
@@ -926,16 +1435,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -944,58 +1451,95 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(&mis->loadvm_handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, &mis->loadvm_handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            trace_qemu_loadvm_state_section_command(ret);
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret == LOADVM_QUIT) {
+                return 0;
             }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+int qemu_loadvm_state(QEMUFile *f)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    unsigned int v;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION) {
+        return -ENOTSUP;
+    }
+
+    ret = qemu_loadvm_state_main(f, mis);
+
+    if (mis->have_listen_thread) {
+        /* The listen thread owns the stream and the section handlers
+         * now; it finishes the incoming migration on its own.
+         */
+        return ret;
     }
 
     if (ret == 0) {
+        cpu_synchronize_all_post_init();
         ret = qemu_file_get_error(f);
     }
 
+    loadvm_free_handlers(mis);
+
     return ret;
 }
 
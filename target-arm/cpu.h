@@ -1173,6 +1173,12 @@ bool write_cpustate_to_list(ARMCPU *cpu);
 #define TARGET_PAGE_BITS 10
 #endif
 
+#if !defined(CONFIG_USER_ONLY)
+/* Store exclusive and device coprocessor registers are safe to use from
+   several vCPU threads, see HELPER(store_exclusive).  */
+#define TARGET_SUPPORTS_MTTCG 1
+#endif
+
 #if defined(TARGET_AARCH64)
 #  define TARGET_PHYS_ADDR_SPACE_BITS 48
 #  define TARGET_VIRT_ADDR_SPACE_BITS 64
@@ -20,6 +20,7 @@
 #include "exec/helper-proto.h"
 #include "internals.h"
 #include "exec/cpu_ldst.h"
+#include "qemu/main-loop.h"
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -78,7 +79,94 @@ void tlb_fill(CPUState *cs, target_ulong addr, int is_write, int mmu_idx,
         raise_exception(env, cs->exception_index);
     }
 }
+
+#endif
+
+/* Store exclusive for multi-threaded TCG and user emulation: the store
+ * only happens if memory still holds the value seen by the load exclusive,
+ * and that check is atomic against the other vCPUs.  A value that was
+ * changed and then restored in between is not detected; guest code does
+ * not rely on that.
+ *
+ * desc holds the log2 of the access size, and bit 2 is set for AArch64
+ * register pairs.  For AArch32 the doubleword forms come in as a single
+ * 8-byte value.  Returns 0 on success and 1 on failure, like STREX.
+ * User emulation handles 128-bit pairs with EXCP_STREX instead.
+ */
+uint32_t HELPER(store_exclusive)(CPUARMState *env, uint64_t addr,
+                                 uint64_t val, uint64_t val2, uint32_t desc)
+{
+    int size = desc & 3;
+    bool is_pair = desc & 4;
+    int mmu_idx = cpu_mmu_index(env);
+    uintptr_t ra = GETRA();
+    uint64_t cmpv = env->exclusive_val;
+#if !defined(CONFIG_USER_ONLY)
+    bool locked = false;
+    uint32_t ret = 1;
+#endif
+
+    if (addr != env->exclusive_addr) {
+        return 1;
+    }
+
+    if (!is_pair) {
+        return cpu_atomic_cmpxchg(env, addr, cmpv, val, 1 << size,
+                                  mmu_idx, ra) != cmpv;
+    }
+    if (size == 2) {
+        cmpv = deposit64(cmpv, 32, 32, env->exclusive_high);
+        val = deposit64(val, 32, 32, val2);
+        return cpu_atomic_cmpxchg(env, addr, cmpv, val, 8, mmu_idx, ra) != cmpv;
+    }
+
+#if defined(CONFIG_USER_ONLY)
+    abort();
+#else
+    /* 128-bit pair: the host has no cmpxchg that wide, so stop the world */
+    tlb_probe_rmw(env, addr, mmu_idx, ra);
+    tlb_probe_rmw(env, addr + 15, mmu_idx, ra);
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    tcg_start_exclusive();
+    if (helper_le_ldq_mmu(env, addr, mmu_idx, ra) == cmpv &&
+        helper_le_ldq_mmu(env, addr + 8, mmu_idx, ra) == env->exclusive_high) {
+        helper_le_stq_mmu(env, addr, val, mmu_idx, ra);
+        helper_le_stq_mmu(env, addr + 8, val2, mmu_idx, ra);
+        ret = 0;
+    }
+    tcg_end_exclusive();
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
+#endif
+}
+
+/* Coprocessor registers marked ARM_CP_IO touch device state, which is
+ * protected by the iothread mutex when vCPUs run in their own threads.
+ */
+static inline bool cp_reg_lock(const ARMCPRegInfo *ri)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if ((ri->type & ARM_CP_IO) && qemu_tcg_mttcg_enabled()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
 #endif
+    return false;
+}
+
+static inline void cp_reg_unlock(bool locked)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+#endif
+}
 
 uint32_t HELPER(add_setq)(CPUARMState *env, uint32_t a, uint32_t b)
 {
@@ -330,29 +418,41 @@ void HELPER(access_check_cp_reg)(CPUARMState *env, void *rip, uint32_t syndrome)
 void HELPER(set_cp_reg)(CPUARMState *env, void *rip, uint32_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock(ri);
 
     ri->writefn(env, ri, value);
+    cp_reg_unlock(locked);
 }
 
 uint32_t HELPER(get_cp_reg)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock(ri);
+    uint32_t res;
 
-    return ri->readfn(env, ri);
+    res = ri->readfn(env, ri);
+    cp_reg_unlock(locked);
+    return res;
 }
 
 void HELPER(set_cp_reg64)(CPUARMState *env, void *rip, uint64_t value)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock(ri);
 
     ri->writefn(env, ri, value);
+    cp_reg_unlock(locked);
 }
 
 uint64_t HELPER(get_cp_reg64)(CPUARMState *env, void *rip)
 {
     const ARMCPRegInfo *ri = rip;
+    bool locked = cp_reg_lock(ri);
+    uint64_t res;
 
-    return ri->readfn(env, ri);
+    res = ri->readfn(env, ri);
+    cp_reg_unlock(locked);
+    return res;
 }
 
 void HELPER(msr_i_pstate)(CPUARMState *env, uint32_t op, uint32_t imm)
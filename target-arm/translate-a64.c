@@ -266,7 +266,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint64_t dest)
         } else if (s->singlestep_enabled) {
             gen_exception_internal(EXCP_DEBUG);
         } else {
-            tcg_gen_exit_tb(0);
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
             s->is_jmp = DISAS_TB_JUMP;
         }
     }
@@ -444,6 +444,16 @@ static inline int fp_reg_hi_offset(DisasContext *s, int regno)
     return offsetof(CPUARMState, vfp.regs[regno * 2 + 1]);
 }
 
+/* Offset of the whole 128 bit vector Qn.  Its two 64-bit halves are
+ * stored low half first on any host, so lane-wise vector operations
+ * can treat it as one block.
+ */
+static inline int vec_full_reg_offset(DisasContext *s, int regno)
+{
+    assert_fp_access_checked(s);
+    return offsetof(CPUARMState, vfp.regs[regno * 2]);
+}
+
 /* Convenience accessors for reading and writing single and double
  * FP registers. Writing clears the upper parts of the associated
  * 128 bit vector register, as required by the architecture.
@@ -1580,7 +1590,7 @@ static void disas_uncond_b_reg(DisasContext *s, uint32_t insn)
             return;
         }
         gen_helper_exception_return(cpu_env);
-        s->is_jmp = DISAS_JUMP;
+        s->is_jmp = DISAS_EXIT;
         return;
     case 5: /* DRPS */
         if (rn != 0x1f) {
@@ -1637,9 +1647,12 @@ static void disas_b_exc_sys(DisasContext *s, uint32_t insn)
  * mandated semantics, but it works for typical guest code sequences
  * and avoids having to monitor regular stores.
  *
- * In system emulation mode only one CPU will be running at once, so
- * this sequence is effectively atomic.  In user emulation mode we
- * throw an exception and handle the atomic operation elsewhere.
+ * In system emulation mode with a single TCG thread only one CPU will
+ * be running at once, so this sequence is effectively atomic; with
+ * multi-threaded TCG and in user emulation mode the store goes through a
+ * helper that does an atomic compare-and-swap.  The host has nothing wide
+ * enough for a pair of 64-bit registers, so in user emulation mode that
+ * case throws an exception and is handled elsewhere.
  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i64 addr, int size, bool is_pair)
@@ -1670,14 +1683,38 @@ static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
     tcg_gen_mov_i64(cpu_exclusive_addr, addr);
 }
 
+static void gen_store_exclusive_parallel(DisasContext *s, int rd, int rt,
+                                         int rt2, TCGv_i64 addr, int size,
+                                         int is_pair)
+{
+    TCGv_i32 desc = tcg_const_i32(size | is_pair << 2);
+    TCGv_i32 res = tcg_temp_new_i32();
+    TCGv_i64 val2 = is_pair ? cpu_reg(s, rt2) : tcg_const_i64(0);
+
+    gen_helper_store_exclusive(res, cpu_env, addr, cpu_reg(s, rt), val2,
+                               desc);
+    tcg_gen_extu_i32_i64(cpu_reg(s, rd), res);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+
+    if (!is_pair) {
+        tcg_temp_free_i64(val2);
+    }
+    tcg_temp_free_i32(res);
+    tcg_temp_free_i32(desc);
+}
+
 #ifdef CONFIG_USER_ONLY
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i64 addr, int size, int is_pair)
 {
-    tcg_gen_mov_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | is_pair << 2 | (rd << 4) | (rt << 9) | (rt2 << 14));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
+    if (is_pair && size == 3) {
+        tcg_gen_mov_i64(cpu_exclusive_test, addr);
+        tcg_gen_movi_i32(cpu_exclusive_info, size | is_pair << 2 | (rd << 4)
+                         | (rt << 9) | (rt2 << 14));
+        gen_exception_internal_insn(s, 4, EXCP_STREX);
+        return;
+    }
+    gen_store_exclusive_parallel(s, rd, rt, rt2, addr, size, is_pair);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -1697,12 +1734,18 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
      */
     int fail_label = gen_new_label();
     int done_label = gen_new_label();
-    TCGv_i64 addr = tcg_temp_local_new_i64();
+    TCGv_i64 addr;
     TCGv_i64 tmp;
 
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_store_exclusive_parallel(s, rd, rt, rt2, inaddr, size, is_pair);
+        return;
+    }
+
     /* Copy input into a local temp so it is not trashed when the
      * basic block ends at the branch insn.
      */
+    addr = tcg_temp_local_new_i64();
     tcg_gen_mov_i64(addr, inaddr);
     tcg_gen_brcond_i64(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
 
@@ -8741,6 +8784,62 @@ static void disas_simd_three_reg_diff(DisasContext *s, uint32_t insn)
 }
 
 /* Logic op (opcode == 3) subgroup of C3.6.16. */
+/* Three-reg-same operations that map onto TCG vector operations.
+ * OP is (U << 2) | size for the logic group, and (U << 5) | opcode for
+ * the integer group.  Return false if the caller must translate the
+ * instruction element by element.
+ */
+static bool gen_simd_3same_gvec(DisasContext *s, bool logic, int op,
+                                int size, bool is_q, int rd, int rn, int rm)
+{
+    int dofs = vec_full_reg_offset(s, rd);
+    int aofs = vec_full_reg_offset(s, rn);
+    int bofs = vec_full_reg_offset(s, rm);
+    int oprsz = is_q ? 16 : 8;
+
+    if (logic) {
+        switch (op) {
+        case 0: /* AND */
+            tcg_gen_gvec_and(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        case 1: /* BIC */
+            tcg_gen_gvec_andc(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        case 2: /* ORR */
+            tcg_gen_gvec_or(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        case 4: /* EOR */
+            tcg_gen_gvec_xor(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        default:
+            return false;
+        }
+    } else {
+        switch (op) {
+        case 0x10: /* ADD */
+            tcg_gen_gvec_add(cpu_env, size, dofs, aofs, bofs, oprsz);
+            break;
+        case 0x30: /* SUB */
+            tcg_gen_gvec_sub(cpu_env, size, dofs, aofs, bofs, oprsz);
+            break;
+        case 0x31: /* CMEQ */
+            tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, size, dofs, aofs, bofs,
+                             oprsz);
+            break;
+        case 0x06: /* CMGT */
+            tcg_gen_gvec_cmp(cpu_env, TCG_COND_GT, size, dofs, aofs, bofs,
+                             oprsz);
+            break;
+        default:
+            return false;
+        }
+    }
+    if (!is_q) {
+        clear_vec_high(s, rd);
+    }
+    return true;
+}
+
 static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
 {
     int rd = extract32(insn, 0, 5);
@@ -8756,6 +8855,11 @@ static void disas_simd_3same_logic(DisasContext *s, uint32_t insn)
         return;
     }
 
+    if (gen_simd_3same_gvec(s, true, (is_u << 2) | size, size, is_q,
+                            rd, rn, rm)) {
+        return;
+    }
+
     tcg_op1 = tcg_temp_new_i64();
     tcg_op2 = tcg_temp_new_i64();
     tcg_res[0] = tcg_temp_new_i64();
@@ -9118,6 +9222,11 @@ static void disas_simd_3same_int(DisasContext *s, uint32_t insn)
         return;
     }
 
+    if (gen_simd_3same_gvec(s, false, (u << 5) | opcode, size, is_q,
+                            rd, rn, rm)) {
+        return;
+    }
+
     if (size == 3) {
         assert(is_q);
         for (pass = 0; pass < 2; pass++) {
@@ -10963,7 +11072,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
         max_insns = CF_COUNT_MASK;
     }
 
-    gen_tb_start();
+    gen_tb_start(tb);
 
     tcg_clear_temp_count();
 
@@ -11050,7 +11159,7 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
          * (and thus a tb-jump is not possible when singlestepping).
          */
         assert(dc->is_jmp != DISAS_TB_JUMP);
-        if (dc->is_jmp != DISAS_JUMP) {
+        if (dc->is_jmp != DISAS_JUMP && dc->is_jmp != DISAS_EXIT) {
             gen_a64_set_pc_im(dc->pc);
         }
         if (cs->singlestep_enabled) {
@@ -11067,10 +11176,14 @@ void gen_intermediate_code_internal_a64(ARMCPU *cpu,
         case DISAS_UPDATE:
             gen_a64_set_pc_im(dc->pc);
             /* fall through */
-        case DISAS_JUMP:
+        case DISAS_EXIT:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
             break;
+        case DISAS_JUMP:
+            /* find the next TB without leaving the generated code */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
         case DISAS_TB_JUMP:
         case DISAS_EXC:
         case DISAS_SWI:
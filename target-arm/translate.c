@@ -67,10 +67,6 @@ static TCGv_i32 cpu_R[16];
 static TCGv_i32 cpu_CF, cpu_NF, cpu_VF, cpu_ZF;
 static TCGv_i64 cpu_exclusive_addr;
 static TCGv_i64 cpu_exclusive_val;
-#ifdef CONFIG_USER_ONLY
-static TCGv_i64 cpu_exclusive_test;
-static TCGv_i32 cpu_exclusive_info;
-#endif
 
 /* FIXME:  These should be removed.  */
 static TCGv_i32 cpu_F0s, cpu_F1s;
@@ -103,12 +99,6 @@ void arm_translate_init(void)
         offsetof(CPUARMState, exclusive_addr), "exclusive_addr");
     cpu_exclusive_val = tcg_global_mem_new_i64(TCG_AREG0,
         offsetof(CPUARMState, exclusive_val), "exclusive_val");
-#ifdef CONFIG_USER_ONLY
-    cpu_exclusive_test = tcg_global_mem_new_i64(TCG_AREG0,
-        offsetof(CPUARMState, exclusive_test), "exclusive_test");
-    cpu_exclusive_info = tcg_global_mem_new_i32(TCG_AREG0,
-        offsetof(CPUARMState, exclusive_info), "exclusive_info");
-#endif
 
     a64_translate_init();
 }
@@ -807,12 +797,13 @@ static const uint8_t table_logic_cc[16] = {
     1, /* mvn */
 };
 
-/* Set PC and Thumb state from an immediate address.  */
+/* Set PC and Thumb state from an immediate address.  The Thumb bit is
+   part of the TB flags, so this is a plain jump for the TB lookup.  */
 static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 {
     TCGv_i32 tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     if (s->thumb != (addr & 1)) {
         tmp = tcg_temp_new_i32();
         tcg_gen_movi_i32(tmp, addr & 1);
@@ -825,7 +816,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv_i32 var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -3881,7 +3872,7 @@ static inline void gen_goto_tb(DisasContext *s, int n, target_ulong dest)
         tcg_gen_exit_tb((uintptr_t)tb + n);
     } else {
         gen_set_pc_im(s, dest);
-        tcg_gen_exit_tb(0);
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     }
 }
 
@@ -4995,6 +4986,61 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Three registers of the same length: the integer operations that map
+   onto TCG vector operations.  Return false if the instruction must be
+   translated pass by pass.  */
+static bool gen_neon_3r_gvec(int op, int u, int size, int q,
+                             int rd, int rn, int rm)
+{
+    uint32_t dofs = vfp_reg_offset(1, rd);
+    uint32_t aofs = vfp_reg_offset(1, rn);
+    uint32_t bofs = vfp_reg_offset(1, rm);
+    int oprsz = q ? 16 : 8;
+
+    switch (op) {
+    case NEON_3R_VADD_VSUB:
+        if (u) {
+            tcg_gen_gvec_sub(cpu_env, size, dofs, aofs, bofs, oprsz);
+        } else {
+            tcg_gen_gvec_add(cpu_env, size, dofs, aofs, bofs, oprsz);
+        }
+        break;
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_gvec_and(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        case 1: /* VBIC */
+            tcg_gen_gvec_andc(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        case 2: /* VORR */
+            tcg_gen_gvec_or(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        case 4: /* VEOR */
+            tcg_gen_gvec_xor(cpu_env, dofs, aofs, bofs, oprsz);
+            break;
+        default:
+            return false;
+        }
+        break;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, size, dofs, aofs, bofs, oprsz);
+        break;
+    case NEON_3R_VCGT:
+        if (u) {
+            return false;
+        }
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_GT, size, dofs, aofs, bofs, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -5089,6 +5135,9 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (gen_neon_3r_gvec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -7299,9 +7348,11 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.
 
-   In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   In system emulation mode with a single TCG thread only one CPU will
+   be running at once, so this sequence is effectively atomic; with
+   multi-threaded TCG and in user emulation mode, where guest threads run
+   in parallel, the store goes through a helper that does an atomic
+   compare-and-swap.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7346,14 +7397,39 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 
+static void gen_store_exclusive_parallel(DisasContext *s, int rd, int rt,
+                                         int rt2, TCGv_i32 addr, int size)
+{
+    TCGv_i64 addr64 = tcg_temp_new_i64();
+    TCGv_i64 val64 = tcg_temp_new_i64();
+    TCGv_i64 zero = tcg_const_i64(0);
+    TCGv_i32 desc = tcg_const_i32(size);
+    TCGv_i32 tmp = load_reg(s, rt);
+
+    tcg_gen_extu_i32_i64(addr64, addr);
+    if (size == 3) {
+        TCGv_i32 tmp2 = load_reg(s, rt2);
+        tcg_gen_concat_i32_i64(val64, tmp, tmp2);
+        tcg_temp_free_i32(tmp2);
+    } else {
+        tcg_gen_extu_i32_i64(val64, tmp);
+    }
+    tcg_temp_free_i32(tmp);
+
+    gen_helper_store_exclusive(cpu_R[rd], cpu_env, addr64, val64, zero, desc);
+    tcg_gen_movi_i64(cpu_exclusive_addr, -1);
+
+    tcg_temp_free_i32(desc);
+    tcg_temp_free_i64(zero);
+    tcg_temp_free_i64(val64);
+    tcg_temp_free_i64(addr64);
+}
+
 #ifdef CONFIG_USER_ONLY
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
+    gen_store_exclusive_parallel(s, rd, rt, rt2, addr, size);
 }
 #else
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
@@ -7364,6 +7440,11 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     int done_label;
     int fail_label;
 
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_store_exclusive_parallel(s, rd, rt, rt2, addr, size);
+        return;
+    }
+
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
          {Rd} = 0;
@@ -10983,7 +11064,7 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
 
     tcg_clear_temp_count();
 
@@ -11184,8 +11265,11 @@ static inline void gen_intermediate_code_internal(ARMCPU *cpu,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* find the next TB without leaving the generated code */
+            tcg_gen_lookup_and_goto_ptr(cpu_env);
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
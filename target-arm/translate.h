@@ -84,6 +84,11 @@ static inline int get_mem_index(DisasContext *s)
 #define DISAS_EXC 6
 /* WFE */
 #define DISAS_WFE 7
+/* The PC is already set, but the CPU state changed in a way that must be
+ * noticed by the main loop, e.g. exception masks on an exception return;
+ * unlike DISAS_JUMP, don't look up the next TB from the generated code.
+ */
+#define DISAS_EXIT 8
 
 #ifdef TARGET_AARCH64
 void a64_translate_init(void);
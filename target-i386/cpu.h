@@ -892,6 +892,7 @@ typedef struct CPUX86State {
     int error_code;
     int exception_is_int;
     target_ulong exception_next_eip;
+    target_ulong exclusive_addr; /* CMPXCHG16B operand, for EXCP_ATOMIC */
     target_ulong dr[8]; /* debug registers */
     union {
         struct CPUBreakpoint *cpu_breakpoint[4];
@@ -20,34 +20,22 @@
 #include "cpu.h"
 #include "exec/helper-proto.h"
 #include "exec/cpu_ldst.h"
-
-/* broken thread support */
-
-static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
-
-void helper_lock(void)
-{
-    spin_lock(&global_cpu_lock);
-}
-
-void helper_unlock(void)
-{
-    spin_unlock(&global_cpu_lock);
-}
+#include "qemu/main-loop.h"
 
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
-    uint64_t d;
+    uint64_t cmpv, d;
     int eflags;
 
     eflags = cpu_cc_compute_all(env, CC_OP);
-    d = cpu_ldq_data(env, a0);
-    if (d == (((uint64_t)env->regs[R_EDX] << 32) | (uint32_t)env->regs[R_EAX])) {
-        cpu_stq_data(env, a0, ((uint64_t)env->regs[R_ECX] << 32) | (uint32_t)env->regs[R_EBX]);
+    cmpv = ((uint64_t)env->regs[R_EDX] << 32) | (uint32_t)env->regs[R_EAX];
+    d = cpu_atomic_cmpxchg(env, a0, cmpv,
+                           ((uint64_t)env->regs[R_ECX] << 32)
+                           | (uint32_t)env->regs[R_EBX],
+                           8, cpu_mmu_index(env), GETRA());
+    if (d == cmpv) {
         eflags |= CC_Z;
     } else {
-        /* always do the store */
-        cpu_stq_data(env, a0, d);
         env->regs[R_EDX] = (uint32_t)(d >> 32);
         env->regs[R_EAX] = (uint32_t)d;
         eflags &= ~CC_Z;
@@ -56,14 +44,42 @@ void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 }
 
 #ifdef TARGET_X86_64
-void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
+/* Hosts have no 16-byte compare-and-swap, so the other CPUs are stopped
+   while CMPXCHG16B runs.  In user mode, this is done by the cpu loop.  */
+#if defined(CONFIG_USER_ONLY)
+void helper_cmpxchg16b(CPUX86State *env, target_ulong a0,
+                       int next_eip_addend)
+{
+    CPUState *cs = CPU(x86_env_get_cpu(env));
+
+    if ((a0 & 0xf) != 0) {
+        raise_exception(env, EXCP0D_GPF);
+    }
+    env->exclusive_addr = a0;
+    env->exception_next_eip = env->eip + next_eip_addend;
+    cs->exception_index = EXCP_ATOMIC;
+    cpu_loop_exit(cs);
+}
+#else
+void helper_cmpxchg16b(CPUX86State *env, target_ulong a0,
+                       int next_eip_addend)
 {
     uint64_t d0, d1;
     int eflags;
+    bool locked = false;
 
     if ((a0 & 0xf) != 0) {
         raise_exception(env, EXCP0D_GPF);
     }
+    /* raise any fault before stopping the world; the operand is aligned,
+       so it is on a single page */
+    tlb_probe_rmw(env, a0, cpu_mmu_index(env), GETRA());
+    if (!qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        locked = true;
+    }
+    tcg_start_exclusive();
+
     eflags = cpu_cc_compute_all(env, CC_OP);
     d0 = cpu_ldq_data(env, a0);
     d1 = cpu_ldq_data(env, a0 + 8);
@@ -80,8 +96,14 @@ void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
         eflags &= ~CC_Z;
     }
     CC_SRC = eflags;
+
+    tcg_end_exclusive();
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
 }
 #endif
+#endif
 
 void helper_boundw(CPUX86State *env, target_ulong a0, int v)
 {
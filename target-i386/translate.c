@@ -84,6 +84,11 @@ static uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 static int x86_64_hregs;
 #endif
 
+/* Conditional jumps that a second-tier superblock can go through, and
+   the TCG ops to keep free for the code of their side exits.  */
+#define SB_MAX_SIDE_EXITS 4
+#define SB_SIDE_EXIT_OPS 16
+
 typedef struct DisasContext {
     /* current insn context */
     int override; /* -1 if no override */
@@ -125,9 +130,16 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    int goto_tb_used; /* bit N set once goto_tb N has been generated */
+    int nb_side_exits;
+    struct {
+        int label;
+        target_ulong eip;
+    } side_exit[SB_MAX_SIDE_EXITS];
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
+static void gen_jr(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong eip);
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num);
 static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d);
@@ -1302,9 +1314,78 @@ static void gen_helper_fp_arith_STN_ST0(int op, int opreg)
     }
 }
 
+/* LOCK-prefixed gen_op on memory (address in A0): the read-modify-write
+   is a single host atomic operation, which returns the old value.  */
+static void gen_op_locked(DisasContext *s1, int op, TCGMemOp ot)
+{
+    switch (op) {
+    case OP_ADCL:
+    case OP_SBBL:
+        gen_compute_eflags_c(s1, cpu_tmp4);
+        tcg_gen_add_tl(cpu_tmp0, cpu_T[1], cpu_tmp4);
+        if (op == OP_SBBL) {
+            tcg_gen_neg_tl(cpu_tmp0, cpu_tmp0);
+        }
+        tcg_gen_atomic_fetch_add_tl(cpu_T[0], cpu_env, cpu_A0, cpu_tmp0,
+                                    s1->mem_index, ot | MO_LE);
+        if (op == OP_ADCL) {
+            tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+            tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_tmp4);
+            set_cc_op(s1, CC_OP_ADCB + ot);
+        } else {
+            tcg_gen_sub_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+            tcg_gen_sub_tl(cpu_T[0], cpu_T[0], cpu_tmp4);
+            set_cc_op(s1, CC_OP_SBBB + ot);
+        }
+        gen_op_update3_cc(cpu_tmp4);
+        break;
+    case OP_ADDL:
+        tcg_gen_atomic_fetch_add_tl(cpu_T[0], cpu_env, cpu_A0, cpu_T[1],
+                                    s1->mem_index, ot | MO_LE);
+        tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+        gen_op_update2_cc();
+        set_cc_op(s1, CC_OP_ADDB + ot);
+        break;
+    case OP_SUBL:
+        tcg_gen_neg_tl(cpu_tmp0, cpu_T[1]);
+        tcg_gen_atomic_fetch_add_tl(cpu_cc_srcT, cpu_env, cpu_A0, cpu_tmp0,
+                                    s1->mem_index, ot | MO_LE);
+        tcg_gen_sub_tl(cpu_T[0], cpu_cc_srcT, cpu_T[1]);
+        gen_op_update2_cc();
+        set_cc_op(s1, CC_OP_SUBB + ot);
+        break;
+    default:
+    case OP_ANDL:
+        tcg_gen_atomic_fetch_and_tl(cpu_T[0], cpu_env, cpu_A0, cpu_T[1],
+                                    s1->mem_index, ot | MO_LE);
+        tcg_gen_and_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+        gen_op_update1_cc();
+        set_cc_op(s1, CC_OP_LOGICB + ot);
+        break;
+    case OP_ORL:
+        tcg_gen_atomic_fetch_or_tl(cpu_T[0], cpu_env, cpu_A0, cpu_T[1],
+                                   s1->mem_index, ot | MO_LE);
+        tcg_gen_or_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+        gen_op_update1_cc();
+        set_cc_op(s1, CC_OP_LOGICB + ot);
+        break;
+    case OP_XORL:
+        tcg_gen_atomic_fetch_xor_tl(cpu_T[0], cpu_env, cpu_A0, cpu_T[1],
+                                    s1->mem_index, ot | MO_LE);
+        tcg_gen_xor_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+        gen_op_update1_cc();
+        set_cc_op(s1, CC_OP_LOGICB + ot);
+        break;
+    }
+}
+
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d)
 {
+    if (d == OR_TMP0 && (s1->prefix & PREFIX_LOCK) && op != OP_CMPL) {
+        gen_op_locked(s1, op, ot);
+        return;
+    }
     if (d != OR_TMP0) {
         gen_op_mov_v_reg(ot, cpu_T[0], d);
     } else {
@@ -1371,6 +1452,16 @@ static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d)
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_inc(DisasContext *s1, TCGMemOp ot, int d, int c)
 {
+    if (d == OR_TMP0 && (s1->prefix & PREFIX_LOCK)) {
+        gen_compute_eflags_c(s1, cpu_cc_src);
+        tcg_gen_movi_tl(cpu_tmp0, c > 0 ? 1 : -1);
+        tcg_gen_atomic_fetch_add_tl(cpu_T[0], cpu_env, cpu_A0, cpu_tmp0,
+                                    s1->mem_index, ot | MO_LE);
+        tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
+        set_cc_op(s1, (c > 0 ? CC_OP_INCB : CC_OP_DECB) + ot);
+        tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
+        return;
+    }
     if (d != OR_TMP0) {
         gen_op_mov_v_reg(ot, cpu_T[0], d);
     } else {
@@ -2205,17 +2296,75 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
 
     pc = s->cs_base + eip;
     tb = s->tb;
-    /* NOTE: we handle the case where the TB spans two pages here */
-    if ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
-        (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))  {
+    /* NOTE: we handle the case where the TB spans two pages here.  A
+       superblock may have more exits than the TB has jump slots; the
+       later ones look the TB up too.  */
+    if (!(s->goto_tb_used & (1 << tb_num)) &&
+        ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
+         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK)))  {
         /* jump to same page: we can use a direct jump */
+        s->goto_tb_used |= 1 << tb_num;
         tcg_gen_goto_tb(tb_num);
         gen_jmp_im(eip);
         tcg_gen_exit_tb((uintptr_t)tb + tb_num);
     } else {
-        /* jump to another page: currently not optimized */
+        /* jump to another page: look the TB up at run time */
         gen_jmp_im(eip);
-        gen_eob(s);
+        gen_jr(s);
+    }
+}
+
+/* In a second-tier translation, a forward conditional jump becomes a side
+   exit of the superblock: the taken path leaves the TB from code emitted
+   after the last instruction by gen_side_exits, and translation goes on
+   with the next instruction.  Backward jumps are left alone, as they are
+   usually taken.  The globals are in memory for the side exit, but keep
+   their host registers on the fall-through path; and CC_OP stays known
+   there, so that later users of the flags compute them inline and
+   set_cc_op discards the cc_* globals that nothing reads any more.
+   With icount the TB must run all of its instructions, so there are no
+   side exits.  Returns false if the jump must end the TB.  */
+static bool gen_jcc_side_exit(DisasContext *s, int b,
+                              target_ulong val, target_ulong next_eip)
+{
+    CCPrepare cc;
+    int l1;
+
+    if (!(s->tb->cflags & CF_TIER2) || !s->jmp_opt || use_icount ||
+        s->nb_side_exits == SB_MAX_SIDE_EXITS || val <= next_eip) {
+        return false;
+    }
+
+    l1 = gen_new_label();
+    cc = gen_prepare_cc(s, b, cpu_T[0]);
+    gen_update_cc_op(s);
+    if (cc.mask != -1) {
+        tcg_gen_andi_tl(cpu_T[0], cc.reg, cc.mask);
+        cc.reg = cpu_T[0];
+    }
+    if (cc.use_reg2) {
+        tcg_gen_brcond_tl(cc.cond, cc.reg, cc.reg2, l1);
+    } else {
+        tcg_gen_brcondi_tl(cc.cond, cc.reg, cc.imm, l1);
+    }
+
+    s->side_exit[s->nb_side_exits].label = l1;
+    s->side_exit[s->nb_side_exits].eip = val;
+    s->nb_side_exits++;
+    return true;
+}
+
+/* Generate the side exits of a superblock, once its last instruction
+   has ended the TB.  CC_OP was stored before each branch.  */
+static void gen_side_exits(DisasContext *s)
+{
+    int i;
+
+    s->cc_op = CC_OP_DYNAMIC;
+    s->cc_op_dirty = false;
+    for (i = 0; i < s->nb_side_exits; i++) {
+        gen_set_label(s->side_exit[i].label);
+        gen_goto_tb(s, 1, s->side_exit[i].eip);
     }
 }
 
@@ -2224,6 +2373,9 @@ static inline void gen_jcc(DisasContext *s, int b,
 {
     int l1, l2;
 
+    if (gen_jcc_side_exit(s, b, val, next_eip)) {
+        return;
+    }
     if (s->jmp_opt) {
         l1 = gen_new_label();
         gen_jcc1(s, b, l1);
@@ -2542,8 +2694,10 @@ static void gen_debug(DisasContext *s, target_ulong cur_eip)
 }
 
 /* generate a generic end of block. Trace exception is also generated
-   if needed */
-static void gen_eob(DisasContext *s)
+   if needed.  If JR, the next TB is looked up from the generated code
+   without going back to the main loop; this is only for jumps whose
+   destination is already in EIP. */
+static void do_gen_eob(DisasContext *s, bool jr)
 {
     gen_update_cc_op(s);
     if (s->tb->flags & HF_INHIBIT_IRQ_MASK) {
@@ -2556,12 +2710,28 @@ static void gen_eob(DisasContext *s)
         gen_helper_debug(cpu_env);
     } else if (s->tf) {
         gen_helper_single_step(cpu_env);
+    } else if (jr && s->jmp_opt) {
+        /* same conditions as for chaining; in particular an interrupt
+           held off by the previous instruction must be noticed by the
+           main loop now */
+        tcg_gen_lookup_and_goto_ptr(cpu_env);
     } else {
         tcg_gen_exit_tb(0);
     }
     s->is_jmp = DISAS_TB_JUMP;
 }
 
+static void gen_eob(DisasContext *s)
+{
+    do_gen_eob(s, false);
+}
+
+/* generate an indirect jump to the EIP already stored in env */
+static void gen_jr(DisasContext *s)
+{
+    do_gen_eob(s, true);
+}
+
 /* generate a jump to eip. No segment change must happen before as a
    direct call to the next block may occur */
 static void gen_jmp_tb(DisasContext *s, target_ulong eip, int tb_num)
@@ -2582,6 +2752,21 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* In a second-tier translation, follow a forward direct jump within the
+   same page instead of ending the TB, so that the optimizer and the
+   condition code tracking see both sides of it.  */
+static void gen_jmp_im_superblock(DisasContext *s, target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if ((s->tb->cflags & CF_TIER2) && s->jmp_opt && pc >= s->pc &&
+        (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK)) {
+        s->pc = pc;
+    } else {
+        gen_jmp(s, eip);
+    }
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
@@ -2970,6 +3155,88 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Integer and logical MMX/SSE operations that map onto TCG vector
+   operations, so that they run inline rather than in a helper.  Return
+   false if the helper must be called.  */
+static bool gen_sse_gvec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    int oprsz = is_xmm ? 16 : 8;
+
+    switch (b) {
+    case 0xfc ... 0xfe: /* paddb, paddw, paddl */
+        tcg_gen_gvec_add(cpu_env, b - 0xfc, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(cpu_env, MO_64, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubl, psubq */
+        tcg_gen_gvec_sub(cpu_env, b - 0xf8, op1_offset, op1_offset,
+                         op2_offset, oprsz);
+        break;
+    case 0x54: /* andps, andpd */
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x55: /* andnps, andnpd */
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(cpu_env, op1_offset, op2_offset, op1_offset, oprsz);
+        break;
+    case 0x56: /* orps, orpd */
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x57: /* xorps, xorpd */
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(cpu_env, op1_offset, op1_offset, op2_offset, oprsz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_EQ, b - 0x74, op1_offset,
+                         op1_offset, op2_offset, oprsz);
+        break;
+    case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+        tcg_gen_gvec_cmp(cpu_env, TCG_COND_GT, b - 0x64, op1_offset,
+                         op1_offset, op2_offset, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+/* Shifts by an immediate (0x71 ... 0x73): OP is the reg field of modrm.  */
+static bool gen_sse_shifti_gvec(int op, int vece, int is_xmm, int offset,
+                                int val)
+{
+    int oprsz = is_xmm ? 16 : 8;
+    int bits = 8 << vece;
+
+    switch (op) {
+    case 2: /* psrlw, psrld, psrlq */
+        if (val >= bits) {
+            tcg_gen_gvec_xor(cpu_env, offset, offset, offset, oprsz);
+        } else {
+            tcg_gen_gvec_shri(cpu_env, vece, offset, offset, val, oprsz);
+        }
+        break;
+    case 4: /* psraw, psrad */
+        tcg_gen_gvec_sari(cpu_env, vece, offset, offset, MIN(val, bits - 1),
+                          oprsz);
+        break;
+    case 6: /* psllw, pslld, psllq */
+        if (val >= bits) {
+            tcg_gen_gvec_xor(cpu_env, offset, offset, offset, oprsz);
+        } else {
+            tcg_gen_gvec_shli(cpu_env, vece, offset, offset, val, oprsz);
+        }
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -3373,6 +3640,22 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
 	        goto illegal_op;
             }
             val = cpu_ldub_code(env, s->pc++);
+            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
+                                       (((modrm >> 3)) & 7)][b1];
+            if (!sse_fn_epp) {
+                goto illegal_op;
+            }
+            if (is_xmm) {
+                rm = (modrm & 7) | REX_B(s);
+                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
+            } else {
+                rm = (modrm & 7);
+                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
+            }
+            if (gen_sse_shifti_gvec((modrm >> 3) & 7, b & 3, is_xmm,
+                                    op2_offset, val)) {
+                break;
+            }
             if (is_xmm) {
                 tcg_gen_movi_tl(cpu_T[0], val);
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,xmm_t0.XMM_L(0)));
@@ -3386,18 +3669,6 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                 tcg_gen_st32_tl(cpu_T[0], cpu_env, offsetof(CPUX86State,mmx_t0.MMX_L(1)));
                 op1_offset = offsetof(CPUX86State,mmx_t0);
             }
-            sse_fn_epp = sse_op_table2[((b - 1) & 3) * 8 +
-                                       (((modrm >> 3)) & 7)][b1];
-            if (!sse_fn_epp) {
-                goto illegal_op;
-            }
-            if (is_xmm) {
-                rm = (modrm & 7) | REX_B(s);
-                op2_offset = offsetof(CPUX86State,xmm_regs[rm]);
-            } else {
-                rm = (modrm & 7);
-                op2_offset = offsetof(CPUX86State,fpregs[rm].mmx);
-            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op2_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op1_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4385,6 +4656,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4561,10 +4835,6 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->aflag = aflag;
     s->dflag = dflag;
 
-    /* lock generation */
-    if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
-
     /* now check op code */
  reswitch:
     switch(b) {
@@ -4715,6 +4985,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             set_cc_op(s, CC_OP_LOGICB + ot);
             break;
         case 2: /* not */
+            if (mod != 3 && (prefixes & PREFIX_LOCK)) {
+                tcg_gen_movi_tl(cpu_tmp0, -1);
+                tcg_gen_atomic_fetch_xor_tl(cpu_T[0], cpu_env, cpu_A0,
+                                            cpu_tmp0, s->mem_index,
+                                            ot | MO_LE);
+                break;
+            }
             tcg_gen_not_tl(cpu_T[0], cpu_T[0]);
             if (mod != 3) {
                 gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
@@ -4723,11 +5000,33 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             }
             break;
         case 3: /* neg */
-            tcg_gen_neg_tl(cpu_T[0], cpu_T[0]);
-            if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
+            if (mod != 3 && (prefixes & PREFIX_LOCK)) {
+                /* no host instruction for this one, retry a cmpxchg
+                   until memory did not change under our feet */
+                int label1 = gen_new_label();
+                TCGv a0 = tcg_temp_local_new();
+                TCGv t0 = tcg_temp_local_new();
+                TCGv t1 = tcg_temp_local_new();
+
+                tcg_gen_mov_tl(a0, cpu_A0);
+                tcg_gen_mov_tl(t0, cpu_T[0]);
+                gen_set_label(label1);
+                tcg_gen_mov_tl(t1, t0);
+                tcg_gen_neg_tl(cpu_T[0], t1);
+                tcg_gen_atomic_cmpxchg_tl(t0, cpu_env, a0, t1, cpu_T[0],
+                                          s->mem_index, ot | MO_LE);
+                tcg_gen_brcond_tl(TCG_COND_NE, t0, t1, label1);
+                tcg_gen_neg_tl(cpu_T[0], t0);
+                tcg_temp_free(a0);
+                tcg_temp_free(t0);
+                tcg_temp_free(t1);
             } else {
-                gen_op_mov_reg_v(ot, rm, cpu_T[0]);
+                tcg_gen_neg_tl(cpu_T[0], cpu_T[0]);
+                if (mod != 3) {
+                    gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
+                } else {
+                    gen_op_mov_reg_v(ot, rm, cpu_T[0]);
+                }
             }
             gen_op_update_neg_cc();
             set_cc_op(s, CC_OP_SUBB + ot);
@@ -4940,7 +5239,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_movi_tl(cpu_T[1], next_eip);
             gen_push_v(s, cpu_T[1]);
             gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 3: /* lcall Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -4967,7 +5266,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
             }
             gen_op_jmp_v(cpu_T[0]);
-            gen_eob(s);
+            gen_jr(s);
             break;
         case 5: /* ljmp Ev */
             gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
@@ -5132,6 +5431,13 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
             gen_op_mov_reg_v(ot, reg, cpu_T[1]);
             gen_op_mov_reg_v(ot, rm, cpu_T[0]);
+        } else if (prefixes & PREFIX_LOCK) {
+            gen_lea_modrm(env, s, modrm);
+            gen_op_mov_v_reg(ot, cpu_T[0], reg);
+            tcg_gen_atomic_fetch_add_tl(cpu_T[1], cpu_env, cpu_A0, cpu_T[0],
+                                        s->mem_index, ot | MO_LE);
+            tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+            gen_op_mov_reg_v(ot, reg, cpu_T[1]);
         } else {
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T[0], reg);
@@ -5158,37 +5464,49 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             t2 = tcg_temp_local_new();
             a0 = tcg_temp_local_new();
             gen_op_mov_v_reg(ot, t1, reg);
-            if (mod == 3) {
-                rm = (modrm & 7) | REX_B(s);
-                gen_op_mov_v_reg(ot, t0, rm);
-            } else {
+            if (mod != 3 && (prefixes & PREFIX_LOCK)) {
                 gen_lea_modrm(env, s, modrm);
-                tcg_gen_mov_tl(a0, cpu_A0);
-                gen_op_ld_v(s, ot, t0, a0);
-                rm = 0; /* avoid warning */
-            }
-            label1 = gen_new_label();
-            tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
-            gen_extu(ot, t0);
-            gen_extu(ot, t2);
-            tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
-            label2 = gen_new_label();
-            if (mod == 3) {
+                tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
+                gen_extu(ot, t2);
+                tcg_gen_atomic_cmpxchg_tl(t0, cpu_env, cpu_A0, t2, t1,
+                                          s->mem_index, ot | MO_LE);
+                label1 = gen_new_label();
+                tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
                 gen_op_mov_reg_v(ot, R_EAX, t0);
-                tcg_gen_br(label2);
                 gen_set_label(label1);
-                gen_op_mov_reg_v(ot, rm, t1);
             } else {
-                /* perform no-op store cycle like physical cpu; must be
-                   before changing accumulator to ensure idempotency if
-                   the store faults and the instruction is restarted */
-                gen_op_st_v(s, ot, t0, a0);
-                gen_op_mov_reg_v(ot, R_EAX, t0);
-                tcg_gen_br(label2);
-                gen_set_label(label1);
-                gen_op_st_v(s, ot, t1, a0);
+                if (mod == 3) {
+                    rm = (modrm & 7) | REX_B(s);
+                    gen_op_mov_v_reg(ot, t0, rm);
+                } else {
+                    gen_lea_modrm(env, s, modrm);
+                    tcg_gen_mov_tl(a0, cpu_A0);
+                    gen_op_ld_v(s, ot, t0, a0);
+                    rm = 0; /* avoid warning */
+                }
+                label1 = gen_new_label();
+                tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
+                gen_extu(ot, t0);
+                gen_extu(ot, t2);
+                tcg_gen_brcond_tl(TCG_COND_EQ, t2, t0, label1);
+                label2 = gen_new_label();
+                if (mod == 3) {
+                    gen_op_mov_reg_v(ot, R_EAX, t0);
+                    tcg_gen_br(label2);
+                    gen_set_label(label1);
+                    gen_op_mov_reg_v(ot, rm, t1);
+                } else {
+                    /* perform no-op store cycle like physical cpu; must be
+                       before changing accumulator to ensure idempotency if
+                       the store faults and the instruction is restarted */
+                    gen_op_st_v(s, ot, t0, a0);
+                    gen_op_mov_reg_v(ot, R_EAX, t0);
+                    tcg_gen_br(label2);
+                    gen_set_label(label1);
+                    gen_op_st_v(s, ot, t1, a0);
+                }
+                gen_set_label(label2);
             }
-            gen_set_label(label2);
             tcg_gen_mov_tl(cpu_cc_src, t0);
             tcg_gen_mov_tl(cpu_cc_srcT, t2);
             tcg_gen_sub_tl(cpu_cc_dst, t2, t0);
@@ -5211,7 +5529,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_jmp_im(pc_start - s->cs_base);
             gen_update_cc_op(s);
             gen_lea_modrm(env, s, modrm);
-            gen_helper_cmpxchg16b(cpu_env, cpu_A0);
+            gen_helper_cmpxchg16b(cpu_env, cpu_A0,
+                                  tcg_const_i32(s->pc - pc_start));
         } else
 #endif        
         {
@@ -5564,12 +5883,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T[0], reg);
             /* for xchg, lock is implicit */
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
-            gen_op_ld_v(s, ot, cpu_T[1], cpu_A0);
-            gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+            tcg_gen_atomic_xchg_tl(cpu_T[1], cpu_env, cpu_A0, cpu_T[0],
+                                   s->mem_index, ot | MO_LE);
             gen_op_mov_reg_v(ot, reg, cpu_T[1]);
         }
         break;
@@ -6381,14 +6696,14 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         gen_stack_update(s, val + (1 << ot));
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xc3: /* ret */
         ot = gen_pop_T0(s);
         gen_pop_update(s, ot);
         /* Note that gen_pop_T0 uses a zero-extending load.  */
         gen_op_jmp_v(cpu_T[0]);
-        gen_eob(s);
+        gen_jr(s);
         break;
     case 0xca: /* lret im */
         val = cpu_ldsw_code(env, s->pc);
@@ -6485,7 +6800,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else if (!CODE64(s)) {
             tval &= 0xffffffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_im_superblock(s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6507,7 +6822,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_im_superblock(s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -6703,32 +7018,59 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         }
     bt_op:
         tcg_gen_andi_tl(cpu_T[1], cpu_T[1], (1 << (3 + ot)) - 1);
-        tcg_gen_shr_tl(cpu_tmp4, cpu_T[0], cpu_T[1]);
-        switch(op) {
-        case 0:
-            break;
-        case 1:
-            tcg_gen_movi_tl(cpu_tmp0, 1);
-            tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T[1]);
-            tcg_gen_or_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
-            break;
-        case 2:
+        if (op != 0 && mod != 3 && (prefixes & PREFIX_LOCK)) {
+            /* the old value, and thus the tested bit, comes back from
+               the atomic operation */
             tcg_gen_movi_tl(cpu_tmp0, 1);
             tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T[1]);
-            tcg_gen_andc_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
-            break;
-        default:
-        case 3:
-            tcg_gen_movi_tl(cpu_tmp0, 1);
-            tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T[1]);
-            tcg_gen_xor_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
-            break;
-        }
-        if (op != 0) {
-            if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
-            } else {
-                gen_op_mov_reg_v(ot, rm, cpu_T[0]);
+            switch (op) {
+            case 1:
+                tcg_gen_atomic_fetch_or_tl(cpu_T[0], cpu_env, cpu_A0,
+                                           cpu_tmp0, s->mem_index,
+                                           ot | MO_LE);
+                break;
+            case 2:
+                tcg_gen_not_tl(cpu_tmp0, cpu_tmp0);
+                tcg_gen_atomic_fetch_and_tl(cpu_T[0], cpu_env, cpu_A0,
+                                            cpu_tmp0, s->mem_index,
+                                            ot | MO_LE);
+                break;
+            default:
+            case 3:
+                tcg_gen_atomic_fetch_xor_tl(cpu_T[0], cpu_env, cpu_A0,
+                                            cpu_tmp0, s->mem_index,
+                                            ot | MO_LE);
+                break;
+            }
+            tcg_gen_shr_tl(cpu_tmp4, cpu_T[0], cpu_T[1]);
+        } else {
+            tcg_gen_shr_tl(cpu_tmp4, cpu_T[0], cpu_T[1]);
+            switch(op) {
+            case 0:
+                break;
+            case 1:
+                tcg_gen_movi_tl(cpu_tmp0, 1);
+                tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T[1]);
+                tcg_gen_or_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
+                break;
+            case 2:
+                tcg_gen_movi_tl(cpu_tmp0, 1);
+                tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T[1]);
+                tcg_gen_andc_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
+                break;
+            default:
+            case 3:
+                tcg_gen_movi_tl(cpu_tmp0, 1);
+                tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T[1]);
+                tcg_gen_xor_tl(cpu_T[0], cpu_T[0], cpu_tmp0);
+                break;
+            }
+            if (op != 0) {
+                if (mod != 3) {
+                    gen_op_st_v(s, ot, cpu_T[0], cpu_A0);
+                } else {
+                    gen_op_mov_reg_v(ot, rm, cpu_T[0]);
+                }
             }
         }
 
@@ -7828,14 +8170,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     default:
         goto illegal_op;
     }
-    /* lock generation */
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
     return s->pc;
  illegal_op:
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
-    /* XXX: ensure that no lock was generated */
     gen_exception(s, EXCP06_ILLOP, pc_start - s->cs_base);
     return s->pc;
 }
@@ -7888,6 +8224,23 @@ void optimize_flags_init(void)
                                          offsetof(CPUX86State, regs[i]),
                                          reg_names[i]);
     }
+
+    /* pushf/popf only need the lazy flags state in memory, not
+       the general purpose registers.  */
+    {
+        const int cc_read[] = {
+            GET_TCGV_I32(cpu_cc_op), GET_TCGV(cpu_cc_dst),
+            GET_TCGV(cpu_cc_src), GET_TCGV(cpu_cc_src2)
+        };
+        const int cc_written[] = {
+            GET_TCGV_I32(cpu_cc_op), GET_TCGV(cpu_cc_src)
+        };
+
+        tcg_set_helper_globals(helper_read_eflags, cc_read,
+                               ARRAY_SIZE(cc_read), NULL, 0);
+        tcg_set_helper_globals(helper_write_eflags, NULL, 0,
+                               cc_written, ARRAY_SIZE(cc_written));
+    }
 }
 
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
@@ -7945,6 +8298,8 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     dc->code64 = (flags >> HF_CS64_SHIFT) & 1;
 #endif
     dc->flags = flags;
+    dc->goto_tb_used = 0;
+    dc->nb_side_exits = 0;
     dc->jmp_opt = !(dc->tf || cs->singlestep_enabled ||
                     (flags & HF_INHIBIT_IRQ_MASK)
 #ifndef CONFIG_SOFTMMU
@@ -7971,6 +8326,9 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     cpu_cc_srcT = tcg_temp_local_new();
 
     gen_opc_end = tcg_ctx.gen_opc_buf + OPC_MAX_SIZE;
+    if (tb->cflags & CF_TIER2) {
+        gen_opc_end -= SB_MAX_SIDE_EXITS * SB_SIDE_EXIT_OPS;
+    }
 
     dc->is_jmp = DISAS_NEXT;
     pc_ptr = pc_start;
@@ -7980,7 +8338,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
     for(;;) {
         if (unlikely(!QTAILQ_EMPTY(&cs->breakpoints))) {
             QTAILQ_FOREACH(bp, &cs->breakpoints, entry) {
@@ -8036,6 +8394,7 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
             break;
         }
     }
+    gen_side_exits(dc);
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
     gen_tb_end(tb, num_insns);
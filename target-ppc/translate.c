@@ -3298,12 +3298,38 @@ LARX(lwarx, 4, ld32u);
 
 
 #if defined(CONFIG_USER_ONLY)
+/* Guest threads run in parallel, so the store is a host compare-and-swap
+   against the value seen by the reservation.  Quadwords and byte-swapped
+   accesses go through POWERPC_EXCP_STCX and the cpu loop instead.  */
 static void gen_conditional_store(DisasContext *ctx, TCGv EA,
                                   int reg, int size)
 {
     TCGv t0 = tcg_temp_new();
     uint32_t save_exception = ctx->exception;
 
+    if (size <= sizeof(target_ulong) && !ctx->le_mode) {
+        TCGv cmpv = tcg_temp_new();
+        TCGv_i32 t1 = tcg_temp_new_i32();
+        int l1 = gen_new_label();
+
+        gen_update_nip(ctx, ctx->nip - 4);
+        tcg_gen_trunc_tl_i32(cpu_crf[0], cpu_so);
+        tcg_gen_brcond_tl(TCG_COND_NE, EA, cpu_reserve, l1);
+        tcg_gen_ld_tl(cmpv, cpu_env, offsetof(CPUPPCState, reserve_val));
+        tcg_gen_atomic_cmpxchg_tl(t0, cpu_env, EA, cmpv, cpu_gpr[reg],
+                                  ctx->mem_idx, MO_TE | ctz32(size));
+        tcg_gen_setcond_tl(TCG_COND_EQ, t0, t0, cmpv);
+        tcg_gen_trunc_tl_i32(t1, t0);
+        tcg_gen_shli_i32(t1, t1, CRF_EQ);
+        tcg_gen_or_i32(cpu_crf[0], cpu_crf[0], t1);
+        gen_set_label(l1);
+        tcg_gen_movi_tl(cpu_reserve, -1);
+        tcg_temp_free_i32(t1);
+        tcg_temp_free(cmpv);
+        tcg_temp_free(t0);
+        return;
+    }
+
     tcg_gen_st_tl(EA, cpu_env, offsetof(CPUPPCState, reserve_ea));
     tcg_gen_movi_tl(t0, (size << 5) | reg);
     tcg_gen_st_tl(t0, cpu_env, offsetof(CPUPPCState, reserve_info));
@@ -11344,7 +11370,7 @@ static inline void gen_intermediate_code_internal(PowerPCCPU *cpu,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
-    gen_tb_start();
+    gen_tb_start(tb);
     tcg_clear_temp_count();
     /* Set env in case of segfault during code fetch */
     while (ctx.exception == POWERPC_EXCP_NONE
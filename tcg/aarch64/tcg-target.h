@@ -69,6 +69,10 @@ typedef enum {
 #define TCG_TARGET_HAS_muls2_i32        0
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
+#define TCG_TARGET_HAS_goto_ptr         1
+#define TCG_TARGET_HAS_gvec             0
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB   0
+#define TCG_TARGET_IMPLEMENTS_PIC       0
 #define TCG_TARGET_HAS_trunc_shr_i32    0
 
 #define TCG_TARGET_HAS_div_i64          1
@@ -83,6 +83,10 @@ extern bool use_idiv_instructions;
 #define TCG_TARGET_HAS_muls2_i32        1
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
+#define TCG_TARGET_HAS_goto_ptr         0
+#define TCG_TARGET_HAS_gvec             0
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB   0
+#define TCG_TARGET_IMPLEMENTS_PIC       0
 #define TCG_TARGET_HAS_div_i32          use_idiv_instructions
 #define TCG_TARGET_HAS_rem_i32          0
 
@@ -139,6 +139,15 @@ static bool have_bmi2;
 # define have_bmi2 0
 #endif
 
+/* SSE2 is part of x86-64; 32-bit hosts must probe for it.  */
+#if TCG_TARGET_REG_BITS == 64
+# define have_sse2 1
+#elif defined(CONFIG_CPUID_H) && defined(bit_SSE2)
+static bool have_sse2;
+#else
+# define have_sse2 0
+#endif
+
 static tcg_insn_unit *tb_ret_addr;
 
 static void patch_reloc(tcg_insn_unit *code_ptr, int type,
@@ -306,6 +315,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_ARITH_GvEv	(0x03)		/* ... plus (ARITH_FOO << 3) */
 #define OPC_ANDN        (0xf2 | P_EXT38)
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
+#define OPC_AND_GvEv	(OPC_ARITH_GvEv | (ARITH_AND << 3))
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
@@ -351,6 +361,37 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
+#define OPC_MOVD_VyEy   (0x6e | P_EXT | P_DATA16)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPGTB     (0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW     (0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD     (0x66 | P_EXT | P_DATA16)
+#define OPC_PINSRW      (0xc4 | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16) /* /2 /4 /6 */
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16) /* /2 /6 */
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+#define OPC_PSHUFLW     (0x70 | P_EXT | P_SIMDF2)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PUNPCKLQDQ  (0x6c | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
+
 /* Group 1 opcode extensions for 0x80-0x83.
    These are also used as modifiers for OPC_ARITH.  */
 #define ARITH_ADD 0
@@ -383,6 +424,11 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define EXT5_CALLN_Ev	2
 #define EXT5_JMPN_Ev	4
 
+/* Opcode extensions for OPC_PSHIFT*_Ib.  */
+#define EXT_PSRL	2
+#define EXT_PSRA	4
+#define EXT_PSLL	6
+
 /* Condition codes to be added to OPC_JCC_{long,short}.  */
 #define JCC_JMP (-1)
 #define JCC_JO  0x0
@@ -428,6 +474,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         assert((opc & P_REXW) == 0);
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
@@ -465,6 +516,11 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -640,11 +696,23 @@ static inline void tcg_out_mov(TCGContext *s, TCGType type,
     }
 }
 
+/* Try a 7 byte pc-relative lea.  */
+static bool tcg_out_movi_pcrel(TCGContext *s, TCGReg ret, tcg_target_long arg)
+{
+    tcg_target_long diff = arg - ((uintptr_t)s->code_ptr + 7);
+
+    if (TCG_TARGET_REG_BITS == 64 && diff == (int32_t)diff) {
+        tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
+        tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
+        tcg_out32(s, diff);
+        return true;
+    }
+    return false;
+}
+
 static void tcg_out_movi(TCGContext *s, TCGType type,
                          TCGReg ret, tcg_target_long arg)
 {
-    tcg_target_long diff;
-
     if (arg == 0) {
         tgen_arithr(s, ARITH_XOR, ret, ret);
         return;
@@ -660,12 +728,9 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         return;
     }
 
-    /* Try a 7 byte pc-relative lea before the 10 byte movq.  */
-    diff = arg - ((uintptr_t)s->code_ptr + 7);
-    if (diff == (int32_t)diff) {
-        tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
-        tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
-        tcg_out32(s, diff);
+    /* Try a pc-relative lea before the 10 byte movq.  Position independent
+       code may move, so there it is only for addresses, see below.  */
+    if (!s->code_gen_pic && tcg_out_movi_pcrel(s, ret, arg)) {
         return;
     }
 
@@ -673,6 +738,19 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     tcg_out64(s, arg);
 }
 
+/* The TB address for exit_tb moves with the code in position independent
+   code.  If it is out of reach, the code cannot be saved by -tbcache.  */
+static void tcg_out_movi_tb(TCGContext *s, TCGReg ret, tcg_target_long arg)
+{
+    if (s->code_gen_pic && arg != 0) {
+        if (tcg_out_movi_pcrel(s, ret, arg)) {
+            return;
+        }
+        s->host_ptrs = true;
+    }
+    tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -1107,6 +1185,7 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
         tcg_out32(s, disp);
     } else {
+        s->host_ptrs = true;
         tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, (uintptr_t)dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
@@ -1200,15 +1279,16 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     tgen_arithi(s, ARITH_AND + trexw, r1,
                 TARGET_PAGE_MASK | ((1 << s_bits) - 1), 0);
-    tgen_arithi(s, ARITH_AND + hrexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
+    /* and tlb_mask(env), r0 */
+    tcg_out_modrm_offset(s, OPC_AND_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
 
-    tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
-                             offsetof(CPUArchState, tlb_table[mem_index][0])
-                             + which);
+    /* add tlb_table(env), r0 */
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_table[mem_index]));
 
-    /* cmp 0(r0), r1 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, 0);
+    /* cmp which(r0), r1 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, which);
 
     /* Prepare for both the fast path add of the tlb addend, and the slow
        path function argument setup.  There are two cases worth note:
@@ -1224,8 +1304,8 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
     s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r0), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, 4);
+        /* cmp which+4(r0), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, which + 4);
 
         /* jne slow_path */
         tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
@@ -1237,7 +1317,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     /* add addend(r0), r1 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1, r0,
-                         offsetof(CPUTLBEntry, addend) - which);
+                         offsetof(CPUTLBEntry, addend));
 }
 
 /*
@@ -1714,6 +1794,163 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/* The gvec opcodes work on the CPU state in memory, 16 bytes at a time
+   (8 for 64-bit operations).  Nothing else in the backend uses the
+   vector registers, so xmm0 and xmm1 serve as scratch.  */
+#define TCG_TMP_XMM0 0
+#define TCG_TMP_XMM1 1
+
+static bool tcg_target_gvec_supported(TCGOpcode opc, unsigned vece)
+{
+    if (!have_sse2) {
+        return false;
+    }
+    switch (opc) {
+    case INDEX_op_gvec_add:
+    case INDEX_op_gvec_sub:
+    case INDEX_op_gvec_and:
+    case INDEX_op_gvec_or:
+    case INDEX_op_gvec_xor:
+    case INDEX_op_gvec_andc:
+        return true;
+    case INDEX_op_gvec_shli:
+    case INDEX_op_gvec_shri:
+    case INDEX_op_gvec_dup:
+        return vece >= MO_16;
+    case INDEX_op_gvec_sari:
+        return vece == MO_16 || vece == MO_32;
+    case INDEX_op_gvec_cmpeq:
+    case INDEX_op_gvec_cmpgt:
+        /* the 64-bit forms need SSE4 */
+        return vece <= MO_32;
+    default:
+        return false;
+    }
+}
+
+static void tcg_out_gvec_ld(TCGContext *s, unsigned len, int xmm,
+                            TCGReg base, intptr_t ofs)
+{
+    tcg_out_modrm_offset(s, len == 8 ? OPC_MOVQ_VqWq : OPC_MOVDQU_VxWx,
+                         xmm, base, ofs);
+}
+
+static void tcg_out_gvec_st(TCGContext *s, unsigned len, int xmm,
+                            TCGReg base, intptr_t ofs)
+{
+    tcg_out_modrm_offset(s, len == 8 ? OPC_MOVQ_WqVq : OPC_MOVDQU_WxVx,
+                         xmm, base, ofs);
+}
+
+static void tcg_out_gvec(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int cmpeq_insn[3] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD
+    };
+    static const int cmpgt_insn[3] = {
+        OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD
+    };
+    static const int shift_insn[4] = {
+        0, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+    };
+    TCGReg base = args[0];
+    intptr_t dofs = args[1], aofs = args[2], bofs = args[3], tmp;
+    unsigned oprsz = tcg_gvec_oprsz(args[4]);
+    unsigned vece = tcg_gvec_vece(args[4]);
+    unsigned len = oprsz == 8 ? 8 : 16;
+    unsigned i;
+    int insn = 0, ext = 0;
+
+    if (opc == INDEX_op_gvec_dup) {
+        /* broadcast the element into xmm0 once */
+        switch (vece) {
+        case MO_16:
+            tcg_out_modrm_offset(s, OPC_PINSRW, TCG_TMP_XMM0, base, aofs);
+            tcg_out8(s, 0);
+            tcg_out_modrm(s, OPC_PSHUFLW, TCG_TMP_XMM0, TCG_TMP_XMM0);
+            tcg_out8(s, 0);
+            tcg_out_modrm(s, OPC_PUNPCKLQDQ, TCG_TMP_XMM0, TCG_TMP_XMM0);
+            break;
+        case MO_32:
+            tcg_out_modrm_offset(s, OPC_MOVD_VyEy, TCG_TMP_XMM0, base, aofs);
+            tcg_out_modrm(s, OPC_PSHUFD, TCG_TMP_XMM0, TCG_TMP_XMM0);
+            tcg_out8(s, 0);
+            break;
+        default:
+            tcg_out_gvec_ld(s, 8, TCG_TMP_XMM0, base, aofs);
+            tcg_out_modrm(s, OPC_PUNPCKLQDQ, TCG_TMP_XMM0, TCG_TMP_XMM0);
+            break;
+        }
+        for (i = 0; i < oprsz; i += len) {
+            tcg_out_gvec_st(s, len, TCG_TMP_XMM0, base, dofs + i);
+        }
+        return;
+    }
+
+    switch (opc) {
+    case INDEX_op_gvec_add:
+        insn = add_insn[vece];
+        break;
+    case INDEX_op_gvec_sub:
+        insn = sub_insn[vece];
+        break;
+    case INDEX_op_gvec_and:
+        insn = OPC_PAND;
+        break;
+    case INDEX_op_gvec_or:
+        insn = OPC_POR;
+        break;
+    case INDEX_op_gvec_xor:
+        insn = OPC_PXOR;
+        break;
+    case INDEX_op_gvec_andc:
+        /* pandn complements its first operand: compute ~b & a */
+        insn = OPC_PANDN;
+        tmp = aofs;
+        aofs = bofs;
+        bofs = tmp;
+        break;
+    case INDEX_op_gvec_cmpeq:
+        insn = cmpeq_insn[vece];
+        break;
+    case INDEX_op_gvec_cmpgt:
+        insn = cmpgt_insn[vece];
+        break;
+    case INDEX_op_gvec_shli:
+        insn = shift_insn[vece];
+        ext = EXT_PSLL;
+        break;
+    case INDEX_op_gvec_shri:
+        insn = shift_insn[vece];
+        ext = EXT_PSRL;
+        break;
+    case INDEX_op_gvec_sari:
+        insn = shift_insn[vece];
+        ext = EXT_PSRA;
+        break;
+    default:
+        tcg_abort();
+    }
+
+    for (i = 0; i < oprsz; i += len) {
+        tcg_out_gvec_ld(s, len, TCG_TMP_XMM0, base, aofs + i);
+        if (ext) {
+            tcg_out_modrm(s, insn, ext, TCG_TMP_XMM0);
+            tcg_out8(s, bofs);
+        } else {
+            tcg_out_gvec_ld(s, len, TCG_TMP_XMM1, base, bofs + i);
+            tcg_out_modrm(s, insn, TCG_TMP_XMM0, TCG_TMP_XMM1);
+        }
+        tcg_out_gvec_st(s, len, TCG_TMP_XMM0, base, dofs + i);
+    }
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1731,12 +1968,16 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        tcg_out_movi_tb(s, TCG_REG_EAX, args[0]);
         tcg_out_jmp(s, tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
         if (s->tb_jmp_offset) {
-            /* direct jump method */
+            /* direct jump method; align the displacement so that it
+               can be patched atomically while other threads run it */
+            while (((uintptr_t)s->code_ptr + 1) & 3) {
+                tcg_out8(s, 0x90); /* nop */
+            }
             tcg_out8(s, OPC_JMP_long); /* jmp im */
             s->tb_jmp_offset[args[0]] = tcg_current_code_size(s);
             tcg_out32(s, 0);
@@ -1747,6 +1988,10 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         s->tb_next_offset[args[0]] = tcg_current_code_size(s);
         break;
+    case INDEX_op_goto_ptr:
+        /* jmp to the given host address (could be the epilogue) */
+        tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, args[0]);
+        break;
     case INDEX_op_br:
         tcg_out_jxx(s, JCC_JMP, args[0], 0);
         break;
@@ -2055,6 +2300,21 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_gvec_add:
+    case INDEX_op_gvec_sub:
+    case INDEX_op_gvec_and:
+    case INDEX_op_gvec_or:
+    case INDEX_op_gvec_xor:
+    case INDEX_op_gvec_andc:
+    case INDEX_op_gvec_shli:
+    case INDEX_op_gvec_shri:
+    case INDEX_op_gvec_sari:
+    case INDEX_op_gvec_cmpeq:
+    case INDEX_op_gvec_cmpgt:
+    case INDEX_op_gvec_dup:
+        tcg_out_gvec(s, opc, args);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -2070,7 +2330,20 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_exit_tb, { } },
     { INDEX_op_goto_tb, { } },
+    { INDEX_op_goto_ptr, { "r" } },
     { INDEX_op_br, { } },
+    { INDEX_op_gvec_add, { "r" } },
+    { INDEX_op_gvec_sub, { "r" } },
+    { INDEX_op_gvec_and, { "r" } },
+    { INDEX_op_gvec_or, { "r" } },
+    { INDEX_op_gvec_xor, { "r" } },
+    { INDEX_op_gvec_andc, { "r" } },
+    { INDEX_op_gvec_shli, { "r" } },
+    { INDEX_op_gvec_shri, { "r" } },
+    { INDEX_op_gvec_sari, { "r" } },
+    { INDEX_op_gvec_cmpeq, { "r" } },
+    { INDEX_op_gvec_cmpgt, { "r" } },
+    { INDEX_op_gvec_dup, { "r" } },
     { INDEX_op_ld8u_i32, { "r", "r" } },
     { INDEX_op_ld8s_i32, { "r", "r" } },
     { INDEX_op_ld16u_i32, { "r", "r" } },
@@ -2262,6 +2535,11 @@ static void tcg_target_qemu_prologue(TCGContext *s)
     tcg_out_modrm(s, OPC_GRP5, EXT5_JMPN_Ev, tcg_target_call_iarg_regs[1]);
 #endif
 
+    /* Return path for goto_ptr: return 0 like exit_tb(0), then fall
+       through to the TB epilogue.  */
+    s->code_gen_epilogue = s->code_ptr;
+    tcg_out_movi(s, TCG_TYPE_REG, TCG_REG_EAX, 0);
+
     /* TB epilogue */
     tb_ret_addr = s->code_ptr;
 
@@ -2298,6 +2576,9 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifndef have_sse2
+        have_sse2 = (d & bit_SSE2) != 0;
 #endif
     }
 
@@ -99,6 +99,10 @@ extern bool have_bmi1;
 #define TCG_TARGET_HAS_muls2_i32        1
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_mulsh_i32        0
+#define TCG_TARGET_HAS_goto_ptr         1
+#define TCG_TARGET_HAS_gvec             1
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB   1
+#define TCG_TARGET_IMPLEMENTS_PIC       (TCG_TARGET_REG_BITS == 64)
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_trunc_shr_i32    0
@@ -135,6 +139,10 @@ extern bool have_bmi1;
      ((ofs) == 0 && (len) == 16))
 #define TCG_TARGET_deposit_i64_valid    TCG_TARGET_deposit_i32_valid
 
+/* Jumps between TBs are patched with an atomic store, and the host memory
+   model is strong enough to run several vCPU threads.  */
+#define TCG_TARGET_SUPPORTS_MTTCG       1
+
 #if TCG_TARGET_REG_BITS == 64
 # define TCG_AREG0 TCG_REG_R14
 #else
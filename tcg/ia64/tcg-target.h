@@ -157,6 +157,10 @@ typedef enum {
 #define TCG_TARGET_HAS_muluh_i32        0
 #define TCG_TARGET_HAS_muluh_i64        0
 #define TCG_TARGET_HAS_mulsh_i32        0
+#define TCG_TARGET_HAS_goto_ptr         0
+#define TCG_TARGET_HAS_gvec             0
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB   0
+#define TCG_TARGET_IMPLEMENTS_PIC       0
 #define TCG_TARGET_HAS_mulsh_i64        0
 #define TCG_TARGET_HAS_trunc_shr_i32    0
 
@@ -532,12 +532,247 @@ static bool swap_commutative2(TCGArg *p1, TCGArg *p2)
     return false;
 }
 
+/* CPU state fields that the front end accesses with loads and stores on
+   env rather than through globals, e.g. vector registers.  Second-tier
+   translations remember, within a basic block, which temp holds the
+   value of each field, and whether the last store to it is still unread. */
+
+#define ENV_SLOTS 16
+
+struct env_slot {
+    tcg_target_long ofs;
+    int size;               /* 0 if the slot is unused */
+    TCGArg temp;            /* holds the value of the field */
+    int store_op;           /* unread store to the field... */
+    TCGArg *store_args;     /* ...and its arguments, or NULL */
+};
+
+static struct env_slot env_slots[ENV_SLOTS];
+static int env_slot_next;
+
+/* Forget everything, e.g. because a helper may have written the CPU
+   state. */
+static void env_reset(void)
+{
+    int i;
+
+    for (i = 0; i < ENV_SLOTS; i++) {
+        env_slots[i].size = 0;
+    }
+}
+
+/* The CPU state may be read: stores to it are not dead anymore. */
+static void env_forget_stores(void)
+{
+    int i;
+
+    for (i = 0; i < ENV_SLOTS; i++) {
+        env_slots[i].store_args = NULL;
+    }
+}
+
+static void env_forget_temp(TCGArg temp)
+{
+    int i;
+
+    for (i = 0; i < ENV_SLOTS; i++) {
+        if (env_slots[i].temp == temp) {
+            env_slots[i].size = 0;
+        }
+    }
+}
+
+static inline bool env_overlaps(struct env_slot *slot,
+                                tcg_target_long ofs, int size)
+{
+    return slot->size && slot->ofs < ofs + size && ofs < slot->ofs + slot->size;
+}
+
+static void env_read(tcg_target_long ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < ENV_SLOTS; i++) {
+        if (env_overlaps(&env_slots[i], ofs, size)) {
+            env_slots[i].store_args = NULL;
+        }
+    }
+}
+
+static void env_write(tcg_target_long ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < ENV_SLOTS; i++) {
+        if (env_overlaps(&env_slots[i], ofs, size)) {
+            env_slots[i].size = 0;
+        }
+    }
+}
+
+static struct env_slot *env_find(tcg_target_long ofs, int size)
+{
+    int i;
+
+    for (i = 0; i < ENV_SLOTS; i++) {
+        if (env_slots[i].size == size && env_slots[i].ofs == ofs) {
+            return &env_slots[i];
+        }
+    }
+    return NULL;
+}
+
+static void env_add(tcg_target_long ofs, int size, TCGArg temp,
+                    int store_op, TCGArg *store_args)
+{
+    struct env_slot *slot = &env_slots[env_slot_next];
+
+    env_slot_next = (env_slot_next + 1) % ENV_SLOTS;
+    slot->ofs = ofs;
+    slot->size = size;
+    slot->temp = temp;
+    slot->store_op = store_op;
+    slot->store_args = store_args;
+}
+
+static int env_access_size(TCGOpcode op)
+{
+    switch (op) {
+    CASE_OP_32_64(ld8u):
+    CASE_OP_32_64(ld8s):
+    CASE_OP_32_64(st8):
+        return 1;
+    CASE_OP_32_64(ld16u):
+    CASE_OP_32_64(ld16s):
+    CASE_OP_32_64(st16):
+        return 2;
+    case INDEX_op_ld_i32:
+    case INDEX_op_st_i32:
+    case INDEX_op_ld32u_i64:
+    case INDEX_op_ld32s_i64:
+    case INDEX_op_st32_i64:
+        return 4;
+    case INDEX_op_ld_i64:
+    case INDEX_op_st_i64:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/* Second-tier optimization of the accesses to the CPU state through env:
+   a load of a field whose value is in a temp becomes a move, a store of
+   the value that the field already holds is dropped, and so is a store
+   that is overwritten before anything reads it.  Helper calls and guest
+   memory accesses may read or write the CPU state, or raise an exception
+   that needs it in memory, so they make us forget everything, as does the
+   end of a basic block.  Returns true if the operation was consumed.
+
+   This only sees explicit loads and stores.  Guest registers that are TCG
+   globals are handled by the liveness analysis and the register allocator,
+   which keep them in host registers past the side exits of a superblock.  */
+static bool tcg_opt_env_access(TCGContext *s, TCGArg env, int op_index,
+                               TCGOpcode op, const TCGOpDef *def,
+                               int nb_oargs, int nb_iargs,
+                               TCGArg **p_args, TCGArg **p_gen_args)
+{
+    TCGArg *args = *p_args;
+    int size = env_access_size(op);
+    int i;
+
+    if (size) {
+        bool full = (op == INDEX_op_ld_i32 || op == INDEX_op_st_i32 ||
+                     op == INDEX_op_ld_i64 || op == INDEX_op_st_i64);
+        tcg_target_long ofs = args[2];
+        struct env_slot *slot;
+
+        if (args[1] != env) {
+            /* this may still point into the CPU state */
+            if (nb_oargs) {
+                env_forget_stores();
+            } else {
+                env_reset();
+            }
+            goto outputs;
+        }
+
+        slot = full ? env_find(ofs, size) : NULL;
+        if (nb_oargs) {
+            TCGArg dst = args[0];
+
+            if (slot) {
+                TCGArg src = slot->temp;
+
+                if (temps_are_copies(dst, src)) {
+                    s->gen_opc_buf[op_index] = INDEX_op_nop;
+                } else {
+                    env_forget_temp(dst);
+                    if (temps[src].state == TCG_TEMP_CONST) {
+                        tcg_opt_gen_movi(s, op_index, *p_gen_args, op, dst,
+                                         temps[src].val);
+                    } else {
+                        tcg_opt_gen_mov(s, op_index, *p_gen_args, op, dst,
+                                        src);
+                    }
+                    *p_gen_args += 2;
+                }
+                *p_args += def->nb_args;
+                return true;
+            }
+            env_read(ofs, size);
+            env_forget_temp(dst);
+            if (full) {
+                env_add(ofs, size, dst, -1, NULL);
+            }
+            return false;
+        }
+
+        if (slot && temps_are_copies(slot->temp, args[0])) {
+            s->gen_opc_buf[op_index] = INDEX_op_nop;
+            *p_args += def->nb_args;
+            return true;
+        }
+        if (slot && slot->store_args) {
+            /* nothing read the previous store, which has three arguments */
+            s->gen_opc_buf[slot->store_op] = INDEX_op_nopn;
+            slot->store_args[0] = 3;
+            slot->store_args[2] = 3;
+        }
+        env_write(ofs, size);
+        if (full) {
+            env_add(ofs, size, args[0], op_index, *p_gen_args);
+        }
+        return false;
+    }
+
+    if (op == INDEX_op_call) {
+        TCGArg flags = args[nb_oargs + nb_iargs + 1];
+
+        if ((flags & TCG_CALL_NO_WG_SE) == TCG_CALL_NO_WG_SE) {
+            /* may still read the CPU state */
+            env_forget_stores();
+        } else {
+            env_reset();
+        }
+    } else if (def->flags & (TCG_OPF_BB_END | TCG_OPF_SIDE_EFFECTS |
+                             TCG_OPF_CALL_CLOBBER)) {
+        env_reset();
+    }
+
+ outputs:
+    for (i = 0; i < nb_oargs; i++) {
+        env_forget_temp(args[i]);
+    }
+    return false;
+}
+
 /* Propagate constants and copies, fold constant expressions. */
 static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                                     TCGArg *args, TCGOpDef *tcg_op_defs)
 {
     int nb_ops, op_index, nb_temps, nb_globals;
     TCGArg *gen_args;
+    TCGArg env = -1;
 
     /* Array VALS has an element for each temp.
        If this temp holds a constant then its value is kept in VALS' element.
@@ -548,6 +783,16 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
     nb_globals = s->nb_globals;
     reset_all_temps(nb_temps);
 
+    if (s->tier2) {
+        for (op_index = 0; op_index < nb_globals; op_index++) {
+            if (s->temps[op_index].fixed_reg &&
+                s->temps[op_index].reg == TCG_AREG0) {
+                env = op_index;
+            }
+        }
+        env_reset();
+    }
+
     nb_ops = tcg_opc_ptr - s->gen_opc_buf;
     gen_args = args;
     for (op_index = 0; op_index < nb_ops; op_index++) {
@@ -575,6 +820,12 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
             }
         }
 
+        if (s->tier2 && tcg_opt_env_access(s, env, op_index, op, def,
+                                           nb_oargs, nb_iargs,
+                                           &args, &gen_args)) {
+            continue;
+        }
+
         /* For commutative operations make constant second argument */
         switch (op) {
         CASE_OP_32_64(add):
@@ -0,0 +1,383 @@
+/*
+ * Tiny Code Generator for QEMU: vector operations on the CPU state
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "config.h"
+#include "qemu-common.h"
+#include "tcg-op.h"
+
+/* When the host backend has no instruction for a gvec opcode, the
+   operation is expanded here: 64 bits at a time where the lanes can be
+   kept apart with masks, one element at a time otherwise.  */
+
+typedef void GVecGen3Fn(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b);
+typedef void GVecGen2iFn(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                         unsigned shift);
+
+/* Replicate C across the elements of a 64-bit word.  */
+static uint64_t gvec_dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    default:
+        return c;
+    }
+}
+
+static bool gvec_op(TCGOpcode opc, TCGv_ptr env, unsigned vece,
+                    uint32_t dofs, uint32_t aofs, TCGArg bofs,
+                    uint32_t oprsz)
+{
+    tcg_debug_assert(oprsz == 8 || oprsz == 16 || oprsz == 32);
+    tcg_debug_assert(vece <= MO_64);
+
+    if (!tcg_gvec_supported(opc, vece)) {
+        return false;
+    }
+    *tcg_ctx.gen_opc_ptr++ = opc;
+    *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(env);
+    *tcg_ctx.gen_opparam_ptr++ = dofs;
+    *tcg_ctx.gen_opparam_ptr++ = aofs;
+    *tcg_ctx.gen_opparam_ptr++ = bofs;
+    *tcg_ctx.gen_opparam_ptr++ = tcg_gvec_desc(oprsz, vece);
+    return true;
+}
+
+static void gvec_expand3(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                         uint32_t aofs, uint32_t bofs, uint32_t oprsz,
+                         GVecGen3Fn *fn)
+{
+    TCGv_i64 a = tcg_temp_new_i64();
+    TCGv_i64 b = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(a, env, aofs + i);
+        tcg_gen_ld_i64(b, env, bofs + i);
+        fn(vece, a, a, b);
+        tcg_gen_st_i64(a, env, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+    tcg_temp_free_i64(b);
+}
+
+static void gvec_expand2i(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t aofs, unsigned shift, uint32_t oprsz,
+                          GVecGen2iFn *fn)
+{
+    TCGv_i64 a = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(a, env, aofs + i);
+        fn(vece, a, a, shift);
+        tcg_gen_st_i64(a, env, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+}
+
+static void gvec_ld_elem(TCGv_ptr env, unsigned vece, bool sign,
+                         TCGv_i64 t, uint32_t ofs)
+{
+    switch (vece) {
+    case MO_8:
+        if (sign) {
+            tcg_gen_ld8s_i64(t, env, ofs);
+        } else {
+            tcg_gen_ld8u_i64(t, env, ofs);
+        }
+        break;
+    case MO_16:
+        if (sign) {
+            tcg_gen_ld16s_i64(t, env, ofs);
+        } else {
+            tcg_gen_ld16u_i64(t, env, ofs);
+        }
+        break;
+    case MO_32:
+        if (sign) {
+            tcg_gen_ld32s_i64(t, env, ofs);
+        } else {
+            tcg_gen_ld32u_i64(t, env, ofs);
+        }
+        break;
+    default:
+        tcg_gen_ld_i64(t, env, ofs);
+        break;
+    }
+}
+
+static void gvec_st_elem(TCGv_ptr env, unsigned vece, TCGv_i64 t,
+                         uint32_t ofs)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_st8_i64(t, env, ofs);
+        break;
+    case MO_16:
+        tcg_gen_st16_i64(t, env, ofs);
+        break;
+    case MO_32:
+        tcg_gen_st32_i64(t, env, ofs);
+        break;
+    default:
+        tcg_gen_st_i64(t, env, ofs);
+        break;
+    }
+}
+
+/* The top bit of each element is computed apart, so that no carry or
+   borrow crosses from one element into the next.  */
+static void gvec_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = gvec_dup_const(vece, 1ull << ((8 << vece) - 1));
+    TCGv_i64 t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_andi_i64(t1, a, ~m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gvec_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    uint64_t m = gvec_dup_const(vece, 1ull << ((8 << vece) - 1));
+    TCGv_i64 t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    tcg_gen_ori_i64(t1, a, m);
+    tcg_gen_andi_i64(t2, b, ~m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_andi_i64(t3, t3, m);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gvec_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gvec_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gvec_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gvec_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gvec_shli_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                          unsigned shift)
+{
+    tcg_gen_shli_i64(d, a, shift);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, gvec_dup_const(vece, -1ull << shift));
+    }
+}
+
+static void gvec_shri_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                          unsigned shift)
+{
+    tcg_gen_shri_i64(d, a, shift);
+    if (vece != MO_64) {
+        uint64_t ones = -1ull >> (64 - (8 << vece));
+
+        tcg_gen_andi_i64(d, d, gvec_dup_const(vece, ones >> shift));
+    }
+}
+
+void tcg_gen_gvec_add(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    if (!gvec_op(INDEX_op_gvec_add, env, vece, dofs, aofs, bofs, oprsz)) {
+        gvec_expand3(env, vece, dofs, aofs, bofs, oprsz, gvec_add_i64);
+    }
+}
+
+void tcg_gen_gvec_sub(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    if (!gvec_op(INDEX_op_gvec_sub, env, vece, dofs, aofs, bofs, oprsz)) {
+        gvec_expand3(env, vece, dofs, aofs, bofs, oprsz, gvec_sub_i64);
+    }
+}
+
+void tcg_gen_gvec_and(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    if (!gvec_op(INDEX_op_gvec_and, env, MO_64, dofs, aofs, bofs, oprsz)) {
+        gvec_expand3(env, MO_64, dofs, aofs, bofs, oprsz, gvec_and_i64);
+    }
+}
+
+void tcg_gen_gvec_or(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz)
+{
+    if (!gvec_op(INDEX_op_gvec_or, env, MO_64, dofs, aofs, bofs, oprsz)) {
+        gvec_expand3(env, MO_64, dofs, aofs, bofs, oprsz, gvec_or_i64);
+    }
+}
+
+void tcg_gen_gvec_xor(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz)
+{
+    if (!gvec_op(INDEX_op_gvec_xor, env, MO_64, dofs, aofs, bofs, oprsz)) {
+        gvec_expand3(env, MO_64, dofs, aofs, bofs, oprsz, gvec_xor_i64);
+    }
+}
+
+void tcg_gen_gvec_andc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz)
+{
+    if (!gvec_op(INDEX_op_gvec_andc, env, MO_64, dofs, aofs, bofs, oprsz)) {
+        gvec_expand3(env, MO_64, dofs, aofs, bofs, oprsz, gvec_andc_i64);
+    }
+}
+
+void tcg_gen_gvec_shli(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    tcg_debug_assert(shift < (8u << vece));
+    if (!gvec_op(INDEX_op_gvec_shli, env, vece, dofs, aofs, shift, oprsz)) {
+        gvec_expand2i(env, vece, dofs, aofs, shift, oprsz, gvec_shli_i64);
+    }
+}
+
+void tcg_gen_gvec_shri(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    tcg_debug_assert(shift < (8u << vece));
+    if (!gvec_op(INDEX_op_gvec_shri, env, vece, dofs, aofs, shift, oprsz)) {
+        gvec_expand2i(env, vece, dofs, aofs, shift, oprsz, gvec_shri_i64);
+    }
+}
+
+void tcg_gen_gvec_sari(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz)
+{
+    TCGv_i64 t;
+    uint32_t i;
+
+    tcg_debug_assert(shift < (8u << vece));
+    if (gvec_op(INDEX_op_gvec_sari, env, vece, dofs, aofs, shift, oprsz)) {
+        return;
+    }
+    t = tcg_temp_new_i64();
+    for (i = 0; i < oprsz; i += 1 << vece) {
+        gvec_ld_elem(env, vece, true, t, aofs + i);
+        tcg_gen_sari_i64(t, t, shift);
+        gvec_st_elem(env, vece, t, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_cmp(TCGv_ptr env, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz)
+{
+    TCGv_i64 a, b;
+    uint32_t i;
+
+    switch (cond) {
+    case TCG_COND_EQ:
+        if (gvec_op(INDEX_op_gvec_cmpeq, env, vece, dofs, aofs, bofs, oprsz)) {
+            return;
+        }
+        break;
+    case TCG_COND_GT:
+        if (gvec_op(INDEX_op_gvec_cmpgt, env, vece, dofs, aofs, bofs, oprsz)) {
+            return;
+        }
+        break;
+    case TCG_COND_LT:
+        if (gvec_op(INDEX_op_gvec_cmpgt, env, vece, dofs, bofs, aofs, oprsz)) {
+            return;
+        }
+        break;
+    default:
+        break;
+    }
+
+    a = tcg_temp_new_i64();
+    b = tcg_temp_new_i64();
+    for (i = 0; i < oprsz; i += 1 << vece) {
+        gvec_ld_elem(env, vece, cond & 2, a, aofs + i);
+        gvec_ld_elem(env, vece, cond & 2, b, bofs + i);
+        tcg_gen_setcond_i64(cond, a, a, b);
+        tcg_gen_neg_i64(a, a);
+        gvec_st_elem(env, vece, a, dofs + i);
+    }
+    tcg_temp_free_i64(a);
+    tcg_temp_free_i64(b);
+}
+
+void tcg_gen_gvec_dup_mem(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t aofs, uint32_t oprsz)
+{
+    TCGv_i64 t;
+    uint32_t i;
+
+    if (gvec_op(INDEX_op_gvec_dup, env, vece, dofs, aofs, 0, oprsz)) {
+        return;
+    }
+    t = tcg_temp_new_i64();
+    gvec_ld_elem(env, vece, false, t, aofs);
+    if (vece != MO_64) {
+        tcg_gen_muli_i64(t, t, gvec_dup_const(vece, 1));
+    }
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(t, env, dofs + i);
+    }
+    tcg_temp_free_i64(t);
+}
@@ -2473,6 +2473,7 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define TCGV_UNUSED(x) TCGV_UNUSED_I32(x)
 #define TCGV_IS_UNUSED(x) TCGV_IS_UNUSED_I32(x)
 #define TCGV_EQUAL(a, b) TCGV_EQUAL_I32(a, b)
+#define GET_TCGV(x) GET_TCGV_I32(x)
 #define tcg_add_param_tl tcg_add_param_i32
 #define tcg_gen_qemu_ld_tl tcg_gen_qemu_ld_i32
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i32
@@ -2486,6 +2487,7 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define TCGV_UNUSED(x) TCGV_UNUSED_I64(x)
 #define TCGV_IS_UNUSED(x) TCGV_IS_UNUSED_I64(x)
 #define TCGV_EQUAL(a, b) TCGV_EQUAL_I64(a, b)
+#define GET_TCGV(x) GET_TCGV_I64(x)
 #define tcg_add_param_tl tcg_add_param_i64
 #define tcg_gen_qemu_ld_tl tcg_gen_qemu_ld_i64
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i64
@@ -2520,6 +2522,172 @@ static inline void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* End a TB whose successor is only known at run time, such as an indirect
+   branch or a return.  The guest PC and the rest of the CPU state must
+   already be in @env.  If the next TB has been translated, jump straight
+   to it; otherwise go back to cpu_exec as with exit_tb(0).  */
+static inline void tcg_gen_lookup_and_goto_ptr(TCGv_ptr env)
+{
+    if (TCG_TARGET_HAS_goto_ptr) {
+        TCGv_ptr ptr = tcg_temp_new_ptr();
+
+        gen_helper_lookup_tb_ptr(ptr, env);
+        tcg_gen_op1i(INDEX_op_goto_ptr, GET_TCGV_PTR(ptr));
+        tcg_temp_free_ptr(ptr);
+    } else {
+        tcg_gen_exit_tb(0);
+    }
+}
+
+/* Atomic read-modify-write of guest memory.  These call helpers that use
+   the host's atomic instructions, so they stay atomic when several vCPUs
+   run in parallel.  RETV receives the old contents of memory, extended
+   as MEMOP says; MEMOP must use the target's byte order.  */
+static inline TCGv_i32 tcg_atomic_desc(TCGArg idx, TCGMemOp memop)
+{
+    tcg_debug_assert((memop & MO_BSWAP) == (MO_TE & MO_BSWAP)
+                     || (memop & MO_SIZE) == MO_8);
+    return tcg_const_i32((idx << 2) | (memop & MO_SIZE));
+}
+
+static inline void tcg_atomic_ext_i32(TCGv_i32 retv, TCGMemOp memop)
+{
+    switch (memop & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i32(retv, retv);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i32(retv, retv);
+        break;
+    default:
+        break;
+    }
+}
+
+static inline void tcg_atomic_ext_i64(TCGv_i64 retv, TCGMemOp memop)
+{
+    switch (memop & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i64(retv, retv);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i64(retv, retv);
+        break;
+    case MO_SL:
+        tcg_gen_ext32s_i64(retv, retv);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Store NEWV if memory holds CMPV, compared at the width of MEMOP.  */
+static inline void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 retv, TCGv_ptr env,
+                                              TCGv addr, TCGv_i32 cmpv,
+                                              TCGv_i32 newv, TCGArg idx,
+                                              TCGMemOp memop)
+{
+    TCGv_i32 desc = tcg_atomic_desc(idx, memop);
+
+    tcg_debug_assert((memop & MO_SIZE) <= MO_32);
+    gen_helper_atomic_cmpxchg_i32(retv, env, addr, cmpv, newv, desc);
+    tcg_temp_free_i32(desc);
+    tcg_atomic_ext_i32(retv, memop);
+}
+
+static inline void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 retv, TCGv_ptr env,
+                                              TCGv addr, TCGv_i64 cmpv,
+                                              TCGv_i64 newv, TCGArg idx,
+                                              TCGMemOp memop)
+{
+    TCGv_i32 desc = tcg_atomic_desc(idx, memop);
+
+    gen_helper_atomic_cmpxchg_i64(retv, env, addr, cmpv, newv, desc);
+    tcg_temp_free_i32(desc);
+    tcg_atomic_ext_i64(retv, memop);
+}
+
+/* Exchange, or combine VAL into memory with an addition or a bitwise
+   operation.  */
+#define TCG_GEN_ATOMIC_RMW(NAME)                                        \
+static inline void tcg_gen_atomic_##NAME##_i32(TCGv_i32 retv, TCGv_ptr env, \
+                                               TCGv addr, TCGv_i32 val, \
+                                               TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    TCGv_i32 desc = tcg_atomic_desc(idx, memop);                        \
+                                                                        \
+    tcg_debug_assert((memop & MO_SIZE) <= MO_32);                       \
+    gen_helper_atomic_##NAME##_i32(retv, env, addr, val, desc);         \
+    tcg_temp_free_i32(desc);                                            \
+    tcg_atomic_ext_i32(retv, memop);                                    \
+}                                                                       \
+                                                                        \
+static inline void tcg_gen_atomic_##NAME##_i64(TCGv_i64 retv, TCGv_ptr env, \
+                                               TCGv addr, TCGv_i64 val, \
+                                               TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    TCGv_i32 desc = tcg_atomic_desc(idx, memop);                        \
+                                                                        \
+    gen_helper_atomic_##NAME##_i64(retv, env, addr, val, desc);         \
+    tcg_temp_free_i32(desc);                                            \
+    tcg_atomic_ext_i64(retv, memop);                                    \
+}
+
+TCG_GEN_ATOMIC_RMW(xchg)
+TCG_GEN_ATOMIC_RMW(fetch_add)
+TCG_GEN_ATOMIC_RMW(fetch_and)
+TCG_GEN_ATOMIC_RMW(fetch_or)
+TCG_GEN_ATOMIC_RMW(fetch_xor)
+
+#undef TCG_GEN_ATOMIC_RMW
+
+#if TARGET_LONG_BITS == 64
+#define tcg_gen_atomic_cmpxchg_tl   tcg_gen_atomic_cmpxchg_i64
+#define tcg_gen_atomic_xchg_tl      tcg_gen_atomic_xchg_i64
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i64
+#define tcg_gen_atomic_fetch_and_tl tcg_gen_atomic_fetch_and_i64
+#define tcg_gen_atomic_fetch_or_tl  tcg_gen_atomic_fetch_or_i64
+#define tcg_gen_atomic_fetch_xor_tl tcg_gen_atomic_fetch_xor_i64
+#else
+#define tcg_gen_atomic_cmpxchg_tl   tcg_gen_atomic_cmpxchg_i32
+#define tcg_gen_atomic_xchg_tl      tcg_gen_atomic_xchg_i32
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i32
+#define tcg_gen_atomic_fetch_and_tl tcg_gen_atomic_fetch_and_i32
+#define tcg_gen_atomic_fetch_or_tl  tcg_gen_atomic_fetch_or_i32
+#define tcg_gen_atomic_fetch_xor_tl tcg_gen_atomic_fetch_xor_i32
+#endif
+
+/* Vector operations on the CPU state, implemented in tcg-op-gvec.c.
+   Each one works on OPRSZ bytes (8, 16 or 32) at the given offsets from
+   ENV, split into elements of 1 << VECE bytes.  The destination must be
+   either equal to or disjoint from each source, and none of the bytes
+   may back a TCG global.  */
+void tcg_gen_gvec_add(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_sub(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_and(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_or(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_xor(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz);
+void tcg_gen_gvec_andc(TCGv_ptr env, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz);
+/* Shifts by an immediate less than the element width.  */
+void tcg_gen_gvec_shli(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+void tcg_gen_gvec_shri(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+void tcg_gen_gvec_sari(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                       uint32_t aofs, unsigned shift, uint32_t oprsz);
+/* Set each element to all ones if COND holds, to zero otherwise.  */
+void tcg_gen_gvec_cmp(TCGv_ptr env, TCGCond cond, unsigned vece,
+                      uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz);
+/* Replicate the element at AOFS.  */
+void tcg_gen_gvec_dup_mem(TCGv_ptr env, unsigned vece, uint32_t dofs,
+                          uint32_t aofs, uint32_t oprsz);
 
 void tcg_gen_qemu_ld_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
@@ -14,3 +14,22 @@ DEF_HELPER_FLAGS_2(sar_i64, TCG_CALL_NO_RWG_SE, s64, s64, s64)
 
 DEF_HELPER_FLAGS_2(mulsh_i64, TCG_CALL_NO_RWG_SE, s64, s64, s64)
 DEF_HELPER_FLAGS_2(muluh_i64, TCG_CALL_NO_RWG_SE, i64, i64, i64)
+
+#ifdef NEED_CPU_H
+DEF_HELPER_FLAGS_1(lookup_tb_ptr, TCG_CALL_NO_WG_SE, ptr, env)
+
+DEF_HELPER_FLAGS_5(atomic_cmpxchg_i32, TCG_CALL_NO_WG, i32, env, tl, i32, i32, i32)
+DEF_HELPER_FLAGS_5(atomic_cmpxchg_i64, TCG_CALL_NO_WG, i64, env, tl, i64, i64, i32)
+
+#define DEF_HELPER_ATOMIC_RMW(NAME)                                     \
+DEF_HELPER_FLAGS_4(atomic_##NAME##_i32, TCG_CALL_NO_WG, i32, env, tl, i32, i32) \
+DEF_HELPER_FLAGS_4(atomic_##NAME##_i64, TCG_CALL_NO_WG, i64, env, tl, i64, i32)
+
+DEF_HELPER_ATOMIC_RMW(xchg)
+DEF_HELPER_ATOMIC_RMW(fetch_add)
+DEF_HELPER_ATOMIC_RMW(fetch_and)
+DEF_HELPER_ATOMIC_RMW(fetch_or)
+DEF_HELPER_ATOMIC_RMW(fetch_xor)
+
+#undef DEF_HELPER_ATOMIC_RMW
+#endif
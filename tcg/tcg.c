@@ -39,6 +39,7 @@
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
 #include "qemu/timer.h"
+#include "qemu/bitmap.h"
 
 /* Note: the long term plan is to reduce the dependencies on the QEMU
    CPU definitions. Currently they are used for qemu_ld/st
@@ -111,6 +112,9 @@ static int tcg_target_const_match(tcg_target_long val, TCGType type,
                                   const TCGArgConstraint *arg_ct);
 static void tcg_out_tb_init(TCGContext *s);
 static void tcg_out_tb_finalize(TCGContext *s);
+#if TCG_TARGET_HAS_gvec
+static bool tcg_target_gvec_supported(TCGOpcode opc, unsigned vece);
+#endif
 
 
 TCGOpDef tcg_op_defs[] = {
@@ -321,11 +325,14 @@ typedef struct TCGHelperInfo {
     const char *name;
     unsigned flags;
     unsigned sizemask;
+    /* globals accessed by the helper, see tcg_set_helper_globals */
+    unsigned long *globals_read;
+    unsigned long *globals_written;
 } TCGHelperInfo;
 
 #include "exec/helper-proto.h"
 
-static const TCGHelperInfo all_helpers[] = {
+static TCGHelperInfo all_helpers[] = {
 #include "exec/helper-tcg.h"
 };
 
@@ -373,6 +380,31 @@ void tcg_context_init(TCGContext *s)
     tcg_target_init(s);
 }
 
+void tcg_set_helper_globals(void *func, const int *read, int nb_read,
+                            const int *written, int nb_written)
+{
+    TCGContext *s = &tcg_ctx;
+    TCGHelperInfo *info;
+    int i;
+
+    info = g_hash_table_lookup(s->helpers, (gpointer)func);
+    if (!info->globals_read) {
+        info->globals_read = bitmap_new(TCG_MAX_TEMPS);
+        info->globals_written = bitmap_new(TCG_MAX_TEMPS);
+    }
+    for (i = 0; i < nb_read; i++) {
+        assert(read[i] < s->nb_globals);
+        set_bit(read[i], info->globals_read);
+    }
+    /* A helper might only write a global under some conditions, so the
+       previous value must be in memory too.  */
+    for (i = 0; i < nb_written; i++) {
+        assert(written[i] < s->nb_globals);
+        set_bit(written[i], info->globals_read);
+        set_bit(written[i], info->globals_written);
+    }
+}
+
 void tcg_prologue_init(TCGContext *s)
 {
     /* init global prologue and epilogue */
@@ -417,6 +449,7 @@ void tcg_func_start(TCGContext *s)
 
     s->gen_opc_ptr = s->gen_opc_buf;
     s->gen_opparam_ptr = s->gen_opparam_buf;
+    s->host_ptrs = false;
 
     s->be = tcg_malloc(sizeof(TCGBackendData));
 }
@@ -711,6 +744,9 @@ void tcg_gen_callN(TCGContext *s, void *func, TCGArg ret,
     info = g_hash_table_lookup(s->helpers, (gpointer)func);
     flags = info->flags;
     sizemask = info->sizemask;
+    if (info->globals_read) {
+        flags |= TCG_CALL_SOME_GLOBALS;
+    }
 
 #if defined(__sparc__) && !defined(__arch64__) \
     && !defined(CONFIG_TCG_INTERPRETER)
@@ -944,6 +980,18 @@ static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
     return op;
 }
 
+/* Return true if the backend can emit the gvec opcode OPC for elements
+   of 1 << VECE bytes; otherwise tcg-op-gvec.c expands it into integer
+   operations.  */
+bool tcg_gvec_supported(TCGOpcode opc, unsigned vece)
+{
+#if TCG_TARGET_HAS_gvec
+    return tcg_target_gvec_supported(opc, vece);
+#else
+    return false;
+#endif
+}
+
 void tcg_gen_qemu_ld_i32(TCGv_i32 val, TCGv addr, TCGArg idx, TCGMemOp memop)
 {
     memop = tcg_canonicalize_memop(memop, 0, 0);
@@ -1007,6 +1055,9 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
     *tcg_ctx.gen_opparam_ptr++ = idx;
 }
 
+/* next_use value of a temporary which is not used anymore */
+#define TCG_NO_NEXT_USE UINT16_MAX
+
 static void tcg_reg_alloc_start(TCGContext *s)
 {
     int i;
@@ -1029,6 +1080,9 @@ static void tcg_reg_alloc_start(TCGContext *s)
         ts->mem_allocated = 0;
         ts->fixed_reg = 0;
     }
+    for (i = 0; i < s->nb_temps; i++) {
+        s->temps[i].next_use = TCG_NO_NEXT_USE;
+    }
     for(i = 0; i < TCG_TARGET_NB_REGS; i++) {
         s->reg_to_temp[i] = -1;
     }
@@ -1398,17 +1452,18 @@ static inline void tcg_set_nop(TCGContext *s, uint16_t *opc_ptr,
 /* liveness analysis: end of function: all temps are dead, and globals
    should be in memory. */
 static inline void tcg_la_func_end(TCGContext *s, uint8_t *dead_temps,
-                                   uint8_t *mem_temps)
+                                   uint8_t *mem_temps, uint16_t *next_use)
 {
     memset(dead_temps, 1, s->nb_temps);
     memset(mem_temps, 1, s->nb_globals);
     memset(mem_temps + s->nb_globals, 0, s->nb_temps - s->nb_globals);
+    memset(next_use, 0xff, s->nb_temps * sizeof(uint16_t));
 }
 
 /* liveness analysis: end of basic block: all temps are dead, globals
    and local temps should be in memory. */
 static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
-                                 uint8_t *mem_temps)
+                                 uint8_t *mem_temps, uint16_t *next_use)
 {
     int i;
 
@@ -1417,11 +1472,57 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     for(i = s->nb_globals; i < s->nb_temps; i++) {
         mem_temps[i] = s->temps[i].temp_local;
     }
+    memset(next_use, 0xff, s->nb_temps * sizeof(uint16_t));
+}
+
+/* liveness analysis: conditional branch: globals and local temps should
+   be in memory for the branch target, but the following code is only
+   reached through the branch and can keep using their registers.  Temps
+   are dead. */
+static inline void tcg_la_bb_sync(TCGContext *s, uint8_t *dead_temps,
+                                  uint8_t *mem_temps, uint16_t *next_use)
+{
+    int i;
+
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            mem_temps[i] = 1;
+        } else {
+            dead_temps[i] = 1;
+            mem_temps[i] = 0;
+            next_use[i] = TCG_NO_NEXT_USE;
+        }
+    }
+}
+
+/* liveness analysis: call to a helper declared with
+   tcg_set_helper_globals: only the globals it reads should be in memory,
+   and only the globals it writes go back to memory. */
+static void tcg_la_call_globals(TCGContext *s, uint8_t *dead_temps,
+                                uint8_t *mem_temps, uint16_t *next_use,
+                                TCGArg func, int call_flags)
+{
+    TCGHelperInfo *info;
+    int i;
+
+    info = g_hash_table_lookup(s->helpers, (gpointer)func);
+    for (i = 0; i < s->nb_globals; i++) {
+        if (test_bit(i, info->globals_read)) {
+            mem_temps[i] = 1;
+        }
+        if (!(call_flags & TCG_CALL_NO_WRITE_GLOBALS)
+            && test_bit(i, info->globals_written)) {
+            dead_temps[i] = 1;
+            next_use[i] = TCG_NO_NEXT_USE;
+        }
+    }
 }
 
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
-   temporaries are removed. */
+   temporaries are removed. The param_next_use array records, for each
+   temporary argument, the next operation using it. */
 static void tcg_liveness_analysis(TCGContext *s)
 {
     int i, op_index, nb_args, nb_iargs, nb_oargs, nb_ops;
@@ -1429,6 +1530,7 @@ static void tcg_liveness_analysis(TCGContext *s)
     TCGArg *args, arg;
     const TCGOpDef *def;
     uint8_t *dead_temps, *mem_temps;
+    uint16_t *next_use, *param_next_use;
     uint16_t dead_args;
     uint8_t sync_args;
     bool have_op_new2;
@@ -1439,10 +1541,13 @@ static void tcg_liveness_analysis(TCGContext *s)
 
     s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
+    s->param_next_use = tcg_malloc((s->gen_opparam_ptr - s->gen_opparam_buf) *
+                                   sizeof(uint16_t));
     
     dead_temps = tcg_malloc(s->nb_temps);
     mem_temps = tcg_malloc(s->nb_temps);
-    tcg_la_func_end(s, dead_temps, mem_temps);
+    next_use = tcg_malloc(s->nb_temps * sizeof(uint16_t));
+    tcg_la_func_end(s, dead_temps, mem_temps, next_use);
 
     args = s->gen_opparam_ptr;
     op_index = nb_ops - 1;
@@ -1475,6 +1580,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 } else {
                 do_not_remove_call:
 
+                    param_next_use = s->param_next_use +
+                                     (args - s->gen_opparam_buf);
+
                     /* output args are dead */
                     dead_args = 0;
                     sync_args = 0;
@@ -1488,16 +1596,26 @@ static void tcg_liveness_analysis(TCGContext *s)
                         }
                         dead_temps[arg] = 1;
                         mem_temps[arg] = 0;
+                        param_next_use[i] = next_use[arg];
+                        next_use[arg] = TCG_NO_NEXT_USE;
                     }
 
-                    if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
+                    if (call_flags & TCG_CALL_NO_READ_GLOBALS) {
+                        /* nothing to do */
+                    } else if (call_flags & TCG_CALL_SOME_GLOBALS) {
+                        tcg_la_call_globals(s, dead_temps, mem_temps,
+                                            next_use,
+                                            args[nb_oargs + nb_iargs],
+                                            call_flags);
+                    } else {
                         /* globals should be synced to memory */
                         memset(mem_temps, 1, s->nb_globals);
-                    }
-                    if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
-                                        TCG_CALL_NO_READ_GLOBALS))) {
-                        /* globals should go back to memory */
-                        memset(dead_temps, 1, s->nb_globals);
+                        if (!(call_flags & TCG_CALL_NO_WRITE_GLOBALS)) {
+                            /* globals should go back to memory */
+                            memset(dead_temps, 1, s->nb_globals);
+                            memset(next_use, 0xff,
+                                   s->nb_globals * sizeof(uint16_t));
+                        }
                     }
 
                     /* input args are live */
@@ -1508,6 +1626,8 @@ static void tcg_liveness_analysis(TCGContext *s)
                                 dead_args |= (1 << i);
                             }
                             dead_temps[arg] = 0;
+                            param_next_use[i] = next_use[arg];
+                            next_use[arg] = op_index;
                         }
                     }
                     s->op_dead_args[op_index] = dead_args;
@@ -1528,6 +1648,7 @@ static void tcg_liveness_analysis(TCGContext *s)
             /* mark the temporary as dead */
             dead_temps[args[0]] = 1;
             mem_temps[args[0]] = 0;
+            next_use[args[0]] = TCG_NO_NEXT_USE;
             break;
         case INDEX_op_end:
             break;
@@ -1639,6 +1760,8 @@ static void tcg_liveness_analysis(TCGContext *s)
 #endif
             } else {
             do_not_remove:
+                param_next_use = s->param_next_use +
+                                 (args - s->gen_opparam_buf);
 
                 /* output args are dead */
                 dead_args = 0;
@@ -1653,11 +1776,15 @@ static void tcg_liveness_analysis(TCGContext *s)
                     }
                     dead_temps[arg] = 1;
                     mem_temps[arg] = 0;
+                    param_next_use[i] = next_use[arg];
+                    next_use[arg] = TCG_NO_NEXT_USE;
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
-                    tcg_la_bb_end(s, dead_temps, mem_temps);
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_bb_sync(s, dead_temps, mem_temps, next_use);
+                } else if (def->flags & TCG_OPF_BB_END) {
+                    tcg_la_bb_end(s, dead_temps, mem_temps, next_use);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
                     memset(mem_temps, 1, s->nb_globals);
@@ -1670,6 +1797,8 @@ static void tcg_liveness_analysis(TCGContext *s)
                         dead_args |= (1 << i);
                     }
                     dead_temps[arg] = 0;
+                    param_next_use[i] = next_use[arg];
+                    next_use[arg] = op_index;
                 }
                 s->op_dead_args[op_index] = dead_args;
                 s->op_sync_args[op_index] = sync_args;
@@ -1687,13 +1816,16 @@ static void tcg_liveness_analysis(TCGContext *s)
 /* dummy liveness analysis */
 static void tcg_liveness_analysis(TCGContext *s)
 {
-    int nb_ops;
+    int nb_ops, nb_params;
     nb_ops = s->gen_opc_ptr - s->gen_opc_buf;
 
     s->op_dead_args = tcg_malloc(nb_ops * sizeof(uint16_t));
     memset(s->op_dead_args, 0, nb_ops * sizeof(uint16_t));
     s->op_sync_args = tcg_malloc(nb_ops * sizeof(uint8_t));
     memset(s->op_sync_args, 0, nb_ops * sizeof(uint8_t));
+    nb_params = s->gen_opparam_ptr - s->gen_opparam_buf;
+    s->param_next_use = tcg_malloc(nb_params * sizeof(uint16_t));
+    memset(s->param_next_use, 0xff, nb_params * sizeof(uint16_t));
 }
 #endif
 
@@ -1824,8 +1956,9 @@ static void tcg_reg_free(TCGContext *s, int reg)
 /* Allocate a register belonging to reg1 & ~reg2 */
 static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
 {
-    int i, reg;
+    int i, reg, best_reg;
     TCGRegSet reg_ct;
+    TCGTemp *ts, *best_ts;
 
     tcg_regset_andnot(reg_ct, reg1, reg2);
 
@@ -1836,16 +1969,29 @@ static int tcg_reg_alloc(TCGContext *s, TCGRegSet reg1, TCGRegSet reg2)
             return reg;
     }
 
-    /* XXX: do better spill choice */
+    /* spill the register whose temporary is used the furthest away,
+       preferring the ones which are already in memory and do not need
+       a store. */
+    best_reg = -1;
+    best_ts = NULL;
     for(i = 0; i < ARRAY_SIZE(tcg_target_reg_alloc_order); i++) {
         reg = tcg_target_reg_alloc_order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
-            tcg_reg_free(s, reg);
-            return reg;
+            ts = &s->temps[s->reg_to_temp[reg]];
+            if (best_reg < 0 || ts->next_use > best_ts->next_use
+                || (ts->next_use == best_ts->next_use
+                    && ts->mem_coherent && !best_ts->mem_coherent)) {
+                best_reg = reg;
+                best_ts = ts;
+            }
         }
     }
 
-    tcg_abort();
+    if (best_reg < 0) {
+        tcg_abort();
+    }
+    tcg_reg_free(s, best_reg);
+    return best_reg;
 }
 
 /* mark a temporary as dead. */
@@ -1909,6 +2055,22 @@ static inline void temp_save(TCGContext *s, int temp, TCGRegSet allocated_regs)
 #endif
 }
 
+/* make sure a temporary that may stay in a register is also in memory.
+   'allocated_regs' is used in case a temporary registers needs to be
+   allocated to store a constant. */
+static inline void temp_sync_checked(TCGContext *s, int temp,
+                                     TCGRegSet allocated_regs)
+{
+#ifdef USE_LIVENESS_ANALYSIS
+    /* The liveness analysis already ensures that the temporary is synced.
+       Keep an assert for safety. */
+    assert(s->temps[temp].val_type != TEMP_VAL_REG ||
+           s->temps[temp].fixed_reg || s->temps[temp].mem_coherent);
+#else
+    temp_sync(s, temp, allocated_regs);
+#endif
+}
+
 /* save globals to their canonical location and assume they can be
    modified be the following code. 'allocated_regs' is used in case a
    temporary registers needs to be allocated to store a constant. */
@@ -1929,12 +2091,26 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     int i;
 
     for (i = 0; i < s->nb_globals; i++) {
-#ifdef USE_LIVENESS_ANALYSIS
-        assert(s->temps[i].val_type != TEMP_VAL_REG || s->temps[i].fixed_reg ||
-               s->temps[i].mem_coherent);
-#else
-        temp_sync(s, i, allocated_regs);
-#endif
+        temp_sync_checked(s, i, allocated_regs);
+    }
+}
+
+/* sync or save the globals read or written by a helper declared with
+   tcg_set_helper_globals. */
+static void call_globals(TCGContext *s, uintptr_t func, int flags,
+                         TCGRegSet allocated_regs)
+{
+    TCGHelperInfo *info;
+    int i;
+
+    info = g_hash_table_lookup(s->helpers, (gpointer)func);
+    for (i = 0; i < s->nb_globals; i++) {
+        if (!(flags & TCG_CALL_NO_WRITE_GLOBALS)
+            && test_bit(i, info->globals_written)) {
+            temp_save(s, i, allocated_regs);
+        } else if (test_bit(i, info->globals_read)) {
+            temp_sync_checked(s, i, allocated_regs);
+        }
     }
 }
 
@@ -1963,6 +2139,51 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, globals and local temporaries are stored at
+   their canonical location for the branch target, but the following code
+   can keep using the registers they are in.  Other temporaries are
+   dead. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    TCGTemp *ts;
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        ts = &s->temps[i];
+        if (ts->temp_local) {
+            temp_sync_checked(s, i, allocated_regs);
+        } else {
+#ifdef USE_LIVENESS_ANALYSIS
+            /* The liveness analysis already ensures that temps are dead.
+               Keep an assert for safety. */
+            assert(ts->val_type == TEMP_VAL_DEAD);
+#else
+            temp_dead(s, i);
+#endif
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+}
+
+/* record the next use of the 'nb_args' temporaries used by an operation,
+   whose arguments start at 'args'.  Outputs are handled last, as their
+   next use is the one that matters for temporaries that are both input
+   and output. */
+static inline void tcg_reg_alloc_next_use(TCGContext *s, const TCGArg *args,
+                                          int nb_args)
+{
+    const uint16_t *param_next_use;
+    int i;
+
+    param_next_use = s->param_next_use + (args - s->gen_opparam_buf);
+    for (i = nb_args - 1; i >= 0; i--) {
+        if (args[i] != TCG_CALL_DUMMY_ARG) {
+            s->temps[args[i]].next_use = param_next_use[i];
+        }
+    }
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -2169,7 +2390,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cbranch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2358,6 +2581,8 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
        they might be read. */
     if (flags & TCG_CALL_NO_READ_GLOBALS) {
         /* Nothing to do */
+    } else if (flags & TCG_CALL_SOME_GLOBALS) {
+        call_globals(s, (uintptr_t)func_addr, flags, allocated_regs);
     } else if (flags & TCG_CALL_NO_WRITE_GLOBALS) {
         sync_globals(s, allocated_regs);
     } else {
@@ -2417,7 +2642,7 @@ static inline int tcg_gen_code_common(TCGContext *s,
                                       long search_pc)
 {
     TCGOpcode opc;
-    int op_index;
+    int op_index, nb_args;
     const TCGOpDef *def;
     const TCGArg *args;
 
@@ -2483,11 +2708,13 @@ static inline int tcg_gen_code_common(TCGContext *s,
         case INDEX_op_mov_i64:
             tcg_reg_alloc_mov(s, def, args, s->op_dead_args[op_index],
                               s->op_sync_args[op_index]);
+            tcg_reg_alloc_next_use(s, args, def->nb_oargs + def->nb_iargs);
             break;
         case INDEX_op_movi_i32:
         case INDEX_op_movi_i64:
             tcg_reg_alloc_movi(s, args, s->op_dead_args[op_index],
                                s->op_sync_args[op_index]);
+            tcg_reg_alloc_next_use(s, args, def->nb_oargs + def->nb_iargs);
             break;
         case INDEX_op_debug_insn_start:
             /* debug instruction */
@@ -2508,9 +2735,12 @@ static inline int tcg_gen_code_common(TCGContext *s,
             tcg_out_label(s, args[0], s->code_ptr);
             break;
         case INDEX_op_call:
-            args += tcg_reg_alloc_call(s, def, opc, args,
-                                       s->op_dead_args[op_index],
-                                       s->op_sync_args[op_index]);
+            nb_args = tcg_reg_alloc_call(s, def, opc, args,
+                                         s->op_dead_args[op_index],
+                                         s->op_sync_args[op_index]);
+            tcg_reg_alloc_next_use(s, args + 1,
+                                   (args[0] >> 16) + (args[0] & 0xffff));
+            args += nb_args;
             goto next;
         case INDEX_op_end:
             goto the_end;
@@ -2524,6 +2754,7 @@ static inline int tcg_gen_code_common(TCGContext *s,
                some common argument patterns */
             tcg_reg_alloc_op(s, def, opc, args, s->op_dead_args[op_index],
                              s->op_sync_args[op_index]);
+            tcg_reg_alloc_next_use(s, args, def->nb_oargs + def->nb_iargs);
             break;
         }
         args += def->nb_args;
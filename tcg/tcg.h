@@ -343,6 +343,9 @@ static inline intptr_t QEMU_ARTIFICIAL GET_TCGV_PTR(TCGv_ptr t)
 #define TCG_CALL_NO_WRITE_GLOBALS   0x0020
 /* Helper can be safely suppressed if the return value is not used. */
 #define TCG_CALL_NO_SIDE_EFFECTS    0x0040
+/* Helper only accesses the globals declared with tcg_set_helper_globals.
+   Set by tcg_gen_callN, not meant to be used in helper definitions. */
+#define TCG_CALL_SOME_GLOBALS       0x0080
 
 /* convenience version of most used call flags */
 #define TCG_CALL_NO_RWG         TCG_CALL_NO_READ_GLOBALS
@@ -439,6 +442,9 @@ typedef struct TCGTemp {
                                   basic blocks. Otherwise, it is not
                                   preserved across basic blocks. */
     unsigned int temp_allocated:1; /* never used for code gen */
+    uint16_t next_use; /* index of the next operation using the temp,
+                          used by the register allocator to choose
+                          which register to spill. */
     const char *name;
 } TCGTemp;
 
@@ -468,6 +474,9 @@ struct TCGContext {
     uint8_t *op_sync_args;  /* for each operation, each bit tells if the
                                corresponding output argument needs to be
                                sync to memory. */
+    uint16_t *param_next_use; /* for each temporary argument in
+                                 gen_opparam_buf, index of the next
+                                 operation using that temporary. */
     
     /* tells in which temporary a given register is. It does not take
        into account fixed registers */
@@ -523,6 +532,17 @@ struct TCGContext {
        extension that allows arithmetic on void*.  */
     int code_gen_max_blocks;
     void *code_gen_prologue;
+    void *code_gen_epilogue;
+    /* Set by the caller of tcg_gen_code for a second-tier translation,
+       which is worth more expensive optimizations.  */
+    bool tier2;
+    /* Set when the code may be saved by -tbcache in a position independent
+       build: the only host addresses it may depend on are those of TBs,
+       encoded relative to the code (TCG_TARGET_IMPLEMENTS_PIC).  */
+    bool code_gen_pic;
+    /* Set while translating if the code embeds host pointers that the
+       next run of QEMU may not have, see tcg_const_ptr().  */
+    bool host_ptrs;
     void *code_gen_buffer;
     size_t code_gen_buffer_size;
     /* threshold to flush the translated code buffer */
@@ -640,6 +660,9 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: the code following it is
+       only reached from it, so values can stay in registers.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -678,11 +701,31 @@ do {\
 
 void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 
+/* The last argument of the gvec opcodes packs the operation size in
+   bytes (8, 16 or 32) and the log2 of the element size.  */
+static inline TCGArg tcg_gvec_desc(unsigned oprsz, unsigned vece)
+{
+    return oprsz | vece;
+}
+
+static inline unsigned tcg_gvec_oprsz(TCGArg desc)
+{
+    return desc & ~7;
+}
+
+static inline unsigned tcg_gvec_vece(TCGArg desc)
+{
+    return desc & 7;
+}
+
+bool tcg_gvec_supported(TCGOpcode opc, unsigned vece);
+
 #if UINTPTR_MAX == UINT32_MAX
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I32(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I32(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.host_ptrs = true, TCGV_NAT_TO_PTR(tcg_const_i32((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i32((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -693,7 +736,8 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 #define TCGV_NAT_TO_PTR(n) MAKE_TCGV_PTR(GET_TCGV_I64(n))
 #define TCGV_PTR_TO_NAT(n) MAKE_TCGV_I64(GET_TCGV_PTR(n))
 
-#define tcg_const_ptr(V) TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V)))
+#define tcg_const_ptr(V) \
+    (tcg_ctx.host_ptrs = true, TCGV_NAT_TO_PTR(tcg_const_i64((intptr_t)(V))))
 #define tcg_global_reg_new_ptr(R, N) \
     TCGV_NAT_TO_PTR(tcg_global_reg_new_i64((R), (N)))
 #define tcg_global_mem_new_ptr(R, O, N) \
@@ -705,6 +749,14 @@ void tcg_add_target_add_op_defs(const TCGTargetOpDef *tdefs);
 void tcg_gen_callN(TCGContext *s, void *func,
                    TCGArg ret, int nargs, TCGArg *args);
 
+/* Declare that the helper FUNC reads no global other than the NB_READ
+   temporaries in READ, and writes no global other than the NB_WRITTEN
+   temporaries in WRITTEN.  Only the corresponding host registers are
+   synced or invalidated around calls to FUNC.  The helper must not
+   raise exceptions, as restoring the CPU state reads every global.  */
+void tcg_set_helper_globals(void *func, const int *read, int nb_read,
+                            const int *written, int nb_written);
+
 void tcg_gen_shifti_i64(TCGv_i64 ret, TCGv_i64 arg1,
                         int c, int right, int arith);
 
@@ -0,0 +1,112 @@
+/*
+ * Throughput of the zero page and XBZRLE delta scan implementations
+ *
+ * Build with "make tests/bench-buffer-scan" and run it on an idle host;
+ * it is not part of "make check".
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE   4096
+#define BUF_SIZE    (64 * 1024 * 1024)
+#define ROUNDS      16
+
+static uint8_t *buf;
+
+static void report(const char *what, BufferAccel accel, double secs)
+{
+    double gb = (double)BUF_SIZE * ROUNDS / (1024 * 1024 * 1024);
+
+    g_print("%-24s %-14s %8.2f GB/s\n", what, buffer_accel_name(accel),
+            gb / secs);
+}
+
+/* An all zero buffer: the whole of it must be read */
+static void bench_zero_buffer(BufferAccel accel)
+{
+    size_t ret = 0;
+    int i;
+
+    memset(buf, 0, BUF_SIZE);
+    g_test_timer_start();
+    for (i = 0; i < ROUNDS; i++) {
+        ret += buffer_find_nonzero_offset(buf, BUF_SIZE);
+    }
+    report("zero buffer", accel, g_test_timer_elapsed());
+    g_assert(ret == (size_t)BUF_SIZE * ROUNDS);
+}
+
+/* Zero pages one at a time, like is_zero_range() during migration */
+static void bench_zero_pages(BufferAccel accel)
+{
+    size_t off, zero = 0;
+    int i;
+
+    memset(buf, 0, BUF_SIZE);
+    g_test_timer_start();
+    for (i = 0; i < ROUNDS; i++) {
+        for (off = 0; off < BUF_SIZE; off += PAGE_SIZE) {
+            zero += buffer_find_nonzero_offset(buf + off, PAGE_SIZE)
+                    == PAGE_SIZE;
+        }
+    }
+    report("zero pages", accel, g_test_timer_elapsed());
+    g_assert(zero == (size_t)BUF_SIZE / PAGE_SIZE * ROUNDS);
+}
+
+/* Pages with a few changed bytes, the common XBZRLE case */
+static void bench_xbzrle(BufferAccel accel, uint8_t *old)
+{
+    uint8_t dst[PAGE_SIZE];
+    size_t off;
+    int i;
+
+    g_test_timer_start();
+    for (i = 0; i < ROUNDS; i++) {
+        for (off = 0; off < BUF_SIZE; off += PAGE_SIZE) {
+            xbzrle_encode_buffer(old + off, buf + off, PAGE_SIZE,
+                                 dst, PAGE_SIZE);
+        }
+    }
+    report("xbzrle sparse delta", accel, g_test_timer_elapsed());
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *old;
+    size_t off;
+    int accel;
+
+    g_test_init(&argc, &argv, NULL);
+
+    buf = g_malloc(BUF_SIZE);
+    old = g_malloc(BUF_SIZE);
+
+    for (accel = 0; accel < BUFFER_ACCEL__MAX; accel++) {
+        if (!buffer_accel_set(accel)) {
+            g_print("%-24s %-14s not supported by the host\n", "",
+                    buffer_accel_name(accel));
+            continue;
+        }
+        bench_zero_buffer(accel);
+        bench_zero_pages(accel);
+
+        memset(old, 0x5a, BUF_SIZE);
+        memcpy(buf, old, BUF_SIZE);
+        for (off = 0; off < BUF_SIZE; off += PAGE_SIZE) {
+            buf[off + g_test_rand_int_range(0, PAGE_SIZE)] ^= 1;
+            buf[off + g_test_rand_int_range(0, PAGE_SIZE)] ^= 1;
+        }
+        bench_xbzrle(accel, old);
+    }
+
+    g_free(buf);
+    g_free(old);
+    return 0;
+}
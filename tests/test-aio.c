@@ -15,6 +15,7 @@
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
+#include "qapi/error.h"
 
 static AioContext *ctx;
 
@@ -425,6 +426,80 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+/* Enough handlers for aio_poll to switch to epoll where available */
+#define MANY_EVENT_NOTIFIERS 100
+
+static void test_many_event_notifiers(void)
+{
+    EventNotifierTestData data[MANY_EVENT_NOTIFIERS];
+    int i;
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    event_notifier_set(&data[42].e);
+    wait_until_inactive(&data[42]);
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i == 42);
+    }
+
+    /* Handlers can come and go while the AioContext uses epoll */
+    aio_set_event_notifier(ctx, &data[42].e, NULL);
+    event_notifier_set(&data[7].e);
+    wait_until_inactive(&data[7]);
+    g_assert_cmpint(data[7].n, ==, 1);
+
+    for (i = 0; i < MANY_EVENT_NOTIFIERS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
+static bool event_poll_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (!data->active) {
+        return false;
+    }
+    data->n++;
+    data->active--;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+    aio_context_set_poll_params(ctx, 10 * SCALE_MS, 0, 0, &error_abort);
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* An event that comes quickly enables polling */
+    event_notifier_set(&data.e);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Now aio_poll finds work without the event notifier being set */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 2);
+    g_assert_cmpint(data.active, ==, 0);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0, &error_abort);
+    aio_set_event_notifier(ctx, &data.e, NULL);
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 2);
+    event_notifier_cleanup(&data.e);
+}
+
 static void test_timer_schedule(void)
 {
     TimerTestData data = { .n = 0, .ctx = ctx, .ns = SCALE_MS * 750LL,
@@ -843,6 +918,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/event/many",              test_many_event_notifiers);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
@@ -226,6 +226,41 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static void test_buffer_find_nonzero_offset(void)
+{
+    size_t len = 64 * 1024;
+    uint8_t *mem = g_malloc(len + 64);
+    uint8_t *buf = (uint8_t *)QEMU_ALIGN_UP((uintptr_t)mem, 64);
+    BufferAccel saved = buffer_accel_get();
+    size_t pos, off;
+    int accel;
+
+    for (accel = 0; accel < BUFFER_ACCEL__MAX; accel++) {
+        if (!buffer_accel_set(accel)) {
+            continue;
+        }
+
+        memset(buf, 0, len);
+        g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+        g_assert(buffer_is_zero(buf, len));
+
+        for (pos = 0; pos < len; pos += 61) {
+            buf[pos] = 1;
+            off = buffer_find_nonzero_offset(buf, len);
+            /* rounded down, but never past the non-zero block */
+            g_assert_cmpint(off, <=, pos);
+            g_assert_cmpint(pos - off, <,
+                            BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR *
+                            sizeof(VECTYPE));
+            g_assert(!buffer_is_zero(buf, len));
+            buf[pos] = 0;
+        }
+    }
+
+    buffer_accel_set(saved);
+    g_free(mem);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -246,6 +281,8 @@ int main(int argc, char **argv)
                     test_parse_uint_full_trailing);
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
 
     return g_test_run();
 }
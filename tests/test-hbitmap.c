@@ -323,6 +323,95 @@ static void test_hbitmap_reset(TestHBitmapData *data,
     hbitmap_test_set(data, L3 / 2, L3);
 }
 
+static void test_hbitmap_reset_all(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_init(data, L3 * 2, 0);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L3 - 1, L3);
+    hbitmap_reset_all(data->hb);
+    memset(data->bits, 0, ((L3 * 2) / BITS_PER_LONG) * sizeof(unsigned long));
+    hbitmap_test_check(data, 0);
+    g_assert(hbitmap_empty(data->hb));
+}
+
+static void test_hbitmap_merge(TestHBitmapData *data,
+                               const void *unused)
+{
+    HBitmap *a, *b;
+
+    hbitmap_test_init(data, L3 * 2, 0);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L3 - L1, L1 * 3);
+
+    /* Fill a second bitmap, keeping the shadow copy in sync.  */
+    a = data->hb;
+    b = data->hb = hbitmap_alloc(L3 * 2, 0);
+    hbitmap_test_set(data, L1, L1 * 2);
+    hbitmap_test_set(data, L3 * 2 - 1, 1);
+    data->hb = a;
+
+    g_assert(hbitmap_merge(a, b));
+    hbitmap_test_check(data, 0);
+    hbitmap_free(b);
+
+    /* Bitmaps of different shape cannot be merged.  */
+    b = hbitmap_alloc(L3, 0);
+    hbitmap_set(b, 0, L3);
+    g_assert(!hbitmap_merge(a, b));
+    hbitmap_test_check(data, 0);
+    hbitmap_free(b);
+}
+
+static void hbitmap_test_serialize(TestHBitmapData *data, int granularity)
+{
+    uint64_t size = L3 * 2 + 7;
+    uint64_t split = L2 << granularity;
+    uint64_t len;
+    uint8_t *buf;
+    HBitmap *hb;
+
+    /* Ranges are aligned so that the shadow bitmap stays exact.  */
+    hbitmap_test_init(data, size, granularity);
+    hbitmap_test_set(data, L1 - 2, L1 + 2);
+    hbitmap_test_set(data, L2 + 4, L1 * 8);
+    hbitmap_test_set(data, size - 1, 1);
+
+    g_assert_cmpint(split % hbitmap_serialization_granularity(data->hb), ==, 0);
+    len = hbitmap_serialization_size(data->hb, 0, size);
+    g_assert_cmpint(len, ==,
+                    hbitmap_serialization_size(data->hb, 0, split) +
+                    hbitmap_serialization_size(data->hb, split, size - split));
+
+    buf = g_malloc(len);
+    hbitmap_serialize_part(data->hb, buf, 0, size);
+
+    /* Restore into a fresh bitmap in two steps.  */
+    hb = hbitmap_alloc(size, granularity);
+    hbitmap_set(hb, 0, size);
+    hbitmap_deserialize_part(hb, buf, 0, split, false);
+    hbitmap_deserialize_part(hb, buf + hbitmap_serialization_size(hb, 0, split),
+                             split, size - split, true);
+    g_free(buf);
+
+    g_assert_cmpint(hbitmap_count(hb), ==, hbitmap_count(data->hb));
+    hbitmap_free(data->hb);
+    data->hb = hb;
+    hbitmap_test_check_get(data);
+}
+
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    hbitmap_test_serialize(data, 0);
+}
+
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    hbitmap_test_serialize(data, 1);
+}
+
 static void test_hbitmap_granularity(TestHBitmapData *data,
                                      const void *unused)
 {
@@ -394,6 +483,11 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/set/overlap", test_hbitmap_set_overlap);
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
+    hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
+    hbitmap_test_add("/hbitmap/merge", test_hbitmap_merge);
+    hbitmap_test_add("/hbitmap/serialize/general", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
     g_test_run();
 
@@ -0,0 +1,106 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+#define NUM_PAGES 64
+/* addresses that map to the same set of a NUM_PAGES cache */
+#define SAME_SET(i) ((uint64_t)(i) * NUM_PAGES * PAGE_SIZE)
+
+static uint8_t page[PAGE_SIZE];
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+        g_assert_cmpint(cache_insert(cache, addr, page), ==, 0);
+    }
+
+    /* a full cache holds every page that was inserted */
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert(cache_is_cached(cache, addr));
+        g_assert_cmpint(get_cached_data(cache, addr)[PAGE_SIZE - 1], ==,
+                        addr / PAGE_SIZE);
+    }
+    g_assert(!cache_is_cached(cache, NUM_PAGES * PAGE_SIZE));
+    g_assert(get_cached_data(cache, NUM_PAGES * PAGE_SIZE) == NULL);
+
+    cache_fini(cache);
+}
+
+static void test_clock_eviction(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    int i;
+
+    /* fill one set, then use all its pages but the third one */
+    for (i = 0; i < 8; i++) {
+        g_assert_cmpint(cache_insert(cache, SAME_SET(i), page), ==, 0);
+    }
+    for (i = 0; i < 8; i++) {
+        if (i != 2) {
+            g_assert(cache_is_cached(cache, SAME_SET(i)));
+        }
+    }
+
+    /* the page that wasn't used goes first */
+    g_assert_cmpint(cache_insert(cache, SAME_SET(8), page), ==, 1);
+    g_assert(!cache_is_cached(cache, SAME_SET(2)));
+    for (i = 0; i < 9; i++) {
+        if (i != 2) {
+            g_assert(cache_is_cached(cache, SAME_SET(i)));
+        }
+    }
+
+    /* other sets are not affected */
+    g_assert_cmpint(cache_insert(cache, PAGE_SIZE, page), ==, 0);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(NUM_PAGES, PAGE_SIZE);
+    uint64_t addr;
+
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        memset(page, addr / PAGE_SIZE, PAGE_SIZE);
+        cache_insert(cache, addr, page);
+    }
+
+    /* growing keeps every page */
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES * 4), ==, NUM_PAGES * 4);
+    for (addr = 0; addr < NUM_PAGES * PAGE_SIZE; addr += PAGE_SIZE) {
+        g_assert_cmpint(get_cached_data(cache, addr)[0], ==,
+                        addr / PAGE_SIZE);
+    }
+
+    /* shrinking keeps the most recently inserted ones */
+    memset(page, 0xff, PAGE_SIZE);
+    cache_insert(cache, 0, page);
+    g_assert_cmpint(cache_resize(cache, NUM_PAGES / 8), ==, NUM_PAGES / 8);
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 0xff);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page_cache/insert_lookup", test_insert_lookup);
+    g_test_add_func("/page_cache/clock_eviction", test_clock_eviction);
+    g_test_add_func("/page_cache/resize", test_resize);
+
+    return g_test_run();
+}
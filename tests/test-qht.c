@@ -0,0 +1,150 @@
+/*
+ * QHT unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+
+#include "qemu-common.h"
+#include "qemu/qht.h"
+
+#define N 1024
+
+static QHT ht;
+static int32_t arr[N];
+
+static bool is_equal(const void *obj, const void *userp)
+{
+    const int32_t *a = obj;
+    const int32_t *b = userp;
+
+    return *a == *b;
+}
+
+/* A few hashes only, so that chains get long */
+static uint32_t hash_of(int32_t v)
+{
+    return v % 7;
+}
+
+static void insert(int start, int end)
+{
+    int i;
+
+    for (i = start; i < end; i++) {
+        arr[i] = i;
+        g_assert(qht_insert(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void remove_range(int start, int end)
+{
+    int i;
+
+    for (i = start; i < end; i++) {
+        g_assert(qht_remove(&ht, &arr[i], hash_of(i)));
+    }
+}
+
+static void check(int start, int end, bool expected)
+{
+    int i;
+
+    for (i = start; i < end; i++) {
+        int32_t key = i;
+        void *p = qht_lookup(&ht, is_equal, &key, hash_of(i));
+
+        if (expected) {
+            g_assert(p == &arr[i]);
+        } else {
+            g_assert(p == NULL);
+        }
+    }
+}
+
+static void count_func(QHT *ht, void *p, uint32_t hash, void *userp)
+{
+    (*(size_t *)userp)++;
+}
+
+static void check_n(size_t expected)
+{
+    QHTStats stats;
+    size_t n = 0;
+
+    qht_iter(&ht, count_func, &n);
+    g_assert_cmpint(n, ==, expected);
+    qht_statistics_init(&ht, &stats);
+    g_assert_cmpint(stats.entries, ==, expected);
+}
+
+static void qht_do_test(unsigned int mode, size_t init_entries)
+{
+    qht_init(&ht, init_entries, mode);
+
+    insert(0, N);
+    check(0, N, true);
+    check_n(N);
+
+    /* duplicates are refused */
+    g_assert(!qht_insert(&ht, &arr[5], hash_of(5)));
+    check_n(N);
+
+    /* remove from the middle of the chains, then the rest */
+    remove_range(N / 4, N / 2);
+    check(0, N / 4, true);
+    check(N / 4, N / 2, false);
+    check(N / 2, N, true);
+    check_n(N - N / 4);
+    g_assert(!qht_remove(&ht, &arr[N / 4], hash_of(N / 4)));
+
+    qht_resize(&ht, N * 4);
+    check(0, N / 4, true);
+    check(N / 2, N, true);
+
+    insert(N / 4, N / 2);
+    check(0, N, true);
+    check_n(N);
+
+    qht_reset(&ht);
+    check(0, N, false);
+    check_n(0);
+
+    insert(0, N);
+    qht_reset_size(&ht, 16);
+    check(0, N, false);
+    insert(0, N);
+    check(0, N, true);
+    remove_range(0, N);
+    check_n(0);
+
+    qht_destroy(&ht);
+}
+
+static void test_default(void)
+{
+    qht_do_test(0, 0);
+}
+
+static void test_resize(void)
+{
+    QHTStats stats;
+
+    qht_init(&ht, 0, QHT_MODE_AUTO_RESIZE);
+    insert(0, N);
+    qht_statistics_init(&ht, &stats);
+    g_assert_cmpint(stats.resizes, >, 0);
+    check(0, N, true);
+    qht_destroy(&ht);
+
+    qht_do_test(QHT_MODE_AUTO_RESIZE, 0);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qht/mode/default", test_default);
+    g_test_add_func("/qht/mode/resize", test_resize);
+    return g_test_run();
+}
@@ -179,6 +179,54 @@ static void test_encode_decode(void)
     }
 }
 
+/* Every scan loop implementation must give the same encoding */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    BufferAccel saved = buffer_accel_get();
+    int i, j, accel, dlen, ref_len;
+
+    for (i = 0; i < 1000; i++) {
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old[j] = g_test_rand_int_range(0, 4);
+        }
+        memcpy(new, old, PAGE_SIZE);
+        for (j = g_test_rand_int_range(0, 64); j > 0; j--) {
+            int pos = g_test_rand_int_range(0, PAGE_SIZE);
+            int len = g_test_rand_int_range(1, 100);
+
+            for (; len > 0 && pos < PAGE_SIZE; len--, pos++) {
+                new[pos] ^= g_test_rand_int_range(1, 4);
+            }
+        }
+        dlen = g_test_rand_int_range(PAGE_SIZE / 8, PAGE_SIZE);
+
+        g_assert(buffer_accel_set(BUFFER_ACCEL_NONE));
+        ref_len = xbzrle_encode_buffer(old, new, PAGE_SIZE, ref, dlen);
+
+        for (accel = 0; accel < BUFFER_ACCEL__MAX; accel++) {
+            if (!buffer_accel_set(accel)) {
+                continue;
+            }
+            g_assert_cmpint(xbzrle_encode_buffer(old, new, PAGE_SIZE,
+                                                 compressed, dlen),
+                            ==, ref_len);
+            if (ref_len > 0) {
+                g_assert(memcmp(ref, compressed, ref_len) == 0);
+            }
+        }
+    }
+
+    buffer_accel_set(saved);
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +239,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
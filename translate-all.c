@@ -60,6 +60,7 @@
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/atomic.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -73,6 +74,15 @@
 
 #define SMC_BITMAP_USE_THRESHOLD 10
 
+/* Number of regions of the code buffer.  User mode keeps a single one:
+   the TB cache file maps the whole buffer, and a flush there is no more
+   expensive than emptying a region.  */
+#ifdef CONFIG_USER_ONLY
+#define TB_REGIONS 1
+#else
+#define TB_REGIONS TB_MAX_REGIONS
+#endif
+
 typedef struct PageDesc {
     /* list of TBs intersecting this ram page */
     TranslationBlock *first_tb;
@@ -126,10 +136,111 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+unsigned int tb_hot_threshold;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
+/* Nesting depth of tb_lock() in this thread */
+static __thread int have_tb_lock;
+
+/* tb_lock protects the TB hash tables, the page lists and the code buffer.
+ * Only one thread at a time can translate code in user mode, and with
+ * multi-threaded TCG in system emulation; otherwise all TCG vCPUs run in
+ * the same thread, which also owns the translation structures.
+ *
+ * The lock is recursive and may be left held by a longjmp out of the
+ * translator or of a helper; cpu_exec() drops it with tb_lock_reset().
+ */
+static inline bool tb_lock_needed(void)
+{
+#ifdef CONFIG_USER_ONLY
+    return true;
+#else
+    return qemu_tcg_mttcg_enabled();
+#endif
+}
+
+void tb_lock(void)
+{
+    if (tb_lock_needed() && have_tb_lock++ == 0) {
+        qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+void tb_unlock(void)
+{
+    if (tb_lock_needed()) {
+        assert(have_tb_lock > 0);
+        if (--have_tb_lock == 0) {
+            qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+        }
+    }
+}
+
+void tb_lock_reset(void)
+{
+    if (have_tb_lock) {
+        have_tb_lock = 0;
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+/* In user mode, cpu_exec() translates code with tb_lock held, while code
+ * invalidation is serialized by mmap_lock(), which nests inside tb_lock.
+ * Taking tb_lock from the invalidation paths would invert that order, so
+ * the paths below only take it in system emulation.
+ */
+static inline void tb_lock_softmmu(void)
+{
+#ifndef CONFIG_USER_ONLY
+    tb_lock();
+#endif
+}
+
+static inline void tb_unlock_softmmu(void)
+{
+#ifndef CONFIG_USER_ONLY
+    tb_unlock();
+#endif
+}
+
+/* The code bitmap of a page is also protected by a page lock, so that
+ * vCPUs writing to a page that holds code can check it without taking
+ * tb_lock, which is then only needed to actually invalidate TBs.  Pages
+ * are hashed onto a fixed set of locks.  The bitmap may only be replaced
+ * with both tb_lock and the page lock held, taken in that order.
+ */
+#ifndef CONFIG_USER_ONLY
+#define PAGE_LOCKS 64
+
+static QemuMutex page_locks[PAGE_LOCKS];
+
+static inline QemuMutex *page_lock_of(PageDesc *p)
+{
+    return &page_locks[((uintptr_t)p / sizeof(PageDesc)) % PAGE_LOCKS];
+}
+#endif
+
+static inline void page_lock(PageDesc *p)
+{
+#ifndef CONFIG_USER_ONLY
+    if (tb_lock_needed()) {
+        qemu_mutex_lock(page_lock_of(p));
+    }
+#endif
+}
+
+static inline void page_unlock(PageDesc *p)
+{
+#ifndef CONFIG_USER_ONLY
+    if (tb_lock_needed()) {
+        qemu_mutex_unlock(page_lock_of(p));
+    }
+#endif
+}
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -156,6 +267,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    s->tier2 = (tb->cflags & CF_TIER2) != 0;
 
     gen_intermediate_code(env, tb);
 
@@ -215,6 +327,8 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
     ti = profile_getclock();
 #endif
     tcg_func_start(s);
+    /* the code must come out the same as when the TB was translated */
+    s->tier2 = (tb->cflags & CF_TIER2) != 0;
 
     gen_intermediate_code_pc(env, tb);
 
@@ -260,13 +374,16 @@ static int cpu_restore_state_from_tb(CPUState *cpu, TranslationBlock *tb,
 bool cpu_restore_state(CPUState *cpu, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    bool found = false;
 
+    tb_lock_softmmu();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(cpu, tb, retaddr);
-        return true;
+        found = true;
     }
-    return false;
+    tb_unlock_softmmu();
+    return found;
 }
 
 #ifdef _WIN32
@@ -540,6 +657,12 @@ static inline void *split_cross_256mb(void *buf1, size_t size1)
 static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
     __attribute__((aligned(CODE_GEN_ALIGN)));
 
+/* Generated code embeds the address of its TB.  Keep the TBs static too,
+   so that the persistent translation cache finds them at the same address
+   in every run.  */
+static TranslationBlock static_tbs[DEFAULT_CODE_GEN_BUFFER_SIZE /
+                                   CODE_GEN_AVG_BLOCK_SIZE];
+
 static inline void *alloc_code_gen_buffer(void)
 {
     void *buf = static_code_gen_buffer;
@@ -652,6 +775,46 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+static void tb_regions_reset(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i;
+
+    for (i = 0; i < ctx->nb_regions; i++) {
+        ctx->regions[i].nb_tbs = 0;
+        ctx->regions[i].code_end = ctx->regions[i].code_start;
+    }
+    ctx->nb_tbs = 0;
+    ctx->cur_region = 0;
+    tcg_ctx.code_gen_ptr = ctx->regions[0].code_start;
+}
+
+/* Split the code buffer and tbs[] into regions.  Each region must have
+   room for many worst-case TBs, so small buffers get fewer regions.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t min_size = 8 * TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i, n = TB_REGIONS;
+
+    while (n > 1 && tcg_ctx.code_gen_buffer_size / n < min_size) {
+        n /= 2;
+    }
+    ctx->nb_regions = n;
+    ctx->region_size = (tcg_ctx.code_gen_buffer_size / n) &
+                       ~(size_t)(CODE_GEN_ALIGN - 1);
+    ctx->region_max_blocks = tcg_ctx.code_gen_max_blocks / n;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->tbs = ctx->tbs + i * ctx->region_max_blocks;
+        r->code_start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->code_max = r->code_start + ctx->region_size -
+                      (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
+    }
+    tb_regions_reset();
+}
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -677,8 +840,14 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
             CODE_GEN_AVG_BLOCK_SIZE;
+#ifdef USE_STATIC_CODE_GEN_BUFFER
+    assert(tcg_ctx.code_gen_max_blocks <= ARRAY_SIZE(static_tbs));
+    tcg_ctx.tb_ctx.tbs = static_tbs;
+#else
     tcg_ctx.tb_ctx.tbs =
             g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+#endif
+    tb_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -687,8 +856,19 @@ static inline void code_gen_alloc(size_t tb_size)
 void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
+    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
+#ifndef CONFIG_USER_ONLY
+    {
+        int i;
+
+        for (i = 0; i < PAGE_LOCKS; i++) {
+            qemu_mutex_init(&page_locks[i]);
+        }
+    }
+#endif
+    qht_init(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE,
+             QHT_MODE_AUTO_RESIZE);
     code_gen_alloc(tb_size);
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
 #if !defined(CONFIG_USER_ONLY) || !defined(CONFIG_USE_GUEST_BASE)
@@ -703,41 +883,52 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has too many translation blocks or too much generated
+   code; the caller must then move on to the next region. */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= ctx->region_max_blocks ||
+        tcg_ctx.code_gen_ptr >= r->code_max) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->exec_count = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
+        ctx->nb_tbs--;
     }
 }
 
 static inline void invalidate_page_bitmap(PageDesc *p)
 {
-    if (p->code_bitmap) {
-        g_free(p->code_bitmap);
-        p->code_bitmap = NULL;
-    }
+    uint8_t *bitmap;
+
+    page_lock(p);
+    bitmap = p->code_bitmap;
+    p->code_bitmap = NULL;
+    page_unlock(p);
+    g_free(bitmap);
     p->code_write_count = 0;
 }
 
@@ -774,12 +965,366 @@ static void page_flush_tb(void)
     }
 }
 
+#ifdef CONFIG_USER_ONLY
+/* Persistent translation cache.
+ *
+ * Short-lived processes, such as compilers run by a build, spend most of
+ * their time translating the same code over and over.  With a cache file,
+ * the TBs and the code buffer are saved when the process exits, and copied
+ * back at the same place when the next run starts.  Both are static in
+ * user mode, so they keep their distance to QEMU's text, and the generated
+ * code needs no relocation as long as the QEMU binary and guest_base are
+ * the same; the header records what the code depends on and the file is
+ * ignored if any of it changed.
+ *
+ * In a position independent build, QEMU is loaded at a different address
+ * on each run.  The code is then generated with tcg_ctx.code_gen_pic, so
+ * that it refers to the TBs, the prologue and the helpers relative to
+ * itself, and the header only records their offsets from the text.
+ * Backends that cannot do that do not support the cache in such builds
+ * (see linux-user/main.c).  Either way, a TB whose code embeds other host
+ * pointers, such as the heap-allocated ARMCPRegInfo of a coprocessor
+ * access, is not saved; see tcg_const_ptr().
+ *
+ * A cached TB is linked in by tb_gen_code() instead of translating anew,
+ * once the guest code it was translated from is found at the same address.
+ * The file has no host pointers: TBs are saved as TBCacheEntry, with their
+ * code as an offset in the code buffer, and the rest of TranslationBlock
+ * is rebuilt when they are linked in.
+ * File layout: header, the nb_tbs entries (invalid ones are kept, because
+ * the TBs that follow must keep their address), the guest code of the valid
+ * TBs, and the code buffer.
+ */
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    3
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_tbs;
+    uint64_t guest_code_size;
+    uint64_t code_size;
+    /* what the generated code depends on */
+    uint64_t code_gen_buffer;   /* relative to text */
+    uint64_t code_gen_buffer_size;
+    uint64_t tbs;               /* relative to text */
+    uint64_t text;              /* the helpers; 0 for code_gen_pic */
+    uint64_t guest_base;
+    char key[512];
+} TBCacheHeader;
+
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint32_t cflags;
+    uint32_t icount;
+    uint64_t tc_offset;     /* of the code, in the code buffer */
+    uint16_t size;
+    uint16_t tb_next_offset[2];
+    uint16_t tb_jmp_offset[2];
+    uint8_t invalid;
+    uint8_t pad[5];
+} TBCacheEntry;
+
+static struct {
+    int nb_tbs;             /* TBs loaded at the start of tbs[] */
+    int *sorted;            /* their indices, sorted by pc */
+    bool *used;             /* linked in, or found stale */
+    uint8_t **guest_code;   /* the guest code each one was translated from */
+    uint8_t *guest_code_buf;
+} tb_cache;
+
+static void tb_cache_reset(void)
+{
+    g_free(tb_cache.sorted);
+    g_free(tb_cache.used);
+    g_free(tb_cache.guest_code);
+    g_free(tb_cache.guest_code_buf);
+    memset(&tb_cache, 0, sizeof(tb_cache));
+}
+
+static void tb_cache_init_header(TBCacheHeader *hdr, const char *key)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, TB_CACHE_MAGIC, sizeof(TB_CACHE_MAGIC));
+    hdr->version = TB_CACHE_VERSION;
+    hdr->code_gen_buffer = (uintptr_t)tcg_ctx.code_gen_buffer -
+                           (uintptr_t)tb_gen_code;
+    hdr->code_gen_buffer_size = tcg_ctx.code_gen_buffer_size;
+    hdr->tbs = (uintptr_t)tcg_ctx.tb_ctx.tbs - (uintptr_t)tb_gen_code;
+    hdr->text = tcg_ctx.code_gen_pic ? 0 : (uintptr_t)tb_gen_code;
+    hdr->guest_base = GUEST_BASE;
+    pstrcpy(hdr->key, sizeof(hdr->key), key);
+}
+
+static void tb_cache_get_entry(TBCacheEntry *e, TranslationBlock *tb)
+{
+    memset(e, 0, sizeof(*e));
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->cflags = tb->cflags;
+    e->icount = tb->icount;
+    e->tc_offset = tb->tc_ptr - tcg_ctx.code_gen_buffer;
+    e->size = tb->size;
+    e->tb_next_offset[0] = tb->tb_next_offset[0];
+    e->tb_next_offset[1] = tb->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    e->tb_jmp_offset[0] = tb->tb_jmp_offset[0];
+    e->tb_jmp_offset[1] = tb->tb_jmp_offset[1];
+#endif
+    e->invalid = tb->invalid;
+}
+
+/* The pointers are set up by tb_link_page(), which also resets the jumps */
+static void tb_cache_put_entry(TranslationBlock *tb, const TBCacheEntry *e)
+{
+    memset(tb, 0, sizeof(*tb));
+    tb->pc = e->pc;
+    tb->cs_base = e->cs_base;
+    tb->flags = e->flags;
+    tb->cflags = e->cflags;
+    tb->icount = e->icount;
+    tb->tc_ptr = tcg_ctx.code_gen_buffer + e->tc_offset;
+    tb->size = e->size;
+    tb->tb_next_offset[0] = e->tb_next_offset[0];
+    tb->tb_next_offset[1] = e->tb_next_offset[1];
+#ifdef USE_DIRECT_JUMP
+    tb->tb_jmp_offset[0] = e->tb_jmp_offset[0];
+    tb->tb_jmp_offset[1] = e->tb_jmp_offset[1];
+#endif
+    tb->invalid = e->invalid;
+}
+
+static int tb_cache_cmp(const void *a, const void *b)
+{
+    target_ulong pc1 = tcg_ctx.tb_ctx.tbs[*(const int *)a].pc;
+    target_ulong pc2 = tcg_ctx.tb_ctx.tbs[*(const int *)b].pc;
+
+    return pc1 < pc2 ? -1 : pc1 > pc2;
+}
+
+/* Must be called before any code is translated, and after the prologue
+   is generated.  */
+bool tb_cache_load(const char *path, const char *key)
+{
+    TBCacheHeader expected, *hdr;
+    TBCacheEntry *entries;
+    uint8_t *guest_code;
+    gchar *data;
+    gsize len;
+    uint64_t ofs;
+    int i;
+
+    assert(tcg_ctx.tb_ctx.nb_tbs == 0 && tcg_ctx.tb_ctx.nb_regions == 1);
+#if defined(__PIE__) || defined(__pie__)
+    /* from now on, as the code translated in this run is saved too */
+    tcg_ctx.code_gen_pic = true;
+#endif
+    if (strlen(key) >= sizeof(expected.key) ||
+        !g_file_get_contents(path, &data, &len, NULL)) {
+        return false;
+    }
+
+    hdr = (TBCacheHeader *)data;
+    tb_cache_init_header(&expected, key);
+    expected.nb_tbs = hdr->nb_tbs;
+    expected.guest_code_size = hdr->guest_code_size;
+    expected.code_size = hdr->code_size;
+    if (len < sizeof(*hdr) || memcmp(hdr, &expected, sizeof(*hdr)) ||
+        hdr->nb_tbs > tcg_ctx.code_gen_max_blocks ||
+        hdr->code_size > tcg_ctx.code_gen_buffer_max_size ||
+        len != sizeof(*hdr) + hdr->nb_tbs * sizeof(TBCacheEntry) +
+               hdr->guest_code_size + hdr->code_size) {
+        g_free(data);
+        return false;
+    }
+    entries = (TBCacheEntry *)(hdr + 1);
+    guest_code = (uint8_t *)(entries + hdr->nb_tbs);
+
+    /* check the guest code sizes and the code offsets before trusting them */
+    for (i = 0, ofs = 0; i < hdr->nb_tbs; i++) {
+        if (entries[i].tc_offset >= hdr->code_size) {
+            break;
+        }
+        if (!entries[i].invalid) {
+            ofs += entries[i].size;
+        }
+    }
+    if (i < hdr->nb_tbs || ofs != hdr->guest_code_size) {
+        g_free(data);
+        return false;
+    }
+
+    tb_cache.nb_tbs = hdr->nb_tbs;
+    tb_cache.sorted = g_new(int, tb_cache.nb_tbs);
+    tb_cache.used = g_new0(bool, tb_cache.nb_tbs);
+    tb_cache.guest_code = g_new0(uint8_t *, tb_cache.nb_tbs);
+    tb_cache.guest_code_buf = g_memdup(guest_code, hdr->guest_code_size);
+
+    for (i = 0; i < hdr->nb_tbs; i++) {
+        tb_cache_put_entry(&tcg_ctx.tb_ctx.tbs[i], &entries[i]);
+    }
+    memcpy(tcg_ctx.code_gen_buffer, guest_code + hdr->guest_code_size,
+           hdr->code_size);
+    flush_icache_range((uintptr_t)tcg_ctx.code_gen_buffer,
+                       (uintptr_t)tcg_ctx.code_gen_buffer + hdr->code_size);
+    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer + hdr->code_size;
+    tcg_ctx.tb_ctx.nb_tbs = hdr->nb_tbs;
+    tcg_ctx.tb_ctx.regions[0].nb_tbs = hdr->nb_tbs;
+    g_free(data);
+
+    for (i = 0, ofs = 0; i < tb_cache.nb_tbs; i++) {
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+
+        tb_cache.sorted[i] = i;
+        if (tb->invalid) {
+            tb_cache.used[i] = true;
+        } else {
+            tb_cache.guest_code[i] = tb_cache.guest_code_buf + ofs;
+            ofs += tb->size;
+        }
+    }
+    qsort(tb_cache.sorted, tb_cache.nb_tbs, sizeof(int), tb_cache_cmp);
+    return true;
+}
+
+/* Return a cached TB for this code, if the guest code it was translated
+   from is still the same.  The caller links it in.  */
+static TranslationBlock *tb_cache_find(target_ulong pc, target_ulong cs_base,
+                                       uint64_t flags, uint32_t cflags)
+{
+    int lo = 0, hi = tb_cache.nb_tbs;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (tcg_ctx.tb_ctx.tbs[tb_cache.sorted[mid]].pc < pc) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (; lo < tb_cache.nb_tbs; lo++) {
+        int i = tb_cache.sorted[lo];
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+
+        if (tb->pc != pc) {
+            break;
+        }
+        if (tb_cache.used[i] || tb->cs_base != cs_base ||
+            tb->flags != flags || tb->cflags != cflags) {
+            continue;
+        }
+        tb_cache.used[i] = true;
+        if (page_check_range(pc, tb->size, PAGE_READ) < 0 ||
+            memcmp(g2h(pc), tb_cache.guest_code[i], tb->size)) {
+            /* the program or a library changed; don't save it again */
+            tb->invalid = true;
+            continue;
+        }
+        return tb;
+    }
+    return NULL;
+}
+
+/* Where to find the guest code of TB number @i when saving, or NULL if
+   it is gone.  */
+static const void *tb_cache_guest_code(int i, TranslationBlock *tb)
+{
+    if (i < tb_cache.nb_tbs && !tb_cache.used[i]) {
+        return tb_cache.guest_code[i];
+    }
+    if (page_check_range(tb->pc, tb->size, PAGE_READ) < 0) {
+        return NULL;
+    }
+    return g2h(tb->pc);
+}
+
+void tb_cache_save(const char *path, const char *key)
+{
+    TBCacheHeader hdr;
+    TBCacheEntry *entries;
+    const void **guest_code;
+    gchar *tmp;
+    bool ok;
+    int fd, i, nb_tbs;
+
+    if (strlen(key) >= sizeof(hdr.key)) {
+        return;
+    }
+
+    tb_lock();
+    nb_tbs = tcg_ctx.tb_ctx.nb_tbs;
+    if (nb_tbs == tb_cache.nb_tbs) {
+        /* nothing new since the cache was loaded */
+        tb_unlock();
+        return;
+    }
+
+    tb_cache_init_header(&hdr, key);
+    hdr.nb_tbs = nb_tbs;
+    hdr.code_size = tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer;
+    entries = g_new(TBCacheEntry, nb_tbs);
+    guest_code = g_new0(const void *, nb_tbs);
+    for (i = 0; i < nb_tbs; i++) {
+        TranslationBlock *tb = &tcg_ctx.tb_ctx.tbs[i];
+
+        tb_cache_get_entry(&entries[i], tb);
+        if (!tb->invalid && !tb->host_ptrs) {
+            guest_code[i] = tb_cache_guest_code(i, tb);
+        }
+        if (guest_code[i]) {
+            hdr.guest_code_size += tb->size;
+        } else {
+            entries[i].invalid = true;
+        }
+    }
+
+    /* several processes may save the same cache; each writes its own
+       file and the last rename wins */
+    tmp = g_strdup_printf("%s.%d", path, (int)getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 &&
+        qemu_write_full(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+        qemu_write_full(fd, entries, nb_tbs * sizeof(TBCacheEntry)) ==
+            nb_tbs * sizeof(TBCacheEntry);
+    for (i = 0; ok && i < nb_tbs; i++) {
+        if (guest_code[i]) {
+            ok = qemu_write_full(fd, guest_code[i], entries[i].size) ==
+                entries[i].size;
+        }
+    }
+    ok = ok && qemu_write_full(fd, tcg_ctx.code_gen_buffer, hdr.code_size) ==
+        hdr.code_size;
+    tb_unlock();
+
+    if (fd >= 0) {
+        ok = close(fd) == 0 && ok;
+    }
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+    }
+    g_free(tmp);
+    g_free(guest_code);
+    g_free(entries);
+}
+#endif
+
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
+/* XXX: tb_flush is currently not thread safe in user mode.  With
+ * multi-threaded TCG it must run while no vCPU executes guest code,
+ * i.e. in an exclusive section or with all vCPUs paused.
+ */
 void tb_flush(CPUArchState *env1)
 {
     CPUState *cpu = ENV_GET_CPU(env1);
 
+    tb_lock_softmmu();
+
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
@@ -791,76 +1336,71 @@ void tb_flush(CPUArchState *env1)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(cpu, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    tb_regions_reset();
+#ifdef CONFIG_USER_ONLY
+    tb_cache_reset();
+#endif
 
     CPU_FOREACH(cpu) {
         memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0, sizeof(tcg_ctx.tb_ctx.tb_phys_hash));
+#ifdef CONFIG_USER_ONLY
+    /* other threads may be looking TBs up */
+    qht_reset(&tcg_ctx.tb_ctx.htable);
+#else
+    /* also shrinks the table back; no lookup can be running here */
+    qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
+#endif
     page_flush_tb();
 
-    tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+    tb_unlock_softmmu();
 }
 
 #ifdef DEBUG_TB_CHECK
 
-static void tb_invalidate_check(target_ulong address)
+static void do_tb_invalidate_check(QHT *ht, void *p, uint32_t hash,
+                                   void *userp)
 {
-    TranslationBlock *tb;
-    int i;
+    TranslationBlock *tb = p;
+    target_ulong addr = *(target_ulong *)userp;
 
-    address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
-            if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
-                  address >= tb->pc + tb->size)) {
-                printf("ERROR invalidate: address=" TARGET_FMT_lx
-                       " PC=%08lx size=%04x\n",
-                       address, (long)tb->pc, tb->size);
-            }
-        }
+    if (!(addr + TARGET_PAGE_SIZE <= tb->pc || addr >= tb->pc + tb->size)) {
+        printf("ERROR invalidate: address=" TARGET_FMT_lx
+               " PC=%08lx size=%04x\n", addr, (long)tb->pc, tb->size);
     }
 }
 
-/* verify that all the pages have correct rights for code */
-static void tb_page_check(void)
+static void tb_invalidate_check(target_ulong address)
 {
-    TranslationBlock *tb;
-    int i, flags1, flags2;
-
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
-            flags1 = page_get_flags(tb->pc);
-            flags2 = page_get_flags(tb->pc + tb->size - 1);
-            if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
-                printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
-                       (long)tb->pc, tb->size, flags1, flags2);
-            }
-        }
-    }
+    address &= TARGET_PAGE_MASK;
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_invalidate_check, &address);
 }
 
-#endif
-
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
+static void do_tb_page_check(QHT *ht, void *p, uint32_t hash, void *userp)
 {
-    TranslationBlock *tb1;
+    TranslationBlock *tb = p;
+    int flags1, flags2;
 
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
+    flags1 = page_get_flags(tb->pc);
+    flags2 = page_get_flags(tb->pc + tb->size - 1);
+    if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
+        printf("ERROR page flags: PC=%08lx size=%04x f1=%x f2=%x\n",
+               (long)tb->pc, tb->size, flags1, flags2);
     }
 }
 
+/* verify that all the pages have correct rights for code */
+static void tb_page_check(void)
+{
+    qht_iter(&tcg_ctx.tb_ctx.htable, do_tb_page_check, NULL);
+}
+
+#endif
+
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -920,13 +1460,20 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     CPUState *cpu;
     PageDesc *p;
     unsigned int h, n1;
+    uint32_t hash;
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    tb_lock_softmmu();
+
+    /* vCPUs that looked the TB up before it was unlinked must not run it
+       or chain to it */
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    hash = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_remove(&tcg_ctx.tb_ctx.htable, tb, hash);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -945,8 +1492,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h]) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h], NULL);
         }
     }
 
@@ -970,6 +1517,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2); /* fail safe */
 
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
+    tb_unlock_softmmu();
 }
 
 static inline void set_bits(uint8_t *tab, int start, int len)
@@ -1003,8 +1551,9 @@ static void build_page_bitmap(PageDesc *p)
 {
     int n, tb_start, tb_end;
     TranslationBlock *tb;
+    uint8_t *bitmap;
 
-    p->code_bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
+    bitmap = g_malloc0(TARGET_PAGE_SIZE / 8);
 
     tb = p->first_tb;
     while (tb != NULL) {
@@ -1023,11 +1572,53 @@ static void build_page_bitmap(PageDesc *p)
             tb_start = 0;
             tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
         }
-        set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
+        set_bits(bitmap, tb_start, tb_end - tb_start);
         tb = tb->page_next[n];
     }
+    page_lock(p);
+    p->code_bitmap = bitmap;
+    page_unlock(p);
+}
+
+/* The current region is full: move to the next one, which holds the
+   oldest TBs, and invalidate whatever is left in it.  Like tb_flush(),
+   this must not run while other vCPUs execute code from the buffer.  */
+static void tb_recycle_region(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int i;
+
+    tb_lock_softmmu();
+    ctx->regions[ctx->cur_region].code_end = tcg_ctx.code_gen_ptr;
+    ctx->cur_region = (ctx->cur_region + 1) % ctx->nb_regions;
+    r = &ctx->regions[ctx->cur_region];
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (!r->tbs[i].invalid) {
+            tb_phys_invalidate(&r->tbs[i], -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    tcg_ctx.code_gen_ptr = r->code_start;
+    ctx->tb_recycle_count++;
+    /* Don't forget to invalidate previous TB info.  */
+    ctx->tb_invalidated_flag = 1;
+    tb_unlock_softmmu();
 }
 
+#ifndef CONFIG_USER_ONLY
+static void tb_recycle_work(void *opaque)
+{
+    int full_region = (intptr_t)opaque;
+
+    /* several vCPUs may have found the same region full */
+    if (tcg_ctx.tb_ctx.cur_region == full_region) {
+        tb_recycle_region();
+    }
+}
+#endif
+
 TranslationBlock *tb_gen_code(CPUState *cpu,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -1039,23 +1630,51 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     int code_gen_size;
 
     phys_pc = get_page_addr_code(env, pc);
+    tb_lock_softmmu();
+#ifdef CONFIG_USER_ONLY
+    tb = tb_cache_find(pc, cs_base, flags, cflags);
+    if (tb) {
+        goto link;
+    }
+#endif
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#ifndef CONFIG_USER_ONLY
+        if (qemu_tcg_mttcg_enabled()) {
+            /* Other vCPUs may be running code from the next region:
+               recycle it once they have all stopped, and retry the
+               lookup then.  */
+            intptr_t full_region = tcg_ctx.tb_ctx.cur_region;
+
+            tb_unlock();
+            async_safe_run_on_cpu(cpu, tb_recycle_work, (void *)full_region);
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
+#endif
+        if (tcg_ctx.tb_ctx.nb_regions > 1) {
+            tb_recycle_region();
+        } else {
+            /* flush must be done */
+            tb_flush(env);
+            /* Don't forget to invalidate previous TB info.  */
+            tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
-        /* Don't forget to invalidate previous TB info.  */
-        tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
     tb->tc_ptr = tcg_ctx.code_gen_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
+    tb->host_ptrs = tcg_ctx.host_ptrs;
     tcg_ctx.code_gen_ptr = (void *)(((uintptr_t)tcg_ctx.code_gen_ptr +
             code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
+#ifdef CONFIG_USER_ONLY
+ link:
+#endif
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
     phys_page2 = -1;
@@ -1063,6 +1682,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_unlock_softmmu();
     return tb;
 }
 
@@ -1110,8 +1730,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_lock_softmmu();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock_softmmu();
         return;
     }
     if (!p->code_bitmap &&
@@ -1201,9 +1823,11 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
            itself */
         cpu->current_tb = NULL;
         tb_gen_code(cpu, current_pc, current_cs_base, current_flags, 1);
+        /* tb_lock is dropped by cpu_exec() */
         cpu_resume_from_signal(cpu, NULL);
     }
 #endif
+    tb_unlock_softmmu();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1225,16 +1849,19 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     if (!p) {
         return;
     }
+    /* tb_lock is only needed if the write hits translated code */
+    page_lock(p);
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
-        if (b & ((1 << len) - 1)) {
-            goto do_invalidate;
+        page_unlock(p);
+        if (!(b & ((1 << len) - 1))) {
+            return;
         }
     } else {
-    do_invalidate:
-        tb_invalidate_phys_page_range(start, start + len, 1);
+        page_unlock(p);
     }
+    tb_invalidate_phys_page_range(start, start + len, 1);
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1371,17 +1998,11 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
+    uint32_t hash;
 
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1403,6 +2024,11 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the hash table last: lookups run without tb_lock, and must
+       only find the TB once it is fully set up */
+    hash = tb_hash_func(phys_pc, tb->pc, tb->flags, tb->cs_base);
+    qht_insert(&tcg_ctx.tb_ctx.htable, tb, hash);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1413,23 +2039,30 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
-    int m_min, m_max, m;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    int m_min, m_max, m, i;
     uintptr_t v;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size;
+    if (i >= ctx->nb_regions) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    r = &ctx->regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr < (uintptr_t)r->tbs[0].tc_ptr ||
+        (i == ctx->cur_region && tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1439,7 +2072,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1464,6 +2097,7 @@ void tb_check_watchpoint(CPUState *cpu)
 {
     TranslationBlock *tb;
 
+    tb_lock_softmmu();
     tb = tb_find_pc(cpu->mem_io_pc);
     if (!tb) {
         cpu_abort(cpu, "check_watchpoint: could not find TB for pc=%p",
@@ -1471,6 +2105,7 @@ void tb_check_watchpoint(CPUState *cpu)
     }
     cpu_restore_state_from_tb(cpu, tb, cpu->mem_io_pc);
     tb_phys_invalidate(tb, -1);
+    tb_unlock_softmmu();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1516,6 +2151,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1563,7 +2199,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
        the first in the TB) then we end up generating a whole new TB and
        repeating the fault, which is horribly inefficient.
        Better would be to execute just this insn uncached, or generate a
-       second new TB.  */
+       second new TB.  tb_lock is dropped by cpu_exec().  */
     cpu_resume_from_signal(cpu, NULL);
 }
 
@@ -1584,36 +2220,47 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    int i, j, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    ptrdiff_t code_size;
     TranslationBlock *tb;
+    TBRegion *r;
+    QHTStats hst;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (j = 0; j < ctx->nb_regions; j++) {
+        r = &ctx->regions[j];
+        code_size += (j == ctx->cur_region ? tcg_ctx.code_gen_ptr
+                      : r->code_end) - r->code_start;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+                code_size, tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                ctx->nb_regions, ctx->cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1621,12 +2268,8 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1637,11 +2280,28 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+
+    qht_statistics_init(&tcg_ctx.tb_ctx.htable, &hst);
+    cpu_fprintf(f, "TB hash buckets     %zu/%zu (%0.2f%% head buckets used)\n",
+                hst.used_head_buckets, hst.head_buckets,
+                hst.head_buckets ?
+                (double)hst.used_head_buckets / hst.head_buckets * 100 : 0);
+    cpu_fprintf(f, "TB hash occupancy   %0.2f%% of the slots (%zu entries)\n",
+                hst.occupancy * 100, hst.entries);
+    cpu_fprintf(f, "TB hash avg chain   %0.3f buckets (max %zu)\n",
+                hst.avg_chain, hst.max_chain);
+    cpu_fprintf(f, "TB hash lookup cost %0.3f buckets per hit\n",
+                hst.lookup_cost);
+
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB recycle count    %d\n",
+                tcg_ctx.tb_ctx.tb_recycle_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
-    cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TB hash resizes     %u\n", hst.resizes);
+    cpu_fprintf(f, "TB tier-2 count     %d\n", tcg_ctx.tb_ctx.tb_tier2_count);
+    tlb_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -22,6 +22,8 @@
 #include "tcg.h"
 #include "qemu/bitops.h"
 #include "exec/cpu_ldst.h"
+#include "exec/cpu_atomic.h"
+#include "exec/spinlock.h"
 
 #undef EAX
 #undef ECX
@@ -39,6 +41,8 @@
 
 //#define DEBUG_SIGNAL
 
+DEFINE_TLS(uintptr_t, helper_retaddr);
+
 static void exception_action(CPUState *cpu)
 {
 #if defined(TARGET_I386)
@@ -75,6 +79,7 @@ void cpu_resume_from_signal(CPUState *cpu, void *puc)
 #endif
     }
     cpu->exception_index = -1;
+    helper_retaddr = 0;
     siglongjmp(cpu->jmp_env, 1);
 }
 
@@ -94,6 +99,11 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     qemu_printf("qemu: SIGSEGV pc=0x%08lx address=%08lx w=%d oldset=0x%08lx\n",
                 pc, address, is_write, *(unsigned long *)old_set);
 #endif
+    /* the fault comes from a helper called by generated code */
+    if (helper_retaddr) {
+        pc = helper_retaddr;
+    }
+
     /* XXX: locking issue */
     if (is_write && h2g_valid(address)
         && page_unprotect(h2g(address), pc, puc)) {
@@ -117,6 +127,7 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     }
     /* now we have a real cpu fault */
     cpu_restore_state(cpu, pc);
+    helper_retaddr = 0;
 
     /* we restore the process signal mask as the sigreturn should
        do it (XXX: use sigsetjmp) */
@@ -127,6 +138,77 @@ static inline int handle_cpu_signal(uintptr_t pc, unsigned long address,
     return 1;
 }
 
+/* Naturally aligned accesses use the host's atomic instructions, and only
+ * the threads that touch the same location contend.  Misaligned ones are
+ * serialized against each other with a lock; they are not atomic with
+ * respect to plain stores, which guests do not rely on.
+ */
+static spinlock_t atomic_unaligned_lock = SPIN_LOCK_UNLOCKED;
+
+static uint64_t atomic_rmw(CPUArchState *env, target_ulong addr,
+                           CPUAtomicOp op, uint64_t cmpv, uint64_t val,
+                           int size, uintptr_t retaddr)
+{
+    uint64_t mask = size == 8 ? -1 : (1ull << (size * 8)) - 1;
+    uint64_t old, newv;
+    void *haddr = g2h(addr);
+
+    helper_retaddr = retaddr ? retaddr - GETPC_ADJ : 0;
+    if ((addr & (size - 1)) == 0) {
+        old = cpu_atomic_host_op((uintptr_t)haddr, op, cmpv, val, size);
+        helper_retaddr = 0;
+        return old;
+    }
+
+    /* Take any fault before the lock: adding zero is a write access.  */
+    cpu_atomic_host_op((uintptr_t)haddr, CPU_ATOMIC_FETCH_ADD, 0, 0, 1);
+    cpu_atomic_host_op((uintptr_t)haddr + size - 1, CPU_ATOMIC_FETCH_ADD,
+                       0, 0, 1);
+
+    spin_lock(&atomic_unaligned_lock);
+    switch (size) {
+    case 2:
+        old = lduw_p(haddr);
+        break;
+    case 4:
+        old = (uint32_t)ldl_p(haddr);
+        break;
+    default:
+        old = ldq_p(haddr);
+        break;
+    }
+    newv = cpu_atomic_new_value(op, old, cmpv & mask, val) & mask;
+    switch (size) {
+    case 2:
+        stw_p(haddr, newv);
+        break;
+    case 4:
+        stl_p(haddr, newv);
+        break;
+    default:
+        stq_p(haddr, newv);
+        break;
+    }
+    spin_unlock(&atomic_unaligned_lock);
+    helper_retaddr = 0;
+    return old;
+}
+
+uint64_t cpu_atomic_cmpxchg(CPUArchState *env, target_ulong addr,
+                            uint64_t cmpv, uint64_t newv, int size,
+                            int mmu_idx, uintptr_t retaddr)
+{
+    return atomic_rmw(env, addr, CPU_ATOMIC_CMPXCHG, cmpv, newv, size,
+                      retaddr);
+}
+
+uint64_t cpu_atomic_rmw(CPUArchState *env, target_ulong addr,
+                        CPUAtomicOp op, uint64_t val, int size,
+                        int mmu_idx, uintptr_t retaddr)
+{
+    return atomic_rmw(env, addr, op, 0, val, size, retaddr);
+}
+
 #if defined(__i386__)
 
 #if defined(__APPLE__)
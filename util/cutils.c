@@ -23,6 +23,7 @@
  */
 #include "qemu-common.h"
 #include "qemu/host-utils.h"
+#include "qemu/cpuid.h"
 #include <math.h>
 #include <limits.h>
 #include <errno.h>
@@ -186,14 +187,46 @@ int qemu_fdatasync(int fd)
  * If the buffer is all zero the return value is equal to len.
  */
 
-size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+/* Granularity of the result past the first block */
+#define NONZERO_BLOCK_SIZE \
+    (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE))
+
+static size_t buffer_find_nonzero_offset_long(const void *buf, size_t len)
+{
+    const unsigned long *p = buf;
+    size_t i, j;
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < NONZERO_BLOCK_SIZE / sizeof(long); i++) {
+        if (p[i]) {
+            return QEMU_ALIGN_DOWN(i * sizeof(long), sizeof(VECTYPE));
+        }
+    }
+
+    for (i = NONZERO_BLOCK_SIZE / sizeof(long); i < len / sizeof(long);
+         i += NONZERO_BLOCK_SIZE / sizeof(long)) {
+        unsigned long tmp = 0;
+
+        for (j = 0; j < NONZERO_BLOCK_SIZE / sizeof(long); j++) {
+            tmp |= p[i + j];
+        }
+        if (tmp) {
+            break;
+        }
+    }
+
+    return i * sizeof(long);
+}
+
+static size_t buffer_find_nonzero_offset_vector(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
     const VECTYPE zero = (VECTYPE){0};
     size_t i;
 
-    assert(can_use_buffer_find_nonzero_offset(buf, len));
-
     if (!len) {
         return 0;
     }
@@ -221,6 +254,121 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
     return i * sizeof(VECTYPE);
 }
 
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#define HAVE_BUFFER_ACCEL_AVX2
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/*
+ * The first block is checked like buffer_find_nonzero_offset_vector()
+ * does, the rest 128 bytes (four 32 byte loads) at a time.  Only 16 byte
+ * alignment is guaranteed, hence the unaligned loads.
+ */
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m128i *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    size_t i;
+
+    if (!len) {
+        return 0;
+    }
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        if (!ALL_EQ(p[i], zero)) {
+            return i * sizeof(__m128i);
+        }
+    }
+
+    for (i = NONZERO_BLOCK_SIZE; i < len; i += NONZERO_BLOCK_SIZE) {
+        const __m256i *q = (const __m256i *)((const char *)buf + i);
+        __m256i tmp0 = _mm256_or_si256(_mm256_loadu_si256(q + 0),
+                                       _mm256_loadu_si256(q + 1));
+        __m256i tmp1 = _mm256_or_si256(_mm256_loadu_si256(q + 2),
+                                       _mm256_loadu_si256(q + 3));
+        tmp0 = _mm256_or_si256(tmp0, tmp1);
+        if (!_mm256_testz_si256(tmp0, tmp0)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+#pragma GCC pop_options
+#endif
+
+static BufferAccel buffer_accel = BUFFER_ACCEL_VECTOR;
+static size_t (*buffer_find_nonzero_offset_fn)(const void *buf, size_t len) =
+    buffer_find_nonzero_offset_vector;
+
+BufferAccel buffer_accel_get(void)
+{
+    return buffer_accel;
+}
+
+bool buffer_accel_set(BufferAccel accel)
+{
+    switch (accel) {
+    case BUFFER_ACCEL_NONE:
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_long;
+        break;
+    case BUFFER_ACCEL_VECTOR:
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_vector;
+        break;
+#ifdef HAVE_BUFFER_ACCEL_AVX2
+    case BUFFER_ACCEL_AVX2:
+        if (!host_cpu_has_avx2()) {
+            return false;
+        }
+        buffer_find_nonzero_offset_fn = buffer_find_nonzero_offset_avx2;
+        break;
+#endif
+    default:
+        return false;
+    }
+
+    buffer_accel = accel;
+    return true;
+}
+
+const char *buffer_accel_name(BufferAccel accel)
+{
+    static const char * const names[BUFFER_ACCEL__MAX] = {
+        [BUFFER_ACCEL_NONE] = "long",
+#if defined(__ALTIVEC__)
+        [BUFFER_ACCEL_VECTOR] = "altivec",
+#elif defined(__SSE2__)
+        [BUFFER_ACCEL_VECTOR] = "sse2",
+#else
+        [BUFFER_ACCEL_VECTOR] = "long-unrolled",
+#endif
+        [BUFFER_ACCEL_AVX2] = "avx2",
+    };
+
+    assert(accel < BUFFER_ACCEL__MAX);
+    return names[accel];
+}
+
+static void __attribute__((constructor)) buffer_accel_init(void)
+{
+    int accel;
+
+    for (accel = BUFFER_ACCEL__MAX - 1; accel > BUFFER_ACCEL_VECTOR; accel--) {
+        if (buffer_accel_set(accel)) {
+            break;
+        }
+    }
+}
+
+size_t buffer_find_nonzero_offset(const void *buf, size_t len)
+{
+    assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    return buffer_find_nonzero_offset_fn(buf, len);
+}
+
 /*
  * Checks if a buffer is all zeroes
  *
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/bswap.h"
 #include "trace.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
@@ -371,6 +372,159 @@ void hbitmap_free(HBitmap *hb)
     g_free(hb);
 }
 
+void hbitmap_reset_all(HBitmap *hb)
+{
+    uint64_t size = hb->size;
+    unsigned i;
+
+    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        memset(hb->levels[i], 0, size * sizeof(unsigned long));
+    }
+
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = 0;
+}
+
+bool hbitmap_merge(HBitmap *a, const HBitmap *b)
+{
+    uint64_t size = a->size;
+    unsigned i;
+    uint64_t j;
+
+    if (a->size != b->size || a->granularity != b->granularity) {
+        return false;
+    }
+    if (hbitmap_empty(b)) {
+        return true;
+    }
+
+    /* The upper levels only record which words below are nonzero, so
+     * ORing every level gives the same tree as setting b's bits one by one.
+     */
+    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        for (j = 0; j < size; j++) {
+            a->levels[i][j] |= b->levels[i][j];
+        }
+    }
+
+    a->count = hb_count_between(a, 0, a->size - 1);
+    return true;
+}
+
+/* Serialization works on whole 64-bit chunks of the bottom level, so that
+ * the format is the same for 32-bit and 64-bit hosts.
+ */
+uint64_t hbitmap_serialization_granularity(const HBitmap *hb)
+{
+    return (uint64_t)64 << hb->granularity;
+}
+
+/* Range of words of the bottom level that hold the items [start,
+ * start + count).  @start must be aligned to the serialization granularity,
+ * and so must @count unless the range extends to the end of the bitmap.
+ */
+static void serialization_chunk(const HBitmap *hb,
+                                uint64_t start, uint64_t count,
+                                unsigned long **first_el, size_t *el_count)
+{
+    uint64_t last = start + count - 1;
+    uint64_t gran = hbitmap_serialization_granularity(hb);
+
+    assert((start & (gran - 1)) == 0);
+    assert((last >> hb->granularity) < hb->size);
+    if ((last & (gran - 1)) != gran - 1) {
+        assert((last >> hb->granularity) + 1 == hb->size);
+    }
+
+    start = (start >> hb->granularity) >> BITS_PER_LEVEL;
+    last = (last >> hb->granularity) >> BITS_PER_LEVEL;
+
+    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *el_count = last - start + 1;
+}
+
+uint64_t hbitmap_serialization_size(const HBitmap *hb,
+                                    uint64_t start, uint64_t count)
+{
+    uint64_t first, last;
+
+    if (!count) {
+        return 0;
+    }
+    first = start >> hb->granularity;
+    last = (start + count - 1) >> hb->granularity;
+    return ((last - first) / 64 + 1) * 8;
+}
+
+void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
+                            uint64_t start, uint64_t count)
+{
+    unsigned long *cur;
+    size_t i, el_count;
+
+    if (!count) {
+        return;
+    }
+
+    /* On 32-bit hosts the last chunk may be only half present.  */
+    memset(buf, 0, hbitmap_serialization_size(hb, start, count));
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    for (i = 0; i < el_count; i++, buf += sizeof(unsigned long)) {
+        unsigned long el = (BITS_PER_LONG == 32 ? cpu_to_le32(cur[i])
+                                                : cpu_to_le64(cur[i]));
+        memcpy(buf, &el, sizeof(el));
+    }
+}
+
+void hbitmap_deserialize_part(HBitmap *hb, const uint8_t *buf,
+                              uint64_t start, uint64_t count, bool finish)
+{
+    unsigned long *cur;
+    size_t i, el_count;
+
+    if (count) {
+        serialization_chunk(hb, start, count, &cur, &el_count);
+        for (i = 0; i < el_count; i++, buf += sizeof(unsigned long)) {
+            unsigned long el;
+            memcpy(&el, buf, sizeof(el));
+            cur[i] = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
+        }
+    }
+
+    if (finish) {
+        hbitmap_deserialize_finish(hb);
+    }
+}
+
+void hbitmap_deserialize_finish(HBitmap *hb)
+{
+    uint64_t sizes[HBITMAP_LEVELS];
+    uint64_t size = hb->size;
+    uint64_t j;
+    unsigned i;
+
+    for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
+        sizes[i] = size;
+    }
+
+    /* Rebuild each upper level from the one below it.  */
+    for (i = HBITMAP_LEVELS - 1; i > 0; i--) {
+        memset(hb->levels[i - 1], 0, sizes[i - 1] * sizeof(unsigned long));
+        for (j = 0; j < sizes[i]; j++) {
+            if (hb->levels[i][j]) {
+                hb->levels[i - 1][j >> BITS_PER_LEVEL] |=
+                    1UL << (j & (BITS_PER_LONG - 1));
+            }
+        }
+    }
+
+    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    hb->count = hb_count_between(hb, 0, hb->size - 1);
+}
+
 HBitmap *hbitmap_alloc(uint64_t size, int granularity)
 {
     HBitmap *hb = g_malloc0(sizeof (struct HBitmap));
@@ -0,0 +1,418 @@
+/*
+ * QHT: concurrent hash table with lock-free lookups
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/atomic.h"
+#include "qemu/seqlock.h"
+#include "qemu/qht.h"
+
+/* The table is an array of head buckets, each the size of a cache line.
+ * A bucket holds a few (hash, pointer) pairs and a pointer to the next
+ * bucket of its chain; comparing the hashes first lets a lookup skip most
+ * entries without touching them.  The entries of a chain are kept packed
+ * at its start, so a lookup stops at the first empty slot.
+ *
+ * Writers are serialized by ht->lock.  Each head bucket has a sequence
+ * counter covering its whole chain: a lookup that overlaps a change to
+ * the chain retries.  A resize builds a new map and publishes it with a
+ * single pointer store; lookups that already loaded the old map finish
+ * there.  Without RCU there is no telling when they are done, so old maps
+ * stay around until the table is reset.  They add up to less than the
+ * size of the current map, since the map doubles at each resize.
+ */
+
+#define QHT_BUCKET_ALIGN 64
+
+#if HOST_LONG_BITS == 32
+#define QHT_BUCKET_ENTRIES 6
+#else
+#define QHT_BUCKET_ENTRIES 3
+#endif
+
+typedef struct QHTBucket QHTBucket;
+
+struct QHTBucket {
+    QemuSeqLock sequence;   /* only used in head buckets */
+    uint32_t hashes[QHT_BUCKET_ENTRIES];
+    void *pointers[QHT_BUCKET_ENTRIES];
+    QHTBucket *next;
+} __attribute__((aligned(QHT_BUCKET_ALIGN)));
+
+struct QHTMap {
+    QHTBucket *buckets;
+    size_t n_buckets;
+    size_t n_added_buckets;
+    size_t n_added_buckets_threshold;
+    QHTMap *retired_next;
+};
+
+/* Grow when more than 1/8 of the head buckets have overflowed */
+#define QHT_ADDED_BUCKETS_DIV 8
+
+static QHTBucket *qht_bucket_new(void)
+{
+    QHTBucket *b = qemu_memalign(QHT_BUCKET_ALIGN, sizeof(*b));
+
+    memset(b, 0, sizeof(*b));
+    seqlock_init(&b->sequence, NULL);
+    return b;
+}
+
+static size_t qht_elems_to_buckets(size_t n_elems)
+{
+    size_t n = MAX(n_elems / QHT_BUCKET_ENTRIES, 1);
+
+    /* round up to a power of 2 */
+    if (!is_power_of_2(n)) {
+        n = pow2floor(n) << 1;
+    }
+    return n;
+}
+
+static QHTMap *qht_map_create(size_t n_buckets)
+{
+    QHTMap *map = g_new0(QHTMap, 1);
+    size_t i;
+
+    QEMU_BUILD_BUG_ON(offsetof(QHTBucket, next) + sizeof(QHTBucket *)
+                      > QHT_BUCKET_ALIGN);
+
+    map->n_buckets = n_buckets;
+    map->n_added_buckets_threshold =
+        MAX(n_buckets / QHT_ADDED_BUCKETS_DIV, 1);
+    map->buckets = qemu_memalign(QHT_BUCKET_ALIGN,
+                                 n_buckets * sizeof(QHTBucket));
+    memset(map->buckets, 0, n_buckets * sizeof(QHTBucket));
+    for (i = 0; i < n_buckets; i++) {
+        seqlock_init(&map->buckets[i].sequence, NULL);
+    }
+    return map;
+}
+
+static void qht_map_destroy(QHTMap *map)
+{
+    size_t i;
+
+    for (i = 0; i < map->n_buckets; i++) {
+        QHTBucket *b = map->buckets[i].next;
+
+        while (b) {
+            QHTBucket *next = b->next;
+
+            qemu_vfree(b);
+            b = next;
+        }
+    }
+    qemu_vfree(map->buckets);
+    g_free(map);
+}
+
+static void qht_free_retired(QHT *ht)
+{
+    while (ht->retired) {
+        QHTMap *map = ht->retired;
+
+        ht->retired = map->retired_next;
+        qht_map_destroy(map);
+    }
+}
+
+static inline QHTBucket *qht_map_to_bucket(QHTMap *map, uint32_t hash)
+{
+    return &map->buckets[hash & (map->n_buckets - 1)];
+}
+
+void qht_init(QHT *ht, size_t n_elems, unsigned int mode)
+{
+    ht->mode = mode;
+    ht->retired = NULL;
+    ht->resizes = 0;
+    qemu_mutex_init(&ht->lock);
+    ht->map = qht_map_create(qht_elems_to_buckets(n_elems));
+}
+
+void qht_destroy(QHT *ht)
+{
+    qht_free_retired(ht);
+    qht_map_destroy(ht->map);
+    qemu_mutex_destroy(&ht->lock);
+    memset(ht, 0, sizeof(*ht));
+}
+
+static void *qht_do_lookup(QHTBucket *head, QHTCompareFunc func,
+                           const void *userp, uint32_t hash)
+{
+    QHTBucket *b = head;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            void *p = atomic_read(&b->pointers[i]);
+
+            if (!p) {
+                return NULL;
+            }
+            if (atomic_read(&b->hashes[i]) == hash && func(p, userp)) {
+                return p;
+            }
+        }
+        b = atomic_read(&b->next);
+        smp_read_barrier_depends();
+    } while (b);
+
+    return NULL;
+}
+
+void *qht_lookup(QHT *ht, QHTCompareFunc func, const void *userp,
+                 uint32_t hash)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    unsigned int version;
+    void *ret;
+
+    map = atomic_read(&ht->map);
+    smp_read_barrier_depends();
+    b = qht_map_to_bucket(map, hash);
+
+    do {
+        version = seqlock_read_begin(&b->sequence);
+        ret = qht_do_lookup(b, func, userp, hash);
+    } while (seqlock_read_retry(&b->sequence, version));
+    return ret;
+}
+
+/* Add @p to @map, with ht->lock held.  Returns false if it is there. */
+static bool qht_map_insert(QHTMap *map, void *p, uint32_t hash)
+{
+    QHTBucket *head = qht_map_to_bucket(map, hash);
+    QHTBucket *b = head, *prev = NULL;
+    int i;
+
+    do {
+        for (i = 0; i < QHT_BUCKET_ENTRIES; i++) {
+            if (b->pointers[i] == NULL) {
+                goto found;
+            }
+            if (b->pointers[i] == p) {
+                return false;
+            }
+        }
+        prev = b;
+        b = b->next;
+    } while (b);
+
+    b = qht_bucket_new();
+    i = 0;
+    b->hashes[0] = hash;
+    b->pointers[0] = p;
+    seqlock_write_lock(&head->sequence);
+    atomic_set(&prev->next, b);
+    seqlock_write_unlock(&head->sequence);
+    map->n_added_buckets++;
+    return true;
+
+ found:
+    seqlock_write_lock(&head->sequence);
+    atomic_set(&b->hashes[i], hash);
+    atomic_set(&b->pointers[i], p);
+    seqlock_write_unlock(&head->sequence);
+    return true;
+}
+
+static void qht_do_resize(QHT *ht, size_t n_buckets)
+{
+    QHTMap *old = ht->map;
+    QHTMap *new;
+    size_t i;
+    int j;
+
+    if (n_buckets == old->n_buckets) {
+        return;
+    }
+
+    new = qht_map_create(n_buckets);
+    for (i = 0; i < old->n_buckets; i++) {
+        QHTBucket *b;
+
+        for (b = &old->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                qht_map_insert(new, b->pointers[j], b->hashes[j]);
+            }
+        }
+    }
+
+    /* The new map must be complete before lookups can see it */
+    smp_wmb();
+    atomic_set(&ht->map, new);
+
+    old->retired_next = ht->retired;
+    ht->retired = old;
+    ht->resizes++;
+}
+
+bool qht_insert(QHT *ht, void *p, uint32_t hash)
+{
+    QHTMap *map;
+    bool ret;
+
+    assert(p);
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    ret = qht_map_insert(map, p, hash);
+    if ((ht->mode & QHT_MODE_AUTO_RESIZE) &&
+        map->n_added_buckets > map->n_added_buckets_threshold) {
+        qht_do_resize(ht, map->n_buckets * 2);
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return ret;
+}
+
+bool qht_remove(QHT *ht, const void *p, uint32_t hash)
+{
+    QHTBucket *head, *b, *lb, *last_b;
+    int i, j, last_i;
+
+    qemu_mutex_lock(&ht->lock);
+    head = qht_map_to_bucket(ht->map, hash);
+
+    for (b = head; b; b = b->next) {
+        for (i = 0; i < QHT_BUCKET_ENTRIES && b->pointers[i]; i++) {
+            if (b->pointers[i] == p) {
+                goto found;
+            }
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+    return false;
+
+ found:
+    /* Move the last entry of the chain into the hole */
+    last_b = b;
+    last_i = i;
+    for (lb = b; lb; lb = lb->next) {
+        for (j = 0; j < QHT_BUCKET_ENTRIES && lb->pointers[j]; j++) {
+            last_b = lb;
+            last_i = j;
+        }
+    }
+
+    seqlock_write_lock(&head->sequence);
+    if (last_b != b || last_i != i) {
+        atomic_set(&b->hashes[i], last_b->hashes[last_i]);
+        atomic_set(&b->pointers[i], last_b->pointers[last_i]);
+    }
+    atomic_set(&last_b->pointers[last_i], NULL);
+    seqlock_write_unlock(&head->sequence);
+
+    qemu_mutex_unlock(&ht->lock);
+    return true;
+}
+
+void qht_reset(QHT *ht)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    size_t i;
+    int j;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    for (i = 0; i < map->n_buckets; i++) {
+        seqlock_write_lock(&map->buckets[i].sequence);
+        for (b = &map->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES; j++) {
+                atomic_set(&b->pointers[j], NULL);
+            }
+        }
+        seqlock_write_unlock(&map->buckets[i].sequence);
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_reset_size(QHT *ht, size_t n_elems)
+{
+    QHTMap *map;
+    size_t n_buckets;
+
+    qemu_mutex_lock(&ht->lock);
+    qht_free_retired(ht);
+    map = ht->map;
+    n_buckets = n_elems ? qht_elems_to_buckets(n_elems) : map->n_buckets;
+    ht->map = qht_map_create(n_buckets);
+    qht_map_destroy(map);
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_resize(QHT *ht, size_t n_elems)
+{
+    qemu_mutex_lock(&ht->lock);
+    qht_do_resize(ht, qht_elems_to_buckets(n_elems));
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_iter(QHT *ht, QHTIterFunc func, void *userp)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    size_t i;
+    int j;
+
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    for (i = 0; i < map->n_buckets; i++) {
+        for (b = &map->buckets[i]; b; b = b->next) {
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                func(ht, b->pointers[j], b->hashes[j], userp);
+            }
+        }
+    }
+    qemu_mutex_unlock(&ht->lock);
+}
+
+void qht_statistics_init(QHT *ht, QHTStats *stats)
+{
+    QHTMap *map;
+    QHTBucket *b;
+    size_t i, chain, chains = 0, cost = 0, slots = 0;
+    int j;
+
+    memset(stats, 0, sizeof(*stats));
+    qemu_mutex_lock(&ht->lock);
+    map = ht->map;
+    stats->head_buckets = map->n_buckets;
+    for (i = 0; i < map->n_buckets; i++) {
+        if (!map->buckets[i].pointers[0]) {
+            slots += QHT_BUCKET_ENTRIES;
+            continue;
+        }
+        stats->used_head_buckets++;
+        chain = 0;
+        for (b = &map->buckets[i]; b; b = b->next) {
+            chain++;
+            slots += QHT_BUCKET_ENTRIES;
+            for (j = 0; j < QHT_BUCKET_ENTRIES && b->pointers[j]; j++) {
+                stats->entries++;
+                cost += chain;
+            }
+        }
+        chains += chain;
+        stats->max_chain = MAX(stats->max_chain, chain);
+    }
+    stats->resizes = ht->resizes;
+    qemu_mutex_unlock(&ht->lock);
+
+    if (stats->used_head_buckets) {
+        stats->avg_chain = (double)chains / stats->used_head_buckets;
+    }
+    if (stats->entries) {
+        stats->lookup_cost = (double)cost / stats->entries;
+    }
+    stats->occupancy = slots ? (double)stats->entries / slots : 0;
+}
@@ -86,6 +86,7 @@ int main(int argc, char **argv)
 #include "sysemu/blockdev.h"
 #include "hw/block/block.h"
 #include "migration/block.h"
+#include "migration/dirty-bitmap.h"
 #include "sysemu/tpm.h"
 #include "sysemu/dma.h"
 #include "audio/audio.h"
@@ -559,6 +560,29 @@ static QemuOptsList qemu_icount_opts = {
     },
 };
 
+static QemuOptsList qemu_accel_opts = {
+    .name = "accel",
+    .implied_opt_name = "accel",
+    .head = QTAILQ_HEAD_INITIALIZER(qemu_accel_opts.head),
+    .merge_lists = true,
+    .desc = {
+        {
+            .name = "accel",
+            .type = QEMU_OPT_STRING,
+            .help = "Select the type of accelerator",
+        }, {
+            .name = "thread",
+            .type = QEMU_OPT_STRING,
+            .help = "Enable/disable multi-threaded TCG",
+        }, {
+            .name = "tiered",
+            .type = QEMU_OPT_BOOL,
+            .help = "Retranslate hot code with more optimizations",
+        },
+        { /* end of list */ }
+    },
+};
+
 /**
  * Get machine options
  *
@@ -2862,6 +2886,7 @@ int main(int argc, char **argv, char **envp)
     DisplayState *ds;
     int cyls, heads, secs, translation;
     QemuOpts *hda_opts = NULL, *opts, *machine_opts, *icount_opts = NULL;
+    QemuOpts *accel_opts = NULL;
     QemuOptsList *olist;
     int optind;
     const char *optarg;
@@ -2928,6 +2953,7 @@ int main(int argc, char **argv, char **envp)
     qemu_add_opts(&qemu_name_opts);
     qemu_add_opts(&qemu_numa_opts);
     qemu_add_opts(&qemu_icount_opts);
+    qemu_add_opts(&qemu_accel_opts);
 
     runstate_init();
 
@@ -3634,6 +3660,28 @@ int main(int argc, char **argv, char **envp)
                     machine_class = machine_parse(optarg);
                 }
                 break;
+            case QEMU_OPTION_accel: {
+                char *machine_accel;
+
+                accel_opts = qemu_opts_parse(qemu_find_opts("accel"),
+                                             optarg, 1);
+                if (!accel_opts) {
+                    exit(1);
+                }
+                optarg = qemu_opt_get(accel_opts, "accel");
+                if (!optarg) {
+                    fprintf(stderr, "-accel: an accelerator must be given\n");
+                    exit(1);
+                }
+                machine_accel = g_strdup_printf("accel=%s", optarg);
+                opts = qemu_opts_parse(qemu_find_opts("machine"),
+                                       machine_accel, 0);
+                g_free(machine_accel);
+                if (!opts) {
+                    exit(1);
+                }
+                break;
+            }
              case QEMU_OPTION_no_kvm:
                 olist = qemu_find_opts("machine");
                 qemu_opts_parse(olist, "accel=tcg", 0);
@@ -4269,6 +4317,17 @@ int main(int argc, char **argv, char **envp)
         qemu_opts_del(icount_opts);
     }
 
+    if (tcg_enabled() && accel_opts) {
+        Error *local_err = NULL;
+
+        qemu_tcg_configure(accel_opts, &local_err);
+        if (local_err) {
+            error_report("%s", error_get_pretty(local_err));
+            error_free(local_err);
+            exit(1);
+        }
+    }
+
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
 
@@ -4295,6 +4354,7 @@ int main(int argc, char **argv, char **envp)
     }
 
     blk_mig_init();
+    dirty_bitmap_mig_init();
     ram_mig_init();
 
     /* If the currently selected machine wishes to override the units-per-bus
@@ -13,6 +13,164 @@
 #include "qemu-common.h"
 #include "include/migration/migration.h"
 
+#include "qemu/host-utils.h"
+
+/*
+ * The scan loops of the encoder: they return the index of the first byte
+ * at or past @i where @old_buf and @new_buf differ (end of a zrun) or are
+ * equal (end of an nzrun), or @slen if there is none.
+ */
+typedef int XbzrleScanFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen);
+
+static int zrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
+
+    /* word at a time for speed */
+    while (i < slen &&
+           (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+        i += sizeof(long);
+    }
+
+    /* go over the rest */
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_long(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    /* truncation to 32-bit long okay */
+    unsigned long mask = (unsigned long)0x0101010101010101ULL;
+
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+    if (res) {
+        return i;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    while (i < slen) {
+        unsigned long xor;
+        xor = *(unsigned long *)(old_buf + i)
+            ^ *(unsigned long *)(new_buf + i);
+        if ((xor - mask) & ~xor & (mask << 7)) {
+            /* found the end of an nzrun within the current long */
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            break;
+        }
+        i += sizeof(long);
+    }
+    return i;
+}
+
+#ifdef __SSE2__
+static int zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        if (eq != 0xffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        uint32_t eq = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#if defined(CONFIG_AVX2_OPT) && defined(__SSE2__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (eq != 0xffffffff) {
+            return i + ctz32(~eq);
+        }
+    }
+    return zrun_end_sse2(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return nzrun_end_sse2(old_buf, new_buf, i, slen);
+}
+
+#pragma GCC pop_options
+#define HAVE_XBZRLE_AVX2
+#endif
+
+/* Indexed by buffer_accel_get() */
+static const struct {
+    XbzrleScanFunc *zrun_end;
+    XbzrleScanFunc *nzrun_end;
+} xbzrle_scan[BUFFER_ACCEL__MAX] = {
+    [BUFFER_ACCEL_NONE] = { zrun_end_long, nzrun_end_long },
+#ifdef __SSE2__
+    [BUFFER_ACCEL_VECTOR] = { zrun_end_sse2, nzrun_end_sse2 },
+#else
+    [BUFFER_ACCEL_VECTOR] = { zrun_end_long, nzrun_end_long },
+#endif
+#ifdef HAVE_XBZRLE_AVX2
+    [BUFFER_ACCEL_AVX2] = { zrun_end_avx2, nzrun_end_avx2 },
+#endif
+};
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -26,10 +184,11 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
-    uint32_t zrun_len = 0, nzrun_len = 0;
+    uint32_t zrun_len, nzrun_len;
     int d = 0, i = 0;
-    long res;
-    uint8_t *nzrun_start = NULL;
+    uint8_t *nzrun_start;
+    XbzrleScanFunc *zrun_end = xbzrle_scan[buffer_accel_get()].zrun_end;
+    XbzrleScanFunc *nzrun_end = xbzrle_scan[buffer_accel_get()].nzrun_end;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +199,8 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        zrun_len = zrun_end(old_buf, new_buf, i, slen) - i;
+        i += zrun_len;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,42 +214,15 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        nzrun_len = nzrun_end(old_buf, new_buf, i, slen) - i;
+        i += nzrun_len;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -119,7 +231,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;